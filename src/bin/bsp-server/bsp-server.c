@@ -22,13 +22,15 @@
  * 
  * @package bsp::bsp-server
  * @author Dr.NP <np@bsgroup.org>
- * @update 10/23/2012
+ * @update 12/02/2014
  * @changelog 
  *      [06/04/2012] - Creation
  *      [08/14/2012] - BSP.Packet protocol
  *      [10/23/2012] - Terminal reload action
  *      [07/15/2013] - Recode
  *      [12/25/2013] - Trace level rearranged
+ *      [11/29/2014] - Event object in arena
+ *      [12/02/2014] - Event keys as atoms
  */
 
 #define _GNU_SOURCE
@@ -85,11 +87,54 @@ static void _usage()
     return;
 }
 
+// Native packet comes as a view, LUA reads it directly.
+// FastCGI upstream needs a real object, build it here
+static void _set_packet_value(BSP_CALLBACK *cb, BSP_VALUE *val)
+{
+    if (!cb->obj && cb->view)
+    {
+        if (cb->server->fcgi_upstream)
+        {
+            cb->obj = view_to_object(cb->view);
+        }
+        else
+        {
+            value_set_view(val, cb->view);
+            return;
+        }
+    }
+
+    value_set_object(val, cb->obj);
+
+    return;
+}
+
 /* Server callback */
+// Keys of event object
+static BSP_STRING *key_server_name = NULL;
+static BSP_STRING *key_client = NULL;
+static BSP_STRING *key_event = NULL;
+static BSP_STRING *key_raw = NULL;
+static BSP_STRING *key_obj = NULL;
+static BSP_STRING *key_cmd = NULL;
+static BSP_STRING *key_params = NULL;
+
+static void _init_keys()
+{
+    key_server_name = atom_intern("server_name", -1);
+    key_client = atom_intern("client", -1);
+    key_event = atom_intern("event", -1);
+    key_raw = atom_intern("raw", -1);
+    key_obj = atom_intern("obj", -1);
+    key_cmd = atom_intern("cmd", -1);
+    key_params = atom_intern("params", -1);
+
+    return;
+}
+
 static void server_callback(BSP_CALLBACK *cb)
 {
-    BSP_OBJECT *p = new_object(OBJECT_TYPE_HASH);
-    if (!cb || !cb->server || !cb->client || !cb->client->script_stack.stack || !p)
+    if (!cb || !cb->server || !cb->client || !cb->client->script_stack.stack)
     {
         return;
     }
@@ -100,74 +145,70 @@ static void server_callback(BSP_CALLBACK *cb)
         return;
     }
 
-    BSP_STRING *key;
+    // Event object is built in the arena of this thread, released by one reset after the call
+    BSP_ARENA *prev_arena = arena_enter();
+    BSP_OBJECT *p = new_object(OBJECT_TYPE_HASH);
+    if (!p)
+    {
+        arena_leave(prev_arena);
+        return;
+    }
+
     BSP_VALUE *val;
     BSP_SCRIPT_SYMBOL sym = {NULL, NULL, 0};
 
-    key = new_string_const("server_name", -1);
     val = new_value();
     BSP_STRING *srv_name = new_string_const(cb->server->name, -1);
     value_set_string(val, srv_name);
-    object_set_hash(p, key, val);
+    object_set_hash_atom(p, key_server_name, val);
 
-    key = new_string_const("client", -1);
     val = new_value();
     value_set_int(val, SFD(cb->client));
-    object_set_hash(p, key, val);
+    object_set_hash_atom(p, key_client, val);
 
     switch (cb->event)
     {
         case SERVER_CALLBACK_ON_CONNECT : 
-            key = new_string_const("event", -1);
             val = new_value();
             value_set_string(val, new_string_const("connect", -1));
-            object_set_hash(p, key, val);
+            object_set_hash_atom(p, key_event, val);
             break;
         case SERVER_CALLBACK_ON_CLOSE : 
-            key = new_string_const("event", -1);
             val = new_value();
             value_set_string(val, new_string_const("close", -1));
-            object_set_hash(p, key, val);
+            object_set_hash_atom(p, key_event, val);
             break;
         case SERVER_CALLBACK_ON_ERROR : 
-            key = new_string_const("event", -1);
             val = new_value();
             value_set_string(val, new_string_const("error", -1));
-            object_set_hash(p, key, val);
+            object_set_hash_atom(p, key_event, val);
             break;
         case SERVER_CALLBACK_ON_DATA_RAW : 
-            key = new_string_const("event", -1);
             val = new_value();
             value_set_string(val, new_string_const("raw", -1));
-            object_set_hash(p, key, val);
-            key = new_string_const("raw", -1);
+            object_set_hash_atom(p, key_event, val);
             val = new_value();
             value_set_string(val, cb->stream);
-            object_set_hash(p, key, val);
+            object_set_hash_atom(p, key_raw, val);
             break;
         case SERVER_CALLBACK_ON_DATA_OBJ : 
-            key = new_string_const("event", -1);
             val = new_value();
             value_set_string(val, new_string_const("obj", -1));
-            object_set_hash(p, key, val);
-            key = new_string_const("obj", -1);
+            object_set_hash_atom(p, key_event, val);
             val = new_value();
-            value_set_object(val, cb->obj);
-            object_set_hash(p, key, val);
+            _set_packet_value(cb, val);
+            object_set_hash_atom(p, key_obj, val);
             break;
         case SERVER_CALLBACK_ON_DATA_CMD : 
-            key = new_string_const("event", -1);
             val = new_value();
             value_set_string(val, new_string_const("cmd", -1));
-            object_set_hash(p, key, val);
-            key = new_string_const("cmd", -1);
+            object_set_hash_atom(p, key_event, val);
             val = new_value();
             value_set_int(val, cb->cmd);
-            object_set_hash(p, key, val);
-            key = new_string_const("params", -1);
+            object_set_hash_atom(p, key_cmd, val);
             val = new_value();
-            value_set_object(val, cb->obj);
-            object_set_hash(p, key, val);
+            _set_packet_value(cb, val);
+            object_set_hash_atom(p, key_params, val);
             break;
         default : 
             break;
@@ -184,7 +225,11 @@ static void server_callback(BSP_CALLBACK *cb)
         fcgi_call(cb->server->fcgi_upstream, p, &cb->client->sck.saddr);
     }
 
-    del_object(p);
+    if (!p->arena)
+    {
+        del_object(p);
+    }
+    arena_leave(prev_arena);
 
     return;
 }
@@ -293,6 +338,7 @@ int main(int argc, char **argv)
 #endif
 
     core_init();
+    _init_keys();
     core_loop(server_callback);
 
     return BSP_RTN_SUCCESS;
@@ -0,0 +1,371 @@
+/*
+ * arena.c
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Bump allocator for short-lived (per-event) data.
+ * Objects, values and strings built while handling one event are taken from
+ * the arena of the worker thread and all go back by one reset after the event.
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 11/29/2014
+ * @changelog
+ *      [11/29/2014] - Creation
+ */
+
+#include "bsp.h"
+
+#define ARENA_CHUNK_HEAD                        ARENA_ALIGN_SIZE(sizeof(struct bsp_arena_chunk_t))
+#define ARENA_CHUNK_DATA(c)                     ((char *) (c) + ARENA_CHUNK_HEAD)
+
+// Arena status of one thread
+struct bsp_arena_slot_t
+{
+    BSP_ARENA           *arena;
+    BSP_ARENA           *curr;
+    int                 depth;
+};
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void _del_arena_slot(void *data)
+{
+    struct bsp_arena_slot_t *slot = (struct bsp_arena_slot_t *) data;
+    if (slot)
+    {
+        del_arena(slot->arena);
+        bsp_free(slot);
+    }
+
+    return;
+}
+
+static void _arena_key_init()
+{
+    pthread_key_create(&arena_key, _del_arena_slot);
+
+    return;
+}
+
+static struct bsp_arena_chunk_t * _new_chunk(size_t size)
+{
+    struct bsp_arena_chunk_t *chunk = bsp_malloc(ARENA_CHUNK_HEAD + size);
+    if (!chunk)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Arena : Alloc chunk error");
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+
+    return chunk;
+}
+
+BSP_ARENA * new_arena(size_t chunk_size)
+{
+    BSP_ARENA *arena = bsp_calloc(1, sizeof(BSP_ARENA));
+    if (!arena)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Arena : Create arena error");
+        return NULL;
+    }
+
+    arena->chunk_size = (chunk_size > 0) ? ARENA_ALIGN_SIZE(chunk_size) : ARENA_CHUNK_SIZE;
+    arena->head = _new_chunk(arena->chunk_size);
+
+    return arena;
+}
+
+void del_arena(BSP_ARENA *arena)
+{
+    if (!arena)
+    {
+        return;
+    }
+
+    arena_reset(arena);
+    if (arena->head)
+    {
+        bsp_free(arena->head);
+    }
+    bsp_free(arena);
+
+    return;
+}
+
+void * arena_alloc(BSP_ARENA *arena, size_t size)
+{
+    if (!arena)
+    {
+        return NULL;
+    }
+
+    struct bsp_arena_chunk_t *chunk = arena->head;
+    size = ARENA_ALIGN_SIZE((size > 0) ? size : 1);
+    if (chunk && chunk->used + size <= chunk->size)
+    {
+        void *ret = ARENA_CHUNK_DATA(chunk) + chunk->used;
+        chunk->used += size;
+        arena->total += size;
+
+        return ret;
+    }
+
+    if (size > arena->chunk_size / 4)
+    {
+        // Large block takes a chunk of its own, current chunk keeps its free space
+        chunk = _new_chunk(size);
+        if (!chunk)
+        {
+            return NULL;
+        }
+        chunk->used = size;
+        if (arena->head)
+        {
+            chunk->next = arena->head->next;
+            arena->head->next = chunk;
+        }
+        else
+        {
+            arena->head = chunk;
+        }
+    }
+    else
+    {
+        chunk = _new_chunk(arena->chunk_size);
+        if (!chunk)
+        {
+            return NULL;
+        }
+        chunk->used = size;
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+    arena->total += size;
+
+    return ARENA_CHUNK_DATA(chunk);
+}
+
+void * arena_calloc(BSP_ARENA *arena, size_t nmemb, size_t size)
+{
+    void *ret = arena_alloc(arena, nmemb * size);
+    if (ret)
+    {
+        memset(ret, 0, nmemb * size);
+    }
+
+    return ret;
+}
+
+// The latest block grows in place, others are copied. Old block is just left there
+void * arena_realloc(BSP_ARENA *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    if (!ptr)
+    {
+        return arena_alloc(arena, new_size);
+    }
+
+    struct bsp_arena_chunk_t *chunk = arena->head;
+    size_t old_aligned = ARENA_ALIGN_SIZE((old_size > 0) ? old_size : 1);
+    size_t new_aligned = ARENA_ALIGN_SIZE((new_size > 0) ? new_size : 1);
+    if (new_aligned <= old_aligned)
+    {
+        return ptr;
+    }
+
+    if (chunk && (char *) ptr + old_aligned == ARENA_CHUNK_DATA(chunk) + chunk->used &&
+        chunk->used - old_aligned + new_aligned <= chunk->size)
+    {
+        chunk->used += new_aligned - old_aligned;
+        arena->total += new_aligned - old_aligned;
+
+        return ptr;
+    }
+
+    void *ret = arena_alloc(arena, new_size);
+    if (ret)
+    {
+        memcpy(ret, ptr, old_size);
+    }
+
+    return ret;
+}
+
+char * arena_strndup(BSP_ARENA *arena, const char *data, size_t len)
+{
+    char *ret = arena_alloc(arena, len + 1);
+    if (ret)
+    {
+        if (data)
+        {
+            memcpy(ret, data, len);
+        }
+        ret[len] = 0x0;
+    }
+
+    return ret;
+}
+
+// Cleanups run in reverse order of registration
+int arena_on_reset(BSP_ARENA *arena, void (*func)(void *), void *data)
+{
+    if (!arena || !func)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    struct bsp_arena_cleanup_t *cleanup = arena_alloc(arena, sizeof(struct bsp_arena_cleanup_t));
+    if (!cleanup)
+    {
+        return BSP_RTN_ERROR_MEMORY;
+    }
+    cleanup->func = func;
+    cleanup->data = data;
+    cleanup->next = arena->cleanups;
+    arena->cleanups = cleanup;
+
+    return BSP_RTN_SUCCESS;
+}
+
+// Give all memory back, only one ordinary chunk kept for next round
+void arena_reset(BSP_ARENA *arena)
+{
+    if (!arena)
+    {
+        return;
+    }
+
+    struct bsp_arena_cleanup_t *cleanup = arena->cleanups;
+    while (cleanup)
+    {
+        cleanup->func(cleanup->data);
+        cleanup = cleanup->next;
+    }
+    arena->cleanups = NULL;
+
+    struct bsp_arena_chunk_t *chunk = arena->head, *next = NULL, *keep = NULL;
+    while (chunk)
+    {
+        next = chunk->next;
+        if (!keep && chunk->size == arena->chunk_size)
+        {
+            keep = chunk;
+        }
+        else
+        {
+            bsp_free(chunk);
+        }
+        chunk = next;
+    }
+
+    if (keep)
+    {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    arena->head = keep;
+    arena->total = 0;
+
+    return;
+}
+
+static struct bsp_arena_slot_t * _arena_slot()
+{
+    pthread_once(&arena_key_once, _arena_key_init);
+
+    return (struct bsp_arena_slot_t *) pthread_getspecific(arena_key);
+}
+
+BSP_ARENA * curr_arena()
+{
+    struct bsp_arena_slot_t *slot = _arena_slot();
+
+    return (slot) ? slot->curr : NULL;
+}
+
+// Set current arena of this thread, NULL for heap. Previous one returned
+BSP_ARENA * arena_switch(BSP_ARENA *arena)
+{
+    struct bsp_arena_slot_t *slot = _arena_slot();
+    BSP_ARENA *prev = NULL;
+    if (!slot)
+    {
+        if (!arena)
+        {
+            return NULL;
+        }
+
+        slot = bsp_calloc(1, sizeof(struct bsp_arena_slot_t));
+        if (!slot)
+        {
+            return NULL;
+        }
+        pthread_setspecific(arena_key, slot);
+    }
+
+    prev = slot->curr;
+    slot->curr = arena;
+
+    return prev;
+}
+
+BSP_ARENA * arena_enter()
+{
+    struct bsp_arena_slot_t *slot = _arena_slot();
+    if (!slot)
+    {
+        slot = bsp_calloc(1, sizeof(struct bsp_arena_slot_t));
+        if (!slot)
+        {
+            return NULL;
+        }
+        pthread_setspecific(arena_key, slot);
+    }
+
+    if (!slot->arena)
+    {
+        slot->arena = new_arena(ARENA_CHUNK_SIZE);
+    }
+
+    BSP_ARENA *prev = slot->curr;
+    slot->curr = slot->arena;
+    slot->depth ++;
+
+    return prev;
+}
+
+void arena_leave(BSP_ARENA *prev)
+{
+    struct bsp_arena_slot_t *slot = _arena_slot();
+    if (!slot || slot->depth <= 0)
+    {
+        return;
+    }
+
+    slot->curr = prev;
+    slot->depth --;
+    if (0 == slot->depth)
+    {
+        arena_reset(slot->arena);
+    }
+
+    return;
+}
@@ -0,0 +1,147 @@
+/*
+ * atom.c
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Interned key strings (atoms).
+ * Lookup goes without lock, new atom is pushed onto its chain by CAS.
+ * Atoms are never removed, so a chain only grows at its head
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/02/2014
+ * @changelog
+ *      [12/02/2014] - Creation
+ */
+
+#include "bsp.h"
+
+static struct bsp_atom_t *atom_table[ATOM_HASH_SIZE];
+static size_t atom_total = 0;
+
+static BSP_STRING * _find_chain(struct bsp_atom_t *atom, const char *data, size_t len, uint32_t hash_key)
+{
+    while (atom)
+    {
+        if (atom->str.hash == hash_key && atom->str.original_len == len && 0 == memcmp(atom->str.str, data, len))
+        {
+            return &atom->str;
+        }
+        atom = atom->next;
+    }
+
+    return NULL;
+}
+
+BSP_STRING * atom_find(const char *data, size_t len, uint32_t hash_key)
+{
+    if (!data)
+    {
+        return NULL;
+    }
+
+    struct bsp_atom_t *head = __sync_fetch_and_add(&atom_table[hash_key & (ATOM_HASH_SIZE - 1)], 0);
+
+    return _find_chain(head, data, len, hash_key);
+}
+
+BSP_STRING * atom_intern(const char *data, ssize_t len)
+{
+    if (!data)
+    {
+        return NULL;
+    }
+
+    if (len < 0)
+    {
+        len = strlen(data);
+    }
+
+    uint32_t hash_key = bsp_hash(data, len);
+    struct bsp_atom_t **slot = &atom_table[hash_key & (ATOM_HASH_SIZE - 1)];
+    struct bsp_atom_t *head = __sync_fetch_and_add(slot, 0);
+    BSP_STRING *ret = _find_chain(head, data, len, hash_key);
+    if (ret)
+    {
+        return ret;
+    }
+
+    // Text stored right after the atom
+    struct bsp_atom_t *atom = bsp_calloc(1, sizeof(struct bsp_atom_t) + len + 1);
+    if (!atom)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Atom : Create atom error");
+        return NULL;
+    }
+
+    atom->str.str = (char *) (atom + 1);
+    memcpy(atom->str.str, data, len);
+    atom->str.original_len = len;
+    atom->str.compress_type = COMPRESS_TYPE_NONE;
+    atom->str.is_const = 1;
+    atom->str.is_atom = 1;
+    atom->str.hash = hash_key;
+    bsp_spin_init(&atom->str.lock);
+    while (1)
+    {
+        atom->next = head;
+        if (__sync_bool_compare_and_swap(slot, head, atom))
+        {
+            __sync_fetch_and_add(&atom_total, 1);
+            break;
+        }
+
+        // Chain changed, someone may have put the same text
+        head = __sync_fetch_and_add(slot, 0);
+        ret = _find_chain(head, data, len, hash_key);
+        if (ret)
+        {
+            bsp_free(atom);
+            return ret;
+        }
+    }
+
+    return &atom->str;
+}
+
+BSP_STRING * atom_key(const char *data, ssize_t len)
+{
+    if (!data)
+    {
+        return NULL;
+    }
+
+    if (len < 0)
+    {
+        len = strlen(data);
+    }
+
+    BSP_STRING *ret = NULL;
+    if (len <= ATOM_KEY_MAX_LEN)
+    {
+        // Data from peers must not fill memory with atoms
+        ret = (atom_total < ATOM_MAX_ITEMS) ? atom_intern(data, len) : atom_find(data, len, bsp_hash(data, len));
+    }
+
+    return (ret) ? ret : new_string(data, len);
+}
+
+size_t atom_count()
+{
+    return atom_total;
+}
@@ -233,6 +233,35 @@ static int bootstrap_set_online_handler(lua_State *s)
     }
     lua_pop(s, 1);
 
+    lua_getfield(s, -1, "snapshot");
+    if (lua_isstring(s, -1) || lua_toboolean(s, -1))
+    {
+        // Snapshot file for warm restart, after autosave interval
+        char filename[_POSIX_PATH_MAX];
+        if (lua_isstring(s, -1))
+        {
+            snprintf(filename, _POSIX_PATH_MAX - 1, "%s", lua_tostring(s, -1));
+        }
+        else
+        {
+            snprintf(filename, _POSIX_PATH_MAX - 1, ONLINE_SNAPSHOT_FILE, settings->runtime_dir, settings->instance_id);
+        }
+        online_snapshot_open(filename);
+    }
+    lua_pop(s, 1);
+
+    lua_getfield(s, -1, "presence_slots");
+    size_t nslots = (lua_isnumber(s, -1)) ? (size_t) lua_tointeger(s, -1) : DEFAULT_PRESENCE_SLOTS;
+    lua_pop(s, 1);
+
+    lua_getfield(s, -1, "presence");
+    if (lua_isstring(s, -1) || lua_toboolean(s, -1))
+    {
+        // Presence shared with instances on host, segment name or default
+        presence_open((lua_isstring(s, -1)) ? lua_tostring(s, -1) : NULL, nslots, settings->instance_id);
+    }
+    lua_pop(s, 1);
+
     return 0;
 }
 
@@ -22,9 +22,12 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 10/31/2014
+ * @update 12/08/2014
  * @changelog 
  *      [10/31/2014] - Creation
+ *      [12/02/2014] - Hash keys decoded as atoms
+ *      [12/03/2014] - Hash traversed without cursor (shared frozen objects)
+ *      [12/08/2014] - Output built in local strings
  */
 
 #include "bsp.h"
@@ -120,7 +123,7 @@ static void _append_value_to_bson(BSP_STRING *str, BSP_VALUE *val)
 
 static void _append_object_to_bson(BSP_STRING *str, BSP_OBJECT *obj)
 {
-    BSP_STRING *body = new_string(NULL, 0);
+    BSP_STRING *body = new_string_local(NULL, 0);
     if (!str || !obj || str->is_const || !body)
     {
         return;
@@ -145,16 +148,7 @@ static void _append_object_to_bson(BSP_STRING *str, BSP_OBJECT *obj)
                 //string_append(str, "[", 1);
                 for (idx = 0; idx < array->nitems; idx ++)
                 {
-                    size_t bucket = idx / ARRAY_BUCKET_SIZE;
-                    size_t seq = idx % ARRAY_BUCKET_SIZE;
-                    if (bucket < array->nbuckets && array->items[bucket])
-                    {
-                        val = array->items[bucket][seq];
-                    }
-                    else
-                    {
-                        val = NULL;
-                    }
+                    val = ARRAY_ITEM(array, idx);
                     // Write key
                     string_printf(body, "%d", idx);
                     string_append(body, "\0", 1);
@@ -166,23 +160,16 @@ static void _append_object_to_bson(BSP_STRING *str, BSP_OBJECT *obj)
         case OBJECT_TYPE_HASH : 
             // Hash
             hash = (struct bsp_hash_t *) obj->node;
-            BSP_STRING *key;
-            if (hash)
+            struct bsp_hash_item_t *item;
+            for (idx = 0; hash && idx < hash->nitems_used; idx ++)
             {
-                reset_object(obj);
-                val = curr_item(obj);
-                while (val)
+                item = HASH_ITEM(hash, idx);
+                if (item)
                 {
-                    key = curr_hash_key(obj);
-                    if (key)
-                    {
-                        // Write key
-                        string_append(body, STR_STR(key), STR_LEN(key));
-                        string_append(body, "\0", 1);
-                        _append_value_to_bson(body, val);
-                    }
-                    next_item(obj);
-                    val = curr_item(obj);
+                    // Write key
+                    string_append(body, STR_STR(item->key), STR_LEN(item->key));
+                    string_append(body, "\0", 1);
+                    _append_value_to_bson(body, item->value);
                 }
             }
             break;
@@ -205,7 +192,7 @@ BSP_STRING * bson_nd_encode(BSP_OBJECT *obj)
     BSP_STRING *bson = NULL;
     if (obj)
     {
-        bson = new_string(NULL, 0);
+        bson = new_string_local(NULL, 0);
         _append_object_to_bson(bson, obj);
     }
     return bson;
@@ -424,6 +411,25 @@ BSP_STRING * _get_str_from_bson(BSP_STRING *str)
     return ret;
 }
 
+// Key of hash, short key taken as atom
+static BSP_STRING * _get_key_from_bson(BSP_STRING *str)
+{
+    if (!str || !STR_REMAIN(str))
+    {
+        return NULL;
+    }
+
+    size_t len = strnlen(STR_CURR(str), STR_REMAIN(str));
+    BSP_STRING *ret = NULL;
+    if (len < STR_REMAIN(str))
+    {
+        ret = atom_key(STR_CURR(str), len);
+        str->cursor += (1 + len);
+    }
+
+    return ret;
+}
+
 void _traverse_bson_array(BSP_OBJECT *obj, BSP_STRING *str)
 {
     if (!obj || OBJECT_TYPE_ARRAY != obj->type || !str)
@@ -455,7 +461,7 @@ void _traverse_bson_hash(BSP_OBJECT *obj, BSP_STRING *str)
     BSP_VALUE *val = NULL;
     while (STR_REMAIN(str))
     {
-        key = _get_str_from_bson(str);
+        key = _get_key_from_bson(str);
         val = _get_value_from_bson(str);
         if (key && val)
         {
@@ -469,7 +475,7 @@ BSP_OBJECT * bson_nd_decode(BSP_STRING *str)
     BSP_OBJECT *obj = NULL;
     if (str)
     {
-        bsp_spin_lock(&str->lock);
+        STR_LOCK(str);
         // If valid ?
         if (STR_LEN(str) >= 5)
         {
@@ -483,7 +489,7 @@ BSP_OBJECT * bson_nd_decode(BSP_STRING *str)
                 del_string(body);
             }
         }
-        bsp_spin_unlock(&str->lock);
+        STR_UNLOCK(str);
     }
     return obj;
 }
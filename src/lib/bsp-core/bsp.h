@@ -71,6 +71,7 @@
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 #include <arpa/inet.h>
@@ -87,8 +88,13 @@
 #include "bsp_spinlock.h"
 #include "bsp_variable.h"
 #include "bsp_mempool.h"
+#include "bsp_freelist.h"
+#include "bsp_arena.h"
 #include "bsp_string.h"
+#include "bsp_rope.h"
+#include "bsp_atom.h"
 #include "bsp_object.h"
+#include "bsp_view.h"
 #include "bsp_json.h"
 #include "bsp_msgpack.h"
 #include "bsp_bson.h"
@@ -98,6 +104,9 @@
 #include "bsp_timer.h"
 #include "bsp_logger.h"
 #include "bsp_conf.h"
+#include "bsp_snapshot.h"
+#include "bsp_presence.h"
+#include "bsp_channel.h"
 #include "bsp_online.h"
 #include "bsp_fd.h"
 #include "bsp_hash.h"
@@ -0,0 +1,92 @@
+/*
+ * bsp_arena.h
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Bump allocator for short-lived (per-event) data header
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 11/29/2014
+ * @changelog
+ *      [11/29/2014] - Creation
+ */
+
+#ifndef _LIB_BSP_CORE_ARENA_H
+
+#define _LIB_BSP_CORE_ARENA_H
+/* Headers */
+
+/* Definations */
+#define ARENA_CHUNK_SIZE                        65536
+#define ARENA_ALIGN                             16
+
+/* Macros */
+#define ARENA_ALIGN_SIZE(s)                     (((s) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+/* Structs */
+struct bsp_arena_chunk_t
+{
+    struct bsp_arena_chunk_t
+                        *next;
+    size_t              size;
+    size_t              used;
+};
+
+// Called before memory goes back, for heap data hanging on arena blocks
+struct bsp_arena_cleanup_t
+{
+    void                (*func)(void *);
+    void                *data;
+    struct bsp_arena_cleanup_t
+                        *next;
+};
+
+typedef struct bsp_arena_t
+{
+    struct bsp_arena_chunk_t
+                        *head;
+    struct bsp_arena_cleanup_t
+                        *cleanups;
+    size_t              chunk_size;
+    size_t              total;
+} BSP_ARENA;
+
+/* Functions */
+BSP_ARENA * new_arena(size_t chunk_size);
+void del_arena(BSP_ARENA *arena);
+
+// Allocation never fails with a partial block, memory is ARENA_ALIGN aligned.
+// Nothing can be freed one by one, all blocks go back by arena_reset()
+void * arena_alloc(BSP_ARENA *arena, size_t size);
+void * arena_calloc(BSP_ARENA *arena, size_t nmemb, size_t size);
+void * arena_realloc(BSP_ARENA *arena, void *ptr, size_t old_size, size_t new_size);
+char * arena_strndup(BSP_ARENA *arena, const char *data, size_t len);
+int arena_on_reset(BSP_ARENA *arena, void (*func)(void *), void *data);
+void arena_reset(BSP_ARENA *arena);
+
+// Current arena of this thread. new_object() / new_value() / new_string() take memory from it if set
+BSP_ARENA * curr_arena();
+BSP_ARENA * arena_switch(BSP_ARENA *arena);
+
+// Event scope on the arena owned by this thread, may be nested.
+// The outermost arena_leave() resets the arena, nothing allocated inside survives
+BSP_ARENA * arena_enter();
+void arena_leave(BSP_ARENA *prev);
+
+#endif  /* _LIB_BSP_CORE_ARENA_H */
@@ -0,0 +1,61 @@
+/*
+ * bsp_atom.h
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Interned key strings (atoms) header
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/02/2014
+ * @changelog
+ *      [12/02/2014] - Creation
+ */
+
+#ifndef _LIB_BSP_CORE_ATOM_H
+
+#define _LIB_BSP_CORE_ATOM_H
+/* Headers */
+
+/* Definations */
+#define ATOM_HASH_SIZE                          4096
+#define ATOM_KEY_MAX_LEN                        32
+#define ATOM_MAX_ITEMS                          16384
+
+/* Macros */
+#define STR_IS_ATOM(s)                          ((s) && (s)->is_atom)
+
+/* Structs */
+struct bsp_atom_t
+{
+    BSP_STRING          str;
+    struct bsp_atom_t   *next;
+};
+
+/* Functions */
+// Atom is an immutable heap string shared by all threads and never freed.
+// It carries its hash, the same text always gives the same atom, so atoms compare by pointer.
+// del_string() on an atom does nothing, clone_string() returns the atom itself
+BSP_STRING * atom_intern(const char *data, ssize_t len);
+BSP_STRING * atom_find(const char *data, size_t len, uint32_t hash_key);
+
+// Key for decoders : atom if the key is short and the table is not full, or a new string
+BSP_STRING * atom_key(const char *data, ssize_t len);
+size_t atom_count();
+
+#endif  /* _LIB_BSP_CORE_ATOM_H */
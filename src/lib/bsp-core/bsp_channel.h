@@ -0,0 +1,126 @@
+/*
+ * bsp_channel.h
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Channel (room) membership header
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/16/2014
+ * @changelog
+ *      [12/16/2014] - Creation
+ */
+
+#ifndef _LIB_BSP_CORE_CHANNEL_H
+
+#define _LIB_BSP_CORE_CHANNEL_H
+/* Headers */
+
+/* Definations */
+#define CHANNEL_HASH_INITIAL                    256         // Power of 2
+#define CHANNEL_MEMBERS_INITIAL                 16
+#define CHANNEL_FD_INITIAL                      4           // Channels joined by one fd
+
+/* Macros */
+
+/* Structs */
+// Sorted fds of one worker in a channel
+struct bsp_channel_members_t
+{
+    int                 *fds;
+    size_t              nfds;
+    size_t              size;
+    BSP_SPINLOCK        lock;
+};
+
+// Channel leaves registry with its last member, messages on the way hold references
+typedef struct bsp_channel_t
+{
+    char                *name;
+    uint32_t            hash;
+    int                 refcount;
+    size_t              nmembers;
+    struct bsp_channel_members_t
+                        *members;               // One set per worker, the last for fds of no worker
+    struct bsp_channel_t
+                        *next;
+} BSP_CHANNEL;
+
+// Channel joined by a fd and the set it is in
+struct bsp_channel_ref_t
+{
+    BSP_CHANNEL         *channel;
+    int                 slot;
+};
+
+// Channels of one fd, kept in fd list
+typedef struct bsp_channel_list_t
+{
+    struct bsp_channel_ref_t
+                        *refs;
+    size_t              nrefs;
+    size_t              size;
+} BSP_CHANNEL_LIST;
+
+// Packet sent by one worker to its own members
+struct bsp_channel_message_t
+{
+    BSP_CHANNEL         *channel;
+    int                 p_type;
+    int                 cmd;
+    BSP_OBJECT          *obj;
+    BSP_STRING          *raw;
+    struct bsp_channel_message_t
+                        *next;
+};
+
+struct bsp_channel_queue_t
+{
+    struct bsp_channel_message_t
+                        *head;
+    struct bsp_channel_message_t
+                        *tail;
+    int                 signaled;
+    BSP_SPINLOCK        lock;
+};
+
+/* Functions */
+// Initialize registry, after workers created
+int channel_init();
+
+// Fd is kept in the set of its worker, a fd joins a channel once. Fd not registered is refused
+int channel_join(const char *name, int fd);
+int channel_leave(const char *name, int fd);
+
+// Leave all channels, when fd unregistered
+void channel_leave_all(int fd);
+
+// Fds of channel, array must be freed by bsp_free()
+int * get_channel_members(const char *name, size_t *nmembers);
+
+// Members of each worker are sent by that worker : members of current worker at once, others
+// queued and notified. Object (taken) and data are encoded once per worker. Number of members returned
+size_t channel_send_raw(const char *name, const char *data, ssize_t len);
+size_t channel_send_obj(const char *name, BSP_OBJECT *obj);
+size_t channel_send_cmd(const char *name, int cmd, BSP_OBJECT *obj);
+
+// Send messages queued for current worker
+void channel_flush();
+
+#endif  /* _LIB_BSP_CORE_CHANNEL_H */
@@ -87,6 +87,9 @@ struct bsp_conf_server_t
     int                 def_data_type;
     size_t              max_packet_length;
     size_t              max_clients;
+    int                 websocket_deflate;
+    int                 websocket_deflate_window_bits;
+    int                 websocket_deflate_no_context_takeover;
     
     // LUA callback
     char                *script_func_on_connect;
@@ -74,6 +74,7 @@ typedef struct bsp_core_setting_t
     void                (* ext_timer_callback) (BSP_TIMER *tmr);
     int                 script_gc_interval;
     int                 online_autosave_interval;
+    size_t              memdb_memory;
 
     // Application base dir (prefix)
     const char          *base_dir;
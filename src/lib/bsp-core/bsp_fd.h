@@ -22,10 +22,11 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 06/07/2012
+ * @update 12/16/2014
  * @changelog 
  *      [05/30/2012] - Creation
  *      [06/07/2012] - Fd's tid property added
+ *      [12/16/2014] - Channels joined by fd
  */
 
 #ifndef _LIB_BSP_CORE_FD_H
@@ -64,6 +65,7 @@ typedef struct bsp_fd_t
     int                 tid;
     void                *ptr;
     BSP_ONLINE          *online;
+    BSP_CHANNEL_LIST    *channels;
 } BSP_FD;
 
 /* Functions */
@@ -93,6 +95,10 @@ void set_fd_online(const int fd, BSP_ONLINE *online);
 // Get fd online info
 BSP_ONLINE * get_fd_online(const int fd);
 
+// Channels joined by fd, kept by channel registry
+void set_fd_channels(const int fd, BSP_CHANNEL_LIST *channels);
+BSP_CHANNEL_LIST * get_fd_channels(const int fd);
+
 // Set fd non-blocking
 int set_fd_nonblock(const int fd);
 
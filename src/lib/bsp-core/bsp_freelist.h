@@ -0,0 +1,87 @@
+/*
+ * bsp_freelist.h
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Fixed-size item pools (free lists) header
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/07/2014
+ * @changelog
+ *      [12/07/2014] - Creation
+ */
+
+#ifndef _LIB_BSP_CORE_FREELIST_H
+
+#define _LIB_BSP_CORE_FREELIST_H
+/* Headers */
+
+/* Definations */
+#define FREELIST_MAX                            32
+#define FREELIST_CACHE_SIZE                     256         // Items kept by one thread
+#define FREELIST_BATCH                          64          // Items moved between thread and pool at once
+
+#define FREE_VALUE_LIST_INITIAL                 4096
+#define FREE_CLIENT_LIST_INITIAL                256
+#define FREE_CONNECTOR_LIST_INITIAL             16
+
+/* Macros */
+
+/* Structs */
+// Shared list of one item type, counters updated by batch. Not pooled before registered (id 0)
+typedef struct bsp_freelist_t
+{
+    const char          *name;
+    size_t              item_size;
+    int                 id;
+    void                *head;
+    size_t              nitems;
+    BSP_SPINLOCK        lock;
+    size_t              ncreated;
+    size_t              nalloc;
+    size_t              nfree;
+} BSP_FREELIST;
+
+// Items of one type kept by one thread
+struct bsp_freelist_cache_t
+{
+    void                *head;
+    size_t              nitems;
+    size_t              nalloc;
+    size_t              nfree;
+};
+
+// Pools of core structs, registered by freelist_init()
+extern BSP_FREELIST freelist_string;
+extern BSP_FREELIST freelist_value;
+extern BSP_FREELIST freelist_client;
+extern BSP_FREELIST freelist_connector;
+
+/* Functions */
+// Items are bsp_malloc()ed blocks of item_size, never given back to mempool.
+// Before the pool is registered, alloc / free go to bsp_calloc() / bsp_free(), items are the same.
+// Register in main thread before workers start
+int freelist_init();
+int freelist_register(BSP_FREELIST *fl, size_t nprewarm);
+
+// Item returned zeroed
+void * freelist_alloc(BSP_FREELIST *fl);
+void freelist_free(BSP_FREELIST *fl, void *item);
+
+#endif  /* _LIB_BSP_CORE_FREELIST_H */
@@ -22,11 +22,12 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 06/07/2012
+ * @update 12/10/2014
  * @changelog 
  *      [06/07/2012] - Creation
  *      [12/18/2012] - Move macros out
  *      [04/07/2013] - IPv4 hash added
+ *      [12/10/2014] - Seeded 64-bit multiply-mix hash (wyhash), streaming hash
  */
 
 #ifndef _LIB_BSP_CORE_HASH_H
@@ -36,34 +37,39 @@
 
 /* Definations */
 #define IPV4_HASH_BLOCK                         2038;
+#define HASH_BLOCK_SIZE                         48
 
 /* Macros */
-// Macros for string hash
-#define rot(x, k) (((x) << (k)) ^ ((x) >> (32 - (k))))
 
-#define mix(a, b, c) \
-{ \
-    a -= c;  a ^= rot(c, 4);  c += b; \
-    b -= a;  b ^= rot(a, 6);  a += c; \
-    c -= b;  c ^= rot(b, 8);  b += a; \
-    a -= c;  a ^= rot(c, 16); c += b; \
-    b -= a;  b ^= rot(a, 19); a += c; \
-    c -= b;  c ^= rot(b, 4);  b += a; \
-}
-
-#define final(a, b, c) \
-{ \
-    c ^= b; c -= rot(b, 14); \
-    a ^= c; a -= rot(c, 11); \
-    b ^= a; b -= rot(a, 25); \
-    c ^= b; c -= rot(b, 16); \
-    a ^= c; a -= rot(c, 4);  \
-    b ^= a; b -= rot(a, 14); \
-    c ^= b; c -= rot(b, 24); \
-}
+/* Structs */
+// Incremental hash of data given in pieces
+typedef struct bsp_hash_stream_t
+{
+    uint64_t            origin;
+    uint64_t            seed;
+    uint64_t            see1;
+    uint64_t            see2;
+    size_t              total;
+    size_t              nbuf;
+    uint8_t             last[16];
+    uint8_t             buf[HASH_BLOCK_SIZE];
+} BSP_HASH_STREAM;
 
 /* Functions */
+// Random process seed, call before anything hashed (core_init() does it)
+int hash_init();
+
+// Hash of string, seeded by process. Same key gives different values in different processes,
+// never store it or send it out. Length < 0 : NUL-terminated key, 0 : empty key
 uint32_t bsp_hash(const char *key, ssize_t len);
+
+// Hash with given seed, stable across processes
+uint64_t bsp_hash64(const char *key, size_t len, uint64_t seed);
+
+void hash_stream_init(BSP_HASH_STREAM *hs, uint64_t seed);
+void hash_stream_update(BSP_HASH_STREAM *hs, const char *data, size_t len);
+uint64_t hash_stream_final(BSP_HASH_STREAM *hs);
+
 uint32_t ipv4_hash(uint32_t ip, int bsize);
 uint32_t ipv6_hash(uint8_t *ip, int bsize);
 
@@ -22,9 +22,11 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 08/23/2012
+ * @update 11/28/2014
  * @changelog 
  *      [08/23/2012] - Creation
+ *      [11/27/2014] - WebSocket permessage-deflate
+ *      [11/28/2014] - In-place frame unmasking
  */
 
 #ifndef _LIB_BSP_CORE_HTTP_H
@@ -102,6 +104,13 @@
 #define WS_OPCODE_PING                          0x9
 #define WS_OPCODE_PONG                          0xa
 
+// RSV1 of first byte, marks a compressed message. Kept in opcode by parser
+#define WS_FLAG_RSV1                            0x40
+
+#define WS_DEFLATE_MIN_WINDOW_BITS              9
+#define WS_DEFLATE_MAX_WINDOW_BITS              15
+#define WS_DEFLATE_TAIL                         "\x00\x00\xff\xff"
+
 /* Macros */
 
 /* Structs */
@@ -176,8 +185,28 @@ typedef struct bsp_http_response_t
     char                *sec_websocket_origin;
     char                *sec_websocket_location;
     char                *sec_websocket_protocol;
+    char                *sec_websocket_extensions;
 } BSP_HTTP_RESPONSE;
 
+// Header of a WebSocket frame
+typedef struct bsp_websocket_frame_t
+{
+    int                 fin;
+    int                 opcode;
+    int                 masked;
+    char                mask[4];
+    size_t              header_len;
+    size_t              payload_len;
+} BSP_WEBSOCKET_FRAME;
+
+// Parameters of permessage-deflate (RFC7692)
+typedef struct bsp_websocket_deflate_t
+{
+    int                 server_max_window_bits;
+    int                 server_no_context_takeover;
+    int                 client_no_context_takeover;
+} BSP_WEBSOCKET_DEFLATE;
+
 /* Functions */
 // == Request ==
 BSP_HTTP_REQUEST * new_http_request();
@@ -194,6 +223,7 @@ void http_request_set_origin(BSP_HTTP_REQUEST *req, const char *origin, ssize_t
 void http_request_set_connection(BSP_HTTP_REQUEST *req, const char *connection, ssize_t len);
 void http_request_set_sec_websocket_version(BSP_HTTP_REQUEST *req, int version);
 void http_request_set_sec_websocket_protocol(BSP_HTTP_REQUEST *req, const char *protocol, ssize_t len);
+void http_request_set_sec_websocket_extensions(BSP_HTTP_REQUEST *req, const char *extensions, ssize_t len);
 void http_request_set_sec_websocket_key(BSP_HTTP_REQUEST *req, const char *key, ssize_t len);
 void http_request_set_sec_websocket_key1(BSP_HTTP_REQUEST *req, const char *key, ssize_t len);
 void http_request_set_sec_websocket_key2(BSP_HTTP_REQUEST *req, const char *key, ssize_t len);
@@ -223,6 +253,7 @@ void http_response_set_connection(BSP_HTTP_RESPONSE *resp, const char *connectio
 void http_response_set_sec_websocket_accept(BSP_HTTP_RESPONSE *resp, const char *accept, ssize_t len);
 void http_response_set_sec_websocket_protocol(BSP_HTTP_RESPONSE *resp, const char *protocol, ssize_t len);
 void http_response_set_sec_websocket_origin(BSP_HTTP_RESPONSE *resp, const char *origin, ssize_t len);
+void http_response_set_sec_websocket_extensions(BSP_HTTP_RESPONSE *resp, const char *extensions, ssize_t len);
 
 // Generate a response stream
 BSP_STRING * generate_http_response(BSP_HTTP_RESPONSE *resp);
@@ -233,10 +264,28 @@ size_t parse_http_response(const char *data, ssize_t len, BSP_HTTP_RESPONSE *res
 // Give response to HTML5 WebSocket handshake
 int websocket_handshake(BSP_HTTP_REQUEST *req, BSP_HTTP_RESPONSE *resp);
 
+// Accept permessage-deflate offer of client. Param gives our preference and returns the agreed one
+int websocket_deflate_negotiate(BSP_HTTP_REQUEST *req, BSP_HTTP_RESPONSE *resp, BSP_WEBSOCKET_DEFLATE *param);
+
+// Per-connection deflate / inflate context of agreed parameters
+BSP_COMPRESS_STREAM * new_websocket_deflate_stream(BSP_WEBSOCKET_DEFLATE *param);
+
+// Parse header of a frame (RFC6455). Return length of whole frame, 0 if incomplete, -1 on protocol error
+ssize_t parse_websocket_frame(const char *data, size_t len, BSP_WEBSOCKET_FRAME *frame);
+
+// XOR payload with mask, dst may be the same as src or before it
+void websocket_unmask(char *dst, const char *src, size_t len, const char *mask);
+
 // Parse WebSocket data(RFC6455)
 size_t parse_websocket_data(const char *data, ssize_t len, int *opcode, BSP_STRING *data_str);
 
+// Inflate a message with WS_FLAG_RSV1
+int websocket_inflate_data(BSP_STRING *data, BSP_COMPRESS_STREAM *cs);
+
 // Generate WebSocket data
 BSP_STRING * generate_websocket_data(BSP_STRING *data, int opcode, int mask);
 
+// Generate compressed WebSocket data, control frames are never compressed
+BSP_STRING * generate_websocket_data_deflate(BSP_STRING *data, int opcode, int mask, BSP_COMPRESS_STREAM *cs);
+
 #endif  /* _LIB_BSP_CORE_HTTP_H */
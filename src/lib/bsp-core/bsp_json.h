@@ -39,12 +39,24 @@
 #define JSON_DECODE_STATUS_DIGIT                0b00001000
 #define JSON_DECODE_STATUS_BOOLEAN              0b00010000
 
+#define JSON_BUFFER_INITIAL                     64
+#define JSON_NUMBER_MAX_LEN                     32
+
 /* Macros */
 
 /* Structs */
+typedef struct bsp_json_buffer_t
+{
+    char                *data;
+    size_t              len;
+    size_t              size;
+    int                 error;
+} BSP_JSON_BUFFER;
 
 /* Functions */
+// NULL returned if buffer cannot be allocated, never a truncated document
 BSP_STRING * json_nd_encode(BSP_OBJECT *obj);
+char * json_nd_encode_buffer(BSP_OBJECT *obj, size_t *len);
 BSP_OBJECT * json_nd_decode(BSP_STRING *str);
 
 #endif  /* _LIB_BSP_CORE_JSON_H */
@@ -19,12 +19,13 @@
 
 /**
  * Object based in-memory db / cache header
- * 
+ *
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 10/22/2014
- * @changelog 
+ * @update 12/17/2014
+ * @changelog
  *      [10/22/2014] - Creation
+ *      [12/17/2014] - Sharded key-value cache with TTL, CLOCK eviction, incr and CAS
  */
 
 #ifndef _LIB_BSP_CORE_MEMDB_H
@@ -33,13 +34,69 @@
 /* Headers */
 
 /* Definations */
+#define MEMDB_SHARD_BITS                        6
+#define MEMDB_SHARDS                            (1 << MEMDB_SHARD_BITS)
+#define MEMDB_SHARD_INITIAL                     64          // Buckets of one shard, power of 2
+#define DEFAULT_MEMDB_MEMORY                    64          // Megabytes
+#define MEMDB_EXPIRE_STEP                       32          // Entries checked in one shard by one tick
 
 /* Macros */
 
 /* Structs */
+// Value in place : scalars copied, string and object frozen and shared with readers.
+// Ring is the CLOCK list of shard, an entry read since last visit of hand survives once
+typedef struct bsp_memdb_entry_t
+{
+    char                *key;
+    size_t              key_len;
+    uint32_t            hash;
+    BSP_VALUE           val;
+    time_t              expire;
+    size_t              size;
+    uint64_t            version;
+    int                 referenced;
+    struct bsp_memdb_entry_t
+                        *prev;
+    struct bsp_memdb_entry_t
+                        *succ;
+    struct bsp_memdb_entry_t
+                        *next;
+} BSP_MEMDB_ENTRY;
+
+// One stripe of cache with its own lock and memory budget.
+// New entries go in front of hand, expire scan walks the ring by itself
+struct bsp_memdb_shard_t
+{
+    BSP_MEMDB_ENTRY     **buckets;
+    size_t              size;
+    size_t              nitems;
+    size_t              memory;
+    size_t              limit;
+    BSP_MEMDB_ENTRY     *hand;
+    BSP_MEMDB_ENTRY     *scan;
+    BSP_SPINLOCK        lock;
+};
 
 /* Functions */
+// Initialize shards, memory limit by core setting
 int memdb_init();
-BSP_VALUE *memdb_get(const char *key);
+
+// Value is taken (string / object frozen), ttl in seconds, 0 for never expires.
+// Old value of key replaced, least recently read entries evicted when shard full
+int memdb_set(const char *key, BSP_VALUE *val, int ttl);
+
+// New value referring data of cache, freed by del_value(). Version set for memdb_cas() if given
+BSP_VALUE * memdb_get(const char *key, uint64_t *version);
+
+int memdb_del(const char *key);
+
+// Add delta to integer value, a missing key starts from 0. New value set to result
+int memdb_incr(const char *key, int64_t delta, int64_t *result);
+
+// Set only if version of key is still the given one (0 : key does not exist)
+int memdb_cas(const char *key, uint64_t version, BSP_VALUE *val, int ttl);
+
+// Drop expired entries, called by main thread every second
+void memdb_expire();
 
 #endif  /* _LIB_BSP_CORE_MEMDB_H */
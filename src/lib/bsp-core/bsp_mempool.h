@@ -22,11 +22,14 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 07/18/2013
+ * @update 12/06/2014
  * @changelog
  *      [06/07/2012] - Creation
  *      [08/23/2012] - mempool_strdup added
  *      [07/18/2013] - mempool_alloc_usable_size
+ *      [12/04/2014] - Thread magazines and remote free list
+ *      [12/05/2014] - Constant time size class, headerless small items
+ *      [12/06/2014] - Free blocks trimmed
  */
 
 #ifndef _LIB_BSP_CORE_MEMPOOL_H
@@ -37,20 +40,63 @@
 /* Definations */
 #define SLAB_BLOCK_LIST_SIZE                    131072      // 512GB - 8TB memory space per pool
 #define SLAB_MAX                                55
+#define SLAB_SMALL_MAX                          16          // Slabs up to 1KB have no item header
+#define SLAB_MIN_SHIFT                          5
+#define SPAN_SHIFT                              16          // Blocks of small slabs are aligned by span
+#define SPAN_MAP_BITS                           16
+#define MEMPOOL_TRIM_INTERVAL                   10          // Seconds
+#define MAGAZINE_SIZE                           64
+#define MAGAZINE_SPACE                          65536       // Max cached bytes per slab per thread
 
 /* Macros */
-#define BLOCK_SIZE(i)                           ((slab_size[i] + 8) * slab_nitems[i])
+#define ITEM_HEAD(i)                            (((i) < SLAB_SMALL_MAX) ? 0 : 8)
+#define ITEM_STRIDE(i)                          (slab_size[i] + ITEM_HEAD(i))
+#define BLOCK_SIZE(i)                           (ITEM_STRIDE(i) * slab_nitems[i])
+#define BLOCK_SPACE(i)                          ((BLOCK_SIZE(i) + (1 << SPAN_SHIFT) - 1) & ~(((size_t) 1 << SPAN_SHIFT) - 1))
 
 /* Structs */
+// Every block covers whole spans, item -> block by span map
+struct bsp_mempool_block_t
+{
+    struct bsp_mempool_slab_t
+                        *slab;
+    void                *data;
+    size_t              nfree;
+    struct bsp_mempool_block_t
+                        *next;
+};
+
 struct bsp_mempool_slab_t
 {
     int                 slab_id;
     size_t              curr_block_alloced;
-    void                *curr_block;
+    struct bsp_mempool_block_t
+                        *curr_block;
+    struct bsp_mempool_block_t
+                        *blocks;
     void                *next_free_item;
+    void                *remote_free;
+    size_t              nfree;
     BSP_SPINLOCK        slab_lock;
 };
 
+// Free items of one slab kept by a thread, no lock needed.
+// Filled from / flushed to the slab by half of size each time
+struct bsp_mempool_magazine_t
+{
+    size_t              nitems;
+    size_t              size;
+    size_t              nalloc;
+    size_t              nfree;
+    void                *items[MAGAZINE_SIZE];
+};
+
+struct bsp_mempool_cache_t
+{
+    struct bsp_mempool_magazine_t
+                        mag[SLAB_MAX];
+};
+
 typedef struct bsp_mempool_t
 {
     struct bsp_mempool_slab_t
@@ -58,6 +104,10 @@ typedef struct bsp_mempool_t
     BSP_SPINLOCK        lock;
 } BSP_MEMPOOL;
 
+// Item size and items per block of slabs
+extern size_t slab_size[SLAB_MAX];
+extern size_t slab_nitems[SLAB_MAX];
+
 /* Functions */
 int mempool_init();
 void * mempool_alloc(size_t nsize);
@@ -68,4 +118,7 @@ char * mempool_strndup(const char *input, ssize_t len);
 size_t mempool_alloc_usable_size(void *addr);
 int mempool_free(void *addr);
 
+// Blocks with all items free given back to system, called by base timer
+size_t mempool_trim();
+
 #endif  /* _LIB_BSP_CORE_MEMPOOL_H */
@@ -22,10 +22,16 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 10/26/2012
+ * @update 12/17/2014
  * @changelog 
  *      [06/11/2012] - Creation
  *      [10/26/2012] - Boolean data type added
+ *      [11/29/2014] - Arena objects
+ *      [11/30/2014] - Open addressing hash
+ *      [12/01/2014] - Contiguous array storage
+ *      [12/02/2014] - Atom keys
+ *      [12/03/2014] - Frozen (refcounted) objects
+ *      [12/17/2014] - Single value to / from LUA stack
  */
 
 #ifndef _LIB_BSP_CORE_OBJECT_H
@@ -34,8 +40,12 @@
 /* Headers */
 
 /* Definations */
-#define HASH_SIZE_INITIAL                       8
-#define ARRAY_BUCKET_SIZE                       64
+#define HASH_SIZE_INITIAL                       16
+#define HASH_GROUP_SIZE                         16
+#define HASH_CTRL_EMPTY                         0x80
+#define HASH_CTRL_DELETED                       0xFE
+#define HASH_CURSOR_END                         ((size_t) -1)
+#define ARRAY_SIZE_INITIAL                      8
 #define SERIALIZE_OBJECT                        0x0
 #define SERIALIZE_ARRAY                         0x1
 
@@ -47,49 +57,54 @@
 #define NO_HASH_KEY                             "_NO_HASH_KEY_"
 
 /* Macros */
+#define HASH_FINGERPRINT(h)                     ((uint8_t) ((h) >> 25))
+#define HASH_ITEMS_SIZE(s)                      ((s) - (s) / 8)
+#define HASH_ITEM(h, i)                         ((h)->items[i].key ? &(h)->items[i] : NULL)
+#define ARRAY_ITEM(a, i)                        ((BSP_VAL_UNKNOWN == (a)->items[i].type) ? NULL : &(a)->items[i])
 
 /* Structs */
+struct bsp_view_t;
+
 typedef struct bsp_item_val_t
 {
     char                lval[16];
     void                *rval;
     char                type;
+    char                in_arena;
 } BSP_VALUE;
 
+// Items kept in insertion order, a removed one leaves a hole (NULL key) until next rebuild
 struct bsp_hash_item_t
 {
     BSP_STRING          *key;
     BSP_VALUE           *value;
-    struct bsp_hash_item_t
-                        *prev;
-    struct bsp_hash_item_t
-                        *next;
-    struct bsp_hash_item_t
-                        *lprev;
-    struct bsp_hash_item_t
-                        *lnext;
+    uint32_t            hash;
 };
 
+// Open addressing table over the item list. Each slot has a control byte
+// (7 bits fingerprint of hash, or EMPTY / DELETED) and the index of its item.
+// Slots are probed by group of HASH_GROUP_SIZE control bytes
 struct bsp_hash_t
 {
     size_t              nitems;
+    size_t              nitems_used;
+    size_t              items_size;
     size_t              hash_size;
+    size_t              nused;
+    size_t              curr;
+    uint8_t             *ctrl;
+    uint32_t            *slots;
     struct bsp_hash_item_t
-                        *hash_table;
-    struct bsp_hash_item_t
-                        *head;
-    struct bsp_hash_item_t
-                        *tail;
-    struct bsp_hash_item_t
-                        *curr;
+                        *items;
 };
 
+// Values stored in place, one block for the whole array. Unset item has type BSP_VAL_UNKNOWN
 struct bsp_array_t
 {
     size_t              nitems;
-    size_t              nbuckets;
+    size_t              size;
     size_t              curr;
-    BSP_VALUE           ***items;
+    BSP_VALUE           *items;
 };
 
 typedef struct bsp_item_val_t bsp_array_item_t;
@@ -99,13 +114,33 @@ typedef struct bsp_object_t
     void                *node;
     BSP_SPINLOCK        lock;
     char                type;
+    char                is_frozen;
+    int                 refcount;
+    BSP_ARENA           *arena;
 } BSP_OBJECT;
 
 /* Functions */
+// Objects and values are taken from the current arena of the thread if there is one.
+// A heap object never refers arena data, arena values set into it are promoted first.
+// An arena object keeps everything in its arena, heap values set into it are copied in and freed
 BSP_OBJECT * new_object(char type);
 void del_object(BSP_OBJECT *obj);
 BSP_VALUE * new_value();
 void del_value(BSP_VALUE *val);
+
+// Deep copy to heap, for data must live after the event. Heap object returned as is
+BSP_OBJECT * object_promote(BSP_OBJECT *obj);
+BSP_VALUE * value_promote(BSP_VALUE *val);
+
+// Frozen object (with everything in it) is immutable and refcounted, shared by holders (threads) without copy.
+// Readers take no lock, setters refuse it. object_freeze() takes the object and returns the frozen one
+// (a heap copy for an arena object) with one reference. object_ref() takes one more reference
+// (a heap copy for an ordinary object), del_object() drops one.
+// object_unshare() gives a writable copy of a frozen object (sub objects / strings shared), others returned as is
+BSP_OBJECT * object_freeze(BSP_OBJECT *obj);
+BSP_OBJECT * object_ref(BSP_OBJECT *obj);
+BSP_OBJECT * object_unshare(BSP_OBJECT *obj);
+
 void value_set_int(BSP_VALUE *val, const int64_t value);
 void value_set_int29(BSP_VALUE *val, const int32_t value);
 void value_set_boolean_true(BSP_VALUE *val);
@@ -115,6 +150,7 @@ void value_set_double(BSP_VALUE *val, const double value);
 void value_set_pointer(BSP_VALUE *val, const void *value);
 void value_set_string(BSP_VALUE *val, BSP_STRING *str);
 void value_set_object(BSP_VALUE *val, BSP_OBJECT *obj);
+void value_set_view(BSP_VALUE *val, struct bsp_view_t *view);
 void value_set_null(BSP_VALUE *val);
 int64_t value_get_int(BSP_VALUE *val);
 int value_get_boolean(BSP_VALUE *val);
@@ -123,16 +159,29 @@ double value_get_double(BSP_VALUE *val);
 void * value_get_pointer(BSP_VALUE *val);
 BSP_STRING * value_get_string(BSP_VALUE *val);
 BSP_OBJECT * value_get_object(BSP_VALUE *val);
+struct bsp_view_t * value_get_view(BSP_VALUE *val);
 
 void object_set_single(BSP_OBJECT *obj, BSP_VALUE *val);
 void object_set_array(BSP_OBJECT *obj, ssize_t idx, BSP_VALUE *val);
 void object_set_hash(BSP_OBJECT *obj, BSP_STRING *key, BSP_VALUE *val);
 void object_set_hash_str(BSP_OBJECT *obj, const char *key, BSP_VALUE *val);
 
+// Key is an atom (atom_intern()) : no hashing, no copy, compared by pointer first
+void object_set_hash_atom(BSP_OBJECT *obj, BSP_STRING *key, BSP_VALUE *val);
+
+// Bulk operations of array. Values are copied into the array, payloads (string / object) owned by array after that.
+// Item pointers are only valid before next change of the array
+int object_array_reserve(BSP_OBJECT *obj, size_t size);
+BSP_VALUE * object_array_push(BSP_OBJECT *obj);
+size_t object_array_append(BSP_OBJECT *obj, BSP_VALUE *vals, size_t nvals);
+size_t object_array_extend(BSP_OBJECT *obj, BSP_OBJECT *src);
+BSP_VALUE * object_array_items(BSP_OBJECT *obj, size_t *nitems);
+
 BSP_VALUE * object_get_single(BSP_OBJECT *obj);
 BSP_VALUE * object_get_array(BSP_OBJECT *obj, size_t idx);
 BSP_VALUE * object_get_hash(BSP_OBJECT *obj, BSP_STRING *key);
 BSP_VALUE * object_get_hash_str(BSP_OBJECT *obj, const char *key);
+BSP_VALUE * object_get_hash_atom(BSP_OBJECT *obj, BSP_STRING *key);
 
 BSP_VALUE * object_get_value(BSP_OBJECT *obj, const char *path);
 
@@ -149,4 +198,6 @@ BSP_OBJECT * object_unserialize(BSP_STRING *str);
 
 void object_to_lua_stack(lua_State *s, BSP_OBJECT *obj);
 BSP_OBJECT * lua_stack_to_object(lua_State *s);
+void value_to_lua_stack(lua_State *s, BSP_VALUE *val);
+BSP_VALUE * lua_stack_to_value(lua_State *s);
 #endif  /* _LIB_BSP_CORE_OBJECT_H */
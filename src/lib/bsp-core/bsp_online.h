@@ -22,9 +22,13 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 10/22/2014
+ * @update 12/14/2014
  * @changelog
  *      [10/22/2014[ - Creation
+ *      [12/11/2014] - Sharded online table with incremental resize
+ *      [12/12/2014] - Secondary indexes on fields of online data
+ *      [12/13/2014] - Dirty tracking and write-behind autosave
+ *      [12/14/2014] - Snapshot file for warm restart
  */
 
 #ifndef _LIB_BSP_CORE_ONLINE_H
@@ -33,24 +37,96 @@
 /* Headers */
 
 /* Definations */
-#define ONLINE_HASH_SIZE                        4096
+#define ONLINE_SHARD_BITS                       6
+#define ONLINE_SHARDS                           (1 << ONLINE_SHARD_BITS)
+#define ONLINE_SHARD_INITIAL                    64          // Buckets of one shard, power of 2
+#define ONLINE_REHASH_STEP                      4           // Buckets moved by one operation while resizing
+#define ONLINE_INDEX_MAX                        8
+#define ONLINE_INDEX_HASH_INITIAL               256         // Buckets of values of one index, power of 2
+#define ONLINE_POSTING_INITIAL                  8
+#define ONLINE_INDEX_VALUE_LENGTH               64          // Formatted number
 #define ONLINE_HANDLER_NAME_SAVE                "_bsp_online_handler_save_"
 #define ONLINE_HANDLER_NAME_LOAD                "_bsp_online_handler_load_"
 #define DEFAULT_ONLINE_AUTOSAVE_INTERVAL        300
+#define ONLINE_FLUSH_BATCH                      64          // Entries saved by one worker for one autosave event
+#define ONLINE_OFFLINE                          -1          // Bind of entry kept until its data saved
+#define ONLINE_BIND_LOCKS                       64          // Stripes guarding entries referred by fds
+#define ONLINE_SNAPSHOT_FILE                    "%s/bsp.%d.online"
 
 /* Macros */
 
 /* Structs */
+struct bsp_online_posting_t;
+
+// Place of an entry in one index, no posting if field not set.
+// Bind copied under shard lock when indexed, read by queries under index lock
+struct bsp_online_index_ref_t
+{
+    struct bsp_online_posting_t
+                        *posting;
+    size_t              pos;
+    int                 bind;
+};
+
+// Entry owned by table, key lookups and dirty queue hold references.
+// Dirty data is newer than storage : it is never dropped or reloaded, and
+// an entry set offline stays (ONLINE_OFFLINE) until its data saved
 typedef struct bsp_online_entry_t
 {
     int                 bind;
     time_t              last_save;
+    uint32_t            hash;
+    int                 refcount;
     char                *key;
     BSP_OBJECT          *data;
+    struct bsp_online_index_ref_t
+                        indexed[ONLINE_INDEX_MAX];
+    int                 dirty;
+    int                 queued;
+    time_t              dirty_since;
+    struct bsp_online_entry_t
+                        *dirty_next;
     struct bsp_online_entry_t
                         *next;
 } BSP_ONLINE;
 
+// Entries whose indexed field has the same value
+struct bsp_online_posting_t
+{
+    uint32_t            hash;
+    char                *value;
+    size_t              value_len;
+    BSP_ONLINE          **entries;
+    size_t              nentries;
+    size_t              size;
+    struct bsp_online_posting_t
+                        *next;
+};
+
+// Secondary index on a field (path of object_get_value()) of online data
+struct bsp_online_index_t
+{
+    char                *field;
+    struct bsp_online_posting_t
+                        **buckets;
+    size_t              size;
+    size_t              npostings;
+    BSP_SPINLOCK        lock;
+};
+
+// One stripe of online table, with its own lock. Shard is chosen by high bits of hash,
+// bucket by low bits. While resizing, old buckets below rehash_idx were moved to new table
+struct bsp_online_shard_t
+{
+    BSP_ONLINE          **buckets;
+    size_t              size;
+    BSP_ONLINE          **old_buckets;
+    size_t              old_size;
+    size_t              rehash_idx;
+    size_t              nitems;
+    BSP_SPINLOCK        lock;
+};
+
 /* Functions */
 // Initialize online hash table
 int online_init();
@@ -72,6 +148,31 @@ int save_online_data_by_key(const char *key);
 BSP_OBJECT * get_online_data_by_key(const char *key);
 BSP_OBJECT * get_online_data_by_bind(int fd);
 
+// Replace data (taken and frozen), entry marked dirty and saved by autosave
+int set_online_data_by_key(const char *key, BSP_OBJECT *data);
+int set_online_data_by_bind(int fd, BSP_OBJECT *data);
+
+// Autosave, called by main thread every second. Dirty entries are saved by workers in batches
+// spread across the interval, one dirty for a whole interval goes at once.
+// Queued snapshot records are handed to a worker too, with interval 0 as well
+void online_autosave(int interval);
+
+// Save a batch of dirty entries by save handler and write queued snapshot records, in worker
+void online_flush();
+
+// Keep data in snapshot file too. Data left by last run is loaded on first access of key
+// instead of load handler, dirty data is restored offline and saved by autosave.
+// Open (after autosave interval set) before workers start
+int online_snapshot_open(const char *filename);
+
+// Index a field of online data, id of index returned. Same field declared again returns the same index.
+// Indexes are kept on new_online() and data loading, values of string, number and boolean are indexed
+int online_add_index(const char *field);
+
+// Binds of online entries matching condition "field=value[&field=value ...]" (indexed fields only),
+// all entries for NULL or empty condition. Array must be freed by bsp_free()
+int * get_online_binds(const char *condition, size_t *nbinds);
+
 // Online list
 BSP_OBJECT * get_online_list(const char *condition);
 
@@ -22,9 +22,10 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 06/06/2012
+ * @update 12/06/2014
  * @changelog 
  *      [06/06/2012] - Creation
+ *      [12/06/2014] - Large page of memory blocks
  */
 
 #ifndef _LIB_BSP_CORE_OS_H
@@ -33,6 +34,7 @@
 /* Headers */
 
 /* Definations */
+#define LARGE_PAGE_SIZE                         2097152
 
 /* Macros */
 
@@ -52,4 +54,8 @@ int proc_daemonize(void);
 // Reduce TLB-misses by using large memory page
 int enable_large_pages(void);
 
+// Large page size (0 if not enabled), blocks aligned by it can be advised to use large pages
+size_t get_large_page_size(void);
+int advise_large_pages(void *addr, size_t len);
+
 #endif  /* _LIB_BSP_CORE_OS_H */
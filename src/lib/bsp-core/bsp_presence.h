@@ -0,0 +1,103 @@
+/*
+ * bsp_presence.h
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Shared-memory presence table header
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/15/2014
+ * @changelog
+ *      [12/15/2014] - Creation
+ */
+
+#ifndef _LIB_BSP_CORE_PRESENCE_H
+
+#define _LIB_BSP_CORE_PRESENCE_H
+/* Headers */
+
+/* Definations */
+#define PRESENCE_MAGIC                          "BSPPRES1"
+#define PRESENCE_MAGIC_LENGTH                   8
+#define PRESENCE_SHM_NAME                       "/bsp.presence"
+#define DEFAULT_PRESENCE_SLOTS                  65536       // Power of 2
+#define PRESENCE_KEY_LENGTH                     64          // Longer keys are not shared
+#define PRESENCE_MAX_LOAD                       75          // Percent of slots used, new keys refused above
+#define PRESENCE_OPEN_WAIT                      1000        // Times of 1ms waiting for the creator
+#define PRESENCE_LOCK_SPIN                      1024        // Tries before checking owner of lock alive
+#define PRESENCE_READ_RETRY                     1024        // A slot being written longer was left by a dead writer
+
+#define PRESENCE_SLOT_EMPTY                     0
+#define PRESENCE_SLOT_USED                      1
+#define PRESENCE_SLOT_DELETED                   2
+
+/* Macros */
+
+/* Structs */
+// Head of segment, written once by creator (magic last)
+struct bsp_presence_head_t
+{
+    char                magic[PRESENCE_MAGIC_LENGTH];
+    uint64_t            seed;
+    uint32_t            nslots;
+    uint32_t            slot_size;
+    volatile int32_t    lock;                   // Pid of writer
+    volatile uint32_t   nused;
+};
+
+// Slot of open addressing table. Seq is odd while slot being written,
+// readers copy a slot and retry if seq changed
+struct bsp_presence_slot_t
+{
+    volatile uint32_t   seq;
+    uint32_t            state;
+    uint64_t            hash;
+    int32_t             instance_id;
+    int32_t             bind;
+    int64_t             since;
+    uint32_t            key_len;
+    char                key[PRESENCE_KEY_LENGTH];
+};
+
+// Copy of a slot
+typedef struct bsp_presence_t
+{
+    int                 instance_id;
+    int                 bind;
+    time_t              since;
+} BSP_PRESENCE;
+
+/* Functions */
+// Map (create if not exists) segment shared by instances on this host. Entries left by
+// last run of this instance are cleared. Slots of an existing segment are kept.
+// Open before workers start, every function does nothing before
+int presence_open(const char *name, size_t nslots, int instance_id);
+void presence_close();
+
+// Key is online at bind (fd) of this instance, replaces any instance it was at.
+// A new key is refused (BSP_RTN_ERROR_RESOURCE) once PRESENCE_MAX_LOAD of slots are used
+int presence_set(const char *key, int bind);
+
+// Key gone from bind (any bind for -1). Entry of key moved to another one is kept
+int presence_del(const char *key, int bind);
+
+// Lock-free lookup, BSP_RTN_SUCCESS if key online in any instance
+int presence_get(const char *key, BSP_PRESENCE *p);
+
+#endif  /* _LIB_BSP_CORE_PRESENCE_H */
@@ -0,0 +1,89 @@
+/*
+ * bsp_rope.h
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Segmented output builder (rope) header
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/09/2014
+ * @changelog
+ *      [12/09/2014] - Creation
+ */
+
+#ifndef _LIB_BSP_CORE_ROPE_H
+
+#define _LIB_BSP_CORE_ROPE_H
+/* Headers */
+
+/* Definations */
+#define ROPE_SEGMENTS_INITIAL                   8
+#define ROPE_HEAD_ROOM                          2           // Free slots kept before the first segment
+#define ROPE_SEGMENT_SIZE                       4096        // Buffer of copied data
+
+/* Macros */
+#define ROPE_LEN(r)                             r->len
+#define ROPE_NSEGS(r)                           ((r)->tail - (r)->head)
+#define ROPE_SEG(r, i)                          (&(r)->segs[(r)->head + (i)])
+
+/* Structs */
+// Every segment is a block of bsp_malloc(), so it can be handed to a socket as an iovec.
+// Segment with size larger than len has room to append
+struct bsp_rope_segment_t
+{
+    char                *data;
+    size_t              len;
+    size_t              size;
+};
+
+// Used segments are segs[head] ... segs[tail - 1]
+typedef struct bsp_rope_t
+{
+    struct bsp_rope_segment_t
+                        *segs;
+    size_t              nsegs;
+    size_t              head;
+    size_t              tail;
+    size_t              len;
+} BSP_ROPE;
+
+/* Functions */
+// A rope is owned by one thread, no lock
+BSP_ROPE * new_rope();
+void del_rope(BSP_ROPE *rope);
+void clean_rope(BSP_ROPE *rope);
+
+// Copy data to the end / the front, data of other segments never moves
+int rope_append(BSP_ROPE *rope, const char *data, size_t len);
+int rope_prepend(BSP_ROPE *rope, const char *data, size_t len);
+
+// Rope takes a buffer allocated by bsp_malloc() as a segment, without copy
+int rope_take(BSP_ROPE *rope, char *buffer, size_t len);
+
+// Data (compressed data for a compressed string) of string as a segment.
+// Buffer of a writable string is taken (string left empty), others are copied
+int rope_append_string(BSP_ROPE *rope, BSP_STRING *str);
+
+// Segments handed to someone else (socket) who frees them, rope left empty
+void rope_detach(BSP_ROPE *rope);
+
+// Whole data in one (local) string
+BSP_STRING * rope_flatten(BSP_ROPE *rope);
+
+#endif  /* _LIB_BSP_CORE_ROPE_H */
@@ -45,6 +45,7 @@
 #define PACKET_TYPE_RAW                         0x1
 #define PACKET_TYPE_OBJ                         0x2
 #define PACKET_TYPE_CMD                         0x3
+#define PACKET_TYPE_REP_STREAM                  0x4
 #define PACKET_TYPE_UNDEFINED                   0x6
 #define PACKET_TYPE_HEARTBEAT                   0x7
 
@@ -73,6 +74,8 @@
 #define SERVER_CALLBACK_ON_LOOP_EXIT            0xC2
 #define SERVER_CALLBACK_ON_LOOP_TIMER           0xC3
 
+#define GROUP_FRAME_MAX                         16
+
 /* Macros */
 
 /* Structs */
@@ -96,8 +99,19 @@ typedef struct bsp_callback_t
     int                 cmd;
     BSP_STRING          *stream;
     BSP_OBJECT          *obj;
+    BSP_VIEW            *view;
 } BSP_CALLBACK;
 
+// Finished frame shared by clients of the same configuration in group output
+typedef struct bsp_group_frame_t
+{
+    int                 client_type;
+    int                 serialize_type;
+    int                 compress_type;
+    int                 window_bits;
+    BSP_STRING          *frame;
+} BSP_GROUP_FRAME;
+
 /* Functions */
 BSP_CLIENT * server_accept(BSP_SERVER *srv, struct sockaddr_storage *addr);
 
@@ -120,4 +134,10 @@ size_t output_client_raw(BSP_CLIENT *clt, const char *data, ssize_t len);
 size_t output_client_obj(BSP_CLIENT *clt, BSP_OBJECT *obj);
 size_t output_client_cmd(BSP_CLIENT *clt, int cmd, BSP_OBJECT *obj);
 
+// Send to a group of clients. Payload is encoded once per serialize type,
+// compressed and framed once per client configuration unless a connection window is involved
+size_t output_clients_raw(BSP_CLIENT **clts, size_t nclts, const char *data, ssize_t len);
+size_t output_clients_obj(BSP_CLIENT **clts, size_t nclts, BSP_OBJECT *obj);
+size_t output_clients_cmd(BSP_CLIENT **clts, size_t nclts, int cmd, BSP_OBJECT *obj);
+
 #endif  /* _LIB_BSP_CORE_SERVER_H */
@@ -0,0 +1,117 @@
+/*
+ * bsp_snapshot.h
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Keyed snapshot file header
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/14/2014
+ * @changelog
+ *      [12/14/2014] - Creation
+ */
+
+#ifndef _LIB_BSP_CORE_SNAPSHOT_H
+
+#define _LIB_BSP_CORE_SNAPSHOT_H
+/* Headers */
+
+/* Definations */
+#define SNAPSHOT_MAGIC                          "BSPSNAP1"
+#define SNAPSHOT_MAGIC_LENGTH                   8
+#define SNAPSHOT_CHECK_SEED                     0x62737073          // Fixed, checksums are kept in file
+#define SNAPSHOT_INDEX_INITIAL                  1024
+#define SNAPSHOT_PENDING_INITIAL                65536
+#define SNAPSHOT_COMPACT_MIN                    16777216    // File never compacted at runtime below 16MB
+#define SNAPSHOT_COMPACT_RATIO                  2           // Compacted when grown to ratio times of size after last compaction
+
+#define SNAPSHOT_FLAG_DIRTY                     0x1         // Data not saved to storage yet
+#define SNAPSHOT_FLAG_SAVED                     0x2         // Data of last record saved, no data
+#define SNAPSHOT_FLAG_REMOVED                   0x4         // Key removed, no data
+
+/* Macros */
+
+/* Structs */
+// Record in file : head, key, data. Native byte order
+struct bsp_snapshot_record_head_t
+{
+    uint32_t            key_len;
+    uint32_t            data_len;
+    uint32_t            flags;
+    uint32_t            check;
+};
+
+// Last record of a key in mapped file. Chained by index (+ 1) in records
+struct bsp_snapshot_record_t
+{
+    const char          *key;
+    const char          *data;
+    uint32_t            key_len;
+    uint32_t            data_len;
+    uint32_t            flags;
+    uint32_t            hash;
+    int                 taken;
+    size_t              next;
+};
+
+typedef struct bsp_snapshot_t
+{
+    int                 fd;
+    char                *map;
+    size_t              map_size;
+    struct bsp_snapshot_record_t
+                        *records;
+    size_t              nrecords;
+    size_t              *buckets;
+    size_t              nbuckets;
+    char                *filename;
+    char                *pending;
+    size_t              pending_len;
+    size_t              pending_size;
+    size_t              file_size;
+    size_t              compacted_size;
+    int                 flushing;
+    BSP_SPINLOCK        lock;
+} BSP_SNAPSHOT;
+
+/* Functions */
+// Append-only file of (key, data) records, the last record of a key wins.
+// Opening compacts the file left by last run to the last records, maps it and
+// keeps it until closed, records are taken from the map without copy.
+// New records are queued in memory and appended by snapshot_flush(), a torn record at the end (crash) is dropped
+BSP_SNAPSHOT * snapshot_open(const char *filename);
+void snapshot_close(BSP_SNAPSHOT *snap);
+
+// Data NULL for a record without data (SAVED / REMOVED). Only queued, no IO
+int snapshot_write(BSP_SNAPSHOT *snap, const char *key, size_t key_len, const char *data, size_t data_len, uint32_t flags);
+
+// Append queued records to file, file compacted once grown by SNAPSHOT_COMPACT_RATIO.
+// One flusher at a time, others return at once
+int snapshot_flush(BSP_SNAPSHOT *snap);
+
+// Bytes queued
+size_t snapshot_pending(BSP_SNAPSHOT *snap);
+
+// Last record of key in mapped file, every record taken once. Data pointer lives until snapshot closed
+const char * snapshot_take(BSP_SNAPSHOT *snap, const char *key, size_t key_len, size_t *data_len, uint32_t *flags);
+
+// Take all records with any of flags
+void snapshot_take_flagged(BSP_SNAPSHOT *snap, uint32_t flags, void (* callback) (const char *key, size_t key_len, const char *data, size_t data_len));
+
+#endif  /* _LIB_BSP_CORE_SNAPSHOT_H */
@@ -168,6 +168,17 @@ typedef struct bsp_client_t
     int                 packet_compress_type;
     int                 packet_heartbeat;
 
+    // Compression window shared by packets (Reported by PACKET_TYPE_REP_STREAM)
+    BSP_COMPRESS_STREAM *compress_stream;
+
+    // WebSocket permessage-deflate context
+    BSP_COMPRESS_STREAM *ws_deflate;
+
+    // WebSocket fragmented message, offsets from the message start in read buffer
+    size_t              ws_frag_parsed;
+    size_t              ws_frag_len;
+    int                 ws_frag_opcode;
+
     // Script runner
     BSP_SCRIPT_STACK    script_stack;
 } BSP_CLIENT;
@@ -192,6 +203,10 @@ typedef struct bsp_server_t
     size_t              max_packet_length;
     size_t              max_clients;
 
+    // WebSocket permessage-deflate
+    int                 websocket_deflate;
+    BSP_WEBSOCKET_DEFLATE websocket_deflate_param;
+
     // Debug
     int                 debug_hex_input;
     int                 debug_hex_output;
@@ -242,6 +257,12 @@ int free_connector(BSP_CONNECTOR *cnt);
 // Append data to socket
 size_t append_data_socket(struct bsp_socket_t *sck, BSP_STRING *data);
 
+// Append a bsp_malloc()ed buffer to socket without copy, socket will free it
+size_t append_buffer_socket(struct bsp_socket_t *sck, const char *head, size_t head_len, char *buffer, size_t len);
+
+// Append segments of rope to socket without copy, socket will free them and the rope is left empty
+size_t append_rope_socket(struct bsp_socket_t *sck, BSP_ROPE *rope);
+
 // Try send data
 size_t send_data_socket(struct bsp_socket_t *sck);
 
@@ -22,9 +22,10 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 07/18/2013
+ * @update 12/06/2014
  * @chagelog
  *      [07/18/2013] - Creation
+ *      [12/06/2014] - Mempool block free
  */
 
 #ifndef _LIB_BSP_CORE_STATUS_H
@@ -42,6 +43,7 @@
 #define STATUS_OP_MEMPOOL_HUGE_FREE             0x1004
 #define STATUS_OP_MEMPOOL_BLOCK                 0x1011
 #define STATUS_OP_MEMPOOL_ITEM                  0x1012
+#define STATUS_OP_MEMPOOL_BLOCK_FREE            0x1013
 
 #define STATUS_OP_FD_TOTAL                      0x1101
 #define STATUS_OP_FD_REG                        0x1102
@@ -22,9 +22,15 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 06/14/2012
+ * @update 12/09/2014
  * @changelog 
  *      [06/12/2012] - Creation
+ *      [11/26/2014] - Persistent compression streams
+ *      [11/29/2014] - Arena strings
+ *      [12/02/2014] - Atom strings
+ *      [12/03/2014] - Frozen (refcounted) strings
+ *      [12/08/2014] - Buffer capacity, inline short strings, local strings
+ *      [12/09/2014] - Buffer detached for rope
  */
 
 #ifndef _LIB_BSP_CORE_STRING_H
@@ -34,7 +40,8 @@
 
 /* Definations */
 #define FREE_STRING_LIST_INITIAL                1024
-#define STRING_INITIAL                          60
+#define STRING_INITIAL                          64          // First heap buffer
+#define STRING_SSO_SIZE                         24          // Data stored inside the string
 
 #define COMPRESS_TYPE_NONE                      0x0
 #define COMPRESS_TYPE_DEFLATE                   0x1
@@ -42,6 +49,11 @@
 #define COMPRESS_TYPE_LZ4                       0x3
 
 #define COMPRESS_ZLIB_CHUNK_SIZE                16384
+#define COMPRESS_LZ4_DICT_SIZE                  65536
+#define COMPRESS_STREAM_MAX_LENGTH              0x4000000
+#define COMPRESS_STREAM_WINDOW_BITS             15
+#define COMPRESS_STREAM_DEFLATE_NO_TAKEOVER     0x1
+#define COMPRESS_STREAM_INFLATE_NO_TAKEOVER     0x2
 
 /* Macros */
 #define STR_LEN(s)                              s->original_len
@@ -53,27 +65,71 @@
 #define STR_NEXT(s)                             s->cursor ++
 #define STR_PREV(s)                             s->cursor --
 #define STR_REMAIN(s)                           ((ssize_t) (s->original_len - s->cursor))
+#define STR_IS_READONLY(s)                      ((s)->is_const || (s)->is_frozen)
+#define STR_IS_INLINE(s)                        ((s)->str == (s)->sso)
+#define STR_CAPACITY(s)                         s->capacity
+#define STR_NEED_LOCK(s)                        (!(s)->is_local && !STR_IS_READONLY(s))
+#define STR_LOCK(s)                             do { if (STR_NEED_LOCK(s)) bsp_spin_lock(&(s)->lock); } while (0)
+#define STR_UNLOCK(s)                           do { if (STR_NEED_LOCK(s)) bsp_spin_unlock(&(s)->lock); } while (0)
 #define STR_IS_EQUAL(s1, s2)                    (s1) && (s2) && (s1->original_len == s2->original_len) && (0 == memcmp(s1->str, s2->str, s1->original_len))
 
 /* Structs */
+// Data (str) is the inline buffer (sso) up to STRING_SSO_SIZE bytes, or a heap buffer of capacity bytes
+// growing geometrically, or given data of a const string (capacity 0)
 typedef struct bsp_string_t
 {
     char                *str;
     size_t              original_len;
     size_t              compressed_len;
+    size_t              capacity;
     size_t              cursor;
     char                compress_type;
     char                is_const;
+    char                is_atom;
+    char                is_frozen;
+    char                is_local;
+    int                 refcount;
+    uint32_t            hash;
     BSP_SPINLOCK        lock;
+    BSP_ARENA           *arena;
+    char                sso[STRING_SSO_SIZE];
 } BSP_STRING;
 
+// Long-lived compression context of one connection
+typedef struct bsp_compress_stream_t
+{
+    char                compress_type;
+    int                 window_bits;
+    int                 flags;
+    void                *deflate_strm;
+    void                *inflate_strm;
+    void                *lz4_strm;
+    char                *lz4_enc_dict;
+    char                *lz4_dec_dict;
+    size_t              lz4_enc_dict_size;
+    size_t              lz4_dec_dict_len;
+    int                 refcount;
+    BSP_SPINLOCK        lock;
+} BSP_COMPRESS_STREAM;
+
 /* Functions */
 // Create a new string by given data
 
 // If data is NULL or len is zero, a empty string will be created
 BSP_STRING * new_string(const char *data, ssize_t len);
+
+// Const string refers data without copy. A heap one put into a heap object is kept as is,
+// data must outlive the object (literals), temporary data goes by new_string() instead
 BSP_STRING * new_string_const(const char *data, ssize_t len);
 
+// Create a string in given arena (NULL for heap), new_string() uses the current arena of the thread.
+// Data buffer is always on the heap, the arena frees it on reset
+BSP_STRING * new_string_arena(BSP_ARENA *arena, const char *data, ssize_t len);
+
+// Local string is owned by one thread, no lock taken on it (arena strings are always local).
+// Serializers build their output as local strings, freeze the result before sharing it with other threads
+BSP_STRING * new_string_local(const char *data, ssize_t len);
+
 // Create string from an ordinary file
 BSP_STRING * new_string_from_file(const char *path);
 
@@ -86,6 +142,30 @@ void clean_string(BSP_STRING *str);
 // Duplicate a string
 BSP_STRING * clone_string(BSP_STRING *str);
 
+// Copy an arena string (const one too) to the heap, heap string (const one too) returned as is
+BSP_STRING * string_promote(BSP_STRING *str);
+
+// Private copy in given arena (NULL for heap), frozen strings copied too
+BSP_STRING * string_copy_arena(BSP_ARENA *arena, BSP_STRING *str);
+
+// Frozen string is immutable and refcounted, shared by holders without copy.
+// string_freeze() takes the string and returns the frozen one (maybe a heap copy) with one reference.
+// string_ref() takes one more reference (a heap copy for an ordinary string), del_string() drops one.
+// string_unshare() gives a private copy of a frozen string to write, other strings returned as is
+BSP_STRING * string_freeze(BSP_STRING *str);
+BSP_STRING * string_ref(BSP_STRING *str);
+BSP_STRING * string_unshare(BSP_STRING *str);
+
+// Make room for size bytes of data in total, data pointer may change
+int string_reserve(BSP_STRING *str, size_t size);
+
+// String takes a buffer allocated by bsp_malloc() as its data
+void string_take(BSP_STRING *str, char *data, size_t len);
+
+// Take data buffer (compressed data of a compressed string) out, string left empty. Caller owns it.
+// NULL returned for an empty or read-only string, or when alloc failed with len > 0
+char * string_detach(BSP_STRING *str, size_t *len);
+
 // Append data to an exists string
 ssize_t string_append(BSP_STRING *str, const char *data, ssize_t len);
 
@@ -115,6 +195,23 @@ int string_decompress_deflate(BSP_STRING *str);
 int string_decompress_snappy(BSP_STRING *str);
 int string_decompress_lz4(BSP_STRING *str);
 
+// Compression stream shared by all packets of a connection
+BSP_COMPRESS_STREAM * new_compress_stream(char compress_type);
+
+// Deflate stream with given window, zlib convention : negative window_bits for raw deflate data.
+// Flags reset the window after every packet (no context takeover)
+BSP_COMPRESS_STREAM * new_deflate_stream(int window_bits, int flags);
+
+// Stream is created with one reference, a sender takes one more while using it.
+// del_compress_stream() drops one, the last one frees the stream
+BSP_COMPRESS_STREAM * compress_stream_ref(BSP_COMPRESS_STREAM *cs);
+void del_compress_stream(BSP_COMPRESS_STREAM *cs);
+
+// Compress with the stream window, flushed per packet.
+// Hold cs->lock until the packet is queued, peer must receive packets in order
+int string_compress_stream(BSP_STRING *str, BSP_COMPRESS_STREAM *cs);
+int string_decompress_stream(BSP_STRING *str, BSP_COMPRESS_STREAM *cs);
+
 // Base64 encode
 BSP_STRING * string_base64_encode(const char *data, ssize_t len);
 
@@ -102,6 +102,12 @@ int modify_fd_events(const int fd, struct epoll_event *ev);
 // Trigger script garbage-collection
 int trigger_gc(int tid);
 
+// Trigger online autosave
+int trigger_autosave(int tid);
+
+// Trigger sending of queued channel messages
+int trigger_channel(int tid);
+
 // Stop all static worker
 void stop_workers(void);
 
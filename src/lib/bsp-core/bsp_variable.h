@@ -53,6 +53,8 @@
 #define BSP_VAL_OBJECT_ARRAY_END                0x55
 #define BSP_VAL_OBJECT_HASH                     0x56
 #define BSP_VAL_OBJECT_HASH_END                 0x57
+// Memory only, never appears in serialized data
+#define BSP_VAL_VIEW                            0x5F
 
 #define BSP_VAL_NULL                            0x7F
 
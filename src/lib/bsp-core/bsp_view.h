@@ -0,0 +1,83 @@
+/*
+ * bsp_view.h
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Read-only view over native serialized (BSP.Packet) data header
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 11/24/2014
+ * @changelog
+ *      [11/24/2014] - Creation
+ */
+
+#ifndef _LIB_BSP_CORE_VIEW_H
+
+#define _LIB_BSP_CORE_VIEW_H
+/* Headers */
+
+/* Definations */
+#define VIEW_MAX_DEPTH                          64
+
+/* Macros */
+
+/* Structs */
+// A view never owns its data, the buffer must live longer than the view
+typedef struct bsp_view_t
+{
+    const char          *data;
+    size_t              len;
+    char                type;
+} BSP_VIEW;
+
+// Item of a view. For values, data points to the payload after the type byte
+typedef struct bsp_view_value_t
+{
+    const char          *data;
+    size_t              len;
+    char                type;
+} BSP_VIEW_VALUE;
+
+/* Functions */
+// Check native data and initialize a view on it, no copy
+int view_init(BSP_VIEW *view, const char *data, size_t len);
+size_t view_size(BSP_VIEW *view);
+
+// Lookup without allocation
+int view_next_item(BSP_VIEW *view, size_t *offset, BSP_VIEW_VALUE *key, BSP_VIEW_VALUE *val);
+int view_get_single(BSP_VIEW *view, BSP_VIEW_VALUE *val);
+int view_get_array(BSP_VIEW *view, size_t idx, BSP_VIEW_VALUE *val);
+int view_get_hash(BSP_VIEW *view, const char *key, ssize_t key_len, BSP_VIEW_VALUE *val);
+int view_get_value(BSP_VIEW *view, const char *path, BSP_VIEW_VALUE *val);
+
+// Value readers
+int view_value_to_view(BSP_VIEW_VALUE *val, BSP_VIEW *view);
+int64_t view_value_get_int(BSP_VIEW_VALUE *val);
+int view_value_get_boolean(BSP_VIEW_VALUE *val);
+double view_value_get_double(BSP_VIEW_VALUE *val);
+const char * view_value_get_string(BSP_VIEW_VALUE *val, size_t *len);
+
+// Materialize on demand
+BSP_VALUE * view_value_to_value(BSP_VIEW_VALUE *val);
+BSP_OBJECT * view_to_object(BSP_VIEW *view);
+
+// Push to LUA directly, without an intermediate object
+void view_to_lua_stack(lua_State *s, BSP_VIEW *view);
+
+#endif  /* _LIB_BSP_CORE_VIEW_H */
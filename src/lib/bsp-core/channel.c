@@ -0,0 +1,732 @@
+/*
+ * channel.c
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Channel (room) registry. Members are kept by worker, a message to a
+ * channel is sent by every worker to its own members.
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/16/2014
+ * @changelog
+ *      [12/16/2014] - Creation
+ */
+
+#include "bsp.h"
+
+// Registry and fd lists. Lock order : registry -> members
+static BSP_CHANNEL **channel_buckets = NULL;
+static size_t channel_hash_size = 0;
+static size_t nchannels = 0;
+static BSP_SPINLOCK channel_lock;
+
+// Messages to members of each worker
+static struct bsp_channel_queue_t *channel_queues = NULL;
+static int nworkers = 0;
+
+int channel_init()
+{
+    BSP_CORE_SETTING *settings = get_core_setting();
+    int i;
+    nworkers = (settings->static_workers > 0) ? settings->static_workers : 0;
+    channel_buckets = bsp_calloc(CHANNEL_HASH_INITIAL, sizeof(BSP_CHANNEL *));
+    channel_queues = bsp_calloc(nworkers + 1, sizeof(struct bsp_channel_queue_t));
+    if (!channel_buckets || !channel_queues)
+    {
+        trigger_exit(BSP_RTN_ERROR_MEMORY, "Cannot create channel registry");
+    }
+
+    channel_hash_size = CHANNEL_HASH_INITIAL;
+    for (i = 0; i <= nworkers; i ++)
+    {
+        bsp_spin_init(&channel_queues[i].lock);
+    }
+    bsp_spin_init(&channel_lock);
+    trace_msg(TRACE_LEVEL_DEBUG, "Channe : Channel registry initialized for %d workers", nworkers);
+
+    return BSP_RTN_SUCCESS;
+}
+
+/* Channels */
+static BSP_CHANNEL * _new_channel(const char *name, uint32_t h)
+{
+    BSP_CHANNEL *channel = bsp_calloc(1, sizeof(BSP_CHANNEL));
+    int i;
+    if (!channel)
+    {
+        return NULL;
+    }
+
+    channel->name = bsp_strdup(name);
+    channel->members = bsp_calloc(nworkers + 1, sizeof(struct bsp_channel_members_t));
+    if (!channel->name || !channel->members)
+    {
+        bsp_free(channel->name);
+        bsp_free(channel->members);
+        bsp_free(channel);
+        return NULL;
+    }
+
+    for (i = 0; i <= nworkers; i ++)
+    {
+        bsp_spin_init(&channel->members[i].lock);
+    }
+    channel->hash = h;
+    channel->refcount = 1;
+
+    return channel;
+}
+
+static void _channel_release(BSP_CHANNEL *channel)
+{
+    int i;
+    if (channel && 0 == __sync_sub_and_fetch(&channel->refcount, 1))
+    {
+        for (i = 0; i <= nworkers; i ++)
+        {
+            bsp_free(channel->members[i].fds);
+        }
+        bsp_free(channel->members);
+        bsp_free(channel->name);
+        bsp_free(channel);
+    }
+
+    return;
+}
+
+// Registry locked by caller
+static BSP_CHANNEL ** _channel_lookup(const char *name, uint32_t h)
+{
+    BSP_CHANNEL **link = &channel_buckets[h & (channel_hash_size - 1)];
+    while (*link)
+    {
+        if (h == (*link)->hash && 0 == strcmp(name, (*link)->name))
+        {
+            return link;
+        }
+        link = &(*link)->next;
+    }
+
+    return NULL;
+}
+
+static void _channel_grow()
+{
+    size_t size = channel_hash_size * 2, i, idx;
+    BSP_CHANNEL **buckets = bsp_calloc(size, sizeof(BSP_CHANNEL *)), *channel, *next;
+    if (!buckets)
+    {
+        // Longer chains
+        return;
+    }
+
+    for (i = 0; i < channel_hash_size; i ++)
+    {
+        for (channel = channel_buckets[i]; channel; channel = next)
+        {
+            next = channel->next;
+            idx = channel->hash & (size - 1);
+            channel->next = buckets[idx];
+            buckets[idx] = channel;
+        }
+    }
+    bsp_free(channel_buckets);
+    channel_buckets = buckets;
+    channel_hash_size = size;
+
+    return;
+}
+
+// Channel with one more reference
+static BSP_CHANNEL * _channel_find(const char *name)
+{
+    uint32_t h = bsp_hash(name, -1);
+    BSP_CHANNEL **link, *ret = NULL;
+    bsp_spin_lock(&channel_lock);
+    link = _channel_lookup(name, h);
+    if (link)
+    {
+        ret = *link;
+        __sync_add_and_fetch(&ret->refcount, 1);
+    }
+    bsp_spin_unlock(&channel_lock);
+
+    return ret;
+}
+
+/* Member sets */
+// Position of fd in sorted set, or where it goes
+static size_t _members_search(struct bsp_channel_members_t *m, int fd)
+{
+    size_t lo = 0, hi = m->nfds, mid;
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (m->fds[mid] < fd)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static int _members_add(struct bsp_channel_members_t *m, int fd)
+{
+    size_t pos;
+    int ret = BSP_RTN_SUCCESS;
+    bsp_spin_lock(&m->lock);
+    if (m->nfds == m->size)
+    {
+        size_t size = (m->size) ? m->size * 2 : CHANNEL_MEMBERS_INITIAL;
+        int *fds = bsp_realloc(m->fds, size * sizeof(int));
+        if (fds)
+        {
+            m->fds = fds;
+            m->size = size;
+        }
+        else
+        {
+            ret = BSP_RTN_ERROR_MEMORY;
+        }
+    }
+
+    if (BSP_RTN_SUCCESS == ret)
+    {
+        pos = _members_search(m, fd);
+        memmove(m->fds + pos + 1, m->fds + pos, (m->nfds - pos) * sizeof(int));
+        m->fds[pos] = fd;
+        m->nfds ++;
+    }
+    bsp_spin_unlock(&m->lock);
+
+    return ret;
+}
+
+static void _members_remove(struct bsp_channel_members_t *m, int fd)
+{
+    size_t pos;
+    bsp_spin_lock(&m->lock);
+    pos = _members_search(m, fd);
+    if (pos < m->nfds && fd == m->fds[pos])
+    {
+        memmove(m->fds + pos, m->fds + pos + 1, (m->nfds - pos - 1) * sizeof(int));
+        m->nfds --;
+    }
+    bsp_spin_unlock(&m->lock);
+
+    return;
+}
+
+// Copy of set, to send out of lock
+static int * _members_copy(struct bsp_channel_members_t *m, int *buf, size_t *n)
+{
+    bsp_spin_lock(&m->lock);
+    *n = m->nfds;
+    if (m->nfds > 0)
+    {
+        int *tmp = bsp_realloc(buf, m->nfds * sizeof(int));
+        if (tmp)
+        {
+            buf = tmp;
+            memcpy(buf, m->fds, m->nfds * sizeof(int));
+        }
+        else
+        {
+            *n = 0;
+        }
+    }
+    bsp_spin_unlock(&m->lock);
+
+    return buf;
+}
+
+/* Membership */
+// Registry locked by caller, reference of registry returned to caller
+static BSP_CHANNEL * _channel_unlink(BSP_CHANNEL *channel)
+{
+    BSP_CHANNEL **link = _channel_lookup(channel->name, channel->hash);
+    if (link && channel == *link)
+    {
+        *link = channel->next;
+        channel->next = NULL;
+        nchannels --;
+
+        return channel;
+    }
+
+    return NULL;
+}
+
+// Registry locked by caller. Channel unlinked with its last member
+static BSP_CHANNEL * _channel_drop(BSP_CHANNEL *channel, int fd, int slot)
+{
+    _members_remove(&channel->members[slot], fd);
+    if (0 == -- channel->nmembers)
+    {
+        return _channel_unlink(channel);
+    }
+
+    return NULL;
+}
+
+int channel_join(const char *name, int fd)
+{
+    if (!name || fd < 0 || !channel_buckets)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    uint32_t h = bsp_hash(name, -1);
+    int tid = get_fd_thread(fd), slot = (tid >= 0 && tid < nworkers) ? tid : nworkers, ret = BSP_RTN_SUCCESS, type = FD_TYPE_ANY;
+    BSP_CHANNEL **link, *channel, *fresh = NULL, *dropped = NULL;
+    BSP_CHANNEL_LIST *list;
+    size_t i;
+
+    // Prepared out of lock, dropped if channel exists
+    bsp_spin_lock(&channel_lock);
+    link = _channel_lookup(name, h);
+    bsp_spin_unlock(&channel_lock);
+    if (!link)
+    {
+        fresh = _new_channel(name, h);
+        if (!fresh)
+        {
+            trace_msg(TRACE_LEVEL_ERROR, "Channe : Create channel error");
+            return BSP_RTN_ERROR_MEMORY;
+        }
+    }
+
+    bsp_spin_lock(&channel_lock);
+    get_fd(fd, &type);
+    link = _channel_lookup(name, h);
+    if (FD_TYPE_UNKNOWN == type)
+    {
+        // Not registered, or unregistered already : channel_leave_all() never comes for it
+        channel = NULL;
+        ret = BSP_RTN_ERROR_GENERAL;
+    }
+    else if (link)
+    {
+        channel = *link;
+    }
+    else if (fresh)
+    {
+        if (nchannels >= channel_hash_size)
+        {
+            _channel_grow();
+        }
+        channel = fresh;
+        fresh = NULL;
+        channel->next = channel_buckets[h & (channel_hash_size - 1)];
+        channel_buckets[h & (channel_hash_size - 1)] = channel;
+        nchannels ++;
+    }
+    else
+    {
+        channel = NULL;
+        ret = BSP_RTN_ERROR_GENERAL;
+    }
+
+    list = get_fd_channels(fd);
+    for (i = 0; channel && list && i < list->nrefs; i ++)
+    {
+        if (channel == list->refs[i].channel)
+        {
+            // Joined
+            channel = NULL;
+        }
+    }
+
+    if (channel && !list)
+    {
+        list = bsp_calloc(1, sizeof(BSP_CHANNEL_LIST));
+        set_fd_channels(fd, list);
+        if (list && list != get_fd_channels(fd))
+        {
+            // Refused by fd being unregistered, no member added
+            bsp_free(list);
+            list = NULL;
+            ret = BSP_RTN_ERROR_GENERAL;
+        }
+    }
+
+    if (channel && list && list->nrefs == list->size)
+    {
+        size_t size = (list->size) ? list->size * 2 : CHANNEL_FD_INITIAL;
+        struct bsp_channel_ref_t *refs = bsp_realloc(list->refs, size * sizeof(struct bsp_channel_ref_t));
+        if (refs)
+        {
+            list->refs = refs;
+            list->size = size;
+        }
+    }
+
+    if (channel && (!list || list->nrefs == list->size || BSP_RTN_SUCCESS != _members_add(&channel->members[slot], fd)))
+    {
+        // Channel without member never left in registry
+        ret = (BSP_RTN_SUCCESS == ret) ? BSP_RTN_ERROR_MEMORY : ret;
+        if (0 == channel->nmembers)
+        {
+            dropped = _channel_unlink(channel);
+        }
+    }
+    else if (channel)
+    {
+        list->refs[list->nrefs].channel = channel;
+        list->refs[list->nrefs].slot = slot;
+        list->nrefs ++;
+        channel->nmembers ++;
+    }
+    bsp_spin_unlock(&channel_lock);
+
+    _channel_release(fresh);
+    _channel_release(dropped);
+    if (BSP_RTN_SUCCESS == ret)
+    {
+        trace_msg(TRACE_LEVEL_VERBOSE, "Channe : FD %d joined channel [%s]", fd, name);
+    }
+    else
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Channe : FD %d join channel [%s] error", fd, name);
+    }
+
+    return ret;
+}
+
+int channel_leave(const char *name, int fd)
+{
+    if (!name || fd < 0 || !channel_buckets)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    uint32_t h = bsp_hash(name, -1);
+    BSP_CHANNEL **link, *dropped = NULL;
+    BSP_CHANNEL_LIST *list;
+    size_t i;
+    int ret = BSP_RTN_ERROR_GENERAL;
+    bsp_spin_lock(&channel_lock);
+    link = _channel_lookup(name, h);
+    list = get_fd_channels(fd);
+    for (i = 0; link && list && i < list->nrefs; i ++)
+    {
+        if (*link == list->refs[i].channel)
+        {
+            dropped = _channel_drop(*link, fd, list->refs[i].slot);
+            list->refs[i] = list->refs[-- list->nrefs];
+            ret = BSP_RTN_SUCCESS;
+            break;
+        }
+    }
+    bsp_spin_unlock(&channel_lock);
+
+    _channel_release(dropped);
+
+    return ret;
+}
+
+void channel_leave_all(int fd)
+{
+    BSP_CHANNEL_LIST *list;
+    BSP_CHANNEL **dropped = NULL;
+    size_t i, ndropped = 0;
+    if (!channel_buckets)
+    {
+        return;
+    }
+
+    bsp_spin_lock(&channel_lock);
+    list = get_fd_channels(fd);
+    set_fd_channels(fd, NULL);
+    if (list && list->nrefs > 0)
+    {
+        dropped = bsp_malloc(list->nrefs * sizeof(BSP_CHANNEL *));
+        for (i = 0; i < list->nrefs; i ++)
+        {
+            BSP_CHANNEL *channel = _channel_drop(list->refs[i].channel, fd, list->refs[i].slot);
+            if (channel && dropped)
+            {
+                dropped[ndropped ++] = channel;
+            }
+            else if (channel)
+            {
+                // Freed in lock
+                _channel_release(channel);
+            }
+        }
+    }
+    bsp_spin_unlock(&channel_lock);
+
+    for (i = 0; i < ndropped; i ++)
+    {
+        _channel_release(dropped[i]);
+    }
+    bsp_free(dropped);
+
+    if (list)
+    {
+        bsp_free(list->refs);
+        bsp_free(list);
+    }
+
+    return;
+}
+
+int * get_channel_members(const char *name, size_t *nmembers)
+{
+    BSP_CHANNEL *channel;
+    int *ret = NULL, *buf = NULL;
+    size_t n, total = 0;
+    int i;
+    *nmembers = 0;
+    if (!name || !channel_buckets)
+    {
+        return NULL;
+    }
+
+    channel = _channel_find(name);
+    if (!channel)
+    {
+        return NULL;
+    }
+
+    for (i = 0; i <= nworkers; i ++)
+    {
+        buf = _members_copy(&channel->members[i], buf, &n);
+        if (n > 0)
+        {
+            int *tmp = bsp_realloc(ret, (total + n) * sizeof(int));
+            if (!tmp)
+            {
+                break;
+            }
+            ret = tmp;
+            memcpy(ret + total, buf, n * sizeof(int));
+            total += n;
+        }
+    }
+    bsp_free(buf);
+    _channel_release(channel);
+    *nmembers = total;
+
+    return ret;
+}
+
+/* Output */
+// Members of one set, encoded once for them
+static size_t _channel_output(BSP_CHANNEL *channel, int slot, int p_type, int cmd, BSP_OBJECT *obj, BSP_STRING *raw)
+{
+    BSP_CLIENT **clts;
+    int *fds, fd_type;
+    size_t nfds, nclts = 0, i, sent = 0;
+    fds = _members_copy(&channel->members[slot], NULL, &nfds);
+    if (!fds || 0 == nfds)
+    {
+        bsp_free(fds);
+        return 0;
+    }
+
+    clts = bsp_malloc(nfds * sizeof(BSP_CLIENT *));
+    if (clts)
+    {
+        for (i = 0; i < nfds; i ++)
+        {
+            fd_type = FD_TYPE_SOCKET_CLIENT;
+            BSP_CLIENT *clt = (BSP_CLIENT *) get_fd(fds[i], &fd_type);
+            if (clt)
+            {
+                clts[nclts ++] = clt;
+            }
+        }
+
+        switch (p_type)
+        {
+            case PACKET_TYPE_RAW :
+                sent = output_clients_raw(clts, nclts, STR_STR(raw), STR_LEN(raw));
+                break;
+            case PACKET_TYPE_OBJ :
+                sent = output_clients_obj(clts, nclts, obj);
+                break;
+            case PACKET_TYPE_CMD :
+                sent = output_clients_cmd(clts, nclts, cmd, obj);
+                break;
+            default :
+                break;
+        }
+        bsp_free(clts);
+    }
+    bsp_free(fds);
+
+    return sent;
+}
+
+// Queue takes message, worker notified once until it flushes
+static void _channel_queue(int tid, struct bsp_channel_message_t *msg)
+{
+    struct bsp_channel_queue_t *q = &channel_queues[tid];
+    int signal = 0;
+    bsp_spin_lock(&q->lock);
+    if (q->tail)
+    {
+        q->tail->next = msg;
+    }
+    else
+    {
+        q->head = msg;
+    }
+    q->tail = msg;
+    if (!q->signaled)
+    {
+        q->signaled = 1;
+        signal = 1;
+    }
+    bsp_spin_unlock(&q->lock);
+
+    if (signal)
+    {
+        trigger_channel(tid);
+    }
+
+    return;
+}
+
+static void _del_message(struct bsp_channel_message_t *msg)
+{
+    _channel_release(msg->channel);
+    del_object(msg->obj);
+    del_string(msg->raw);
+    bsp_free(msg);
+
+    return;
+}
+
+// Object and raw string are frozen, shared by messages
+static size_t _channel_send(const char *name, int p_type, int cmd, BSP_OBJECT *obj, BSP_STRING *raw)
+{
+    BSP_CHANNEL *channel = (name && channel_buckets) ? _channel_find(name) : NULL;
+    struct bsp_channel_message_t *msg;
+    int me = curr_thread_id(), i;
+    size_t ret = 0;
+    if (!channel)
+    {
+        del_object(obj);
+        del_string(raw);
+
+        return 0;
+    }
+
+    // Sets read without lock, a member joining now may miss this message
+    ret = __sync_fetch_and_add(&channel->nmembers, 0);
+    for (i = 0; i < nworkers; i ++)
+    {
+        if (i == me || 0 == __sync_fetch_and_add(&channel->members[i].nfds, 0))
+        {
+            continue;
+        }
+
+        msg = bsp_calloc(1, sizeof(struct bsp_channel_message_t));
+        if (!msg)
+        {
+            trace_msg(TRACE_LEVEL_ERROR, "Channe : Create channel message error");
+            continue;
+        }
+
+        __sync_add_and_fetch(&channel->refcount, 1);
+        msg->channel = channel;
+        msg->p_type = p_type;
+        msg->cmd = cmd;
+        msg->obj = object_ref(obj);
+        msg->raw = (raw) ? string_ref(raw) : NULL;
+        _channel_queue(i, msg);
+    }
+
+    // Members of current worker and of no worker go at once
+    if (me >= 0 && me < nworkers)
+    {
+        _channel_output(channel, me, p_type, cmd, obj, raw);
+    }
+    _channel_output(channel, nworkers, p_type, cmd, obj, raw);
+    del_object(obj);
+    del_string(raw);
+    _channel_release(channel);
+
+    return ret;
+}
+
+size_t channel_send_raw(const char *name, const char *data, ssize_t len)
+{
+    if (!data)
+    {
+        return 0;
+    }
+
+    return _channel_send(name, PACKET_TYPE_RAW, 0, NULL, string_freeze(new_string(data, len)));
+}
+
+size_t channel_send_obj(const char *name, BSP_OBJECT *obj)
+{
+    if (!obj)
+    {
+        return 0;
+    }
+
+    return _channel_send(name, PACKET_TYPE_OBJ, 0, object_freeze(obj), NULL);
+}
+
+size_t channel_send_cmd(const char *name, int cmd, BSP_OBJECT *obj)
+{
+    if (!obj)
+    {
+        return 0;
+    }
+
+    return _channel_send(name, PACKET_TYPE_CMD, cmd, object_freeze(obj), NULL);
+}
+
+void channel_flush()
+{
+    int me = curr_thread_id();
+    struct bsp_channel_queue_t *q;
+    struct bsp_channel_message_t *msg, *next;
+    if (!channel_queues || me < 0 || me >= nworkers)
+    {
+        return;
+    }
+
+    q = &channel_queues[me];
+    bsp_spin_lock(&q->lock);
+    msg = q->head;
+    q->head = q->tail = NULL;
+    q->signaled = 0;
+    bsp_spin_unlock(&q->lock);
+
+    for (; msg; msg = next)
+    {
+        next = msg->next;
+        _channel_output(msg->channel, me, msg->p_type, msg->cmd, msg->obj, msg->raw);
+        _del_message(msg);
+    }
+
+    return;
+}
@@ -53,14 +53,19 @@ static void base_timer(BSP_TIMER *tmr)
         }
     }
 
-    // Online autosave
-    if (core_settings.online_autosave_interval)
+#ifdef ENABLE_MEMPOOL
+    // Give free memory blocks back
+    if (0 == tmr->timer % MEMPOOL_TRIM_INTERVAL)
     {
-        if (0 == tmr->timer % core_settings.online_autosave_interval)
-        {
-            // Auto save
-        }
+        mempool_trim();
     }
+#endif
+
+    // Online autosave, dirty entries and snapshot records handed to workers every tick
+    online_autosave(core_settings.online_autosave_interval);
+
+    // Expired cache entries
+    memdb_expire();
 
     // External callback
     if (core_settings.ext_timer_callback)
@@ -100,6 +105,7 @@ static void init_core_setting()
     core_settings.ext_timer_callback = NULL;
     core_settings.script_gc_interval = DEFAULT_SCRIPT_GC_INTERVAL;
     core_settings.online_autosave_interval = DEFAULT_ONLINE_AUTOSAVE_INTERVAL;
+    core_settings.memdb_memory = DEFAULT_MEMDB_MEMORY;
 
     core_settings.base_dir = NULL;
     core_settings.mod_dir = NULL;
@@ -194,6 +200,11 @@ int _parse_runtime_setting(BSP_STRING *rs)
         {
             core_settings.script_gc_interval = value_get_int(val);
         }
+        val = object_get_hash_str(vobj, "memdb_memory");
+        if (val && BSP_VAL_INT == val->type && value_get_int(val) > 0)
+        {
+            core_settings.memdb_memory = (size_t) value_get_int(val);
+        }
     }
 
     return BSP_RTN_SUCCESS;
@@ -256,6 +267,8 @@ int core_init()
         proc_daemonize();
     }
 
+    hash_init();
+    freelist_init();
     fd_init(0);
     load_runtime_setting();
     status_op_core(STATUS_OP_INSTANCE_ID, (size_t) core_settings.instance_id);
@@ -265,6 +278,7 @@ int core_init()
     socket_init();
     memdb_init();
     online_init();
+    channel_init();
 
     // Load modules
     BSP_VALUE *val = object_get_hash_str(runtime_settings, "modules");
@@ -377,6 +391,12 @@ int core_loop(void (* server_event)(BSP_CALLBACK *))
                 {
                     srv.def_client_type = CLIENT_TYPE_WEBSOCKET_HANDSHAKE;
                 }
+                val = object_get_hash_str(vsrv, "websocket_deflate");
+                srv.websocket_deflate = value_get_boolean(val);
+                val = object_get_hash_str(vsrv, "websocket_deflate_window_bits");
+                srv.websocket_deflate_window_bits = (int) value_get_int(val);
+                val = object_get_hash_str(vsrv, "websocket_deflate_no_context_takeover");
+                srv.websocket_deflate_no_context_takeover = value_get_boolean(val);
                 val = object_get_hash_str(vsrv, "data_type");
                 vstr = value_get_string(val);
                 if (vstr && 0 == strncasecmp(STR_STR(vstr), "stream", 6))
@@ -401,6 +421,9 @@ int core_loop(void (* server_event)(BSP_CALLBACK *))
                         s->def_data_type = srv.def_data_type;
                         s->max_packet_length = srv.max_packet_length;
                         s->max_clients = srv.max_clients;
+                        s->websocket_deflate = srv.websocket_deflate;
+                        s->websocket_deflate_param.server_max_window_bits = srv.websocket_deflate_window_bits ? srv.websocket_deflate_window_bits : WS_DEFLATE_MAX_WINDOW_BITS;
+                        s->websocket_deflate_param.server_no_context_takeover = srv.websocket_deflate_no_context_takeover;
                         s->debug_hex_input = srv.debug_hex_input;
                         s->debug_hex_output = srv.debug_hex_output;
 
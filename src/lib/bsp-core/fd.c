@@ -22,10 +22,11 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 06/07/2012
+ * @update 12/16/2014
  * @changelog 
  *      [05/30/2012] - Creation
  *      [06/07/2012] - Fd's tid property added
+ *      [12/16/2014] - Channels joined by fd
  */
 
 #include "bsp.h"
@@ -86,6 +87,7 @@ int reg_fd(const int fd, const int type, void *ptr)
         fd_list[fd].tid = UNBOUNDED_THREAD;
         fd_list[fd].ptr = ptr;
         fd_list[fd].online = NULL;
+        fd_list[fd].channels = NULL;
         status_op_fd(STATUS_OP_FD_REG, 0);
         trace_msg(TRACE_LEVEL_VERBOSE, "FileDs : FD %d registed as type %d", fd, type);
 
@@ -106,14 +108,20 @@ int unreg_fd(const int fd)
     if (fd >= 0 && fd < fd_list_size)
     {
         bsp_spin_lock(&fd_lock);
+        if (fd_list[fd].online)
+        {
+            // Remove from online list, while fd still registered to give back its reference
+            del_online_by_bind(fd);
+        }
         fd_list[fd].fd = 0;
         fd_list[fd].type = 0;
         fd_list[fd].tid = UNBOUNDED_THREAD;
         fd_list[fd].ptr = NULL;
-        if (fd_list[fd].online)
+        if (fd_list[fd].channels)
         {
-            // Remove from online list
-            del_online_by_key(fd_list[fd].online->key);
+            // Leave channels
+            channel_leave_all(fd);
+            fd_list[fd].channels = NULL;
         }
         status_op_fd(STATUS_OP_FD_UNREG, 0);
         trace_msg(TRACE_LEVEL_VERBOSE, "FileDs : FD %d unregisted from list", fd);
@@ -212,6 +220,28 @@ BSP_ONLINE * get_fd_online(const int fd)
     return NULL;
 }
 
+// Set fd channels
+void set_fd_channels(const int fd, BSP_CHANNEL_LIST *channels)
+{
+    if (fd >= 0 && fd < fd_list_size && fd_list[fd].fd == fd)
+    {
+        fd_list[fd].channels = channels;
+    }
+
+    return;
+}
+
+// Get fd channels
+BSP_CHANNEL_LIST * get_fd_channels(const int fd)
+{
+    if (fd >= 0 && fd < fd_list_size)
+    {
+        return fd_list[fd].channels;
+    }
+
+    return NULL;
+}
+
 // Set fd non-blocking
 int set_fd_nonblock(const int fd)
 {
@@ -0,0 +1,250 @@
+/*
+ * freelist.c
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Fixed-size item pools for hot structs (strings, values, clients ...).
+ * Every thread keeps a list of free items of each pool, moved from / to
+ * the shared list of the pool by batch.
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/07/2014
+ * @changelog
+ *      [12/07/2014] - Creation
+ */
+
+#include "bsp.h"
+
+BSP_FREELIST freelist_string = {.name = "String", .item_size = sizeof(BSP_STRING)};
+BSP_FREELIST freelist_value = {.name = "Value", .item_size = sizeof(BSP_VALUE)};
+BSP_FREELIST freelist_client = {.name = "Client", .item_size = sizeof(BSP_CLIENT)};
+BSP_FREELIST freelist_connector = {.name = "Connector", .item_size = sizeof(BSP_CONNECTOR)};
+
+static BSP_FREELIST *freelists[FREELIST_MAX];
+static int nfreelists = 0;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+// Move up to n items from list (head) to list (to), count returned
+static size_t _move_items(void **head, void **to, size_t n)
+{
+    size_t ret = 0;
+    void *item;
+    while (ret < n && *head)
+    {
+        item = *head;
+        *head = get_pointer(item);
+        set_pointer(*to, item);
+        *to = item;
+        ret ++;
+    }
+
+    return ret;
+}
+
+static void _report_cache(BSP_FREELIST *fl, struct bsp_freelist_cache_t *cache)
+{
+    if (cache->nalloc)
+    {
+        __sync_add_and_fetch(&fl->nalloc, cache->nalloc);
+        cache->nalloc = 0;
+    }
+
+    if (cache->nfree)
+    {
+        __sync_add_and_fetch(&fl->nfree, cache->nfree);
+        cache->nfree = 0;
+    }
+
+    return;
+}
+
+// Thread exit, items go back to pools
+static void _del_caches(void *data)
+{
+    struct bsp_freelist_cache_t *caches = (struct bsp_freelist_cache_t *) data;
+    BSP_FREELIST *fl;
+    int i;
+    if (!caches)
+    {
+        return;
+    }
+
+    for (i = 0; i < nfreelists; i ++)
+    {
+        fl = freelists[i];
+        bsp_spin_lock(&fl->lock);
+        fl->nitems += _move_items(&caches[i].head, &fl->head, caches[i].nitems);
+        bsp_spin_unlock(&fl->lock);
+        _report_cache(fl, &caches[i]);
+    }
+    bsp_free(caches);
+
+    return;
+}
+
+static void _cache_key_init()
+{
+    pthread_key_create(&cache_key, _del_caches);
+
+    return;
+}
+
+static struct bsp_freelist_cache_t * _get_caches()
+{
+    struct bsp_freelist_cache_t *caches = pthread_getspecific(cache_key);
+    if (!caches)
+    {
+        caches = bsp_calloc(FREELIST_MAX, sizeof(struct bsp_freelist_cache_t));
+        if (caches)
+        {
+            pthread_setspecific(cache_key, caches);
+        }
+    }
+
+    return caches;
+}
+
+int freelist_register(BSP_FREELIST *fl, size_t nprewarm)
+{
+    void *item;
+    if (!fl || fl->id > 0)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    if (nfreelists >= FREELIST_MAX)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Freelist : Too many pools");
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    pthread_once(&cache_key_once, _cache_key_init);
+    bsp_spin_init(&fl->lock);
+    for (fl->nitems = 0; fl->nitems < nprewarm; fl->nitems ++)
+    {
+        item = bsp_malloc(fl->item_size);
+        if (!item)
+        {
+            break;
+        }
+        set_pointer(fl->head, item);
+        fl->head = item;
+    }
+    fl->ncreated = fl->nitems;
+    freelists[nfreelists ++] = fl;
+    fl->id = nfreelists;
+    trace_msg(TRACE_LEVEL_CORE, "Freelist : Pool %s (%d bytes) registered with %d items", fl->name, (int) fl->item_size, (int) fl->nitems);
+
+    return BSP_RTN_SUCCESS;
+}
+
+// Pools of core structs
+int freelist_init()
+{
+    freelist_register(&freelist_string, FREE_STRING_LIST_INITIAL);
+    freelist_register(&freelist_value, FREE_VALUE_LIST_INITIAL);
+    freelist_register(&freelist_client, FREE_CLIENT_LIST_INITIAL);
+    freelist_register(&freelist_connector, FREE_CONNECTOR_LIST_INITIAL);
+
+    return BSP_RTN_SUCCESS;
+}
+
+void * freelist_alloc(BSP_FREELIST *fl)
+{
+    struct bsp_freelist_cache_t *caches = (fl && fl->id > 0) ? _get_caches() : NULL;
+    struct bsp_freelist_cache_t *cache = NULL;
+    void *ret = NULL;
+    if (!fl)
+    {
+        return NULL;
+    }
+
+    if (!caches)
+    {
+        return bsp_calloc(1, fl->item_size);
+    }
+
+    cache = &caches[fl->id - 1];
+    if (!cache->head)
+    {
+        // Refill from pool
+        bsp_spin_lock(&fl->lock);
+        cache->nitems = _move_items(&fl->head, &cache->head, FREELIST_BATCH);
+        fl->nitems -= cache->nitems;
+        bsp_spin_unlock(&fl->lock);
+        _report_cache(fl, cache);
+    }
+
+    if (cache->head)
+    {
+        ret = cache->head;
+        cache->head = get_pointer(ret);
+        cache->nitems --;
+        memset(ret, 0, fl->item_size);
+    }
+    else
+    {
+        // Pool is empty
+        ret = bsp_calloc(1, fl->item_size);
+        if (ret)
+        {
+            __sync_add_and_fetch(&fl->ncreated, 1);
+        }
+    }
+    cache->nalloc ++;
+
+    return ret;
+}
+
+void freelist_free(BSP_FREELIST *fl, void *item)
+{
+    struct bsp_freelist_cache_t *caches = (fl && fl->id > 0) ? _get_caches() : NULL;
+    struct bsp_freelist_cache_t *cache = NULL;
+    if (!fl || !item)
+    {
+        return;
+    }
+
+    if (!caches)
+    {
+        bsp_free(item);
+
+        return;
+    }
+
+    cache = &caches[fl->id - 1];
+    if (cache->nitems >= FREELIST_CACHE_SIZE)
+    {
+        // Flush to pool
+        size_t n;
+        bsp_spin_lock(&fl->lock);
+        n = _move_items(&cache->head, &fl->head, FREELIST_BATCH);
+        fl->nitems += n;
+        bsp_spin_unlock(&fl->lock);
+        cache->nitems -= n;
+        _report_cache(fl, cache);
+    }
+    set_pointer(cache->head, item);
+    cache->head = item;
+    cache->nitems ++;
+    cache->nfree ++;
+
+    return;
+}
@@ -22,17 +22,176 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 06/07/2012
+ * @update 12/10/2014
  * @changelog 
  *      [06/07/2012] - Creation
  *      [12/18/2012] - Move macros here
  *      [04/07/2013] - IPv4 hash added
+ *      [12/10/2014] - Seeded 64-bit multiply-mix hash (wyhash), streaming hash
  */
 
 #include "config.h"
 
 #include "bsp.h"
 
+static const uint64_t hash_secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+static uint64_t hash_seed = 0;
+static int hash_seeded = 0;
+
+// 64 x 64 multiply, halves folded with the inputs (a zero factor does not wipe the state)
+static inline uint64_t _hash_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t) a * b;
+
+    return a ^ b ^ (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+// Unaligned little-endian reads
+static inline uint64_t _hash_r8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+#ifdef ENDIAN_LITTLE
+    return v;
+#else
+    return __builtin_bswap64(v);
+#endif
+}
+
+static inline uint64_t _hash_r4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+#ifdef ENDIAN_LITTLE
+    return v;
+#else
+    return __builtin_bswap32(v);
+#endif
+}
+
+static inline uint64_t _hash_r3(const uint8_t *p, size_t k)
+{
+    return (((uint64_t) p[0]) << 16) | (((uint64_t) p[k >> 1]) << 8) | p[k - 1];
+}
+
+// Last (up to) 16 bytes and length. Data before p is readable when more than 16 bytes hashed
+static inline uint64_t _hash_final(const uint8_t *p, size_t i, size_t len, uint64_t seed, int is_long)
+{
+    uint64_t a, b;
+    __uint128_t r;
+    if (!is_long)
+    {
+        if (len >= 4)
+        {
+            a = (_hash_r4(p) << 32) | _hash_r4(p + ((len >> 3) << 2));
+            b = (_hash_r4(p + len - 4) << 32) | _hash_r4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0)
+        {
+            a = _hash_r3(p, len);
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        while (i > 16)
+        {
+            seed = _hash_mix(_hash_r8(p) ^ hash_secret[1], _hash_r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = _hash_r8(p + i - 16);
+        b = _hash_r8(p + i - 8);
+    }
+
+    a ^= hash_secret[1];
+    b ^= seed;
+    r = (__uint128_t) a * b;
+    a ^= (uint64_t) r;
+    b ^= (uint64_t) (r >> 64);
+
+    return _hash_mix(a ^ hash_secret[0] ^ len, b ^ hash_secret[1]);
+}
+
+// 48 bytes a round, in three independent lanes
+static inline const uint8_t * _hash_blocks(const uint8_t *p, size_t nblocks, uint64_t *seed, uint64_t *see1, uint64_t *see2)
+{
+    uint64_t s0 = *seed, s1 = *see1, s2 = *see2;
+    while (nblocks -- > 0)
+    {
+        s0 = _hash_mix(_hash_r8(p) ^ hash_secret[1], _hash_r8(p + 8) ^ s0);
+        s1 = _hash_mix(_hash_r8(p + 16) ^ hash_secret[2], _hash_r8(p + 24) ^ s1);
+        s2 = _hash_mix(_hash_r8(p + 32) ^ hash_secret[3], _hash_r8(p + 40) ^ s2);
+        p += HASH_BLOCK_SIZE;
+    }
+    *seed = s0;
+    *see1 = s1;
+    *see2 = s2;
+
+    return p;
+}
+
+// Process seed from random device, or time and pid if it is not available
+int hash_init()
+{
+    uint64_t seed = 0;
+    struct timeval tv;
+    int fd;
+    if (hash_seeded)
+    {
+        return BSP_RTN_SUCCESS;
+    }
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || sizeof(seed) != read(fd, &seed, sizeof(seed)))
+    {
+        gettimeofday(&tv, NULL);
+        seed = ((uint64_t) tv.tv_sec << 32) ^ (uint64_t) tv.tv_usec ^ ((uint64_t) getpid() << 16);
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    hash_seed = seed;
+    hash_seeded = 1;
+
+    return BSP_RTN_SUCCESS;
+}
+
+uint64_t bsp_hash64(const char *key, size_t len, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *) key;
+    uint64_t see1, see2;
+    size_t i = len;
+    if (!key)
+    {
+        return 0;
+    }
+
+    seed ^= _hash_mix(seed ^ hash_secret[0], hash_secret[1]);
+    if (len <= 16)
+    {
+        return _hash_final(p, len, len, seed, 0);
+    }
+
+    if (i >= HASH_BLOCK_SIZE)
+    {
+        see1 = see2 = seed;
+        p = _hash_blocks(p, i / HASH_BLOCK_SIZE, &seed, &see1, &see2);
+        i %= HASH_BLOCK_SIZE;
+        seed ^= see1 ^ see2;
+    }
+
+    return _hash_final(p, i, len, seed, 1);
+}
+
 /* String hash */
 uint32_t bsp_hash(const char *key, ssize_t len)
 {
@@ -41,111 +200,106 @@ uint32_t bsp_hash(const char *key, ssize_t len)
         return 0;
     }
 
-    if (len <= 0)
+    if (len < 0)
     {
         len = strlen(key);
     }
-    
-	uint32_t a, b, c;
-	uint32_t *k = (uint32_t *) key;
-	a = (uint32_t) 0xdeadface + (uint32_t) len;
-	b = (uint32_t) 0xfacebeef + (uint32_t) len;
-	c = (uint32_t) 0xbeefdead + (uint32_t) len;
-
-	// Pass every 12 bytes
-	while (len > 12)
-	{
-		a += k[0];
-		b += k[1];
-		c += k[2];
-
-		mix(a, b, c);
-			
-		len -= 12;
-		k += 3;
-	}
-
-	mix(a, b, c);
-
-	// Mix data
-#ifdef ENDIAN_LITTLE
-	switch (len)
-    {
-        case 12: c += k[2]; b += k[1]; a += k[0]; break;
-        case 11: c += k[2] & 0xffffff; b += k[1]; a += k[0]; break;
-        case 10: c += k[2] & 0xffff; b += k[1]; a += k[0]; break;
-        case 9 : c += k[2] & 0xff; b += k[1]; a += k[0]; break;
-        case 8 : b += k[1]; a += k[0]; break;
-        case 7 : b += k[1] & 0xffffff; a += k[0]; break;
-        case 6 : b += k[1] & 0xffff; a += k[0]; break;
-        case 5 : b += k[1] & 0xff; a += k[0]; break;
-        case 4 : a += k[0]; break;
-        case 3 : a += k[0] & 0xffffff; break;
-        case 2 : a += k[0] & 0xffff; break;
-        case 1 : a += k[0] & 0xff; break;
-        case 0 : return c;
+
+    uint64_t h = bsp_hash64(key, (size_t) len, hash_seed);
+
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+/* Streaming hash, same value as bsp_hash64() of the whole data */
+void hash_stream_init(BSP_HASH_STREAM *hs, uint64_t seed)
+{
+    if (hs)
+    {
+        memset(hs, 0, sizeof(BSP_HASH_STREAM));
+        hs->origin = seed;
+        hs->seed = seed ^ _hash_mix(seed ^ hash_secret[0], hash_secret[1]);
+        hs->see1 = hs->see2 = hs->seed;
     }
-#else
-    switch (len)
-    {
-        case 12: c += k[2]; b += k[1]; a += k[0]; break;
-        case 11: c += k[2] & 0xffffff00; b += k[1]; a += k[0]; break;
-        case 10: c += k[2] & 0xffff0000; b += k[1]; a += k[0]; break;
-        case 9 : c += k[2] & 0xff000000; b += k[1]; a += k[0]; break;
-        case 8 : b += k[1]; a += k[0]; break;
-        case 7 : b += k[1] & 0xffffff00; a += k[0]; break;
-        case 6 : b += k[1] & 0xffff0000; a += k[0]; break;
-        case 5 : b += k[1] & 0xff000000; a += k[0]; break;
-        case 4 : a += k[0]; break;
-        case 3 : a += k[0] & 0xffffff00; break;
-        case 2 : a += k[0] & 0xffff0000; break;
-        case 1 : a += k[0] & 0xff000000; break;
-        case 0 : return c;
-    }
-#endif  /* ENDIAN */
-    final(a, b, c);
-    
-    return c;
+
+    return;
+}
+
+void hash_stream_update(BSP_HASH_STREAM *hs, const char *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    size_t n;
+    if (!hs || !data)
+    {
+        return;
+    }
+
+    hs->total += len;
+    if (hs->nbuf > 0)
+    {
+        n = HASH_BLOCK_SIZE - hs->nbuf;
+        n = (n > len) ? len : n;
+        memcpy(hs->buf + hs->nbuf, p, n);
+        hs->nbuf += n;
+        p += n;
+        len -= n;
+        if (hs->nbuf < HASH_BLOCK_SIZE)
+        {
+            return;
+        }
+
+        _hash_blocks(hs->buf, 1, &hs->seed, &hs->see1, &hs->see2);
+        memcpy(hs->last, hs->buf + HASH_BLOCK_SIZE - 16, 16);
+        hs->nbuf = 0;
+    }
+
+    // Whole blocks straight from data
+    n = len / HASH_BLOCK_SIZE;
+    if (n > 0)
+    {
+        p = _hash_blocks(p, n, &hs->seed, &hs->see1, &hs->see2);
+        memcpy(hs->last, p - 16, 16);
+        len -= n * HASH_BLOCK_SIZE;
+    }
+
+    memcpy(hs->buf, p, len);
+    hs->nbuf = len;
+
+    return;
+}
+
+uint64_t hash_stream_final(BSP_HASH_STREAM *hs)
+{
+    uint8_t tmp[16 + HASH_BLOCK_SIZE];
+    if (!hs)
+    {
+        return 0;
+    }
+
+    if (hs->total < HASH_BLOCK_SIZE)
+    {
+        // Never reached a block, all data in buffer
+        return bsp_hash64((const char *) hs->buf, hs->total, hs->origin);
+    }
+
+    // Tail may reach back into the last block
+    memcpy(tmp, hs->last, 16);
+    memcpy(tmp + 16, hs->buf, hs->nbuf);
+
+    return _hash_final(tmp + 16, hs->nbuf, hs->total, hs->seed ^ hs->see1 ^ hs->see2, 1);
 }
 
 /* IPv4 (uint32_t) hash */
 uint32_t ipv4_hash(uint32_t ip, int bsize)
 {
-    uint32_t h = 0;
+    uint64_t h = _hash_mix((uint64_t) ip ^ hash_seed ^ hash_secret[0], hash_secret[1]);
 
-    h = ip % bsize;
-    ip /= bsize;
-    h ^= ip % bsize;
-    h ^= ip / bsize;
-
-    return h;
+    return (uint32_t) (h % (uint64_t) bsize);
 }
 
 /* IPv6 (uint8_t * 16) hash */
 uint32_t ipv6_hash(uint8_t *ip, int bsize)
 {
-    uint32_t h = 0;
-
-    h = ((ip[0] << 24) + (ip[2] << 16) + (ip[4] << 8) + ip[6]) % bsize;
-    h ^= ((ip[1] << 24) + (ip[3] << 16) + (ip[5] << 8) + ip[7]) % bsize;
-    h ^= ((ip[8] << 24) + (ip[10] << 16) + (ip[12] << 8) + ip[14]) % bsize;
-    h ^= ((ip[9] << 24) + (ip[11] << 16) + (ip[13] << 8) + ip[15]) % bsize;
-    h ^= ((ip[0] << 24) + 
-          (ip[1] << 23) + 
-          (ip[2] << 22) + 
-          (ip[3] << 21) + 
-          (ip[4] << 20) + 
-          (ip[5] << 19) + 
-          (ip[6] << 18) + 
-          (ip[7] << 17) + 
-          (ip[8] << 16) + 
-          (ip[9] << 15) + 
-          (ip[10] << 14) + 
-          (ip[11] << 13) + 
-          (ip[12] << 12) + 
-          (ip[13] << 11) + 
-          (ip[14] << 10) + 
-          (ip[15] << 9)) / bsize;
-
-    return h;
+    uint64_t h = bsp_hash64((const char *) ip, 16, hash_seed);
+
+    return (uint32_t) (h % (uint64_t) bsize);
 }
@@ -22,9 +22,12 @@
  * 
  * @package bsp::libbsp-ext
  * @author Dr.NP <np@bsgroup.org>
- * @update 08/23/2012
+ * @update 12/08/2014
  * @changelog 
  *      [08/23/2012] - Creation
+ *      [11/27/2014] - WebSocket permessage-deflate
+ *      [11/28/2014] - In-place frame unmasking
+ *      [12/08/2014] - Output built in local strings
  */
 
 #include "bsp.h"
@@ -32,6 +35,14 @@
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+    #include <immintrin.h>
+#endif
+
 static void clear_http_request(BSP_HTTP_REQUEST *req)
 {
     if (req)
@@ -76,6 +87,11 @@ static void clear_http_request(BSP_HTTP_REQUEST *req)
             bsp_free(req->sec_websocket_protocol);
         }
 
+        if (req->sec_websocket_extensions)
+        {
+            bsp_free(req->sec_websocket_extensions);
+        }
+
         if (req->sec_websocket_key)
         {
             bsp_free(req->sec_websocket_key);
@@ -276,6 +292,21 @@ void http_request_set_sec_websocket_protocol(BSP_HTTP_REQUEST *req, const char *
     return;
 }
 
+void http_request_set_sec_websocket_extensions(BSP_HTTP_REQUEST *req, const char *extensions, ssize_t len)
+{
+    if (req)
+    {
+        if (req->sec_websocket_extensions)
+        {
+            bsp_free(req->sec_websocket_extensions);
+        }
+
+        req->sec_websocket_extensions = bsp_strndup(extensions, len);
+    }
+
+    return;
+}
+
 void http_request_set_sec_websocket_key(BSP_HTTP_REQUEST *req, const char *key, ssize_t len)
 {
     if (req)
@@ -394,6 +425,11 @@ void clear_http_response(BSP_HTTP_RESPONSE *resp)
             bsp_free(resp->sec_websocket_protocol);
         }
 
+        if (resp->sec_websocket_extensions)
+        {
+            bsp_free(resp->sec_websocket_extensions);
+        }
+
         memset(resp, 0, sizeof(BSP_HTTP_RESPONSE));
     }
 
@@ -627,13 +663,28 @@ void http_response_set_sec_websocket_origin(BSP_HTTP_RESPONSE *resp, const char
     return;
 }
 
+void http_response_set_sec_websocket_extensions(BSP_HTTP_RESPONSE *resp, const char *extensions, ssize_t len)
+{
+    if (resp)
+    {
+        if (resp->sec_websocket_extensions)
+        {
+            bsp_free(resp->sec_websocket_extensions);
+        }
+
+        resp->sec_websocket_extensions = bsp_strndup(extensions, len);
+    }
+
+    return;
+}
+
 /* HTTP request genrator */
 BSP_STRING * generate_http_request(BSP_HTTP_REQUEST *req)
 {
     BSP_STRING *ret = NULL;
     if (req && req->host && req->request_uri)
     {
-        ret = new_string(NULL, 0);
+        ret = new_string_local(NULL, 0);
         string_printf(ret, "%s %s %s\r\n", req->method, req->request_uri, req->version);
         string_printf(ret, "Host: %s\r\n", req->host);
 
@@ -785,6 +836,10 @@ size_t parse_http_request(const char *data, ssize_t len, BSP_HTTP_REQUEST *req)
             {
                 http_request_set_sec_websocket_protocol(req, req_value, req_value_len);
             }
+            else if (0 == strncasecmp("sec-websocket-extensions", req_key, 24))
+            {
+                http_request_set_sec_websocket_extensions(req, req_value, req_value_len);
+            }
             else if (0 == strncasecmp("sec-websocket-key1", req_key, 18))
             {
                 http_request_set_sec_websocket_key1(req, req_value, req_value_len);
@@ -818,7 +873,7 @@ BSP_STRING * generate_http_response(BSP_HTTP_RESPONSE *resp)
 
     if (resp->version && resp->status_code)
     {
-        BSP_STRING *ret = new_string(NULL, 0);
+        BSP_STRING *ret = new_string_local(NULL, 0);
         string_printf(ret, "%s %d %s\r\n", resp->version, resp->status_code, resp->status_description ? resp->status_description : "OK");
 
         if (resp->server)
@@ -851,6 +906,11 @@ BSP_STRING * generate_http_response(BSP_HTTP_RESPONSE *resp)
             string_printf(ret, "Sec-WebSocket-Origin: %s\r\n", resp->sec_websocket_origin);
         }
 
+        if (resp->sec_websocket_extensions)
+        {
+            string_printf(ret, "Sec-WebSocket-Extensions: %s\r\n", resp->sec_websocket_extensions);
+        }
+
         string_append(ret, "\r\n", -1);
         status_op_http(STATUS_OP_HTTP_RESPONSE);
 
@@ -1055,127 +1115,393 @@ int websocket_handshake(BSP_HTTP_REQUEST *req, BSP_HTTP_RESPONSE *resp)
     return BSP_RTN_SUCCESS;
 }
 
-// Parse websocket data
-size_t parse_websocket_data(const char *data, ssize_t len, int *opcode, BSP_STRING *data_str)
+// Trim blanks (and quotes of value) of a token
+static const char * _ws_ext_token(const char *start, const char *end, size_t *len)
 {
-    if (!data || !data_str)
+    while (start < end && (' ' == *start || '\t' == *start || '"' == *start))
     {
-        *opcode = 0xF;
-        return 0;
+        start ++;
     }
 
-    if (len < 0)
+    while (end > start && (' ' == end[-1] || '\t' == end[-1] || '"' == end[-1]))
     {
-        len = strlen(data);
+        end --;
+    }
+
+    *len = end - start;
+
+    return start;
+}
+
+static int _ws_ext_is(const char *token, size_t len, const char *name)
+{
+    size_t name_len = strlen(name);
+
+    return (len == name_len && 0 == strncasecmp(token, name, name_len)) ? 1 : 0;
+}
+
+// Window bits parameter, -1 if invalid
+static int _ws_ext_window_bits(const char *value, size_t len)
+{
+    if (len < 1 || len > 2 || !isdigit(value[0]) || (2 == len && !isdigit(value[1])))
+    {
+        return -1;
+    }
+
+    int bits = (1 == len) ? value[0] - '0' : (value[0] - '0') * 10 + (value[1] - '0');
+
+    return (bits >= 8 && bits <= WS_DEFLATE_MAX_WINDOW_BITS) ? bits : -1;
+}
+
+// Try all offers in order, the first acceptable one wins (RFC7692 5.)
+int websocket_deflate_negotiate(BSP_HTTP_REQUEST *req, BSP_HTTP_RESPONSE *resp, BSP_WEBSOCKET_DEFLATE *param)
+{
+    if (!req || !resp || !param || !req->sec_websocket_extensions)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    const char *offer = req->sec_websocket_extensions;
+    const char *offer_end, *item, *item_end, *eq, *token, *value;
+    size_t token_len, value_len;
+    int server_bits, server_no_takeover, client_no_takeover, valid, bits;
+    char ext[128];
+
+    while (*offer)
+    {
+        offer_end = strchr(offer, ',');
+        if (!offer_end)
+        {
+            offer_end = offer + strlen(offer);
+        }
+
+        item_end = memchr(offer, ';', offer_end - offer);
+        if (!item_end)
+        {
+            item_end = offer_end;
+        }
+
+        token = _ws_ext_token(offer, item_end, &token_len);
+        if (_ws_ext_is(token, token_len, "permessage-deflate"))
+        {
+            server_bits = param->server_max_window_bits;
+            if (server_bits < WS_DEFLATE_MIN_WINDOW_BITS || server_bits > WS_DEFLATE_MAX_WINDOW_BITS)
+            {
+                server_bits = WS_DEFLATE_MAX_WINDOW_BITS;
+            }
+            server_no_takeover = param->server_no_context_takeover;
+            client_no_takeover = 0;
+            valid = 1;
+
+            while (valid && item_end < offer_end)
+            {
+                item = item_end + 1;
+                item_end = memchr(item, ';', offer_end - item);
+                if (!item_end)
+                {
+                    item_end = offer_end;
+                }
+
+                eq = memchr(item, '=', item_end - item);
+                token = _ws_ext_token(item, eq ? eq : item_end, &token_len);
+                value = NULL;
+                value_len = 0;
+                if (eq)
+                {
+                    value = _ws_ext_token(eq + 1, item_end, &value_len);
+                }
+
+                if (_ws_ext_is(token, token_len, "server_no_context_takeover"))
+                {
+                    server_no_takeover = 1;
+                }
+                else if (_ws_ext_is(token, token_len, "client_no_context_takeover"))
+                {
+                    client_no_takeover = 1;
+                }
+                else if (_ws_ext_is(token, token_len, "server_max_window_bits"))
+                {
+                    bits = _ws_ext_window_bits(value, value_len);
+                    if (bits < WS_DEFLATE_MIN_WINDOW_BITS)
+                    {
+                        // zlib can not make a raw stream with 8 bits window
+                        valid = 0;
+                    }
+                    else if (bits < server_bits)
+                    {
+                        server_bits = bits;
+                    }
+                }
+                else if (_ws_ext_is(token, token_len, "client_max_window_bits"))
+                {
+                    // Our inflater takes any window, just check it
+                    if (value && _ws_ext_window_bits(value, value_len) < 0)
+                    {
+                        valid = 0;
+                    }
+                }
+                else if (token_len > 0)
+                {
+                    // Unknown parameter, decline this offer
+                    valid = 0;
+                }
+            }
+
+            if (valid)
+            {
+                param->server_max_window_bits = server_bits;
+                param->server_no_context_takeover = server_no_takeover;
+                param->client_no_context_takeover = client_no_takeover;
+                snprintf(ext, sizeof(ext) - 1, "permessage-deflate%s%s", 
+                         server_no_takeover ? "; server_no_context_takeover" : "", 
+                         client_no_takeover ? "; client_no_context_takeover" : "");
+                if (server_bits < WS_DEFLATE_MAX_WINDOW_BITS)
+                {
+                    snprintf(ext + strlen(ext), sizeof(ext) - 1 - strlen(ext), "; server_max_window_bits=%d", server_bits);
+                }
+                http_response_set_sec_websocket_extensions(resp, ext, -1);
+
+                return BSP_RTN_SUCCESS;
+            }
+        }
+
+        offer = (*offer_end) ? offer_end + 1 : offer_end;
+    }
+
+    return BSP_RTN_ERROR_GENERAL;
+}
+
+BSP_COMPRESS_STREAM * new_websocket_deflate_stream(BSP_WEBSOCKET_DEFLATE *param)
+{
+    if (!param)
+    {
+        return NULL;
+    }
+
+    int flags = 0;
+    if (param->server_no_context_takeover)
+    {
+        flags |= COMPRESS_STREAM_DEFLATE_NO_TAKEOVER;
+    }
+
+    if (param->client_no_context_takeover)
+    {
+        flags |= COMPRESS_STREAM_INFLATE_NO_TAKEOVER;
+    }
+
+    // Raw deflate data without zlib header
+    return new_deflate_stream(0 - param->server_max_window_bits, flags);
+}
+
+// XOR payload with mask, 4 bytes of mask repeat so wide blocks keep the phase
+void websocket_unmask(char *dst, const char *src, size_t len, const char *mask)
+{
+    size_t i = 0;
+    uint32_t m32;
+    uint64_t m64, v;
+
+    if (!dst || !src || !mask)
+    {
+        return;
+    }
+
+    memcpy(&m32, mask, 4);
+    m64 = ((uint64_t) m32 << 32) | m32;
+#ifdef __AVX2__
+    const __m256i m256 = _mm256_set1_epi32((int) m32);
+    while (i + 32 <= len)
+    {
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (src + i)), m256));
+        i += 32;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i m128 = _mm_set1_epi32((int) m32);
+    while (i + 16 <= len)
+    {
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *) (src + i)), m128));
+        i += 16;
+    }
+#endif
+    while (i + 8 <= len)
+    {
+        memcpy(&v, src + i, 8);
+        v ^= m64;
+        memcpy(dst + i, &v, 8);
+        i += 8;
+    }
+
+    while (i < len)
+    {
+        dst[i] = src[i] ^ mask[i & 3];
+        i ++;
+    }
+
+    return;
+}
+
+// Parse header of a frame
+ssize_t parse_websocket_frame(const char *data, size_t len, BSP_WEBSOCKET_FRAME *frame)
+{
+    if (!data || !frame)
+    {
+        return -1;
     }
 
     if (len < 2)
     {
-        *opcode = 0xF;
         return 0;
     }
 
-    if ((unsigned char) data[0] >> 4 != 0x8)
+    unsigned char b0 = (unsigned char) data[0];
+    unsigned char b1 = (unsigned char) data[1];
+    size_t payload_len = b1 & 0x7F;
+    size_t header_len = 2;
+
+    if (b0 & 0x30)
     {
-        // Multi frament and RSV not support now
-        *opcode = 0xF;
-        return 0;
+        // RSV2 & RSV3 not support
+        return -1;
     }
 
-    // Fake value now
-    *opcode = (unsigned char) data[0] & 0xF;
-    int mask = (unsigned char) data[1] >> 7;
-    size_t data_len = (unsigned char) data[1] & 0x7F;
-    size_t remaining = len;
-    char mask_data[4];
-    if (126 == data_len)
+    frame->fin = (b0 & 0x80) ? 1 : 0;
+    frame->opcode = b0 & (WS_FLAG_RSV1 | 0xF);
+    frame->masked = (b1 & 0x80) ? 1 : 0;
+    if (126 == payload_len)
     {
         // Next two bytes
         if (len < 4)
         {
-            *opcode = 0xF;
             return 0;
         }
 
-        data_len = (size_t) get_int16(data + 2);
-        remaining -= 4;
+        payload_len = (size_t) (uint16_t) get_int16(data + 2);
+        header_len = 4;
     }
-    else if (127 == data_len)
+    else if (127 == payload_len)
     {
         // Next eight bytes
         if (len < 10)
         {
-            *opcode = 0xF;
             return 0;
         }
 
-        data_len = (size_t) get_int64(data + 2);
-        remaining -= 10;
+        payload_len = (size_t) get_int64(data + 2);
+        header_len = 10;
+        if (payload_len > (size_t) SSIZE_MAX - 14)
+        {
+            return -1;
+        }
     }
-    else
+
+    if ((frame->opcode & 0x8) && (!frame->fin || payload_len > 125 || (frame->opcode & WS_FLAG_RSV1)))
     {
-        remaining -= 2;
+        // Control frame can not be fragmented, compressed or longer than 125
+        return -1;
     }
 
-    if (mask)
+    if (frame->masked)
     {
         // Four bytes mask data
-        if (remaining < 4)
+        if (len < header_len + 4)
         {
-            *opcode = 0xF;
             return 0;
         }
 
-        memcpy(mask_data, data + (len - remaining), 4);
-        remaining -= 4;
+        memcpy(frame->mask, data + header_len, 4);
+        header_len += 4;
     }
 
-    if (remaining < data_len)
+    frame->header_len = header_len;
+    frame->payload_len = payload_len;
+    if (len - header_len < payload_len)
     {
         // Data not complete
-        *opcode = 0xF;
         return 0;
     }
 
-    const char *start = data + (len - remaining);
-    if (mask)
+    return (ssize_t) (header_len + payload_len);
+}
+
+// Parse websocket data
+size_t parse_websocket_data(const char *data, ssize_t len, int *opcode, BSP_STRING *data_str)
+{
+    BSP_WEBSOCKET_FRAME frame;
+    ssize_t frame_len;
+
+    *opcode = 0xF;
+    if (!data || !data_str)
+    {
+        return 0;
+    }
+
+    if (len < 0)
+    {
+        len = strlen(data);
+    }
+
+    frame_len = parse_websocket_frame(data, (size_t) len, &frame);
+    if (frame_len <= 0 || !frame.fin)
+    {
+        // Incomplete, error or fragmented
+        return 0;
+    }
+
+    *opcode = frame.opcode;
+    if (frame.masked)
     {
-        size_t i;
         // Ensure space
-        string_fill(data_str, -1, data_len);
-        for (i = 0; i < data_len; i ++)
-        {
-            data_str->str[i] = start[i] ^ mask_data[i & 3];
-        }
+        string_fill(data_str, -1, frame.payload_len);
+        websocket_unmask(STR_STR(data_str), data + frame.header_len, frame.payload_len, frame.mask);
     }
     else
     {
-        string_append(data_str, start, data_len);
+        string_append(data_str, data + frame.header_len, frame.payload_len);
     }
 
-    return (len - remaining + data_len);
+    return (size_t) frame_len;
 }
 
-// Generate WebSocket data
-BSP_STRING * generate_websocket_data(BSP_STRING *data, int opcode, int mask)
+// Inflate payload of a compressed message in place
+int websocket_inflate_data(BSP_STRING *data, BSP_COMPRESS_STREAM *cs)
+{
+    if (!data || !cs || COMPRESS_TYPE_NONE != data->compress_type)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    // Put back the tail removed by sender
+    string_append(data, WS_DEFLATE_TAIL, 4);
+    data->compress_type = COMPRESS_TYPE_DEFLATE;
+    data->compressed_len = STR_LEN(data);
+
+    return string_decompress_stream(data, cs);
+}
+
+// Put frame header, payload masked if required
+static BSP_STRING * _generate_websocket_frame(const char *data, size_t len, int head_byte, int mask)
 {
     char head[14];
     int head_len = 0;
-    int len = data ? STR_LEN(data) : 0;
 
     mask = mask ? 1 : 0;
-    BSP_STRING *ret = new_string(NULL, 0);
-    head[0] = 0x80 | opcode;
+    BSP_STRING *ret = new_string_local(NULL, 0);
+    if (!ret)
+    {
+        return NULL;
+    }
+
+    head[0] = head_byte;
     if (len > 65535)
     {
         head[1] = mask << 7 | 0x7F;
-        set_int64(len, &head[2]);
+        set_int64((int64_t) len, &head[2]);
         head_len = 10;
     }
-    else if (len > 126)
+    else if (len > 125)
     {
         head[1] = mask << 7 | 0x7E;
-        set_int16(len, &head[2]);
+        set_int16((int16_t) len, &head[2]);
         head_len = 4;
     }
     else
@@ -1190,26 +1516,65 @@ BSP_STRING * generate_websocket_data(BSP_STRING *data, int opcode, int mask)
         head_len += 4;
     }
 
+    string_reserve(ret, head_len + ((data) ? len : 0));
     string_append(ret, head, head_len);
     if (data)
     {
         // Write data
         if (!mask)
         {
-            string_append(ret, STR_STR(data), len);
+            string_append(ret, data, len);
         }
         else
         {
             // XOR with mask
             string_fill(ret, -1, len);
-            size_t i;
-            for (i = 0; i < len; i ++)
-            {
-                ret->str[head_len + i] = (unsigned char) STR_STR(data)[i] ^ head[head_len - 4 + (i & 3)];
-            }
+            websocket_unmask(STR_STR(ret) + head_len, data, len, &head[head_len - 4]);
         }
     }
 
     return ret;
 }
 
+// Generate WebSocket data
+BSP_STRING * generate_websocket_data(BSP_STRING *data, int opcode, int mask)
+{
+    return _generate_websocket_frame(data ? STR_STR(data) : NULL, data ? STR_LEN(data) : 0, 0x80 | opcode, mask);
+}
+
+BSP_STRING * generate_websocket_data_deflate(BSP_STRING *data, int opcode, int mask, BSP_COMPRESS_STREAM *cs)
+{
+    if (!data || !cs || COMPRESS_TYPE_NONE == cs->compress_type || 
+        (WS_OPCODE_TEXT != opcode && WS_OPCODE_BINARY != opcode))
+    {
+        return generate_websocket_data(data, opcode, mask);
+    }
+
+    BSP_STRING *payload = new_string_local(STR_STR(data), STR_LEN(data));
+    if (!payload)
+    {
+        return NULL;
+    }
+
+    if (BSP_RTN_SUCCESS != string_compress_stream(payload, cs))
+    {
+        // Window is out of sync with the peer, send plain data from now on
+        trace_msg(TRACE_LEVEL_ERROR, "HTTP : WebSocket deflate failed");
+        cs->compress_type = COMPRESS_TYPE_NONE;
+        del_string(payload);
+
+        return generate_websocket_data(data, opcode, mask);
+    }
+
+    // Flushed data always ends with an empty block, peer appends it back (RFC7692 7.2.1)
+    size_t len = payload->compressed_len;
+    if (len >= 4 && 0 == memcmp(STR_STR(payload) + len - 4, WS_DEFLATE_TAIL, 4))
+    {
+        len -= 4;
+    }
+
+    BSP_STRING *ret = _generate_websocket_frame(STR_STR(payload), len, 0x80 | WS_FLAG_RSV1 | opcode, mask);
+    del_string(payload);
+
+    return ret;
+}
@@ -22,78 +22,301 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 01/28/2014
+ * @update 12/08/2014
  * @chagelog 
  *      [01/14/2014] - Creation
  *      [01/28/2014] - next_item() mixed
  *      [08/18/2014[ - Recode
+ *      [11/25/2014] - Faster decoder, bulk scan of strings and blanks
+ *      [11/26/2014] - Encoder with size planning and bulk escape scan
+ *      [12/02/2014] - Hash keys decoded as atoms
+ *      [12/03/2014] - Hash traversed without cursor (shared frozen objects)
+ *      [12/08/2014] - Output built in local strings
  */
 
 #include "bsp.h"
 
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+    #include <immintrin.h>
+#endif
+
 /* === SERIALIZE === */
-static inline void _append_string_to_json(BSP_STRING *str, BSP_STRING *src)
+// Buffer grows by doubling, we never realloc for every piece.
+// First failure kept in buffer, all writes after are dropped
+static inline int _json_reserve(BSP_JSON_BUFFER *buf, size_t len)
 {
-    if (str && src && !str->is_const)
+    if (buf->error)
+    {
+        return buf->error;
+    }
+
+    if (buf->len + len <= buf->size)
+    {
+        return BSP_RTN_SUCCESS;
+    }
+
+    size_t new_size = (buf->size > 0) ? buf->size : JSON_BUFFER_INITIAL;
+    while (new_size < buf->len + len)
+    {
+        new_size *= 2;
+    }
+
+    char *new_data = bsp_realloc(buf->data, new_size);
+    if (!new_data)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "JSON : Enlarge encode buffer error");
+        buf->error = BSP_RTN_ERROR_MEMORY;
+        return BSP_RTN_ERROR_MEMORY;
+    }
+    buf->data = new_data;
+    buf->size = new_size;
+
+    return BSP_RTN_SUCCESS;
+}
+
+static inline void _json_write(BSP_JSON_BUFFER *buf, const char *data, size_t len)
+{
+    if (len > 0 && BSP_RTN_SUCCESS == _json_reserve(buf, len))
+    {
+        memcpy(buf->data + buf->len, data, len);
+        buf->len += len;
+    }
+
+    return;
+}
+
+// Offset of the first byte should be escaped : < 0x20, '"', '/', '\' and non-ASCII
+static inline size_t _scan_json_escape(const char *data, size_t len)
+{
+    size_t i = 0;
+    unsigned char c;
+#ifdef __AVX2__
+    const __m256i ctrl32 = _mm256_set1_epi8(0x20);
+    const __m256i quote32 = _mm256_set1_epi8('"');
+    const __m256i slash32 = _mm256_set1_epi8('/');
+    const __m256i strip32 = _mm256_set1_epi8('\\');
+    while (i + 32 <= len)
     {
-        size_t i;
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (data + i));
+        // Signed compare, bytes >= 0x80 are negative
+        __m256i m = _mm256_or_si256(
+                        _mm256_or_si256(_mm256_cmpgt_epi8(ctrl32, chunk), _mm256_cmpeq_epi8(chunk, quote32)), 
+                        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, slash32), _mm256_cmpeq_epi8(chunk, strip32)));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(m);
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i ctrl = _mm_set1_epi8(0x20);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i strip = _mm_set1_epi8('\\');
+    while (i + 16 <= len)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+        // Signed compare, bytes >= 0x80 are negative
+        __m128i m = _mm_or_si128(
+                        _mm_or_si128(_mm_cmplt_epi8(chunk, ctrl), _mm_cmpeq_epi8(chunk, quote)), 
+                        _mm_or_si128(_mm_cmpeq_epi8(chunk, slash), _mm_cmpeq_epi8(chunk, strip)));
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+#endif
+    while (i < len)
+    {
+        c = (unsigned char) data[i];
+        if (c < 0x20 || c >= 0x80 || '"' == c || '/' == c || '\\' == c)
+        {
+            break;
+        }
+        i ++;
+    }
+
+    return i;
+}
+
+static inline void _append_string_to_json(BSP_JSON_BUFFER *buf, BSP_STRING *src)
+{
+    if (buf && src)
+    {
+        size_t i = 0, run, len;
         unsigned char c;
         const char *esc;
+        const char *data;
         int utf_len;
         int32_t utf_value;
-        bsp_spin_lock(&src->lock);
-        for (i = 0; i < STR_LEN(src); i ++)
+        STR_LOCK(src);
+        data = STR_STR(src);
+        len = STR_LEN(src);
+        while (i < len)
         {
-            c = (unsigned char) STR_STR(src)[i];
+            // Bulk copy normal bytes
+            run = _scan_json_escape(data + i, len - i);
+            _json_write(buf, data + i, run);
+            i += run;
+            if (i >= len)
+            {
+                break;
+            }
+
+            c = (unsigned char) data[i];
             if (c < 0x80)
             {
                 esc = escape_char(c);
                 if (esc)
                 {
                     // Escaped char
-                    string_append(str, esc, -1);
+                    _json_write(buf, esc, strlen(esc));
                 }
                 else
                 {
                     // Normal
-                    string_append(str, STR_STR(src) + i, 1);
+                    _json_write(buf, data + i, 1);
                 }
+                i ++;
             }
             else
             {
                 // UTF
-                utf_value = utf8_to_value(STR_STR(src) + i, STR_LEN(src) - i, &utf_len);
-                string_printf(str, "\\u%04x", utf_value);
-                i += (utf_len - 1);
+                utf_len = 1;
+                utf_value = utf8_to_value(data + i, len - i, &utf_len);
+                if (BSP_RTN_SUCCESS == _json_reserve(buf, 16))
+                {
+                    buf->len += snprintf(buf->data + buf->len, 16, "\\u%04x", utf_value);
+                }
+                i += (utf_len > 0) ? utf_len : 1;
             }
         }
-        bsp_spin_unlock(&src->lock);
+        STR_UNLOCK(src);
     }
 
     return;
 }
 
-static void _append_key_to_json(BSP_STRING *str, BSP_STRING *key);
-static void _append_value_to_json(BSP_STRING *str, BSP_VALUE *val);
-static void _append_object_to_json(BSP_STRING *str, BSP_OBJECT *obj);
+// Size planning, make one allocation for most objects
+static size_t _estimate_value_json(BSP_VALUE *val);
+static size_t _estimate_object_json(BSP_OBJECT *obj);
 
-static void _append_key_to_json(BSP_STRING *str, BSP_STRING *key)
+static size_t _estimate_value_json(BSP_VALUE *val)
 {
-    if (!str || !key || str->is_const)
+    size_t ret = 0;
+    BSP_STRING *src = NULL;
+    if (val)
+    {
+        switch (val->type)
+        {
+            case BSP_VAL_INT : 
+                ret = 3 * vintlen(val->lval, -1) + 1;
+                break;
+            case BSP_VAL_FLOAT : 
+            case BSP_VAL_DOUBLE : 
+                ret = 24;
+                break;
+            case BSP_VAL_NULL : 
+            case BSP_VAL_BOOLEAN_TRUE : 
+            case BSP_VAL_BOOLEAN_FALSE : 
+                ret = 5;
+                break;
+            case BSP_VAL_STRING : 
+                src = (BSP_STRING *) val->rval;
+                // A little more for escaped chars
+                ret = (src) ? STR_LEN(src) + (STR_LEN(src) >> 3) + 2 : 2;
+                break;
+            case BSP_VAL_OBJECT : 
+                ret = _estimate_object_json((BSP_OBJECT *) val->rval);
+                break;
+            case BSP_VAL_VIEW : 
+                ret = ((BSP_VIEW *) val->rval) ? 2 * ((BSP_VIEW *) val->rval)->len : 0;
+                break;
+            default : 
+                break;
+        }
+    }
+
+    return ret;
+}
+
+static size_t _estimate_object_json(BSP_OBJECT *obj)
+{
+    size_t ret = 0, idx;
+    BSP_VALUE *val = NULL;
+    struct bsp_array_t *array = NULL;
+    struct bsp_hash_t *hash = NULL;
+    struct bsp_hash_item_t *item = NULL;
+    if (!obj)
+    {
+        return 0;
+    }
+
+    switch (obj->type)
+    {
+        case OBJECT_TYPE_SINGLE : 
+            ret = _estimate_value_json((BSP_VALUE *) obj->node);
+            break;
+        case OBJECT_TYPE_ARRAY : 
+            array = (struct bsp_array_t *) obj->node;
+            ret = 2;
+            if (array)
+            {
+                for (idx = 0; idx < array->nitems; idx ++)
+                {
+                    val = ARRAY_ITEM(array, idx);
+                    ret += ((val) ? _estimate_value_json(val) : 4) + 1;
+                }
+            }
+            break;
+        case OBJECT_TYPE_HASH : 
+            hash = (struct bsp_hash_t *) obj->node;
+            ret = 2;
+            for (idx = 0; hash && idx < hash->nitems_used; idx ++)
+            {
+                item = HASH_ITEM(hash, idx);
+                if (item)
+                {
+                    ret += STR_LEN(item->key) + 4 + _estimate_value_json(item->value);
+                }
+            }
+            break;
+        default : 
+            break;
+    }
+
+    return ret;
+}
+
+static void _append_key_to_json(BSP_JSON_BUFFER *buf, BSP_STRING *key);
+static void _append_value_to_json(BSP_JSON_BUFFER *buf, BSP_VALUE *val);
+static void _append_object_to_json(BSP_JSON_BUFFER *buf, BSP_OBJECT *obj);
+
+static void _append_key_to_json(BSP_JSON_BUFFER *buf, BSP_STRING *key)
+{
+    if (!buf || !key)
     {
         return;
     }
 
-    string_append(str, "\"", 1);
-    _append_string_to_json(str, key);
-    string_append(str, "\"", 1);
+    _json_write(buf, "\"", 1);
+    _append_string_to_json(buf, key);
+    _json_write(buf, "\"", 1);
 
     return;
 }
 
-static void _append_value_to_json(BSP_STRING *str, BSP_VALUE *val)
+static void _append_value_to_json(BSP_JSON_BUFFER *buf, BSP_VALUE *val)
 {
-    if (!str || !val || str->is_const)
+    if (!buf || !val)
     {
         return;
     }
@@ -104,32 +327,47 @@ static void _append_value_to_json(BSP_STRING *str, BSP_VALUE *val)
     switch (val->type)
     {
         case BSP_VAL_NULL : 
-            string_append(str, "null", 4);
+            _json_write(buf, "null", 4);
             break;
         case BSP_VAL_INT : 
-            string_printf(str, "%lld", get_vint(val->lval, &vlen));
+            if (BSP_RTN_SUCCESS == _json_reserve(buf, JSON_NUMBER_MAX_LEN))
+            {
+                buf->len += snprintf(buf->data + buf->len, JSON_NUMBER_MAX_LEN, "%lld", (long long int) get_vint(val->lval, &vlen));
+            }
             break;
         case BSP_VAL_FLOAT : 
-            string_printf(str, "%.14g", get_float(val->lval));
+            if (BSP_RTN_SUCCESS == _json_reserve(buf, JSON_NUMBER_MAX_LEN))
+            {
+                buf->len += snprintf(buf->data + buf->len, JSON_NUMBER_MAX_LEN, "%.14g", get_float(val->lval));
+            }
             break;
         case BSP_VAL_DOUBLE : 
-            string_printf(str, "%.14g", get_double(val->lval));
+            if (BSP_RTN_SUCCESS == _json_reserve(buf, JSON_NUMBER_MAX_LEN))
+            {
+                buf->len += snprintf(buf->data + buf->len, JSON_NUMBER_MAX_LEN, "%.14g", get_double(val->lval));
+            }
             break;
         case BSP_VAL_BOOLEAN_TRUE : 
-            string_append(str, "true", 4);
+            _json_write(buf, "true", 4);
             break;
         case BSP_VAL_BOOLEAN_FALSE : 
-            string_append(str, "false", 5);
+            _json_write(buf, "false", 5);
             break;
         case BSP_VAL_STRING : 
             src = (BSP_STRING *) val->rval;
-            string_append(str, "\"", 1);
-            _append_string_to_json(str, src);
-            string_append(str, "\"", 1);
+            _json_write(buf, "\"", 1);
+            _append_string_to_json(buf, src);
+            _json_write(buf, "\"", 1);
             break;
         case BSP_VAL_OBJECT : 
             sub_obj = (BSP_OBJECT *) val->rval;
-            _append_object_to_json(str, sub_obj);
+            _append_object_to_json(buf, sub_obj);
+            break;
+        case BSP_VAL_VIEW : 
+            // Native packet, materialize it
+            sub_obj = view_to_object((BSP_VIEW *) val->rval);
+            _append_object_to_json(buf, sub_obj);
+            del_object(sub_obj);
             break;
         default : 
             break;
@@ -138,9 +376,9 @@ static void _append_value_to_json(BSP_STRING *str, BSP_VALUE *val)
     return;
 }
 
-static void _append_object_to_json(BSP_STRING *str, BSP_OBJECT *obj)
+static void _append_object_to_json(BSP_JSON_BUFFER *buf, BSP_OBJECT *obj)
 {
-    if (!str || !obj || str->is_const)
+    if (!buf || !obj)
     {
         return;
     }
@@ -153,7 +391,7 @@ static void _append_object_to_json(BSP_STRING *str, BSP_OBJECT *obj)
         case OBJECT_TYPE_SINGLE : 
             // Single
             val = (BSP_VALUE *) obj->node;
-            _append_value_to_json(str, val);
+            _append_value_to_json(buf, val);
             break;
         case OBJECT_TYPE_ARRAY : 
             // Array
@@ -161,54 +399,50 @@ static void _append_object_to_json(BSP_STRING *str, BSP_OBJECT *obj)
             size_t idx;
             if (array)
             {
-                string_append(str, "[", 1);
+                _json_write(buf, "[", 1);
                 for (idx = 0; idx < array->nitems; idx ++)
                 {
-                    size_t bucket = idx / ARRAY_BUCKET_SIZE;
-                    size_t seq = idx % ARRAY_BUCKET_SIZE;
-                    if (bucket < array->nbuckets && array->items[bucket])
+                    val = ARRAY_ITEM(array, idx);
+                    if (val)
                     {
-                        val = array->items[bucket][seq];
+                        _append_value_to_json(buf, val);
                     }
                     else
                     {
-                        val = NULL;
+                        // Unset item
+                        _json_write(buf, "null", 4);
                     }
-                    _append_value_to_json(str, val);
                     if (idx < array->nitems - 1)
                     {
-                        string_append(str, ",", 1);
+                        _json_write(buf, ",", 1);
                     }
                 }
-                string_append(str, "]", 1);
+                _json_write(buf, "]", 1);
             }
             break;
         case OBJECT_TYPE_HASH : 
             // Hash
             hash = (struct bsp_hash_t *) obj->node;
-            BSP_STRING *key;
+            struct bsp_hash_item_t *item;
+            size_t nwritten = 0;
             if (hash)
             {
-                string_append(str, "{", 1);
-                reset_object(obj);
-                val = curr_item(obj);
-                while (val)
+                _json_write(buf, "{", 1);
+                for (idx = 0; idx < hash->nitems_used; idx ++)
                 {
-                    key = curr_hash_key(obj);
-                    if (key)
-                    {
-                        _append_key_to_json(str, key);
-                        string_append(str, ":", 1);
-                        _append_value_to_json(str, val);
-                    }
-                    next_item(obj);
-                    val = curr_item(obj);
-                    if (val)
+                    item = HASH_ITEM(hash, idx);
+                    if (item)
                     {
-                        string_append(str, ",", 1);
+                        if (nwritten ++ > 0)
+                        {
+                            _json_write(buf, ",", 1);
+                        }
+                        _append_key_to_json(buf, item->key);
+                        _json_write(buf, ":", 1);
+                        _append_value_to_json(buf, item->value);
                     }
                 }
-                string_append(str, "}", 1);
+                _json_write(buf, "}", 1);
             }
             break;
         case OBJECT_TYPE_UNDETERMINED : 
@@ -219,19 +453,423 @@ static void _append_object_to_json(BSP_STRING *str, BSP_OBJECT *obj)
     return;
 }
 
+// Encode object into a raw buffer allocated by bsp_malloc(), caller owns it.
+// The buffer can be handed to socket directly by append_buffer_socket()
+char * json_nd_encode_buffer(BSP_OBJECT *obj, size_t *len)
+{
+    BSP_JSON_BUFFER buf = {NULL, 0, 0, BSP_RTN_SUCCESS};
+    if (obj)
+    {
+        _json_reserve(&buf, _estimate_object_json(obj) + 1);
+        _append_object_to_json(&buf, obj);
+    }
+
+    if (buf.error)
+    {
+        bsp_free(buf.data);
+        buf.data = NULL;
+        buf.len = 0;
+    }
+
+    if (len)
+    {
+        *len = buf.len;
+    }
+
+    return buf.data;
+}
+
 BSP_STRING * json_nd_encode(BSP_OBJECT *obj)
 {
     BSP_STRING *json = NULL;
+    size_t len = 0;
+    char *data = NULL;
     if (obj)
     {
-        json = new_string(NULL, 0);
-        _append_object_to_json(json, obj);
+        data = json_nd_encode_buffer(obj, &len);
+        json = (data) ? new_string_local(NULL, 0) : NULL;
+        if (json)
+        {
+            // Take buffer
+            string_take(json, data, len);
+        }
+        else if (data)
+        {
+            bsp_free(data);
+        }
     }
 
     return json;
 }
 
 /* === UNSERIALIZE === */
+// Scan helpers, return offset of the first matched byte, or len if not found
+// Bytes which end a normal run in string : '"' and '\'
+static inline size_t _scan_json_string(const char *data, size_t len)
+{
+    size_t i = 0;
+#ifdef __AVX2__
+    const __m256i quote32 = _mm256_set1_epi8('"');
+    const __m256i strip32 = _mm256_set1_epi8('\\');
+    while (i + 32 <= len)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (data + i));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(
+                            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote32), _mm256_cmpeq_epi8(chunk, strip32)));
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i strip = _mm_set1_epi8('\\');
+    while (i + 16 <= len)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, strip)));
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+#endif
+    while (i < len && '"' != data[i] && '\\' != data[i])
+    {
+        i ++;
+    }
+
+    return i;
+}
+
+// Blanks (<= 0x20) between tokens
+static inline size_t _skip_json_blank(const char *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len && (unsigned char) data[i] <= 0x20)
+    {
+        i ++;
+#ifdef __SSE2__
+        if (i + 16 <= len && (unsigned char) data[i] <= 0x20)
+        {
+            // Long blank run (formatted json), 16 bytes per step
+            const __m128i blank = _mm_set1_epi8(0x20);
+            while (i + 16 <= len)
+            {
+                __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+                int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(chunk, blank), blank)) & 0xFFFF;
+                if (mask)
+                {
+                    return i + __builtin_ctz(mask);
+                }
+                i += 16;
+            }
+        }
+#endif
+    }
+
+    return i;
+}
+
+static inline int _hex_value(unsigned char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    else if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+// Length of string body (between quotes), escape sequences included
+static inline size_t _json_string_span(const char *data, size_t len, int *closed, int *escaped)
+{
+    size_t i = 0;
+    *closed = 0;
+    *escaped = 0;
+    while (i < len)
+    {
+        i += _scan_json_string(data + i, len - i);
+        if (i >= len)
+        {
+            break;
+        }
+
+        if ('"' == data[i])
+        {
+            *closed = 1;
+            break;
+        }
+
+        // Strip, \uXXXX eats 4 more bytes
+        *escaped = 1;
+        if (i + 1 < len && 'u' == data[i + 1] && len - (i + 1) > 4)
+        {
+            i += 6;
+        }
+        else
+        {
+            i += 2;
+        }
+    }
+
+    return (i > len) ? len : i;
+}
+
+// Decode escaped string body into out, out must have len bytes at least
+static size_t _unescape_json_string(const char *data, size_t len, char *out)
+{
+    size_t i = 0, o = 0, run;
+    char utf[5];
+    long int utf_value;
+    while (i < len)
+    {
+        // Normal bytes, bulk copy
+        run = _scan_json_string(data + i, len - i);
+        if (run > 0)
+        {
+            memcpy(out + o, data + i, run);
+            o += run;
+            i += run;
+        }
+
+        if (i >= len)
+        {
+            break;
+        }
+
+        if ('\\' != data[i])
+        {
+            // Should not be here
+            out[o ++] = data[i ++];
+            continue;
+        }
+
+        i ++;
+        if (i >= len)
+        {
+            break;
+        }
+
+        switch (data[i])
+        {
+            case '\\' : 
+                out[o ++] = '\\';
+                break;
+            case '/' : 
+                out[o ++] = '/';
+                break;
+            case '"' : 
+                out[o ++] = '"';
+                break;
+            case 'b' : 
+                out[o ++] = '\b';
+                break;
+            case 't' : 
+                out[o ++] = '\t';
+                break;
+            case 'n' : 
+                out[o ++] = '\n';
+                break;
+            case 'f' : 
+                out[o ++] = '\f';
+                break;
+            case 'r' : 
+                out[o ++] = '\r';
+                break;
+            case 'u' : 
+                // Unicode
+                if (len - i > 4)
+                {
+                    int h0 = _hex_value(data[i + 1]);
+                    int h1 = _hex_value(data[i + 2]);
+                    int h2 = _hex_value(data[i + 3]);
+                    int h3 = _hex_value(data[i + 4]);
+                    if (h0 >= 0 && h1 >= 0 && h2 >= 0 && h3 >= 0)
+                    {
+                        utf_value = (h0 << 12) | (h1 << 8) | (h2 << 4) | h3;
+                    }
+                    else
+                    {
+                        // Sick sequence, let strtol() decide
+                        memcpy(utf, data + i + 1, 4);
+                        utf[4] = 0x0;
+                        utf_value = strtol(utf, NULL, 16);
+                    }
+
+                    if (utf_value < 0x80)
+                    {
+                        out[o ++] = utf_value;
+                    }
+                    else if (utf_value < 0x800)
+                    {
+                        // 2 bytes
+                        out[o ++] = ((utf_value >> 6) & 0x1f) | 0xc0;
+                        out[o ++] = (utf_value & 0x3f) | 0x80;
+                    }
+                    else
+                    {
+                        // 3 bytes
+                        out[o ++] = ((utf_value >> 12) & 0x0f) | 0xe0;
+                        out[o ++] = ((utf_value >> 6) & 0x3f) | 0x80;
+                        out[o ++] = (utf_value & 0x3f) | 0x80;
+                    }
+                    i += 4;
+                }
+                else
+                {
+                    out[o ++] = 'u';
+                }
+                break;
+            default : 
+                break;
+        }
+        i ++;
+    }
+
+    return o;
+}
+
+// Exact powers of ten for fast path
+static const double _json_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parse a number. Simple decimals are computed directly, both mantissa
+// and power of ten are exact doubles so the result is correctly rounded,
+// just the same as strtod(). Others go to strtod().
+// Return bytes consumed, 0 if not a number
+static size_t _parse_json_number(const char *data, size_t len, double *value)
+{
+    size_t i = 0, ndigits = 0;
+    uint64_t mantissa = 0;
+    int exp10 = 0, exp_part = 0, exp_neg = 0, neg = 0, fast = 1;
+    if (i < len && '-' == data[i])
+    {
+        neg = 1;
+        i ++;
+    }
+
+    if (i >= len || data[i] < '0' || data[i] > '9')
+    {
+        fast = 0;
+    }
+
+    while (fast && i < len && data[i] >= '0' && data[i] <= '9')
+    {
+        if (mantissa || '0' != data[i])
+        {
+            ndigits ++;
+        }
+        mantissa = mantissa * 10 + (data[i] - '0');
+        i ++;
+    }
+
+    if (fast && i < len && '.' == data[i])
+    {
+        i ++;
+        if (i >= len || data[i] < '0' || data[i] > '9')
+        {
+            fast = 0;
+        }
+        while (fast && i < len && data[i] >= '0' && data[i] <= '9')
+        {
+            if (mantissa || '0' != data[i])
+            {
+                ndigits ++;
+            }
+            mantissa = mantissa * 10 + (data[i] - '0');
+            exp10 --;
+            i ++;
+        }
+    }
+
+    if (fast && i < len && ('e' == data[i] || 'E' == data[i]))
+    {
+        i ++;
+        if (i < len && ('-' == data[i] || '+' == data[i]))
+        {
+            exp_neg = ('-' == data[i]);
+            i ++;
+        }
+        if (i >= len || data[i] < '0' || data[i] > '9')
+        {
+            fast = 0;
+        }
+        while (fast && i < len && data[i] >= '0' && data[i] <= '9')
+        {
+            if (exp_part < 10000)
+            {
+                exp_part = exp_part * 10 + (data[i] - '0');
+            }
+            i ++;
+        }
+        exp10 += (exp_neg) ? -exp_part : exp_part;
+    }
+
+    // Hex, inf, nan, ... will never come to fast path
+    if (fast && i < len && (isalnum((unsigned char) data[i]) || '.' == data[i] || '_' == data[i]))
+    {
+        fast = 0;
+    }
+
+    if (fast && ndigits <= 15 && exp10 >= -22 && exp10 <= 22)
+    {
+        double v = (double) mantissa;
+        v = (exp10 < 0) ? v / _json_pow10[-exp10] : v * _json_pow10[exp10];
+        *value = (neg) ? -v : v;
+
+        return i;
+    }
+
+    // Slow path, strtod() needs a null-terminated buffer
+    char buf[128];
+    char *token = buf;
+    char *digit_end = NULL;
+    size_t tlen = 0;
+    while (tlen < len && (unsigned char) data[tlen] > 0x20 && !strchr("\"{}[],:", data[tlen]))
+    {
+        tlen ++;
+    }
+
+    if (0 == tlen)
+    {
+        return 0;
+    }
+
+    if (tlen >= sizeof(buf))
+    {
+        token = bsp_malloc(tlen + 1);
+        if (!token)
+        {
+            return 0;
+        }
+    }
+    memcpy(token, data, tlen);
+    token[tlen] = 0x0;
+    errno = 0;
+    *value = strtod(token, &digit_end);
+    i = (digit_end && !errno) ? (size_t) (digit_end - token) : 0;
+    if (token != buf)
+    {
+        bsp_free(token);
+    }
+
+    return i;
+}
+
 static BSP_VALUE * _get_value_from_json(BSP_STRING *str);
 static void _traverse_json_array(BSP_OBJECT *obj, BSP_STRING *str);
 static void _traverse_json_hash(BSP_OBJECT *obj, BSP_STRING *str);
@@ -244,247 +882,131 @@ static BSP_VALUE * _get_value_from_json(BSP_STRING *str)
     }
 
     BSP_VALUE *ret = NULL;
-    unsigned char c;
-    char status = 0;
-    char utf[5];
-    char utf_data[4];
-    long int utf_value;
     BSP_STRING *v_str = NULL;
-    char *digit_end = NULL;
+    BSP_OBJECT *v_obj = NULL;
+    const char *data;
+    size_t remain, span, nlen;
+    int closed, escaped;
     double intpart;
     double v_digit = 0.0f;
-    BSP_OBJECT *v_obj = NULL;
-    int end = 0;
-    size_t normal = 0;
+    unsigned char c;
 
     while (STR_REMAIN(str) > 0)
     {
-        c = STR_CHAR(str);
-        if (status & JSON_DECODE_STATUS_STR)
+        str->cursor += _skip_json_blank(STR_CURR(str), STR_REMAIN(str));
+        if (STR_REMAIN(str) <= 0)
         {
-            // In string
-            if (('\\' == c) && 0 == (status & JSON_DECODE_STATUS_STRIP))
-            {
-                // Strip
-                status |= JSON_DECODE_STATUS_STRIP;
-                // If normal remain
-                if (STR_NOW(str) > normal && v_str)
-                {
-                    string_append(v_str, STR_STR(str) + normal, (STR_NOW(str) - normal));
-                }
-                STR_NEXT(str);
-            }
-            else if (status & JSON_DECODE_STATUS_STRIP)
-            {
-                switch (c)
-                {
-                    case '\\' : 
-                        string_append(v_str, "\\", 1);
-                        break;
-                    case '/' : 
-                        string_append(v_str, "/", 1);
-                        break;
-                    case '"' : 
-                        string_append(v_str, "\"", 1);
-                        break;
-                    case 'b' : 
-                        string_append(v_str, "\b", 1);
-                        break;
-                    case 't' : 
-                        string_append(v_str, "\t", 1);
-                        break;
-                    case 'n' : 
-                        string_append(v_str, "\n", 1);
-                        break;
-                    case 'f' : 
-                        string_append(v_str, "\f", 1);
-                        break;
-                    case 'r' : 
-                        string_append(v_str, "\r", 1);
-                        break;
-                    case 'u' : 
-                        // Unicode
-                        if (STR_REMAIN(str) > 4)
-                        {
-                            memcpy(utf, STR_CURR(str) + 1, 4);
-                            utf[4] = 0x0;
-                            utf_value = strtol(utf, NULL, 16);
-
-                            if (utf_value < 0x80)
-                            {
-                                utf_data[0] = utf_value;
-                                string_append(v_str, utf_data, 1);
-                            }
-                            else if (utf_value < 0x800)
-                            {
-                                // 2 bytes
-                                utf_data[0] = ((utf_value >> 6) & 0x1f) | 0xc0;
-                                utf_data[1] = (utf_value & 0x3f) | 0x80;
-                                string_append(v_str, utf_data, 2);
-                            }
-                            else
-                            {
-                                // 3 bytes
-                                utf_data[0] = ((utf_value >> 12) & 0x0f) | 0xe0;
-                                utf_data[1] = ((utf_value >> 6) & 0x3f) | 0x80;
-                                utf_data[2] = (utf_value & 0x3f) | 0x80;
-                                string_append(v_str, utf_data, 3);
-                            }
-                            str->cursor += 4;
-                        }
-                        else
-                        {
-                            string_append(v_str, "u", 1);  
-                        }
-                        break;
-                    default : 
-                        break;
-                }
+            break;
+        }
 
-                status &= ~JSON_DECODE_STATUS_STRIP;
-                STR_NEXT(str);
-                normal = str->cursor;
-            }
-            else
-            {
-                if ('"' == c && v_str)
+        data = STR_CURR(str);
+        remain = STR_REMAIN(str);
+        c = (unsigned char) data[0];
+        switch (c)
+        {
+            case '"' : 
+                // String
+                span = _json_string_span(data + 1, remain - 1, &closed, &escaped);
+                if (escaped)
                 {
-                    // String exit
-                    status &= ~JSON_DECODE_STATUS_STR;
-                    if (STR_NOW(str) > normal)
+                    v_str = new_string(NULL, span);
+                    if (v_str && span > 0)
                     {
-                        string_append(v_str, STR_STR(str) + normal, (STR_NOW(str) - normal));
+                        nlen = _unescape_json_string(data + 1, span, STR_STR(v_str));
+                        STR_LEN(v_str) = nlen;
                     }
-                    ret = new_value();
-                    value_set_string(ret, v_str);
-                    end = 1;
                 }
                 else
                 {
-                    // Normal
-                    // Just append
+                    v_str = new_string((span > 0) ? data + 1 : NULL, span);
                 }
-                STR_NEXT(str);
-            }
-        }
-        else
-        {
-            if ('"' == c)
-            {
-                // String
-                status |= JSON_DECODE_STATUS_STR;
-                v_str = new_string(NULL, 0);
-                STR_NEXT(str);
-                normal = str->cursor;
-            }
-            else if ('{' == c)
-            {
+                ret = new_value();
+                value_set_string(ret, v_str);
+                str->cursor += 1 + span + closed;
+                return ret;
+            case '{' : 
                 // A new hash
                 v_obj = new_object(OBJECT_TYPE_HASH);
                 STR_NEXT(str);
                 _traverse_json_hash(v_obj, str);
                 ret = new_value();
                 value_set_object(ret, v_obj);
-                end = 1;
-            }
-            else if ('}' == c)
-            {
-                // hash endding
+                return ret;
+            case '}' : 
+                // Hash endding
                 ret = new_value();
                 ret->type = BSP_VAL_OBJECT_HASH_END;
                 STR_NEXT(str);
-                end = 1;
-            }
-            else if ('[' == c)
-            {
+                return ret;
+            case '[' : 
                 // A new array
                 v_obj = new_object(OBJECT_TYPE_ARRAY);
                 STR_NEXT(str);
                 _traverse_json_array(v_obj, str);
                 ret = new_value();
                 value_set_object(ret, v_obj);
-                end = 1;
-            }
-            else if (']' == c)
-            {
+                return ret;
+            case ']' : 
                 // Array endding
                 ret = new_value();
                 ret->type = BSP_VAL_OBJECT_ARRAY_END;
                 STR_NEXT(str);
-                end = 1;
-            }
-            else if (STR_REMAIN(str) >= 4 && 0 == strncmp("null", STR_CURR(str), 4))
-            {
-                // null
-                ret = new_value();
-                value_set_null(ret);
-                str->cursor += 4;
-                end = 1;
-            }
-            else if (STR_REMAIN(str) >= 4 && 0 == strncmp("true", STR_CURR(str), 4))
-            {
-                // Boolean true
-                ret = new_value();
-                value_set_boolean_true(ret);
-                str->cursor += 4;
-                end = 1;
-            }
-            else if (STR_REMAIN(str) >= 5 && 0 == strncmp("false", STR_CURR(str), 5))
-            {
-                // Boolean false
-                ret = new_value();
-                value_set_boolean_false(ret);
-                str->cursor += 5;
-                end = 1;
-            }
-            else if (c > 0x20)
-            {
-                // Digit
-                errno = 0;
-                v_digit = strtod(STR_CURR(str), &digit_end);
-                if (digit_end && digit_end > STR_CURR(str) && !errno)
-                {
-                    // Has value
-                    ret = new_value();
-                    if (0.0f == modf(v_digit, &intpart))
-                    {
-                        // Integer
-                        value_set_int(ret, (const int64_t) v_digit);
-                    }
-                    else
-                    {
-                        // Double
-                        value_set_double(ret, (const double) v_digit);
-                    }
-                    str->cursor += (digit_end - STR_CURR(str));
-                    end = 1;
-                }
-                else
-                {
-                    // Other char
-                    STR_NEXT(str);
-                }
-            }
-            else
-            {
-                // Just ignore
+                return ret;
+            case ',' : 
+            case ':' : 
+                // Decollator
                 STR_NEXT(str);
-            }
+                continue;
+            default : 
+                break;
         }
-        if (end)
+
+        if (remain >= 4 && 0 == memcmp("null", data, 4))
         {
+            // null
+            ret = new_value();
+            value_set_null(ret);
+            str->cursor += 4;
             break;
         }
-    }
-    // Non-closed object
-    if (status & JSON_DECODE_STATUS_STR && v_str)
-    {
-        if (STR_NOW(str) > normal)
+        else if (remain >= 4 && 0 == memcmp("true", data, 4))
+        {
+            // Boolean true
+            ret = new_value();
+            value_set_boolean_true(ret);
+            str->cursor += 4;
+            break;
+        }
+        else if (remain >= 5 && 0 == memcmp("false", data, 5))
+        {
+            // Boolean false
+            ret = new_value();
+            value_set_boolean_false(ret);
+            str->cursor += 5;
+            break;
+        }
+
+        // Digit
+        span = _parse_json_number(data, remain, &v_digit);
+        if (span > 0)
         {
-            string_append(v_str, STR_STR(str) + normal, (STR_NOW(str) - normal));
+            ret = new_value();
+            if (0.0f == modf(v_digit, &intpart))
+            {
+                // Integer
+                value_set_int(ret, (const int64_t) v_digit);
+            }
+            else
+            {
+                // Double
+                value_set_double(ret, (const double) v_digit);
+            }
+            str->cursor += span;
+            break;
         }
-        ret = new_value();
-        value_set_string(ret, v_str);
+
+        // Other char
+        STR_NEXT(str);
     }
 
     return ret;
@@ -520,6 +1042,31 @@ static void _traverse_json_array(BSP_OBJECT *obj, BSP_STRING *str)
     return;
 }
 
+// Key of hash, a short plain key is taken as atom without a new string
+static BSP_VALUE * _get_key_from_json(BSP_STRING *str)
+{
+    str->cursor += _skip_json_blank(STR_CURR(str), STR_REMAIN(str));
+    if (STR_REMAIN(str) > 1 && '"' == STR_CHAR(str))
+    {
+        int closed = 0, escaped = 0;
+        const char *data = STR_CURR(str) + 1;
+        size_t span = _json_string_span(data, STR_REMAIN(str) - 1, &closed, &escaped);
+        if (!escaped && span <= ATOM_KEY_MAX_LEN)
+        {
+            BSP_VALUE *ret = new_value();
+            if (ret)
+            {
+                value_set_string(ret, atom_key(data, span));
+                str->cursor += 1 + span + closed;
+            }
+
+            return ret;
+        }
+    }
+
+    return _get_value_from_json(str);
+}
+
 static void _traverse_json_hash(BSP_OBJECT *obj, BSP_STRING *str)
 {
     if (!obj || OBJECT_TYPE_HASH != obj->type || !str)
@@ -534,7 +1081,7 @@ static void _traverse_json_hash(BSP_OBJECT *obj, BSP_STRING *str)
     // We ignore [:] here, we accept any decollator here -_-
     while (1)
     {
-        key = _get_value_from_json(str);
+        key = _get_key_from_json(str);
         if (!key)
         {
             // Unwilling break
@@ -569,6 +1116,9 @@ static void _traverse_json_hash(BSP_OBJECT *obj, BSP_STRING *str)
             // K/V pair
             key_str = (BSP_STRING *) key->rval;
             object_set_hash(obj, key_str, val);
+            // Key string moved into hash
+            key->rval = NULL;
+            del_value(key);
         }
         else
         {
@@ -587,7 +1137,7 @@ BSP_OBJECT * json_nd_decode(BSP_STRING *str)
     if (str)
     {
         str->cursor = 0;
-        bsp_spin_lock(&str->lock);
+        STR_LOCK(str);
         // Try first value
         BSP_VALUE *first = _get_value_from_json(str);
         if (first)
@@ -622,7 +1172,7 @@ BSP_OBJECT * json_nd_decode(BSP_STRING *str)
                 object_set_single(ret, first);
             }
         }
-        bsp_spin_unlock(&str->lock);
+        STR_UNLOCK(str);
     }
 
     return ret;
@@ -20,34 +20,599 @@
 /**
  * Object based in-memory db / cache
  * Used for runtime cache
- * 
+ *
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 10/22/2014
- * @changelog 
+ * @update 12/17/2014
+ * @changelog
  *      [10/22/2014] - Creation
+ *      [12/17/2014] - Sharded key-value cache with TTL, CLOCK eviction, incr and CAS
  */
 
 #include "bsp.h"
 
-BSP_OBJECT *memdb_base = NULL;
+// Shard chosen by high bits of hash, bucket by low bits
+static struct bsp_memdb_shard_t *memdb_shards = NULL;
+static uint64_t memdb_version = 0;
 
 int memdb_init()
 {
-    memdb_base = new_object(OBJECT_TYPE_HASH);
-    if (!memdb_base)
+    BSP_CORE_SETTING *settings = get_core_setting();
+    size_t memory = (settings->memdb_memory > 0) ? settings->memdb_memory : DEFAULT_MEMDB_MEMORY;
+    int i;
+    memdb_shards = bsp_calloc(MEMDB_SHARDS, sizeof(struct bsp_memdb_shard_t));
+    if (!memdb_shards)
+    {
+        trigger_exit(BSP_RTN_ERROR_MEMORY, "Create memdb shards error");
+    }
+
+    for (i = 0; i < MEMDB_SHARDS; i ++)
     {
-        trigger_exit(BSP_RTN_ERROR_MEMORY, "Create memdb base object error");
+        memdb_shards[i].buckets = bsp_calloc(MEMDB_SHARD_INITIAL, sizeof(BSP_MEMDB_ENTRY *));
+        if (!memdb_shards[i].buckets)
+        {
+            trigger_exit(BSP_RTN_ERROR_MEMORY, "Create memdb shards error");
+        }
+        memdb_shards[i].size = MEMDB_SHARD_INITIAL;
+        memdb_shards[i].limit = memory * 1024 * 1024 / MEMDB_SHARDS;
+        bsp_spin_init(&memdb_shards[i].lock);
     }
 
-    trace_msg(TRACE_LEVEL_DEBUG, "MemDB  : Base object initialized");
+    trace_msg(TRACE_LEVEL_DEBUG, "MemDB  : %d shards initialized, %llu MB memory", MEMDB_SHARDS, (unsigned long long) memory);
 
     return BSP_RTN_SUCCESS;
 }
 
-BSP_VALUE *memdb_get(const char *key)
+/* Size */
+static size_t _object_size(BSP_OBJECT *obj);
+
+static size_t _value_size(BSP_VALUE *val)
+{
+    BSP_STRING *str = NULL;
+    if (!val)
+    {
+        return 0;
+    }
+
+    if (BSP_VAL_STRING == val->type && val->rval)
+    {
+        str = (BSP_STRING *) val->rval;
+        return sizeof(BSP_STRING) + ((str->capacity > 0) ? str->capacity : STR_LEN(str));
+    }
+    else if (BSP_VAL_OBJECT == val->type)
+    {
+        return _object_size((BSP_OBJECT *) val->rval);
+    }
+
+    return 0;
+}
+
+// Estimated heap of a frozen object, nobody writes it any more
+static size_t _object_size(BSP_OBJECT *obj)
+{
+    struct bsp_array_t *array = NULL;
+    struct bsp_hash_t *hash = NULL;
+    struct bsp_hash_item_t *item = NULL;
+    size_t size = 0, idx;
+    if (!obj)
+    {
+        return 0;
+    }
+
+    size = sizeof(BSP_OBJECT);
+    switch (obj->type)
+    {
+        case OBJECT_TYPE_SINGLE :
+            size += sizeof(BSP_VALUE) + _value_size((BSP_VALUE *) obj->node);
+            break;
+        case OBJECT_TYPE_ARRAY :
+            array = (struct bsp_array_t *) obj->node;
+            if (array)
+            {
+                size += sizeof(struct bsp_array_t) + array->size * sizeof(BSP_VALUE);
+                for (idx = 0; idx < array->nitems; idx ++)
+                {
+                    size += _value_size(&array->items[idx]);
+                }
+            }
+            break;
+        case OBJECT_TYPE_HASH :
+            hash = (struct bsp_hash_t *) obj->node;
+            if (hash)
+            {
+                size += sizeof(struct bsp_hash_t) + hash->items_size * sizeof(struct bsp_hash_item_t) + hash->hash_size * (sizeof(uint8_t) + sizeof(uint32_t));
+                for (idx = 0; idx < hash->nitems_used; idx ++)
+                {
+                    item = &hash->items[idx];
+                    if (item->key)
+                    {
+                        size += sizeof(BSP_STRING) + STR_LEN(item->key) + sizeof(BSP_VALUE) + _value_size(item->value);
+                    }
+                }
+            }
+            break;
+        default :
+            break;
+    }
+
+    return size;
+}
+
+/* Entries */
+// Value moved into entry : string / object frozen, view taken as object. Container left to caller
+static BSP_MEMDB_ENTRY * _new_entry(const char *key, size_t key_len, uint32_t hash, BSP_VALUE *val, int ttl)
+{
+    BSP_MEMDB_ENTRY *entry = bsp_calloc(1, sizeof(BSP_MEMDB_ENTRY));
+    BSP_OBJECT *obj = NULL;
+    if (!entry)
+    {
+        return NULL;
+    }
+
+    entry->key = bsp_strndup(key, key_len);
+    if (!entry->key)
+    {
+        bsp_free(entry);
+
+        return NULL;
+    }
+
+    entry->key_len = key_len;
+    entry->hash = hash;
+    entry->expire = (ttl > 0) ? time(NULL) + ttl : 0;
+    memcpy(entry->val.lval, val->lval, sizeof(val->lval));
+    entry->val.type = val->type;
+    switch (val->type)
+    {
+        case BSP_VAL_STRING :
+            entry->val.rval = string_freeze((BSP_STRING *) val->rval);
+            break;
+        case BSP_VAL_OBJECT :
+            entry->val.rval = object_freeze((BSP_OBJECT *) val->rval);
+            break;
+        case BSP_VAL_VIEW :
+            // Data of view dies with its packet
+            obj = view_to_object((BSP_VIEW *) val->rval);
+            entry->val.rval = object_freeze(obj);
+            entry->val.type = (obj) ? BSP_VAL_OBJECT : BSP_VAL_NULL;
+            break;
+        default :
+            entry->val.rval = val->rval;
+            break;
+    }
+
+    // Payload belongs to entry now
+    val->rval = NULL;
+    val->type = BSP_VAL_UNKNOWN;
+    entry->size = sizeof(BSP_MEMDB_ENTRY) + key_len + 1 + _value_size(&entry->val);
+
+    return entry;
+}
+
+static void _del_entry(BSP_MEMDB_ENTRY *entry)
 {
-    BSP_VALUE *ret = object_get_value(memdb_base, key);
+    if (!entry)
+    {
+        return;
+    }
+
+    if (BSP_VAL_STRING == entry->val.type)
+    {
+        del_string((BSP_STRING *) entry->val.rval);
+    }
+    else if (BSP_VAL_OBJECT == entry->val.type)
+    {
+        del_object((BSP_OBJECT *) entry->val.rval);
+    }
+    bsp_free(entry->key);
+    bsp_free(entry);
+
+    return;
+}
+
+// Entries unlinked in lock are released after unlock
+static void _del_garbage(BSP_MEMDB_ENTRY *garbage)
+{
+    BSP_MEMDB_ENTRY *next = NULL;
+    while (garbage)
+    {
+        next = garbage->next;
+        _del_entry(garbage);
+        garbage = next;
+    }
+
+    return;
+}
+
+/* CLOCK ring */
+static void _ring_insert(struct bsp_memdb_shard_t *shard, BSP_MEMDB_ENTRY *entry)
+{
+    if (!shard->hand)
+    {
+        entry->prev = entry->succ = entry;
+        shard->hand = shard->scan = entry;
+    }
+    else
+    {
+        // Just behind hand, visited last
+        entry->succ = shard->hand;
+        entry->prev = shard->hand->prev;
+        shard->hand->prev->succ = entry;
+        shard->hand->prev = entry;
+    }
+
+    return;
+}
+
+static void _ring_remove(struct bsp_memdb_shard_t *shard, BSP_MEMDB_ENTRY *entry)
+{
+    if (entry->succ == entry)
+    {
+        shard->hand = shard->scan = NULL;
+    }
+    else
+    {
+        if (shard->hand == entry)
+        {
+            shard->hand = entry->succ;
+        }
+        if (shard->scan == entry)
+        {
+            shard->scan = entry->succ;
+        }
+        entry->prev->succ = entry->succ;
+        entry->succ->prev = entry->prev;
+    }
+    entry->prev = entry->succ = NULL;
+
+    return;
+}
+
+/* Shard (locked) */
+static BSP_MEMDB_ENTRY ** _shard_find(struct bsp_memdb_shard_t *shard, const char *key, size_t key_len, uint32_t hash)
+{
+    BSP_MEMDB_ENTRY **link = &shard->buckets[hash & (shard->size - 1)];
+    while (*link)
+    {
+        if ((*link)->hash == hash && (*link)->key_len == key_len && 0 == memcmp((*link)->key, key, key_len))
+        {
+            break;
+        }
+        link = &(*link)->next;
+    }
+
+    return link;
+}
+
+static void _shard_unlink(struct bsp_memdb_shard_t *shard, BSP_MEMDB_ENTRY **link, BSP_MEMDB_ENTRY **garbage)
+{
+    BSP_MEMDB_ENTRY *entry = *link;
+    *link = entry->next;
+    _ring_remove(shard, entry);
+    shard->nitems --;
+    shard->memory -= entry->size;
+    entry->next = *garbage;
+    *garbage = entry;
+
+    return;
+}
+
+// Link of live entry of key, or the empty end of its chain (an expired entry dropped first)
+static BSP_MEMDB_ENTRY ** _shard_lookup(struct bsp_memdb_shard_t *shard, const char *key, size_t key_len, uint32_t hash, time_t now, BSP_MEMDB_ENTRY **garbage)
+{
+    BSP_MEMDB_ENTRY **link = _shard_find(shard, key, key_len, hash);
+    if (*link && (*link)->expire > 0 && (*link)->expire <= now)
+    {
+        // Link points to the next entry (another key) after unlinking
+        _shard_unlink(shard, link, garbage);
+        link = _shard_find(shard, key, key_len, hash);
+    }
+
+    return link;
+}
+
+static void _shard_unlink_entry(struct bsp_memdb_shard_t *shard, BSP_MEMDB_ENTRY *entry, BSP_MEMDB_ENTRY **garbage)
+{
+    BSP_MEMDB_ENTRY **link = &shard->buckets[entry->hash & (shard->size - 1)];
+    while (*link && *link != entry)
+    {
+        link = &(*link)->next;
+    }
+
+    if (*link)
+    {
+        _shard_unlink(shard, link, garbage);
+    }
+
+    return;
+}
+
+static void _shard_rehash(struct bsp_memdb_shard_t *shard)
+{
+    size_t new_size = shard->size * 2, idx;
+    BSP_MEMDB_ENTRY **buckets = bsp_calloc(new_size, sizeof(BSP_MEMDB_ENTRY *));
+    BSP_MEMDB_ENTRY *entry = NULL, *next = NULL;
+    if (!buckets)
+    {
+        // Longer chains, still works
+        return;
+    }
+
+    for (idx = 0; idx < shard->size; idx ++)
+    {
+        entry = shard->buckets[idx];
+        while (entry)
+        {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (new_size - 1)];
+            buckets[entry->hash & (new_size - 1)] = entry;
+            entry = next;
+        }
+    }
+    bsp_free(shard->buckets);
+    shard->buckets = buckets;
+    shard->size = new_size;
+
+    return;
+}
+
+// Fresh entry takes the place of link (*link is the old one or NULL), then
+// CLOCK hand evicts until shard fits its budget again. Fresh entry is never evicted
+static void _shard_insert(struct bsp_memdb_shard_t *shard, BSP_MEMDB_ENTRY **link, BSP_MEMDB_ENTRY *fresh, BSP_MEMDB_ENTRY **garbage)
+{
+    BSP_MEMDB_ENTRY *entry = NULL;
+    if (*link)
+    {
+        _shard_unlink(shard, link, garbage);
+    }
+
+    fresh->version = __sync_add_and_fetch(&memdb_version, 1);
+    fresh->next = *link;
+    *link = fresh;
+    _ring_insert(shard, fresh);
+    shard->nitems ++;
+    shard->memory += fresh->size;
+    while (shard->memory > shard->limit && shard->hand)
+    {
+        entry = shard->hand;
+        if (entry == fresh || entry->referenced)
+        {
+            // Second chance
+            entry->referenced = 0;
+            shard->hand = entry->succ;
+        }
+        else
+        {
+            _shard_unlink_entry(shard, entry, garbage);
+        }
+    }
+
+    if (shard->nitems >= shard->size)
+    {
+        _shard_rehash(shard);
+    }
+
+    return;
+}
+
+/* Public */
+static int _memdb_put(const char *key, BSP_VALUE *val, int ttl, int cas, uint64_t version)
+{
+    if (!memdb_shards || !key || !val)
+    {
+        del_value(val);
+
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    size_t key_len = strlen(key);
+    uint32_t hash = bsp_hash(key, key_len);
+    struct bsp_memdb_shard_t *shard = &memdb_shards[hash >> (32 - MEMDB_SHARD_BITS)];
+    BSP_MEMDB_ENTRY *fresh = _new_entry(key, key_len, hash, val, ttl);
+    BSP_MEMDB_ENTRY *garbage = NULL, **link = NULL;
+    time_t now = time(NULL);
+    int ret = BSP_RTN_SUCCESS;
+    del_value(val);
+    if (!fresh)
+    {
+        return BSP_RTN_ERROR_MEMORY;
+    }
+
+    if (fresh->size > shard->limit)
+    {
+        trace_msg(TRACE_LEVEL_NOTICE, "MemDB  : Value of %s too large for cache", key);
+        _del_entry(fresh);
+
+        return BSP_RTN_ERROR_RESOURCE;
+    }
+
+    bsp_spin_lock(&shard->lock);
+    link = _shard_lookup(shard, key, key_len, hash, now, &garbage);
+    if (cas && ((*link) ? (*link)->version : 0) != version)
+    {
+        // Changed by others
+        fresh->next = garbage;
+        garbage = fresh;
+        ret = BSP_RTN_ERROR_GENERAL;
+    }
+    else
+    {
+        _shard_insert(shard, link, fresh, &garbage);
+    }
+    bsp_spin_unlock(&shard->lock);
+    _del_garbage(garbage);
+
+    return ret;
+}
+
+int memdb_set(const char *key, BSP_VALUE *val, int ttl)
+{
+    return _memdb_put(key, val, ttl, 0, 0);
+}
+
+int memdb_cas(const char *key, uint64_t version, BSP_VALUE *val, int ttl)
+{
+    return _memdb_put(key, val, ttl, 1, version);
+}
+
+BSP_VALUE * memdb_get(const char *key, uint64_t *version)
+{
+    if (!memdb_shards || !key)
+    {
+        return NULL;
+    }
+
+    size_t key_len = strlen(key);
+    uint32_t hash = bsp_hash(key, key_len);
+    struct bsp_memdb_shard_t *shard = &memdb_shards[hash >> (32 - MEMDB_SHARD_BITS)];
+    BSP_MEMDB_ENTRY *entry = NULL, *garbage = NULL, **link = NULL;
+    BSP_VALUE *ret = NULL;
+    bsp_spin_lock(&shard->lock);
+    link = _shard_lookup(shard, key, key_len, hash, time(NULL), &garbage);
+    entry = *link;
+
+    if (entry)
+    {
+        ret = new_value();
+        if (ret)
+        {
+            memcpy(ret->lval, entry->val.lval, sizeof(ret->lval));
+            ret->type = entry->val.type;
+            if (BSP_VAL_STRING == ret->type)
+            {
+                ret->rval = string_ref((BSP_STRING *) entry->val.rval);
+            }
+            else if (BSP_VAL_OBJECT == ret->type)
+            {
+                ret->rval = object_ref((BSP_OBJECT *) entry->val.rval);
+            }
+            else
+            {
+                ret->rval = entry->val.rval;
+            }
+            entry->referenced = 1;
+            if (version)
+            {
+                *version = entry->version;
+            }
+        }
+    }
+    bsp_spin_unlock(&shard->lock);
+    _del_garbage(garbage);
 
     return ret;
 }
+
+int memdb_del(const char *key)
+{
+    if (!memdb_shards || !key)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    size_t key_len = strlen(key);
+    uint32_t hash = bsp_hash(key, key_len);
+    struct bsp_memdb_shard_t *shard = &memdb_shards[hash >> (32 - MEMDB_SHARD_BITS)];
+    BSP_MEMDB_ENTRY *garbage = NULL, **link = NULL;
+    bsp_spin_lock(&shard->lock);
+    link = _shard_find(shard, key, key_len, hash);
+    if (*link)
+    {
+        _shard_unlink(shard, link, &garbage);
+    }
+    bsp_spin_unlock(&shard->lock);
+    _del_garbage(garbage);
+
+    return BSP_RTN_SUCCESS;
+}
+
+// Integer updated in place under lock, entry of a missing key made before locking
+int memdb_incr(const char *key, int64_t delta, int64_t *result)
+{
+    if (!memdb_shards || !key)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    size_t key_len = strlen(key);
+    uint32_t hash = bsp_hash(key, key_len);
+    struct bsp_memdb_shard_t *shard = &memdb_shards[hash >> (32 - MEMDB_SHARD_BITS)];
+    BSP_MEMDB_ENTRY *entry = NULL, *fresh = NULL, *garbage = NULL, **link = NULL;
+    BSP_VALUE init;
+    int64_t v = delta;
+    int ret = BSP_RTN_SUCCESS;
+    memset(&init, 0, sizeof(BSP_VALUE));
+    value_set_int(&init, delta);
+    fresh = _new_entry(key, key_len, hash, &init, 0);
+    if (!fresh)
+    {
+        return BSP_RTN_ERROR_MEMORY;
+    }
+
+    bsp_spin_lock(&shard->lock);
+    link = _shard_lookup(shard, key, key_len, hash, time(NULL), &garbage);
+    entry = *link;
+
+    if (!entry)
+    {
+        _shard_insert(shard, link, fresh, &garbage);
+        fresh = NULL;
+    }
+    else if (BSP_VAL_INT == entry->val.type || BSP_VAL_INT29 == entry->val.type)
+    {
+        v = value_get_int(&entry->val) + delta;
+        value_set_int(&entry->val, v);
+        entry->version = __sync_add_and_fetch(&memdb_version, 1);
+        entry->referenced = 1;
+    }
+    else
+    {
+        // Not a number
+        ret = BSP_RTN_ERROR_GENERAL;
+    }
+    bsp_spin_unlock(&shard->lock);
+    _del_garbage(garbage);
+    _del_entry(fresh);
+    if (BSP_RTN_SUCCESS == ret && result)
+    {
+        *result = v;
+    }
+
+    return ret;
+}
+
+// A few entries of each shard checked by one call, the rest by next ticks
+void memdb_expire()
+{
+    if (!memdb_shards)
+    {
+        return;
+    }
+
+    struct bsp_memdb_shard_t *shard = NULL;
+    BSP_MEMDB_ENTRY *entry = NULL, *garbage = NULL;
+    time_t now = time(NULL);
+    int i, n;
+    for (i = 0; i < MEMDB_SHARDS; i ++)
+    {
+        shard = &memdb_shards[i];
+        bsp_spin_lock(&shard->lock);
+        for (n = 0; n < MEMDB_EXPIRE_STEP && shard->scan; n ++)
+        {
+            entry = shard->scan;
+            if (entry->expire > 0 && entry->expire <= now)
+            {
+                // Scan moves on by itself
+                _shard_unlink_entry(shard, entry, &garbage);
+            }
+            else
+            {
+                shard->scan = entry->succ;
+            }
+        }
+        bsp_spin_unlock(&shard->lock);
+    }
+    _del_garbage(garbage);
+
+    return;
+}
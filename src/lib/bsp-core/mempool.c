@@ -22,11 +22,14 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 08/23/2012
+ * @update 12/06/2014
  * @changelog
  *      [06/07/2012] - Creation
  *      [08/23/2012] - mempool_strdup added
  *      [07/09/2013] - Dissociative bug fixed / free_item_link re-generated
+ *      [12/04/2014] - Thread magazines, slab lock only taken by batch
+ *      [12/05/2014] - Constant time size class, headerless small items
+ *      [12/06/2014] - Free blocks trimmed, realloc shrinks
  */
 
 #include "bsp.h"
@@ -34,19 +37,27 @@
 #ifdef ENABLE_MEMPOOL
 
 BSP_MEMPOOL *pool = NULL;
+static pthread_key_t cache_key;
+// Three classes in each power of two : 1, 1.25, 1.5 (all 8 bytes aligned)
 size_t slab_size[SLAB_MAX] = {
-    32,     40,     50,     64,     80,     100, 
-    128,    160,    200,    256,    320,    400, 
-    512,    640,    800,    1024,   1280,   1600, 
-    2048,   2560,   3200,   4096,   5120,   6400, 
-    8192,   10240,  12800,  16384,  20480,  25600, 
-    32768,  40960,  51200,  65536,  81920,  102400, 
-    131072, 163840, 204800, 262144, 327680, 409600, 
-    524288, 655360, 819200, 1048576,1310720,1638400, 
-    2097152,2621440,3276800,4194304,5242880,6553600, 
+    32,     40,     48,     64,     80,     96, 
+    128,    160,    192,    256,    320,    384, 
+    512,    640,    768,    1024,   1280,   1536, 
+    2048,   2560,   3072,   4096,   5120,   6144, 
+    8192,   10240,  12288,  16384,  20480,  24576, 
+    32768,  40960,  49152,  65536,  81920,  98304, 
+    131072, 163840, 196608, 262144, 327680, 393216, 
+    524288, 655360, 786432, 1048576,1310720,1572864, 
+    2097152,2621440,3145728,4194304,5242880,6291456, 
     8388608
 };
 
+// Class offset in the power of two, by the top two bits under the highest one
+static const int slab_step[4] = {1, 2, 3, 3};
+
+// Span (64KB) of slab blocks -> block, two levels radix map over 48 bits address
+static struct bsp_mempool_block_t **span_map[1 << (48 - SPAN_SHIFT - SPAN_MAP_BITS)];
+
 size_t slab_nitems[SLAB_MAX] = {
     131072, 131072, 131072, 131072, 131072, 131072, 
     65536,  65536,  65536,  32768,  32768,  32768, 
@@ -60,6 +71,257 @@ size_t slab_nitems[SLAB_MAX] = {
     8
 };
 
+static void * _pop_next_free_item(struct bsp_mempool_slab_t *slab);
+
+// Block of a slab item, NULL for huge block
+static inline struct bsp_mempool_block_t * _span_block(void *addr)
+{
+    uintptr_t span = (uintptr_t) addr >> SPAN_SHIFT;
+    struct bsp_mempool_block_t **leaf = NULL;
+    if (span >> (48 - SPAN_SHIFT))
+    {
+        return NULL;
+    }
+
+    leaf = span_map[span >> SPAN_MAP_BITS];
+
+    return (leaf) ? leaf[span & ((1 << SPAN_MAP_BITS) - 1)] : NULL;
+}
+
+// Set (NULL to clear) all spans of a block
+static int _set_span_block(void *data, size_t size, struct bsp_mempool_block_t *block)
+{
+    uintptr_t span = (uintptr_t) data >> SPAN_SHIFT;
+    uintptr_t end = ((uintptr_t) data + size - 1) >> SPAN_SHIFT;
+    struct bsp_mempool_block_t **leaf = NULL;
+    if (end >> (48 - SPAN_SHIFT))
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    for (; span <= end; span ++)
+    {
+        leaf = span_map[span >> SPAN_MAP_BITS];
+        if (!leaf)
+        {
+            leaf = calloc(1 << SPAN_MAP_BITS, sizeof(struct bsp_mempool_block_t *));
+            if (!leaf)
+            {
+                return BSP_RTN_ERROR_MEMORY;
+            }
+
+            if (!__sync_bool_compare_and_swap(&span_map[span >> SPAN_MAP_BITS], NULL, leaf))
+            {
+                // Set by another slab
+                free(leaf);
+                leaf = span_map[span >> SPAN_MAP_BITS];
+            }
+        }
+        leaf[span & ((1 << SPAN_MAP_BITS) - 1)] = block;
+    }
+
+    return BSP_RTN_SUCCESS;
+}
+
+// Block data covers whole spans (large pages if enabled), never shares a span with others
+static struct bsp_mempool_block_t * _new_block(struct bsp_mempool_slab_t *slab)
+{
+    int slab_id = slab->slab_id;
+    size_t align = get_large_page_size();
+    struct bsp_mempool_block_t *block = calloc(1, sizeof(struct bsp_mempool_block_t));
+    if (!block)
+    {
+        return NULL;
+    }
+
+    if (align < (1 << SPAN_SHIFT))
+    {
+        align = 1 << SPAN_SHIFT;
+    }
+
+    if (0 != posix_memalign(&block->data, align, BLOCK_SPACE(slab_id)))
+    {
+        free(block);
+        return NULL;
+    }
+
+    if (BSP_RTN_SUCCESS != _set_span_block(block->data, BLOCK_SPACE(slab_id), block))
+    {
+        free(block->data);
+        free(block);
+        return NULL;
+    }
+    advise_large_pages(block->data, BLOCK_SPACE(slab_id));
+    block->slab = slab;
+    block->next = slab->blocks;
+    slab->blocks = block;
+
+    return block;
+}
+
+// Push a chain (head ... tail) to remote free list of slab, no lock
+static void _push_remote_free(struct bsp_mempool_slab_t *slab, void *head, void *tail, size_t n)
+{
+    void *old = NULL, *curr;
+    set_pointer(old, tail);
+    while (old != (curr = __sync_val_compare_and_swap(&slab->remote_free, old, head)))
+    {
+        old = curr;
+        set_pointer(old, tail);
+    }
+    __sync_add_and_fetch(&slab->nfree, n);
+
+    return;
+}
+
+// Take one item under slab lock, remote freed items merged first when free list runs out
+static void * _take_item(struct bsp_mempool_slab_t *slab)
+{
+    int slab_id = slab->slab_id;
+    void *ret = NULL;
+    if (!slab->next_free_item)
+    {
+        slab->next_free_item = __sync_lock_test_and_set(&slab->remote_free, NULL);
+    }
+
+    if (slab->next_free_item)
+    {
+        // Recycled item
+        __sync_sub_and_fetch(&slab->nfree, 1);
+
+        return _pop_next_free_item(slab);
+    }
+
+    if (!slab->curr_block || slab->curr_block_alloced >= slab_nitems[slab_id])
+    {
+        // Need new block
+        struct bsp_mempool_block_t *block = _new_block(slab);
+        if (!block)
+        {
+            return NULL;
+        }
+        slab->curr_block = block;
+        slab->curr_block_alloced = 0;
+        status_op_mempool(slab_id, STATUS_OP_MEMPOOL_BLOCK, BLOCK_SPACE(slab_id));
+        status_op_mempool(slab_id, STATUS_OP_MEMPOOL_ITEM, slab_nitems[slab_id]);
+        trace_msg(TRACE_LEVEL_VERBOSE, "Memory : Allocated a new memory block to slab %d.", slab_id);
+    }
+    ret = slab->curr_block->data + (slab->curr_block_alloced ++) * ITEM_STRIDE(slab_id);
+
+    return ret;
+}
+
+// Counters of magazine reported by batch
+static void _report_magazine(int slab_id, struct bsp_mempool_magazine_t *mag)
+{
+    if (mag->nalloc)
+    {
+        status_op_mempool(slab_id, STATUS_OP_MEMPOOL_ALLOC, mag->nalloc);
+        mag->nalloc = 0;
+    }
+
+    if (mag->nfree)
+    {
+        status_op_mempool(slab_id, STATUS_OP_MEMPOOL_FREE, mag->nfree);
+        mag->nfree = 0;
+    }
+
+    return;
+}
+
+// Fill half of magazine with one lock of slab
+static void _refill_magazine(struct bsp_mempool_slab_t *slab, struct bsp_mempool_magazine_t *mag)
+{
+    void *item;
+    bsp_spin_lock(&slab->slab_lock);
+    while (mag->nitems < mag->size / 2 + 1)
+    {
+        item = _take_item(slab);
+        if (!item)
+        {
+            break;
+        }
+        mag->items[mag->nitems ++] = item;
+    }
+    bsp_spin_unlock(&slab->slab_lock);
+    _report_magazine(slab->slab_id, mag);
+
+    return;
+}
+
+// Give n items of magazine back to slab as one chain, no lock
+static void _flush_magazine(struct bsp_mempool_slab_t *slab, struct bsp_mempool_magazine_t *mag, size_t n)
+{
+    size_t i;
+    void *head, *tail;
+    if (!n || n > mag->nitems)
+    {
+        return;
+    }
+
+    tail = mag->items[mag->nitems - n];
+    head = tail;
+    for (i = mag->nitems - n + 1; i < mag->nitems; i ++)
+    {
+        set_pointer(head, mag->items[i]);
+        head = mag->items[i];
+    }
+    mag->nitems -= n;
+    _push_remote_free(slab, head, tail, n);
+    _report_magazine(slab->slab_id, mag);
+
+    return;
+}
+
+// Thread exit, cached items go back
+static void _del_cache(void *data)
+{
+    struct bsp_mempool_cache_t *cache = (struct bsp_mempool_cache_t *) data;
+    int i;
+    if (cache && pool)
+    {
+        for (i = 0; i < SLAB_MAX; i ++)
+        {
+            _flush_magazine(&pool->slab_list[i], &cache->mag[i], cache->mag[i].nitems);
+            _report_magazine(i, &cache->mag[i]);
+        }
+        free(cache);
+    }
+
+    return;
+}
+
+// Magazines of current thread, created by first allocation.
+// Large slabs have small (or no) magazine
+static struct bsp_mempool_cache_t * _get_cache(int create)
+{
+    struct bsp_mempool_cache_t *cache = pthread_getspecific(cache_key);
+    int i;
+    if (!cache && create)
+    {
+        // Never from mempool itself
+        cache = calloc(1, sizeof(struct bsp_mempool_cache_t));
+        if (cache)
+        {
+            for (i = 0; i < SLAB_MAX; i ++)
+            {
+                cache->mag[i].size = MAGAZINE_SPACE / slab_size[i];
+                if (cache->mag[i].size > MAGAZINE_SIZE)
+                {
+                    cache->mag[i].size = MAGAZINE_SIZE;
+                }
+                else if (cache->mag[i].size < 2)
+                {
+                    cache->mag[i].size = 0;
+                }
+            }
+            pthread_setspecific(cache_key, cache);
+        }
+    }
+
+    return cache;
+}
+
 // Initialize memory pool
 int mempool_init()
 {
@@ -69,6 +331,7 @@ int mempool_init()
         _exit(BSP_RTN_ERROR_MEMORY);
     }
     bsp_spin_init(&pool->lock);
+    pthread_key_create(&cache_key, _del_cache);
     
     int i;
     for (i = 0; i < SLAB_MAX; i ++)
@@ -82,20 +345,6 @@ int mempool_init()
     return BSP_RTN_SUCCESS;
 }
 
-static void _mempool_free_item(void *addr, struct bsp_mempool_slab_t *slab)
-{
-    if (!addr || !pool || !slab)
-    {
-        return;
-    }
-    
-    // Recycle to free link
-    set_pointer(slab->next_free_item, addr);
-    slab->next_free_item = addr;
-    
-    return;
-}
-
 static void * _pop_next_free_item(struct bsp_mempool_slab_t *slab)
 {
     void *ret = slab->next_free_item;
@@ -107,25 +356,23 @@ static void * _pop_next_free_item(struct bsp_mempool_slab_t *slab)
     return ret;
 }
 
-// Calculate the slab id by given size
-static int _get_slab_id(int nsize)
+// Slab id by given size : highest bit gives the power of two, next two bits the class in it
+static int _get_slab_id(size_t nsize)
 {
-    int slab_id = 0;
-    if (nsize > slab_size[SLAB_MAX - 1])
+    if (nsize <= slab_size[0])
     {
-        return -1;
+        return 0;
     }
-    
-    // Slab item size = 1.25 * 1.25 * 1.28 * 1.25 * 1.25 * 1.28 ...
-    for (slab_id = 0; slab_id < SLAB_MAX; slab_id ++)
+
+    if (nsize > slab_size[SLAB_MAX - 1])
     {
-        if (slab_size[slab_id] >= nsize)
-        {
-            break;
-        }
+        return -1;
     }
-    
-    return slab_id;
+
+    size_t n = nsize - 1;
+    int high = (int) (sizeof(unsigned long long) * 8 - 1) - __builtin_clzll((unsigned long long) n);
+
+    return (high - SLAB_MIN_SHIFT) * 3 + slab_step[(n >> (high - 2)) & 0x3];
 }
 
 // Get Item size by given slab ID
@@ -134,6 +381,22 @@ static size_t _get_slab_item_size(int slab_id)
     return (slab_id < SLAB_MAX && slab_id >= 0) ? slab_size[slab_id] : 0;
 }
 
+// Slab (NULL for huge block) and start address of an allocated pointer
+static inline struct bsp_mempool_slab_t * _get_item_slab(void *addr, void **ori_addr)
+{
+    struct bsp_mempool_block_t *block = _span_block(addr);
+    if (block && block->slab->slab_id < SLAB_SMALL_MAX)
+    {
+        // Headerless
+        *ori_addr = addr;
+
+        return block->slab;
+    }
+    *ori_addr = addr - 8;
+
+    return (block) ? block->slab : NULL;
+}
+
 // Fetch space from pool
 void * mempool_alloc(size_t nsize)
 {
@@ -156,47 +419,51 @@ void * mempool_alloc(size_t nsize)
     {
         // A huge item, Simply alloc one block for this
         ret = malloc(osize);
-        bsp_spin_lock(&pool->lock);
         status_op_mempool(slab_id, STATUS_OP_MEMPOOL_HUGE_ALLOC, osize);
-        bsp_spin_unlock(&pool->lock);
         trace_msg(TRACE_LEVEL_VERBOSE, "Memory : Alloc a big memory block, size %lld", (long long int) nsize);
     }
     else
     {
         slab = &pool->slab_list[slab_id];
-        bsp_spin_lock(&slab->slab_lock);
-        if (slab->next_free_item)
+        struct bsp_mempool_cache_t *cache = _get_cache(1);
+        struct bsp_mempool_magazine_t *mag = (cache) ? &cache->mag[slab_id] : NULL;
+        if (mag && mag->size > 0)
         {
-            // Recycled item
-            ret = _pop_next_free_item(slab);
+            // Lock free
+            if (!mag->nitems)
+            {
+                _refill_magazine(slab, mag);
+            }
+            if (mag->nitems)
+            {
+                ret = mag->items[-- mag->nitems];
+                mag->nalloc ++;
+            }
         }
         else
         {
-            if (!slab->curr_block || slab->curr_block_alloced >= slab_nitems[slab_id])
+            bsp_spin_lock(&slab->slab_lock);
+            ret = _take_item(slab);
+            bsp_spin_unlock(&slab->slab_lock);
+            if (ret)
             {
-                // Need new block
-                void *block = malloc(BLOCK_SIZE(slab_id));
-                if (!block)
-                {
-                    bsp_spin_unlock(&slab->slab_lock);
-                    trigger_exit(BSP_RTN_FATAL, "Memory : Allocate memory block error!!!");
-                    return NULL;
-                }
-                slab->curr_block = block;
-                slab->curr_block_alloced = 0;
-                status_op_mempool(slab_id, STATUS_OP_MEMPOOL_BLOCK, BLOCK_SIZE(slab_id));
-                status_op_mempool(slab_id, STATUS_OP_MEMPOOL_ITEM, slab_nitems[slab_id]);
-                trace_msg(TRACE_LEVEL_VERBOSE, "Memory : Allocated a new memory block to slab %d.", slab_id);
+                status_op_mempool(slab_id, STATUS_OP_MEMPOOL_ALLOC, 1);
             }
-            
-            ret = slab->curr_block + (slab->curr_block_alloced ++) * (slab_size[slab_id] + 8);
         }
-        status_op_mempool(slab_id, STATUS_OP_MEMPOOL_ALLOC, 0);
-        bsp_spin_unlock(&slab->slab_lock);
+
+        if (!ret)
+        {
+            trigger_exit(BSP_RTN_FATAL, "Memory : Allocate memory block error!!!");
+            return NULL;
+        }
     }
 
     if (ret)
     {
+        if (slab_id >= 0 && slab_id < SLAB_SMALL_MAX)
+        {
+            return ret;
+        }
         set_pointer((void *) slab, ret);
         return ret + 8;
     }
@@ -228,9 +495,9 @@ void * mempool_realloc(void *addr, size_t nsize)
         return mempool_alloc(nsize);
     }
     
-    void *old_addr = addr - 8;
+    void *old_addr = NULL;
     void *new_addr = NULL;
-    struct bsp_mempool_slab_t *slab = get_pointer(old_addr);
+    struct bsp_mempool_slab_t *slab = _get_item_slab(addr, &old_addr);
     if (!slab)
     {
         // Huge block
@@ -238,11 +505,23 @@ void * mempool_realloc(void *addr, size_t nsize)
         return (new_addr) ? new_addr + 8 : NULL;
     }
     size_t slab_item_size = _get_slab_item_size(slab->slab_id);
-    if (nsize <= slab_item_size)
+    if (nsize <= slab_item_size && (nsize > slab_item_size / 2 || nsize <= slab_size[0]))
     {
         // Needn't move data, just return the same addr
         return addr;
     }
+    else if (nsize <= slab_item_size)
+    {
+        // Shrink to a smaller slab
+        new_addr = mempool_alloc(nsize);
+        if (new_addr)
+        {
+            memcpy(new_addr, addr, nsize);
+            mempool_free(addr);
+        }
+
+        return new_addr;
+    }
     else
     {
         // Move data to a new slab
@@ -305,8 +584,8 @@ size_t mempool_alloc_usable_size(void *addr)
         return 0;
     }
     
-    void *oaddr = addr - 8;
-    struct bsp_mempool_slab_t *slab = get_pointer(oaddr);
+    void *oaddr = NULL;
+    struct bsp_mempool_slab_t *slab = _get_item_slab(addr, &oaddr);
     if (!slab)
     {
         // Huge block
@@ -324,14 +603,12 @@ int mempool_free(void *addr)
         return BSP_RTN_ERROR_GENERAL;
     }
     
-    void *ori_addr = addr - 8;
-    struct bsp_mempool_slab_t *slab = get_pointer(ori_addr);
+    void *ori_addr = NULL;
+    struct bsp_mempool_slab_t *slab = _get_item_slab(addr, &ori_addr);
     if (!slab)
     {
         // Huge block
-        bsp_spin_lock(&pool->lock);
         status_op_mempool(0, STATUS_OP_MEMPOOL_HUGE_FREE, malloc_usable_size(ori_addr));
-        bsp_spin_unlock(&pool->lock);
         free(ori_addr);
     }
     else
@@ -344,14 +621,145 @@ int mempool_free(void *addr)
         }
         else
         {
-            bsp_spin_lock(&slab->slab_lock);
-            _mempool_free_item(ori_addr, slab);
-            status_op_mempool(slab->slab_id, STATUS_OP_MEMPOOL_FREE, 0);
-            bsp_spin_unlock(&slab->slab_lock);
+            struct bsp_mempool_cache_t *cache = _get_cache(0);
+            struct bsp_mempool_magazine_t *mag = (cache) ? &cache->mag[slab->slab_id] : NULL;
+            if (mag && mag->size > 0)
+            {
+                if (mag->nitems >= mag->size)
+                {
+                    _flush_magazine(slab, mag, mag->size / 2);
+                }
+                mag->items[mag->nitems ++] = ori_addr;
+                mag->nfree ++;
+            }
+            else
+            {
+                // Thread without magazine (or item too large for it)
+                _push_remote_free(slab, ori_addr, ori_addr, 1);
+                status_op_mempool(slab->slab_id, STATUS_OP_MEMPOOL_FREE, 1);
+            }
         }
     }
     
     return BSP_RTN_SUCCESS;
 }
 
+// Blocks (except current one) whose items all in free list of slab.
+// Free list is walked under slab lock, only when there may be a whole free block
+static size_t _trim_slab(struct bsp_mempool_slab_t *slab)
+{
+    int slab_id = slab->slab_id;
+    struct bsp_mempool_block_t *block, **prev, *released = NULL;
+    void *item, *next, *remote, *head = NULL, *tail = NULL;
+    size_t nreleased = 0, nremoved = 0;
+    if (__sync_add_and_fetch(&slab->nfree, 0) < slab_nitems[slab_id])
+    {
+        return 0;
+    }
+
+    bsp_spin_lock(&slab->slab_lock);
+    // Remote freed items merged
+    remote = __sync_lock_test_and_set(&slab->remote_free, NULL);
+    while (remote)
+    {
+        next = get_pointer(remote);
+        set_pointer(slab->next_free_item, remote);
+        slab->next_free_item = remote;
+        remote = next;
+    }
+
+    for (block = slab->blocks; block; block = block->next)
+    {
+        block->nfree = 0;
+    }
+
+    for (item = slab->next_free_item; item; item = get_pointer(item))
+    {
+        _span_block(item)->nfree ++;
+    }
+
+    prev = &slab->blocks;
+    while ((block = *prev))
+    {
+        if (block != slab->curr_block && block->nfree >= slab_nitems[slab_id])
+        {
+            *prev = block->next;
+            block->next = released;
+            released = block;
+            nreleased ++;
+        }
+        else
+        {
+            prev = &block->next;
+        }
+    }
+
+    if (released)
+    {
+        // Rebuild free list without items of released blocks
+        for (item = slab->next_free_item; item; item = next)
+        {
+            next = get_pointer(item);
+            block = _span_block(item);
+            if (block != slab->curr_block && block->nfree >= slab_nitems[slab_id])
+            {
+                nremoved ++;
+                continue;
+            }
+
+            if (tail)
+            {
+                set_pointer(item, tail);
+            }
+            else
+            {
+                head = item;
+            }
+            tail = item;
+        }
+
+        if (tail)
+        {
+            set_pointer(NULL, tail);
+        }
+        slab->next_free_item = head;
+        __sync_sub_and_fetch(&slab->nfree, nremoved);
+    }
+    bsp_spin_unlock(&slab->slab_lock);
+
+    while (released)
+    {
+        block = released;
+        released = block->next;
+        _set_span_block(block->data, BLOCK_SPACE(slab_id), NULL);
+        free(block->data);
+        free(block);
+        status_op_mempool(slab_id, STATUS_OP_MEMPOOL_BLOCK_FREE, BLOCK_SPACE(slab_id));
+    }
+
+    if (nreleased)
+    {
+        trace_msg(TRACE_LEVEL_VERBOSE, "Memory : %d free blocks of slab %d released", (int) nreleased, slab_id);
+    }
+
+    return nreleased;
+}
+
+size_t mempool_trim()
+{
+    size_t ret = 0;
+    int i;
+    if (!pool)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < SLAB_MAX; i ++)
+    {
+        ret += _trim_slab(&pool->slab_list[i]);
+    }
+
+    return ret;
+}
+
 #endif
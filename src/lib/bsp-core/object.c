@@ -22,7 +22,7 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 05/21/2013
+ * @update 12/17/2014
  * @changelog 
  *      [06/11/2012] - Creation
  *      [08/14/2012] - Float / Double byte order
@@ -30,10 +30,23 @@
  *      [05/21/2013] - Remove float / double byte-order reverse
  *      [12/17/2013] - Lightuserdata supported
  *      [08/05/2014] - Rebuild
+ *      [11/24/2014] - Unserialize by view
+ *      [11/29/2014] - Arena objects
+ *      [11/30/2014] - Open addressing hash
+ *      [12/01/2014] - Contiguous array storage
+ *      [12/02/2014] - Atom keys
+ *      [12/03/2014] - Frozen (refcounted) objects
+ *      [12/07/2014] - Values from freelist
+ *      [12/08/2014] - Serialized into local string
+ *      [12/17/2014] - Single value to / from LUA stack
  */
 
 #include "bsp.h"
 
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
 /* Set values */
 /*
 void set_item_int8(BSP_VALUE *val, const int8_t value)
@@ -167,6 +180,18 @@ void value_set_object(BSP_VALUE *val, BSP_OBJECT *obj)
     return;
 }
 
+// View is not owned by value, caller must keep it alive
+void value_set_view(BSP_VALUE *val, BSP_VIEW *view)
+{
+    if (val && view)
+    {
+        val->rval = (void *) view;
+        val->type = BSP_VAL_VIEW;
+    }
+
+    return;
+}
+
 void value_set_null(BSP_VALUE *val)
 {
     if (val)
@@ -214,7 +239,7 @@ float value_get_float(BSP_VALUE *val)
     float ret = 0.0;
     if (val && BSP_VAL_FLOAT == val->type)
     {
-        ret = get_float(val->rval);
+        ret = get_float(val->lval);
     }
 
     return ret;
@@ -225,7 +250,7 @@ double value_get_double(BSP_VALUE *val)
     double ret = 0.0;
     if (val && BSP_VAL_DOUBLE == val->type)
     {
-        ret = get_double(val->rval);
+        ret = get_double(val->lval);
     }
 
     return ret;
@@ -264,19 +289,95 @@ BSP_OBJECT * value_get_object(BSP_VALUE *val)
     return ret;
 }
 
+BSP_VIEW * value_get_view(BSP_VALUE *val)
+{
+    BSP_VIEW *ret = NULL;
+    if (val && BSP_VAL_VIEW == val->type)
+    {
+        ret = (BSP_VIEW *) val->rval;
+    }
+
+    return ret;
+}
+
 /* Object & Value */
+// Internal memory of an object comes from where the object lives
+static inline void * _object_calloc(BSP_ARENA *arena, size_t nmemb, size_t size)
+{
+    return (arena) ? arena_calloc(arena, nmemb, size) : bsp_calloc(nmemb, size);
+}
+
+static inline void _object_free(BSP_ARENA *arena, void *ptr)
+{
+    if (!arena && ptr)
+    {
+        bsp_free(ptr);
+    }
+
+    return;
+}
+
+// Frozen object never changes, readers go without lock
+static inline void _object_lock(BSP_OBJECT *obj)
+{
+    if (!obj->is_frozen)
+    {
+        bsp_spin_lock(&obj->lock);
+    }
+
+    return;
+}
+
+static inline void _object_unlock(BSP_OBJECT *obj)
+{
+    if (!obj->is_frozen)
+    {
+        bsp_spin_unlock(&obj->lock);
+    }
+
+    return;
+}
+
 BSP_OBJECT * new_object(char type)
 {
-    BSP_OBJECT *obj = bsp_calloc(1, sizeof(BSP_OBJECT));
+    BSP_ARENA *arena = curr_arena();
+    BSP_OBJECT *obj = _object_calloc(arena, 1, sizeof(BSP_OBJECT));
     if (obj)
     {
         obj->type = type;
+        obj->arena = arena;
         bsp_spin_init(&obj->lock);
     }
 
     return obj;
 }
 
+// Release payload of value, the value itself left unset
+static void _clear_value(BSP_VALUE *val)
+{
+    if (BSP_VAL_POINTER == val->type || BSP_VAL_VIEW == val->type)
+    {
+        // Just ignore, we cannot determine what you are
+    }
+    else if (BSP_VAL_STRING == val->type)
+    {
+        del_string((BSP_STRING *) val->rval);
+    }
+    else if (BSP_VAL_OBJECT == val->type)
+    {
+        del_object((BSP_OBJECT *) val->rval);
+    }
+    else
+    {
+        // Local value, Just free
+    }
+    val->rval = NULL;
+    val->type = BSP_VAL_UNKNOWN;
+
+    return;
+}
+
+// Arena memory is not given back here, but heap data hanging on the object is
 void del_object(BSP_OBJECT *obj)
 {
     if (!obj)
@@ -284,12 +385,18 @@ void del_object(BSP_OBJECT *obj)
         return;
     }
 
+    if (obj->is_frozen && __sync_sub_and_fetch(&obj->refcount, 1) > 0)
+    {
+        // Still referred by others
+        return;
+    }
+
     BSP_VALUE *val = NULL;
     struct bsp_array_t *array = NULL;
     struct bsp_hash_t *hash = NULL;
-    struct bsp_hash_item_t *item = NULL, *old = NULL;
-    size_t idx, bucket, seq;
-    bsp_spin_lock(&obj->lock);
+    struct bsp_hash_item_t *item = NULL;
+    size_t idx;
+    _object_lock(obj);
     switch (obj->type)
     {
         case OBJECT_TYPE_SINGLE : 
@@ -302,71 +409,428 @@ void del_object(BSP_OBJECT *obj)
             {
                 for (idx = 0; idx < array->nitems; idx ++)
                 {
-                    bucket = (idx / ARRAY_BUCKET_SIZE);
-                    seq = idx % ARRAY_BUCKET_SIZE;
-                    if (bucket < array->nbuckets && array->items[bucket])
-                    {
-                        val = array->items[bucket][seq];
-                        del_value(val);
-                    }
+                    _clear_value(&array->items[idx]);
                 }
-                bsp_free(array);
+                _object_free(obj->arena, array->items);
+                _object_free(obj->arena, array);
             }
             break;
         case OBJECT_TYPE_HASH : 
             hash = (struct bsp_hash_t *) obj->node;
             if (hash)
             {
-                item = hash->head;
-                while (item)
+                for (idx = 0; idx < hash->nitems_used; idx ++)
                 {
-                    del_string(item->key);
-                    del_value(item->value);
-                    old = item;
-                    item = old->lnext;
-                    bsp_free(old);
+                    item = &hash->items[idx];
+                    if (item->key)
+                    {
+                        del_string(item->key);
+                        del_value(item->value);
+                    }
                 }
-                bsp_free(hash);
+                _object_free(obj->arena, hash->items);
+                _object_free(obj->arena, hash->ctrl);
+                _object_free(obj->arena, hash);
             }
             break;
         case OBJECT_TYPE_UNDETERMINED : 
         default : 
             break;
     }
-    bsp_spin_unlock(&obj->lock);
-    bsp_free(obj);
+    _object_unlock(obj);
+    _object_free(obj->arena, obj);
 
     return;
 }
 
 BSP_VALUE * new_value()
 {
-    return (BSP_VALUE *) bsp_calloc(1, sizeof(BSP_VALUE));
+    BSP_ARENA *arena = curr_arena();
+    BSP_VALUE *val = (arena) ? arena_calloc(arena, 1, sizeof(BSP_VALUE)) : freelist_alloc(&freelist_value);
+    if (val && arena)
+    {
+        val->in_arena = 1;
+    }
+
+    return val;
 }
 
 void del_value(BSP_VALUE *val)
 {
     if (val)
     {
-        if (BSP_VAL_POINTER == val->type)
+        _clear_value(val);
+        if (!val->in_arena)
         {
-            // Just ignore, we cannot determine what you are
+            freelist_free(&freelist_value, val);
         }
-        else if (BSP_VAL_STRING == val->type)
+    }
+
+    return;
+}
+
+/* Promote */
+static BSP_OBJECT * _copy_object(BSP_OBJECT *obj);
+
+// View of an event packet dies with the event, take it as an object
+static BSP_VALUE * _copy_value(BSP_VALUE *val)
+{
+    if (!val)
+    {
+        return NULL;
+    }
+
+    BSP_VALUE *ret = new_value();
+    if (ret)
+    {
+        memcpy(ret->lval, val->lval, sizeof(val->lval));
+        ret->rval = val->rval;
+        ret->type = val->type;
+        if (BSP_VAL_STRING == val->type)
         {
-            del_string((BSP_STRING *) val->rval);
+            ret->rval = (void *) clone_string((BSP_STRING *) val->rval);
         }
         else if (BSP_VAL_OBJECT == val->type)
         {
-            del_object((BSP_OBJECT *) val->rval);
+            ret->rval = (void *) _copy_object((BSP_OBJECT *) val->rval);
         }
-        else
+        else if (BSP_VAL_VIEW == val->type)
         {
-            // Local value, Just free
+            ret->rval = (void *) view_to_object((BSP_VIEW *) val->rval);
+            ret->type = BSP_VAL_OBJECT;
         }
     }
 
-    return bsp_free(val);
+    return ret;
+}
+
+static BSP_OBJECT * _copy_items(BSP_OBJECT *obj)
+{
+    if (!obj)
+    {
+        return NULL;
+    }
+
+    BSP_OBJECT *ret = new_object(obj->type);
+    struct bsp_array_t *array = NULL;
+    struct bsp_hash_t *hash = NULL;
+    struct bsp_hash_item_t *item = NULL;
+    BSP_VALUE *val = NULL;
+    size_t idx;
+    if (!ret)
+    {
+        return NULL;
+    }
+
+    _object_lock(obj);
+    switch (obj->type)
+    {
+        case OBJECT_TYPE_SINGLE : 
+            val = _copy_value((BSP_VALUE *) obj->node);
+            if (val)
+            {
+                object_set_single(ret, val);
+            }
+            break;
+        case OBJECT_TYPE_ARRAY : 
+            array = (struct bsp_array_t *) obj->node;
+            if (array)
+            {
+                object_array_reserve(ret, array->nitems);
+            }
+            for (idx = 0; array && idx < array->nitems; idx ++)
+            {
+                val = ARRAY_ITEM(array, idx);
+                if (val)
+                {
+                    object_set_array(ret, idx, _copy_value(val));
+                }
+            }
+            break;
+        case OBJECT_TYPE_HASH : 
+            hash = (struct bsp_hash_t *) obj->node;
+            for (idx = 0; hash && idx < hash->nitems_used; idx ++)
+            {
+                item = &hash->items[idx];
+                if (item->key)
+                {
+                    object_set_hash(ret, clone_string(item->key), _copy_value(item->value));
+                }
+            }
+            break;
+        default : 
+            break;
+    }
+    _object_unlock(obj);
+
+    return ret;
+}
+
+// Frozen object is shared instead
+static BSP_OBJECT * _copy_object(BSP_OBJECT *obj)
+{
+    if (obj && obj->is_frozen)
+    {
+        return object_ref(obj);
+    }
+
+    return _copy_items(obj);
+}
+
+// Deep copy of an arena object, the original one is not changed (and still goes with the arena)
+BSP_OBJECT * object_promote(BSP_OBJECT *obj)
+{
+    if (!obj || !obj->arena)
+    {
+        return obj;
+    }
+
+    BSP_ARENA *prev = arena_switch(NULL);
+    BSP_OBJECT *ret = _copy_object(obj);
+    arena_switch(prev);
+
+    return ret;
+}
+
+// Value about to be owned by a heap object. Payload moves with the value
+BSP_VALUE * value_promote(BSP_VALUE *val)
+{
+    if (!val)
+    {
+        return NULL;
+    }
+
+    BSP_VALUE *ret = val;
+    BSP_ARENA *prev = NULL;
+    if (val->in_arena)
+    {
+        prev = arena_switch(NULL);
+        ret = new_value();
+        arena_switch(prev);
+        if (!ret)
+        {
+            return NULL;
+        }
+
+        memcpy(ret->lval, val->lval, sizeof(val->lval));
+        ret->rval = val->rval;
+        ret->type = val->type;
+        if (BSP_VAL_VIEW == val->type)
+        {
+            prev = arena_switch(NULL);
+            ret->rval = (void *) view_to_object((BSP_VIEW *) val->rval);
+            ret->type = BSP_VAL_OBJECT;
+            arena_switch(prev);
+        }
+    }
+
+    if (BSP_VAL_STRING == ret->type)
+    {
+        ret->rval = (void *) string_promote((BSP_STRING *) ret->rval);
+    }
+    else if (BSP_VAL_OBJECT == ret->type)
+    {
+        ret->rval = (void *) object_promote((BSP_OBJECT *) ret->rval);
+    }
+
+    return ret;
+}
+
+// Payload kept by an arena object goes with the arena : data from heap or another arena copied in.
+// Heap payload replaced is freed, payload of another arena stays there
+static void _arena_payload(BSP_ARENA *arena, BSP_VALUE *slot)
+{
+    BSP_STRING *str = NULL;
+    BSP_OBJECT *sub = NULL;
+    BSP_ARENA *prev = NULL;
+    if (BSP_VAL_STRING == slot->type)
+    {
+        str = (BSP_STRING *) slot->rval;
+        if (str && !str->is_atom && arena != str->arena)
+        {
+            slot->rval = (void *) string_copy_arena(arena, str);
+            if (!str->arena)
+            {
+                del_string(str);
+            }
+        }
+    }
+    else if (BSP_VAL_OBJECT == slot->type)
+    {
+        sub = (BSP_OBJECT *) slot->rval;
+        if (sub && arena != sub->arena)
+        {
+            prev = arena_switch(arena);
+            slot->rval = (void *) _copy_items(sub);
+            arena_switch(prev);
+            if (!sub->arena)
+            {
+                del_object(sub);
+            }
+        }
+    }
+    else
+    {
+        return;
+    }
+
+    if (!slot->rval)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Object : Copy payload into arena error");
+        slot->type = BSP_VAL_UNKNOWN;
+    }
+
+    return;
+}
+
+// Value kept by an arena object (hash / single) taken from the arena too, heap one freed
+static BSP_VALUE * _arena_value(BSP_ARENA *arena, BSP_VALUE *val)
+{
+    BSP_VALUE *ret = val;
+    BSP_ARENA *prev = NULL;
+    if (!val)
+    {
+        return NULL;
+    }
+
+    if (!val->in_arena)
+    {
+        prev = arena_switch(arena);
+        ret = new_value();
+        arena_switch(prev);
+        if (!ret)
+        {
+            del_value(val);
+            return NULL;
+        }
+
+        memcpy(ret->lval, val->lval, sizeof(val->lval));
+        ret->rval = val->rval;
+        ret->type = val->type;
+        freelist_free(&freelist_value, val);
+    }
+    _arena_payload(arena, ret);
+
+    return ret;
+}
+
+/* Frozen */
+static void _freeze_object(BSP_OBJECT *obj);
+
+static void _freeze_value(BSP_VALUE *val)
+{
+    if (!val)
+    {
+        return;
+    }
+
+    if (BSP_VAL_STRING == val->type)
+    {
+        val->rval = (void *) string_freeze((BSP_STRING *) val->rval);
+    }
+    else if (BSP_VAL_OBJECT == val->type)
+    {
+        _freeze_object((BSP_OBJECT *) val->rval);
+    }
+
+    return;
+}
+
+// Everything in a heap object frozen in place, atom keys stay as they are
+static void _freeze_object(BSP_OBJECT *obj)
+{
+    if (!obj || obj->is_frozen)
+    {
+        return;
+    }
+
+    struct bsp_array_t *array = NULL;
+    struct bsp_hash_t *hash = NULL;
+    struct bsp_hash_item_t *item = NULL;
+    size_t idx;
+    bsp_spin_lock(&obj->lock);
+    switch (obj->type)
+    {
+        case OBJECT_TYPE_SINGLE : 
+            _freeze_value((BSP_VALUE *) obj->node);
+            break;
+        case OBJECT_TYPE_ARRAY : 
+            array = (struct bsp_array_t *) obj->node;
+            for (idx = 0; array && idx < array->nitems; idx ++)
+            {
+                _freeze_value(ARRAY_ITEM(array, idx));
+            }
+            break;
+        case OBJECT_TYPE_HASH : 
+            hash = (struct bsp_hash_t *) obj->node;
+            for (idx = 0; hash && idx < hash->nitems_used; idx ++)
+            {
+                item = HASH_ITEM(hash, idx);
+                if (item)
+                {
+                    item->key = string_freeze(item->key);
+                    _freeze_value(item->value);
+                }
+            }
+            break;
+        default : 
+            break;
+    }
+    obj->refcount = 1;
+    obj->is_frozen = 1;
+    bsp_spin_unlock(&obj->lock);
+
+    return;
+}
+
+// Object taken, an arena one is copied to heap first
+BSP_OBJECT * object_freeze(BSP_OBJECT *obj)
+{
+    if (!obj || obj->is_frozen)
+    {
+        return obj;
+    }
+
+    obj = object_promote(obj);
+    _freeze_object(obj);
+
+    return obj;
+}
+
+BSP_OBJECT * object_ref(BSP_OBJECT *obj)
+{
+    if (!obj)
+    {
+        return NULL;
+    }
+
+    if (obj->is_frozen)
+    {
+        __sync_add_and_fetch(&obj->refcount, 1);
+
+        return obj;
+    }
+
+    BSP_ARENA *prev = arena_switch(NULL);
+    BSP_OBJECT *ret = _copy_items(obj);
+    arena_switch(prev);
+
+    return ret;
+}
+
+// Copy on write : only the top level is copied, frozen sub objects and strings referred
+BSP_OBJECT * object_unshare(BSP_OBJECT *obj)
+{
+    if (!obj || !obj->is_frozen)
+    {
+        return obj;
+    }
+
+    BSP_ARENA *prev = arena_switch(NULL);
+    BSP_OBJECT *ret = _copy_items(obj);
+    arena_switch(prev);
+
+    return ret;
 }
 
 /* Item cursor operates */
@@ -388,22 +852,18 @@ BSP_VALUE * curr_item(BSP_OBJECT *obj)
             break;
         case OBJECT_TYPE_ARRAY : 
             array = (struct bsp_array_t *) obj->node;
-            if (array)
+            if (array && array->curr < array->nitems)
             {
-                size_t bucket = (array->curr / ARRAY_BUCKET_SIZE);
-                if (array->curr < array->nitems && bucket < array->nbuckets && array->items[bucket])
-                {
-                    curr = array->items[bucket][array->curr % ARRAY_BUCKET_SIZE];
-                }
+                curr = ARRAY_ITEM(array, array->curr);
             }
             break;
         case OBJECT_TYPE_HASH : 
             hash = (struct bsp_hash_t *) obj->node;
-            if (hash && hash->curr)
+            if (hash && hash->curr < hash->nitems_used)
             {
                 // Just value
                 // You can get current key with curr_item_key()
-                curr = hash->curr->value;
+                curr = hash->items[hash->curr].value;
             }
             break;
         default : 
@@ -436,9 +896,9 @@ BSP_STRING * curr_hash_key(BSP_OBJECT *obj)
     if (obj && OBJECT_TYPE_HASH == obj->type)
     {
         struct bsp_hash_t *hash = (struct bsp_hash_t *) obj->node;
-        if (hash && hash->curr)
+        if (hash && hash->curr < hash->nitems_used)
         {
-            key = hash->curr->key;
+            key = hash->items[hash->curr].key;
         }
     }
 
@@ -504,7 +964,16 @@ void reset_object(BSP_OBJECT *obj)
             hash = (struct bsp_hash_t *) obj->node;
             if (hash)
             {
-                hash->curr = hash->head;
+                // First item may be a hole
+                hash->curr = 0;
+                while (hash->curr < hash->nitems_used && !hash->items[hash->curr].key)
+                {
+                    hash->curr ++;
+                }
+                if (hash->curr >= hash->nitems_used)
+                {
+                    hash->curr = HASH_CURSOR_END;
+                }
             }
             break;
         case OBJECT_TYPE_SINGLE : 
@@ -536,9 +1005,16 @@ void next_item(BSP_OBJECT *obj)
             break;
         case OBJECT_TYPE_HASH : 
             hash = (struct bsp_hash_t *) obj->node;
-            if (hash && hash->curr)
+            if (hash && hash->curr < hash->nitems_used)
             {
-                hash->curr = hash->curr->lnext;
+                do
+                {
+                    hash->curr ++;
+                } while (hash->curr < hash->nitems_used && !hash->items[hash->curr].key);
+                if (hash->curr >= hash->nitems_used)
+                {
+                    hash->curr = HASH_CURSOR_END;
+                }
             }
             break;
         case OBJECT_TYPE_SINGLE : 
@@ -570,9 +1046,12 @@ void prev_item(BSP_OBJECT *obj)
             break;
         case OBJECT_TYPE_HASH : 
             hash = (struct bsp_hash_t *) obj->node;
-            if (hash && hash->curr)
+            if (hash && hash->curr < hash->nitems_used)
             {
-                hash->curr = hash->curr->lprev;
+                do
+                {
+                    hash->curr --;
+                } while (hash->curr != HASH_CURSOR_END && !hash->items[hash->curr].key);
             }
             break;
         case OBJECT_TYPE_SINGLE : 
@@ -836,379 +1315,663 @@ int sort_object(BSP_OBJECT *obj)
     return BSP_RTN_SUCCESS;
 }
 */
-// Find item from hash
-static inline struct bsp_hash_item_t * _find_hash(struct bsp_hash_t *hash, BSP_STRING *key)
+// Bit mask of control bytes in a group equal to c
+static inline uint32_t _hash_group_match(const uint8_t *group, uint8_t c)
 {
-    struct bsp_hash_item_t *ret = NULL;
-    if (hash && key && hash->hash_table)
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((const __m128i *) group);
+
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char) c)));
+#else
+    uint32_t ret = 0;
+    int i;
+    for (i = 0; i < HASH_GROUP_SIZE; i ++)
     {
-        uint32_t hash_key = bsp_hash(STR_STR(key), STR_LEN(key));
-        struct bsp_hash_item_t *bucket = &hash->hash_table[hash_key % hash->hash_size];
-        struct bsp_hash_item_t *curr = bucket->next;
-        while (curr)
+        if (group[i] == c)
         {
-            if (STR_IS_EQUAL(key, curr->key))
-            {
-                ret = curr;
-                break;
-            }
-            curr = curr->next;
+            ret |= (1U << i);
         }
     }
 
     return ret;
+#endif
 }
 
-static inline struct bsp_hash_item_t * _find_hash_str(struct bsp_hash_t *hash, const char *key)
+// Bit mask of free (EMPTY or DELETED) slots in a group, they are the bytes with high bit set
+static inline uint32_t _hash_group_free(const uint8_t *group)
 {
-    struct bsp_hash_item_t *ret = NULL;
-    if (hash && key && hash->hash_table)
+#ifdef __SSE2__
+    return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+#else
+    uint32_t ret = 0;
+    int i;
+    for (i = 0; i < HASH_GROUP_SIZE; i ++)
     {
-        uint32_t hash_key = bsp_hash(key, -1);
-        struct bsp_hash_item_t *bucket = &hash->hash_table[hash_key % hash->hash_size];
-        struct bsp_hash_item_t *curr = bucket->next;
-        while (curr)
+        if (group[i] & 0x80)
         {
-            if (0 == strncmp(key, STR_STR(curr->key), STR_LEN(curr->key)))
-            {
-                ret = curr;
-                break;
-            }
-            curr = curr->next;
+            ret |= (1U << i);
         }
     }
 
     return ret;
+#endif
 }
 
-// Remove item from hash
-static inline int _remove_hash(struct bsp_hash_t *hash, BSP_STRING *key)
+// Find entry of key, -1 if not found. Stored hash compared before key bytes
+static ssize_t _find_hash(struct bsp_hash_t *hash, const char *key, size_t len, uint32_t hash_key, size_t *slot)
 {
-    int ret = 0;
-    struct bsp_hash_item_t *item = _find_hash(hash, key);
-    if (item)
+    if (!hash || !hash->ctrl)
+    {
+        return -1;
+    }
+
+    size_t mask = hash->hash_size / HASH_GROUP_SIZE - 1;
+    size_t group = hash_key & mask;
+    size_t step = 0, s;
+    uint8_t fp = HASH_FINGERPRINT(hash_key);
+    uint32_t match;
+    struct bsp_hash_item_t *item;
+    while (step <= mask)
     {
-        if (hash->head == item)
+        const uint8_t *ctrl = hash->ctrl + group * HASH_GROUP_SIZE;
+        match = _hash_group_match(ctrl, fp);
+        while (match)
         {
-            hash->head = item->lnext;
+            s = group * HASH_GROUP_SIZE + __builtin_ctz(match);
+            item = &hash->items[hash->slots[s]];
+            // Same atom (or same string) has the same data pointer
+            if (item->hash == hash_key && STR_LEN(item->key) == len && (STR_STR(item->key) == key || 0 == memcmp(STR_STR(item->key), key, len)))
+            {
+                if (slot)
+                {
+                    *slot = s;
+                }
+
+                return (ssize_t) hash->slots[s];
+            }
+            match &= match - 1;
         }
-        if (hash->tail == item)
+
+        if (_hash_group_match(ctrl, HASH_CTRL_EMPTY))
         {
-            hash->tail = item->lprev;
+            // Probe never goes over a group with empty slot
+            break;
         }
-        if (hash->curr == item)
+
+        // Triangular probing visits every group
+        step ++;
+        group = (group + step) & mask;
+    }
+
+    return -1;
+}
+
+// Put entry idx into the first free slot of its probe sequence
+static void _hash_place(struct bsp_hash_t *hash, size_t idx, uint32_t hash_key)
+{
+    size_t mask = hash->hash_size / HASH_GROUP_SIZE - 1;
+    size_t group = hash_key & mask;
+    size_t step = 0, s;
+    uint32_t free_slots;
+    while (1)
+    {
+        free_slots = _hash_group_free(hash->ctrl + group * HASH_GROUP_SIZE);
+        if (free_slots)
         {
-            hash->curr = item->lnext;
+            s = group * HASH_GROUP_SIZE + __builtin_ctz(free_slots);
+            if (HASH_CTRL_EMPTY == hash->ctrl[s])
+            {
+                hash->nused ++;
+            }
+            hash->ctrl[s] = HASH_FINGERPRINT(hash_key);
+            hash->slots[s] = (uint32_t) idx;
+
+            return;
         }
-        if (item->lnext)
+
+        step ++;
+        group = (group + step) & mask;
+    }
+}
+
+// Squeeze holes out of item list and index them again in a new table
+static int _rebuild_hash(BSP_ARENA *arena, struct bsp_hash_t *hash, size_t new_hash_size)
+{
+    size_t i, n = 0;
+    size_t curr = HASH_CURSOR_END;
+    uint8_t *ctrl = NULL;
+
+    // Allocate everything before compacting, old slots stay valid on failure
+    size_t new_items_size = HASH_ITEMS_SIZE(new_hash_size);
+    if (new_items_size > hash->items_size)
+    {
+        struct bsp_hash_item_t *items = (arena) ? 
+            arena_realloc(arena, hash->items, hash->items_size * sizeof(struct bsp_hash_item_t), new_items_size * sizeof(struct bsp_hash_item_t)) : 
+            bsp_realloc(hash->items, new_items_size * sizeof(struct bsp_hash_item_t));
+        if (!items)
         {
-            item->lnext->lprev = item->lprev;
+            return BSP_RTN_ERROR_MEMORY;
         }
-        if (item->next)
+        hash->items = items;
+        hash->items_size = new_items_size;
+    }
+
+    if (new_hash_size != hash->hash_size || !hash->ctrl)
+    {
+        // Control bytes and slots in one block
+        ctrl = (arena) ? arena_alloc(arena, new_hash_size * (1 + sizeof(uint32_t))) : bsp_malloc(new_hash_size * (1 + sizeof(uint32_t)));
+        if (!ctrl)
         {
-            item->next->prev = item->prev;
+            return BSP_RTN_ERROR_MEMORY;
         }
-        if (item->lprev)
+    }
+
+    for (i = 0; i < hash->nitems_used; i ++)
+    {
+        if (hash->items[i].key)
         {
-            item->lprev->lnext = item->lnext;
+            if (i == hash->curr)
+            {
+                curr = n;
+            }
+            hash->items[n ++] = hash->items[i];
         }
-        if (item->prev)
+    }
+    hash->nitems_used = n;
+    hash->curr = curr;
+
+    if (ctrl)
+    {
+        _object_free(arena, hash->ctrl);
+        hash->ctrl = ctrl;
+        hash->slots = (uint32_t *) (ctrl + new_hash_size);
+        hash->hash_size = new_hash_size;
+    }
+    memset(hash->ctrl, HASH_CTRL_EMPTY, hash->hash_size);
+    hash->nused = 0;
+
+    for (i = 0; i < n; i ++)
+    {
+        _hash_place(hash, i, hash->items[i].hash);
+    }
+
+    return BSP_RTN_SUCCESS;
+}
+
+static struct bsp_hash_t * _new_hash(BSP_ARENA *arena)
+{
+    struct bsp_hash_t *hash = _object_calloc(arena, 1, sizeof(struct bsp_hash_t));
+    if (hash)
+    {
+        hash->curr = HASH_CURSOR_END;
+        if (BSP_RTN_SUCCESS != _rebuild_hash(arena, hash, HASH_SIZE_INITIAL))
+        {
+            _object_free(arena, hash->items);
+            _object_free(arena, hash);
+            hash = NULL;
+        }
+    }
+
+    return hash;
+}
+
+// Remove item from hash
+static int _remove_hash(BSP_ARENA *arena, struct bsp_hash_t *hash, const char *key, size_t len, uint32_t hash_key)
+{
+    size_t slot;
+    ssize_t idx = _find_hash(hash, key, len, hash_key, &slot);
+    if (idx < 0)
+    {
+        return 0;
+    }
+
+    // A slot in a group with empty slot is never probed over, it can be empty again
+    if (_hash_group_match(hash->ctrl + (slot & ~((size_t) HASH_GROUP_SIZE - 1)), HASH_CTRL_EMPTY))
+    {
+        hash->ctrl[slot] = HASH_CTRL_EMPTY;
+        hash->nused --;
+    }
+    else
+    {
+        hash->ctrl[slot] = HASH_CTRL_DELETED;
+    }
+
+    struct bsp_hash_item_t *item = &hash->items[idx];
+    del_value(item->value);
+    del_string(item->key);
+    item->key = NULL;
+    item->value = NULL;
+
+    if (hash->curr == (size_t) idx)
+    {
+        // Cursor goes to next item
+        while (hash->curr < hash->nitems_used && !hash->items[hash->curr].key)
         {
-            item->prev->next = item->next;
+            hash->curr ++;
         }
+    }
 
-        ret = 1;
-        // Delete item
-        del_value(item->value);
-        del_string(item->key);
-        bsp_free(item);
-        item = NULL;
+    // Holes on the tail can be used again
+    while (hash->nitems_used > 0 && !hash->items[hash->nitems_used - 1].key)
+    {
+        hash->nitems_used --;
+    }
+    if (hash->curr >= hash->nitems_used)
+    {
+        hash->curr = HASH_CURSOR_END;
     }
 
-    return ret;
+    return 1;
 }
 
-static inline int _remove_hash_str(struct bsp_hash_t *hash, const char *key)
+// Insert an item into hash, key given by data or by string (owned by hash after that)
+static int _insert_hash(BSP_ARENA *arena, struct bsp_hash_t *hash, BSP_STRING *key, const char *data, size_t len, uint32_t hash_key, BSP_VALUE *val)
 {
-    int ret = 0;
-    struct bsp_hash_item_t *item = _find_hash_str(hash, key);
-    if (item)
+    ssize_t idx = _find_hash(hash, data, len, hash_key, NULL);
+    struct bsp_hash_item_t *item = NULL;
+    if (idx >= 0)
     {
-        if (hash->head == item)
+        // Just overwrite value
+        item = &hash->items[idx];
+        if (item->value && item->value != val)
         {
-            hash->head = item->lnext;
+            del_value(item->value);
         }
-        if (hash->tail == item)
+        item->value = val;
+        if (key && key != item->key)
         {
-            hash->tail = item->lprev;
+            del_string(key);
         }
-        if (hash->curr == item)
+
+        return 0;
+    }
+
+    if (hash->nitems_used >= hash->items_size || (hash->nused + 1) > HASH_ITEMS_SIZE(hash->hash_size))
+    {
+        // Grow when live items take half of the slots, or just clean up holes
+        size_t new_hash_size = hash->hash_size;
+        while ((hash->nitems + 1) * 2 > new_hash_size)
         {
-            hash->curr = item->lnext;
+            new_hash_size *= 2;
         }
-        if (item->lnext)
+        if (BSP_RTN_SUCCESS != _rebuild_hash(arena, hash, new_hash_size))
         {
-            item->lnext->lprev = item->lprev;
+            return 0;
         }
-        if (item->next)
+    }
+
+    if (!key)
+    {
+        // Known key shares the atom
+        key = atom_find(data, len, hash_key);
+    }
+
+    if (!key)
+    {
+        key = new_string_arena(arena, data, len);
+        if (!key)
         {
-            item->next->prev = item->prev;
+            return 0;
         }
-        if (item->lprev)
+    }
+
+    idx = hash->nitems_used ++;
+    item = &hash->items[idx];
+    item->key = key;
+    item->value = val;
+    item->hash = hash_key;
+    _hash_place(hash, idx, hash_key);
+
+    return 1;
+}
+
+// Evalute a single (Number / String / Boolean etc) to a object
+void object_set_single(BSP_OBJECT *obj, BSP_VALUE *val)
+{
+    if (obj && OBJECT_TYPE_SINGLE == obj->type && !obj->is_frozen)
+    {
+        if (!obj->arena)
         {
-            item->lprev->lnext = item->lnext;
+            val = value_promote(val);
         }
-        if (item->prev)
+        else if (val)
         {
-            item->prev->next = item->next;
+            val = _arena_value(obj->arena, val);
+            if (!val)
+            {
+                return;
+            }
         }
+        _object_lock(obj);
+        if (obj->node)
+        {
+            BSP_VALUE *old = (BSP_VALUE *) obj->node;
+            del_value(old);
+        }
+        obj->node = (BSP_VALUE *) val;
+        _object_unlock(obj);
+    }
 
-        ret = 1;
-        // Delete item
-        del_value(item->value);
-        del_string(item->key);
-        bsp_free(item);
-        item = NULL;
+    return;
+}
+
+/* Array */
+static struct bsp_array_t * _get_array(BSP_OBJECT *obj)
+{
+    struct bsp_array_t *array = (struct bsp_array_t *) obj->node;
+    if (!array)
+    {
+        // Make a new array
+        array = _object_calloc(obj->arena, 1, sizeof(struct bsp_array_t));
+        obj->node = (void *) array;
     }
 
-    return ret;
+    return array;
+}
+
+// Capacity doubled, new slots unset
+static int _reserve_array(BSP_ARENA *arena, struct bsp_array_t *array, size_t size)
+{
+    if (size <= array->size)
+    {
+        return BSP_RTN_SUCCESS;
+    }
+
+    size_t new_size = (array->size > 0) ? array->size : ARRAY_SIZE_INITIAL;
+    while (new_size < size)
+    {
+        new_size *= 2;
+    }
+
+    BSP_VALUE *items = NULL;
+    if (arena)
+    {
+        items = arena_realloc(arena, array->items, array->size * sizeof(BSP_VALUE), new_size * sizeof(BSP_VALUE));
+    }
+    else
+    {
+        items = bsp_realloc(array->items, new_size * sizeof(BSP_VALUE));
+    }
+
+    if (!items)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Object : Enlarge array error");
+        return BSP_RTN_ERROR_MEMORY;
+    }
+    memset(items + array->size, 0, (new_size - array->size) * sizeof(BSP_VALUE));
+    array->items = items;
+    array->size = new_size;
+
+    return BSP_RTN_SUCCESS;
 }
 
-// Insert an item into hash
-static int _insert_hash(struct bsp_hash_t *hash, BSP_STRING *key, BSP_VALUE *val)
+// Copy value into slot. Payload of a heap array must be on heap too, payload of an arena array in its arena
+static void _put_array(BSP_OBJECT *obj, struct bsp_array_t *array, size_t idx, const BSP_VALUE *val)
 {
-    int ret = 0;
-    if (hash && hash->hash_table && key && val)
+    BSP_VALUE *slot = &array->items[idx];
+    _clear_value(slot);
+    memcpy(slot->lval, val->lval, sizeof(val->lval));
+    slot->rval = val->rval;
+    slot->type = val->type;
+    slot->in_arena = 0;
+    if (!obj->arena)
     {
-        struct bsp_hash_item_t *item = _find_hash(hash, key);
-        if (item)
+        if (BSP_VAL_STRING == slot->type)
         {
-            // Just overwrite value
-            if (item->value)
-            {
-                del_value(item->value);
-            }
-            item->value = val;
+            slot->rval = (void *) string_promote((BSP_STRING *) slot->rval);
         }
-        else
+        else if (BSP_VAL_OBJECT == slot->type)
         {
-            item = bsp_calloc(1, sizeof(struct bsp_hash_item_t));
-            item->key = key;
-            item->value = val;
-            // Insert into link
-            if (!hash->head)
+            slot->rval = (void *) object_promote((BSP_OBJECT *) slot->rval);
+        }
+    }
+    else
+    {
+        _arena_payload(obj->arena, slot);
+    }
+
+    if (idx >= array->nitems)
+    {
+        array->nitems = idx + 1;
+    }
+
+    return;
+}
+
+// Add an item into array, value copied into the array and freed. NULL value unsets the item
+void object_set_array(BSP_OBJECT *obj, ssize_t idx, BSP_VALUE *val)
+{
+    if (obj && OBJECT_TYPE_ARRAY == obj->type && !obj->is_frozen)
+    {
+        if (!obj->arena)
+        {
+            val = value_promote(val);
+        }
+        _object_lock(obj);
+        struct bsp_array_t *array = _get_array(obj);
+        if (array)
+        {
+            if (idx < 0)
             {
-                hash->head = item;
+                idx = array->nitems;
             }
-            if (hash->tail)
+
+            if (!val)
             {
-                hash->tail->lnext = item;
-                item->lprev = hash->tail;
+                if ((size_t) idx < array->nitems)
+                {
+                    _clear_value(&array->items[idx]);
+                }
             }
-            hash->tail = item;
+            else if (BSP_RTN_SUCCESS == _reserve_array(obj->arena, array, idx + 1))
+            {
+                _put_array(obj, array, idx, val);
+                if (!val->in_arena)
+                {
+                    freelist_free(&freelist_value, val);
+                }
+            }
+        }
+        _object_unlock(obj);
+    }
+
+    return;
+}
+
+int object_array_reserve(BSP_OBJECT *obj, size_t size)
+{
+    int ret = BSP_RTN_ERROR_GENERAL;
+    if (obj && OBJECT_TYPE_ARRAY == obj->type && !obj->is_frozen)
+    {
+        _object_lock(obj);
+        struct bsp_array_t *array = _get_array(obj);
+        ret = (array) ? _reserve_array(obj->arena, array, size) : BSP_RTN_ERROR_MEMORY;
+        _object_unlock(obj);
+    }
 
-            // Insert into hash table
-            uint32_t hash_key = bsp_hash(STR_STR(key), STR_LEN(key));
-            struct bsp_hash_item_t *bucket = &hash->hash_table[hash_key % hash->hash_size];
-            item->next = bucket->next;
-            item->prev = bucket;
-            bucket->next = item;
+    return ret;
+}
 
-            ret = 1;
+// Unset item at the end of array, to be filled with value_set_xxx() in place.
+// Strings / objects put into a heap array this way must be on heap, into an arena array in its arena
+BSP_VALUE * object_array_push(BSP_OBJECT *obj)
+{
+    BSP_VALUE *ret = NULL;
+    if (obj && OBJECT_TYPE_ARRAY == obj->type && !obj->is_frozen)
+    {
+        _object_lock(obj);
+        struct bsp_array_t *array = _get_array(obj);
+        if (array && BSP_RTN_SUCCESS == _reserve_array(obj->arena, array, array->nitems + 1))
+        {
+            ret = &array->items[array->nitems ++];
         }
+        _object_unlock(obj);
     }
 
     return ret;
 }
 
-static int _insert_hash_str(struct bsp_hash_t *hash, const char *key, BSP_VALUE *val)
+// Values appended in one step, vals itself still belongs to caller
+size_t object_array_append(BSP_OBJECT *obj, BSP_VALUE *vals, size_t nvals)
 {
-    int ret = 0;
-    if (hash && hash->hash_table && key && val)
+    size_t ret = 0;
+    if (obj && OBJECT_TYPE_ARRAY == obj->type && !obj->is_frozen && vals)
     {
-        struct bsp_hash_item_t *item = _find_hash_str(hash, key);
-        if (item)
-        {
-            // Just overwrite value
-            if (item->value)
-            {
-                del_value(item->value);
-            }
-            item->value = val;
-        }
-        else
+        _object_lock(obj);
+        struct bsp_array_t *array = _get_array(obj);
+        if (array && BSP_RTN_SUCCESS == _reserve_array(obj->arena, array, array->nitems + nvals))
         {
-            item = bsp_calloc(1, sizeof(struct bsp_hash_item_t));
-            item->key = new_string(key, -1);
-            item->value = val;
-            // Insert into link
-            if (!hash->head)
-            {
-                hash->head = item;
-            }
-            if (hash->tail)
+            for (ret = 0; ret < nvals; ret ++)
             {
-                hash->tail->lnext = item;
-                item->lprev = hash->tail;
+                _put_array(obj, array, array->nitems, &vals[ret]);
             }
-            hash->tail = item;
-
-            // Insert into hash table
-            uint32_t hash_key = bsp_hash(key, -1);
-            struct bsp_hash_item_t *bucket = &hash->hash_table[hash_key % hash->hash_size];
-            item->next = bucket->next;
-            item->prev = bucket;
-            bucket->next = item;
-
-            ret = 1;
         }
+        _object_unlock(obj);
     }
 
     return ret;
 }
 
-// Enlarge hash table, rebuild hash link
-static void _rebuild_hash(struct bsp_hash_t *hash, size_t new_hash_size)
+// All items of src moved to the end of obj, src left empty
+size_t object_array_extend(BSP_OBJECT *obj, BSP_OBJECT *src)
 {
-    if (hash && new_hash_size)
+    size_t ret = 0;
+    if (!obj || !src || obj == src || OBJECT_TYPE_ARRAY != obj->type || OBJECT_TYPE_ARRAY != src->type ||
+        obj->is_frozen || src->is_frozen)
     {
-        if (new_hash_size == hash->hash_size)
-        {
-            return;
-        }
-
-        if (hash->hash_table)
-        {
-            bsp_free(hash->hash_table);
-        }
-        hash->hash_table = bsp_calloc(new_hash_size, sizeof(struct bsp_hash_item_t));
-        hash->hash_size = new_hash_size;
+        return 0;
+    }
 
-        // Insert every item from link
-        struct bsp_hash_item_t *curr = hash->head;
-        struct bsp_hash_item_t *bucket;
-        uint32_t hash_key;
-        while (curr && curr->key)
+    // Always lock in the same order
+    BSP_OBJECT *first = (obj < src) ? obj : src;
+    BSP_OBJECT *second = (obj < src) ? src : obj;
+    bsp_spin_lock(&first->lock);
+    bsp_spin_lock(&second->lock);
+    struct bsp_array_t *array = _get_array(obj);
+    struct bsp_array_t *src_array = (struct bsp_array_t *) src->node;
+    if (array && src_array && BSP_RTN_SUCCESS == _reserve_array(obj->arena, array, array->nitems + src_array->nitems))
+    {
+        size_t base = array->nitems;
+        for (ret = 0; ret < src_array->nitems; ret ++)
         {
-            hash_key = bsp_hash(STR_STR(curr->key), STR_LEN(curr->key));
-            bucket = &hash->hash_table[hash_key % hash->hash_size];
-            curr->next = bucket->next;
-            curr->prev = bucket;
-            bucket->next = curr;
-            curr = curr->lnext;
+            if (BSP_VAL_UNKNOWN != src_array->items[ret].type)
+            {
+                _put_array(obj, array, base + ret, &src_array->items[ret]);
+            }
+            src_array->items[ret].type = BSP_VAL_UNKNOWN;
+            src_array->items[ret].rval = NULL;
         }
+        array->nitems = base + ret;
+        src_array->nitems = 0;
+        src_array->curr = 0;
     }
+    bsp_spin_unlock(&second->lock);
+    bsp_spin_unlock(&first->lock);
 
-    return;
+    return ret;
 }
 
-// Evalute a single (Number / String / Boolean etc) to a object
-void object_set_single(BSP_OBJECT *obj, BSP_VALUE *val)
+// Items block of array, for bulk reading. Unset items have type BSP_VAL_UNKNOWN
+BSP_VALUE * object_array_items(BSP_OBJECT *obj, size_t *nitems)
 {
-    if (obj && OBJECT_TYPE_SINGLE == obj->type)
+    BSP_VALUE *ret = NULL;
+    size_t n = 0;
+    if (obj && OBJECT_TYPE_ARRAY == obj->type)
     {
-        bsp_spin_lock(&obj->lock);
-        if (obj->node)
+        _object_lock(obj);
+        struct bsp_array_t *array = (struct bsp_array_t *) obj->node;
+        if (array)
         {
-            BSP_VALUE *old = (BSP_VALUE *) obj->node;
-            del_value(old);
+            ret = array->items;
+            n = array->nitems;
         }
-        obj->node = (BSP_VALUE *) val;
-        bsp_spin_unlock(&obj->lock);
+        _object_unlock(obj);
     }
 
-    return;
+    if (nitems)
+    {
+        *nitems = n;
+    }
+
+    return ret;
 }
 
-// Add an item into array
-void object_set_array(BSP_OBJECT *obj, ssize_t idx, BSP_VALUE *val)
+// Hash of atom is already there
+static inline uint32_t _string_hash(BSP_STRING *key)
 {
-    if (obj && OBJECT_TYPE_ARRAY == obj->type)
-    {
-        bsp_spin_lock(&obj->lock);
-        struct bsp_array_t *array = (struct bsp_array_t *) obj->node;
-        if (!array)
-        {
-            // Make a new array
-            array = bsp_calloc(1, sizeof(struct bsp_array_t));
-            obj->node = (void *) array;
-        }
+    return (key->is_atom) ? key->hash : bsp_hash(STR_STR(key), STR_LEN(key));
+}
 
-        if (idx < 0)
+static void _set_hash(BSP_OBJECT *obj, BSP_STRING *key, const char *data, size_t len, uint32_t hash_key, BSP_VALUE *val)
+{
+    BSP_STRING *copy = NULL;
+    if (obj->arena && val)
+    {
+        // Key and value kept by an arena hash go with the arena
+        if (key && !key->is_atom && obj->arena != key->arena)
         {
-            idx = array->nitems;
-        }
+            copy = string_copy_arena(obj->arena, key);
+            if (!key->arena)
+            {
+                del_string(key);
+            }
 
-        size_t bucket = (idx / ARRAY_BUCKET_SIZE);
-        size_t seq = idx % ARRAY_BUCKET_SIZE;
-        size_t nbuckets = array->nbuckets;
-        if (bucket >= nbuckets)
-        {
-            // Enlarge buckets
-            nbuckets = 2 << (int) (log2(bucket + 1));
-            array->items = bsp_realloc(array->items, nbuckets * sizeof(struct BSP_VAL **));
-            size_t i;
-            for (i = array->nbuckets; i < nbuckets; i ++)
+            if (!copy)
             {
-                array->items[i] = NULL;
+                trace_msg(TRACE_LEVEL_ERROR, "Object : Copy key into arena error");
+                del_value(val);
+                return;
             }
-            array->nbuckets = nbuckets;
+            key = copy;
+            data = STR_STR(key);
         }
 
-        if (!array->items[bucket])
+        val = _arena_value(obj->arena, val);
+        if (!val)
         {
-            // New bucket
-            array->items[bucket] = bsp_calloc(ARRAY_BUCKET_SIZE, sizeof(struct BSP_VAL *));
+            return;
         }
+    }
 
-        if (array->items[bucket][seq])
-        {
-            // Remove old value
-            del_value(array->items[bucket][seq]);
-        }
-        array->items[bucket][seq] = val;
-        if (idx >= array->nitems)
-        {
-            array->nitems = idx + 1;
-        }
-        bsp_spin_unlock(&obj->lock);
+    _object_lock(obj);
+    struct bsp_hash_t *hash = (struct bsp_hash_t *) obj->node;
+    if (!hash)
+    {
+        // Make a new hash
+        hash = _new_hash(obj->arena);
+        obj->node = (void *) hash;
     }
 
+    if (!hash)
+    {
+        // Alloc error
+    }
+    else if (val)
+    {
+        // Insert
+        hash->nitems += _insert_hash(obj->arena, hash, key, data, len, hash_key, val);
+    }
+    else
+    {
+        // Remove
+        hash->nitems -= _remove_hash(obj->arena, hash, data, len, hash_key);
+    }
+    _object_unlock(obj);
+
     return;
 }
 
 // Insert / Remove an item into / from a hash
 void object_set_hash(BSP_OBJECT *obj, BSP_STRING *key, BSP_VALUE *val)
 {
-    if (obj && OBJECT_TYPE_HASH == obj->type && key)
+    if (obj && OBJECT_TYPE_HASH == obj->type && !obj->is_frozen && key)
     {
-        bsp_spin_lock(&obj->lock);
-        struct bsp_hash_t *hash = (struct bsp_hash_t *) obj->node;
-        if (!hash)
-        {
-            // Make a new hash
-            hash = bsp_calloc(1, sizeof(struct bsp_hash_t));
-            hash->hash_size = HASH_SIZE_INITIAL;
-            hash->hash_table = bsp_calloc(HASH_SIZE_INITIAL, sizeof(struct bsp_hash_item_t));
-            obj->node = (void *) hash;
-        }
-
-        if (val)
-        {
-            // Insert
-            hash->nitems += _insert_hash(hash, key, val);
-            if (hash->nitems > 8 * hash->hash_size)
-            {
-                // Rehash
-                _rebuild_hash(hash, hash->hash_size * 8);
-            }
-        }
-        else
+        if (!obj->arena && val)
         {
-            // Remove
-            hash->nitems -= _remove_hash(hash, key);
+            key = string_promote(key);
+            val = value_promote(val);
         }
-        bsp_spin_unlock(&obj->lock);
+        _set_hash(obj, key, STR_STR(key), STR_LEN(key), _string_hash(key), val);
     }
 
     return;
@@ -1216,35 +1979,33 @@ void object_set_hash(BSP_OBJECT *obj, BSP_STRING *key, BSP_VALUE *val)
 
 void object_set_hash_str(BSP_OBJECT *obj, const char *key, BSP_VALUE *val)
 {
-    if (obj && OBJECT_TYPE_HASH == obj->type && key)
+    if (obj && OBJECT_TYPE_HASH == obj->type && !obj->is_frozen && key)
     {
-        bsp_spin_lock(&obj->lock);
-        struct bsp_hash_t *hash = (struct bsp_hash_t *) obj->node;
-        if (!hash)
+        if (!obj->arena && val)
         {
-            // Make a new hash
-            hash = bsp_calloc(1, sizeof(struct bsp_hash_t));
-            hash->hash_size = HASH_SIZE_INITIAL;
-            hash->hash_table = bsp_calloc(HASH_SIZE_INITIAL, sizeof(struct bsp_hash_item_t));
-            obj->node = (void *) hash;
+            val = value_promote(val);
         }
+        size_t len = strlen(key);
+        _set_hash(obj, NULL, key, len, bsp_hash(key, len), val);
+    }
 
-        if (val)
-        {
-            // Insert
-            hash->nitems += _insert_hash_str(hash, key, val);
-            if (hash->nitems > 8 * hash->hash_size)
-            {
-                // Rehash
-                _rebuild_hash(hash, hash->hash_size * 8);
-            }
-        }
-        else
+    return;
+}
+
+// Key must be an atom, nothing hashed or copied
+void object_set_hash_atom(BSP_OBJECT *obj, BSP_STRING *key, BSP_VALUE *val)
+{
+    if (!STR_IS_ATOM(key))
+    {
+        object_set_hash(obj, key, val);
+    }
+    else if (obj && OBJECT_TYPE_HASH == obj->type && !obj->is_frozen)
+    {
+        if (!obj->arena && val)
         {
-            // Remove
-            hash->nitems -= _remove_hash_str(hash, key);
+            val = value_promote(val);
         }
-        bsp_spin_unlock(&obj->lock);
+        _set_hash(obj, key, STR_STR(key), STR_LEN(key), key->hash, val);
     }
 
     return;
@@ -1256,9 +2017,9 @@ BSP_VALUE * object_get_single(BSP_OBJECT *obj)
     BSP_VALUE *ret = NULL;
     if (obj && OBJECT_TYPE_SINGLE == obj->type)
     {
-        bsp_spin_lock(&obj->lock);
+        _object_lock(obj);
         ret = (BSP_VALUE *) obj->node;
-        bsp_spin_unlock(&obj->lock);
+        _object_unlock(obj);
     }
 
     return ret;
@@ -1270,16 +2031,32 @@ BSP_VALUE * object_get_array(BSP_OBJECT *obj, size_t idx)
     BSP_VALUE *ret = NULL;
     if (obj && OBJECT_TYPE_ARRAY == obj->type)
     {
-        bsp_spin_lock(&obj->lock);
+        _object_lock(obj);
         struct bsp_array_t *array = (struct bsp_array_t *) obj->node;
-        size_t bucket = idx / ARRAY_BUCKET_SIZE;
-        size_t seq = idx % ARRAY_BUCKET_SIZE;
-        if (array && idx < array->nitems && bucket < array->nbuckets && array->items[bucket])
+        if (array && idx < array->nitems)
         {
-            ret = array->items[bucket][seq];
+            ret = ARRAY_ITEM(array, idx);
+        }
+        _object_unlock(obj);
+    }
+
+    return ret;
+}
+
+static BSP_VALUE * _get_hash(BSP_OBJECT *obj, const char *key, size_t len, uint32_t hash_key)
+{
+    BSP_VALUE *ret = NULL;
+    _object_lock(obj);
+    struct bsp_hash_t *hash = (struct bsp_hash_t *) obj->node;
+    if (hash)
+    {
+        ssize_t idx = _find_hash(hash, key, len, hash_key, NULL);
+        if (idx >= 0)
+        {
+            ret = hash->items[idx].value;
         }
-        bsp_spin_unlock(&obj->lock);
     }
+    _object_unlock(obj);
 
     return ret;
 }
@@ -1290,17 +2067,7 @@ BSP_VALUE * object_get_hash(BSP_OBJECT *obj, BSP_STRING *key)
     BSP_VALUE *ret = NULL;
     if (obj && key && OBJECT_TYPE_HASH == obj->type)
     {
-        bsp_spin_lock(&obj->lock);
-        struct bsp_hash_t *hash = (struct bsp_hash_t *) obj->node;
-        if (hash)
-        {
-            struct bsp_hash_item_t *item = _find_hash(hash, key);
-            if (item)
-            {
-                ret = item->value;
-            }
-        }
-        bsp_spin_unlock(&obj->lock);
+        ret = _get_hash(obj, STR_STR(key), STR_LEN(key), _string_hash(key));
     }
 
     return ret;
@@ -1311,17 +2078,23 @@ BSP_VALUE * object_get_hash_str(BSP_OBJECT *obj, const char *key)
     BSP_VALUE *ret = NULL;
     if (obj && key && OBJECT_TYPE_HASH == obj->type)
     {
-        bsp_spin_lock(&obj->lock);
-        struct bsp_hash_t *hash = (struct bsp_hash_t *) obj->node;
-        if (hash)
-        {
-            struct bsp_hash_item_t *item = _find_hash_str(hash, key);
-            if (item)
-            {
-                ret = item->value;
-            }
-        }
-        bsp_spin_unlock(&obj->lock);
+        size_t len = strlen(key);
+        ret = _get_hash(obj, key, len, bsp_hash(key, len));
+    }
+
+    return ret;
+}
+
+BSP_VALUE * object_get_hash_atom(BSP_OBJECT *obj, BSP_STRING *key)
+{
+    BSP_VALUE *ret = NULL;
+    if (obj && STR_IS_ATOM(key) && OBJECT_TYPE_HASH == obj->type)
+    {
+        ret = _get_hash(obj, STR_STR(key), STR_LEN(key), key->hash);
+    }
+    else
+    {
+        ret = object_get_hash(obj, key);
     }
 
     return ret;
@@ -1444,7 +2217,17 @@ static void _pack_key(BSP_STRING *str, BSP_STRING *key)
         char buf[9];
         if (key)
         {
-            string_append(str, buf, set_vint(STR_LEN(key), buf));
+            if (BSP_VAL_OBJECT_HASH_END == STR_LEN(key))
+            {
+                // Long form vint, or the length byte looks like endding marker
+                buf[0] = (char) 0x80;
+                buf[1] = BSP_VAL_OBJECT_HASH_END;
+                string_append(str, buf, 2);
+            }
+            else
+            {
+                string_append(str, buf, set_vint(STR_LEN(key), buf));
+            }
             string_append(str, STR_STR(key), STR_LEN(key));
         }
         else
@@ -1465,6 +2248,20 @@ static void _pack_value(BSP_STRING *str, BSP_VALUE *val)
     BSP_OBJECT *sub_obj = NULL;
     if (val && str)
     {
+        if (BSP_VAL_VIEW == val->type)
+        {
+            // Already serialized, copy data directly
+            BSP_VIEW *view = (BSP_VIEW *) val->rval;
+            tmp[0] = BSP_VAL_OBJECT;
+            string_append(str, tmp, 1);
+            if (view && view->data)
+            {
+                string_append(str, view->data, view->len);
+            }
+
+            return;
+        }
+
         string_append(str, &val->type, 1);
         switch (val->type)
         {
@@ -1475,7 +2272,7 @@ static void _pack_value(BSP_STRING *str, BSP_VALUE *val)
                 string_append(str, val->lval, sizeof(float));
                 break;
             case BSP_VAL_DOUBLE : 
-                string_append(str, val->lval, sizeof(float));
+                string_append(str, val->lval, sizeof(double));
                 break;
             case BSP_VAL_STRING : 
                 sub_str = (BSP_STRING *) val->rval;
@@ -1521,7 +2318,7 @@ static void _pack_object(BSP_STRING *str, BSP_OBJECT *obj)
     BSP_VALUE *val = NULL;
     if (obj && str)
     {
-        bsp_spin_lock(&obj->lock);
+        _object_lock(obj);
         switch (obj->type)
         {
             case OBJECT_TYPE_SINGLE : 
@@ -1540,17 +2337,14 @@ static void _pack_object(BSP_STRING *str, BSP_OBJECT *obj)
                 string_append(str, value_type, 1);
                 // Every item
                 struct bsp_array_t *array = (struct bsp_array_t *) obj->node;
-                size_t idx, bucket, seq;
+                size_t idx;
                 if (array)
                 {
-                    for (idx = 9; idx < array->nitems; idx ++)
+                    for (idx = 0; idx < array->nitems; idx ++)
                     {
-                        bucket = idx / ARRAY_BUCKET_SIZE;
-                        seq = idx % ARRAY_BUCKET_SIZE;
-                        val = NULL;
-                        if (bucket < array->nbuckets && array->items[bucket])
+                        val = ARRAY_ITEM(array, idx);
+                        if (val)
                         {
-                            val = array->items[bucket][seq];
                             _pack_value(str, val);
                         }
                         else
@@ -1568,18 +2362,18 @@ static void _pack_object(BSP_STRING *str, BSP_OBJECT *obj)
                 // Dict
                 value_type[0] = BSP_VAL_OBJECT_HASH;
                 string_append(str, value_type, 1);
-                // Traverse items
-                BSP_STRING *key;
-                reset_object(obj);
-                val = curr_item(obj);
-                while (val)
+                // Traverse items without the cursor, object may be shared (frozen)
+                struct bsp_hash_t *hash = (struct bsp_hash_t *) obj->node;
+                struct bsp_hash_item_t *item;
+                for (idx = 0; hash && idx < hash->nitems_used; idx ++)
                 {
-                    key = curr_hash_key(obj);
-                    // Set key and value
-                    _pack_key(str, key);
-                    _pack_value(str, val);
-                    next_item(obj);
-                    val = curr_item(obj);
+                    item = HASH_ITEM(hash, idx);
+                    if (item)
+                    {
+                        // Set key and value
+                        _pack_key(str, item->key);
+                        _pack_value(str, item->value);
+                    }
                 }
                 value_type[0] = BSP_VAL_OBJECT_HASH_END;
                 string_append(str, value_type, 1);
@@ -1589,7 +2383,7 @@ static void _pack_object(BSP_STRING *str, BSP_OBJECT *obj)
                 // Yaaaahhh~~~?
                 break;
         }
-        bsp_spin_unlock(&obj->lock);
+        _object_unlock(obj);
     }
 
     return;
@@ -1597,7 +2391,7 @@ static void _pack_object(BSP_STRING *str, BSP_OBJECT *obj)
 
 BSP_STRING * object_serialize(BSP_OBJECT *obj)
 {
-    BSP_STRING * ret = new_string(NULL, 0);
+    BSP_STRING * ret = new_string_local(NULL, 0);
     if (obj && ret)
     {
         _pack_object(ret, obj);
@@ -1606,185 +2400,19 @@ BSP_STRING * object_serialize(BSP_OBJECT *obj)
     return ret;
 }
 
-static BSP_STRING * _unpack_key(BSP_STRING *str);
-static BSP_VALUE * _unpack_value(BSP_STRING *str);
-static BSP_OBJECT * _unpack_object(BSP_STRING *str);
-
-static BSP_STRING * _unpack_key(BSP_STRING *str)
-{
-    BSP_STRING *ret = NULL;
-    char *data;
-    if (str)
-    {
-        size_t left = STR_LEN(str) - str->cursor;
-        size_t vlen = 0;
-        if (left > 0)
-        {
-            data = STR_STR(str);
-            vlen = vintlen(data, left);
-            if (left >= vlen)
-            {
-                int nouse = 0;
-                int64_t str_len = get_vint(data, &nouse);
-                if (left >= vlen + str_len)
-                {
-                    ret = new_string(data + vlen, str_len);
-                    vlen += str_len;
-                }
-            }
-        }
-        str->cursor += vlen;
-    }
-
-    return ret;
-}
-
-static BSP_VALUE * _unpack_value(BSP_STRING *str)
-{
-    BSP_VALUE *ret = NULL;
-    char *data;
-    char type;
-    if (str)
-    {
-        size_t left = STR_LEN(str) - str->cursor;
-        size_t vlen = 0;
-        BSP_OBJECT *obj = NULL;
-        if (left > 0)
-        {
-            // 1st byte : Type
-            type = STR_STR(str)[str->cursor];
-            data = STR_STR(str) + 1;
-            ret = new_value();
-            ret->type = type;
-            switch (type)
-            {
-                case BSP_VAL_INT : 
-                    vlen = vintlen(data, left - 1);
-                    memcpy(ret->lval, data, vlen);
-                    break;
-                case BSP_VAL_FLOAT : 
-                    vlen = (left > sizeof(float)) ? sizeof(float) : (left - 1);
-                    memcpy(ret->lval, data, vlen);
-                    break;
-                case BSP_VAL_DOUBLE : 
-                    vlen = (left > sizeof(double)) ? sizeof(double) : (left - 1);
-                    memcpy(ret->lval, data, vlen);
-                    break;
-                case BSP_VAL_STRING : 
-                    vlen = vintlen(data, left - 1);
-                    if (left >= vlen)
-                    {
-                        int nouse = 0;
-                        int64_t str_len = get_vint(data, &nouse);
-                        if (left >= vlen + str_len)
-                        {
-                            ret->rval = (void *) new_string(data + vlen, str_len);
-                            vlen += str_len;
-                        }
-                    }
-                    break;
-                case BSP_VAL_POINTER : 
-                    vlen = (left > sizeof(void *)) ? sizeof(void *) : (left - 1);
-                    memcpy(&ret->rval, data, vlen);
-                    break;
-                case BSP_VAL_OBJECT : 
-                    obj = _unpack_object(str);
-                    ret->rval = (void *) obj;
-                    break;
-                case BSP_VAL_BOOLEAN_TRUE : 
-                case BSP_VAL_BOOLEAN_FALSE : 
-                case BSP_VAL_NULL : 
-                case BSP_VAL_UNKNOWN : 
-                default : 
-                    // Single values
-                    break;
-            }
-            str->cursor += vlen + 1;
-        }
-    }
-
-    return ret;
-}
-
-static BSP_OBJECT * _unpack_object(BSP_STRING *str)
+// Unserialize by view, native data can also be read directly with view_*()
+BSP_OBJECT * object_unserialize(BSP_STRING *str)
 {
-    BSP_OBJECT *obj = NULL;
+    BSP_OBJECT *ret = NULL;
+    BSP_VIEW view;
     if (str)
     {
-        bsp_spin_lock(&str->lock);
-        if (str->cursor < STR_LEN(str))
+        STR_LOCK(str);
+        if (BSP_RTN_SUCCESS == view_init(&view, STR_STR(str), STR_LEN(str)))
         {
-            // Read first
-            BSP_VALUE *val = NULL;
-            BSP_STRING *key = NULL;
-            char type = STR_STR(str)[str->cursor];
-            obj = new_object(type);
-            str->cursor ++;
-            switch (type)
-            {
-                case BSP_VAL_OBJECT_SINGLE : 
-                    val = _unpack_value(str);
-                    object_set_single(obj, val);
-                    // Pass endding
-                    str->cursor ++;
-                    break;
-                case BSP_VAL_OBJECT_ARRAY : 
-                    while (1)
-                    {
-                        val = _unpack_value(str);
-                        if (!val)
-                        {
-                            break;
-                        }
-                        if (str->cursor < STR_LEN(str) && BSP_VAL_OBJECT_ARRAY_END == STR_STR(str)[str->cursor])
-                        {
-                            // Endding
-                            str->cursor ++;
-                            break;
-                        }
-                        object_set_array(obj, -1, val);
-                    }
-                    break;
-                case BSP_VAL_OBJECT_HASH : 
-                    while (1)
-                    {
-                        // Read key first
-                        key = _unpack_key(str);
-                        if (!key)
-                        {
-                            break;
-                        }
-                        val = _unpack_value(str);
-                        if (!val)
-                        {
-                            break;
-                        }
-                        if (str->cursor < STR_LEN(str) && BSP_VAL_OBJECT_HASH_END == STR_STR(str)[str->cursor])
-                        {
-                            // Endding
-                            str->cursor ++;
-                            break;
-                        }
-                        object_set_hash(obj, key, val);
-                    }
-                    break;
-                default : 
-                    break;
-            }
+            ret = view_to_object(&view);
         }
-        bsp_spin_unlock(&str->lock);
-    }
-
-    return obj;
-}
-
-BSP_OBJECT * object_unserialize(BSP_STRING *str)
-{
-    BSP_OBJECT * ret = NULL;
-    if (str)
-    {
-        str->cursor = 0;
-        ret = _unpack_object(str);
+        STR_UNLOCK(str);
     }
 
     return ret;
@@ -1846,6 +2474,9 @@ static void _push_value_to_lua(lua_State *s, BSP_VALUE *val)
             v_obj = (BSP_OBJECT *) val->rval;
             _push_object_to_lua(s, v_obj);
             break;
+        case BSP_VAL_VIEW : 
+            view_to_lua_stack(s, (BSP_VIEW *) val->rval);
+            break;
         case BSP_VAL_NULL : 
         case BSP_VAL_UNKNOWN : 
         default : 
@@ -1871,7 +2502,7 @@ static void _push_object_to_lua(lua_State *s, BSP_OBJECT *obj)
 
     BSP_VALUE *val = NULL;
     BSP_STRING *key = NULL;
-    bsp_spin_lock(&obj->lock);
+    _object_lock(obj);
     lua_checkstack(s, 1);
     switch (obj->type)
     {
@@ -1882,25 +2513,20 @@ static void _push_object_to_lua(lua_State *s, BSP_OBJECT *obj)
             break;
         case OBJECT_TYPE_ARRAY : 
             // Array
-            lua_newtable(s);
             struct bsp_array_t *array = (struct bsp_array_t *) obj->node;
             size_t idx;
+            // Array part of table sized once
+            lua_createtable(s, (array) ? (int) array->nitems : 0, 0);
             if (array)
             {
                 for (idx = 0; idx < array->nitems; idx ++)
                 {
-                    size_t bucket = idx / ARRAY_BUCKET_SIZE;
-                    size_t seq = idx % ARRAY_BUCKET_SIZE;
-                    if (bucket < array->nbuckets && array->items[bucket])
+                    val = ARRAY_ITEM(array, idx);
+                    if (val)
                     {
-                        val = array->items[bucket][seq];
-                        if (val)
-                        {
-                            lua_checkstack(s, 2);
-                            lua_pushinteger(s, (lua_Integer) idx + 1);
-                            _push_value_to_lua(s, val);
-                            lua_settable(s, -3);
-                        }
+                        lua_checkstack(s, 1);
+                        _push_value_to_lua(s, val);
+                        lua_rawseti(s, -2, (int) idx + 1);
                     }
                 }
             }
@@ -1908,23 +2534,22 @@ static void _push_object_to_lua(lua_State *s, BSP_OBJECT *obj)
         case OBJECT_TYPE_HASH : 
             // Hash
             lua_newtable(s);
-            reset_object(obj);
-            val = curr_item(obj);
-            while (val)
+            struct bsp_hash_t *hash = (struct bsp_hash_t *) obj->node;
+            struct bsp_hash_item_t *item;
+            for (idx = 0; hash && idx < hash->nitems_used; idx ++)
             {
-                key = curr_hash_key(obj);
-                if (key)
+                item = HASH_ITEM(hash, idx);
+                if (item)
                 {
+                    key = item->key;
                     lua_checkstack(s, 2);
                     lua_pushlstring(s, STR_STR(key), STR_LEN(key));
-                    _push_value_to_lua(s, val);
+                    _push_value_to_lua(s, item->value);
                     if (lua_istable(s, -3))
                     {
                         lua_settable(s, -3);
                     }
                 }
-                next_item(obj);
-                val = curr_item(obj);
             }
             break;
         case OBJECT_TYPE_UNDETERMINED : 
@@ -1932,7 +2557,7 @@ static void _push_object_to_lua(lua_State *s, BSP_OBJECT *obj)
             lua_pushnil(s);
             break;
     }
-    bsp_spin_unlock(&obj->lock);
+    _object_unlock(obj);
     return;
 }
 
@@ -2030,12 +2655,14 @@ static BSP_OBJECT * _lua_table_to_object(lua_State *s)
     {
         // Array
         ret = new_object(OBJECT_TYPE_ARRAY);
-        size_t idx;
-        for (idx = 1; idx <= luaL_len(s, -1); idx ++)
+        size_t idx, len = luaL_len(s, -1);
+        object_array_reserve(ret, len);
+        for (idx = 1; idx <= len; idx ++)
         {
             lua_rawgeti(s, -1, idx);
             val = _lua_value_to_value(s);
             object_set_array(ret, idx - 1, val);
+            lua_pop(s, 1);
         }
     }
     else
@@ -2051,7 +2678,7 @@ static BSP_OBJECT * _lua_table_to_object(lua_State *s)
         {
             // Key
             key_str = lua_tolstring(s, -2, &key_len);
-            key = new_string(key_str, key_len);
+            key = atom_key(key_str, key_len);
             // Value
             val = _lua_value_to_value(s);
             object_set_hash(ret, key, val);
@@ -2084,3 +2711,25 @@ BSP_OBJECT * lua_stack_to_object(lua_State *s)
 
     return ret;
 }
+
+// Scalars pushed as they are, string / object converted
+void value_to_lua_stack(lua_State *s, BSP_VALUE *val)
+{
+    if (!s)
+    {
+        return;
+    }
+    _push_value_to_lua(s, val);
+
+    return;
+}
+
+BSP_VALUE * lua_stack_to_value(lua_State *s)
+{
+    if (!s)
+    {
+        return NULL;
+    }
+
+    return _lua_value_to_value(s);
+}
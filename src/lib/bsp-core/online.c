@@ -22,372 +22,1528 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 10/22/2014
+ * @update 12/15/2014
  * @changelog
  *      [10/22/2014[ - Creation
+ *      [12/03/2014] - Frozen online data, shared by readers
+ *      [12/11/2014] - Sharded online table with incremental resize, lock of one shard at a time
+ *      [12/12/2014] - Secondary indexes, condition queries answered by binds array
+ *      [12/13/2014] - Dirty tracking, write-behind autosave by workers
+ *      [12/14/2014] - Snapshot file for warm restart, data loaded lazily
+ *      [12/15/2014] - Presence shared with instances on host
  */
 
 #include "bsp.h"
 
-// Hash table
-BSP_ONLINE **online_hash = NULL;
-BSP_SPINLOCK hash_lock;
+// Striped hash table, every shard resized by itself
+static struct bsp_online_shard_t *online_shards = NULL;
+
+// Secondary indexes, never removed. Lock order : shard -> index (ascending)
+static struct bsp_online_index_t online_indexes[ONLINE_INDEX_MAX];
+static int nindexes = 0;
+static BSP_SPINLOCK indexes_lock;
+
+// Dirty entries in order of dirty time, each holds a reference. Lock order : shard -> dirty
+static BSP_ONLINE *dirty_head = NULL;
+static BSP_ONLINE *dirty_tail = NULL;
+static size_t ndirty = 0;
+static BSP_SPINLOCK dirty_lock;
+static int flush_quota = 0;
+static int flush_worker = 0;
+
+// Fd list refers entries with a reference, taken and dropped under the stripe of fd.
+// Never held together with a shard lock
+static BSP_SPINLOCK online_bind_locks[ONLINE_BIND_LOCKS];
+
+// Data records besides storage, queued under shard lock to keep order of changes and written by autosave workers
+static BSP_SNAPSHOT *online_snapshot = NULL;
 
 // Initialize online hash table
 int online_init()
 {
     //BSP_CORE_SETTING *settings = get_core_setting();
-    online_hash = bsp_calloc(ONLINE_HASH_SIZE, sizeof(BSP_ONLINE *));
-    if (!online_hash)
+    struct bsp_online_shard_t *shard;
+    int i;
+    online_shards = bsp_calloc(ONLINE_SHARDS, sizeof(struct bsp_online_shard_t));
+    if (!online_shards)
     {
         trigger_exit(BSP_RTN_ERROR_MEMORY, "Cannot create online list");
     }
-    bsp_spin_init(&hash_lock);
-    trace_msg(TRACE_LEVEL_DEBUG, "Online : Online table initialized");
+
+    for (i = 0; i < ONLINE_SHARDS; i ++)
+    {
+        shard = &online_shards[i];
+        shard->buckets = bsp_calloc(ONLINE_SHARD_INITIAL, sizeof(BSP_ONLINE *));
+        if (!shard->buckets)
+        {
+            trigger_exit(BSP_RTN_ERROR_MEMORY, "Cannot create online list");
+        }
+        shard->size = ONLINE_SHARD_INITIAL;
+        bsp_spin_init(&shard->lock);
+    }
+    for (i = 0; i < ONLINE_BIND_LOCKS; i ++)
+    {
+        bsp_spin_init(&online_bind_locks[i]);
+    }
+    bsp_spin_init(&indexes_lock);
+    bsp_spin_init(&dirty_lock);
+    trace_msg(TRACE_LEVEL_DEBUG, "Online : Online table initialized with %d shards", ONLINE_SHARDS);
 
     return BSP_RTN_SUCCESS;
 }
 
-/* Hash operations */
-static BSP_ONLINE * _hash_find(const char *key)
+/* Hash operations, shard locked by caller */
+static inline struct bsp_online_shard_t * _shard_of(uint32_t h)
 {
-    if (!key || !online_hash)
+    return &online_shards[h >> (32 - ONLINE_SHARD_BITS)];
+}
+
+// Link to the entry in chain
+static BSP_ONLINE ** _chain_lookup(BSP_ONLINE **link, const char *key, uint32_t h)
+{
+    while (*link)
     {
-        return NULL;
+        if (h == (*link)->hash && 0 == strcmp(key, (*link)->key))
+        {
+            return link;
+        }
+        link = &(*link)->next;
     }
 
-    uint32_t h = bsp_hash(key, -1);
-    int idx = (h % ONLINE_HASH_SIZE);
-    bsp_spin_lock(&hash_lock);
-    BSP_ONLINE *try = online_hash[idx];
-    BSP_ONLINE *ret = NULL;
+    return NULL;
+}
 
-    while (try)
+static BSP_ONLINE ** _shard_lookup(struct bsp_online_shard_t *shard, const char *key, uint32_t h)
+{
+    size_t idx;
+    if (shard->old_buckets)
     {
-        if (0 == strcmp(key, try->key))
+        idx = h & (shard->old_size - 1);
+        if (idx >= shard->rehash_idx)
         {
-            ret = try;
-            break;
+            // Bucket not moved yet
+            return _chain_lookup(&shard->old_buckets[idx], key, h);
         }
-        try = try->next;
     }
-    bsp_spin_unlock(&hash_lock);
 
-    return ret;
+    return _chain_lookup(&shard->buckets[h & (shard->size - 1)], key, h);
+}
+
+// Move a few buckets of old table to new one, old table freed after the last one
+static void _shard_rehash(struct bsp_online_shard_t *shard)
+{
+    BSP_ONLINE *o, *next;
+    size_t idx, n;
+    if (!shard->old_buckets)
+    {
+        return;
+    }
+
+    for (n = 0; n < ONLINE_REHASH_STEP && shard->rehash_idx < shard->old_size; n ++)
+    {
+        o = shard->old_buckets[shard->rehash_idx];
+        while (o)
+        {
+            next = o->next;
+            idx = o->hash & (shard->size - 1);
+            o->next = shard->buckets[idx];
+            shard->buckets[idx] = o;
+            o = next;
+        }
+        shard->old_buckets[shard->rehash_idx ++] = NULL;
+    }
+
+    if (shard->rehash_idx >= shard->old_size)
+    {
+        bsp_free(shard->old_buckets);
+        shard->old_buckets = NULL;
+        shard->old_size = 0;
+        shard->rehash_idx = 0;
+    }
+
+    return;
 }
 
-static void _hash_insert(BSP_ONLINE *entry)
+// Double buckets when load factor reaches 1, entries moved later by _shard_rehash()
+static void _shard_grow(struct bsp_online_shard_t *shard)
 {
-    if (!entry || !online_hash)
+    BSP_ONLINE **buckets;
+    if (shard->old_buckets || shard->nitems < shard->size)
     {
         return;
     }
 
-    uint32_t h = bsp_hash(entry->key, -1);
-    int idx = (h % ONLINE_HASH_SIZE);
-    bsp_spin_lock(&hash_lock);
-    entry->next = online_hash[idx];
-    online_hash[idx] = entry;
-    bsp_spin_unlock(&hash_lock);
+    buckets = bsp_calloc(shard->size * 2, sizeof(BSP_ONLINE *));
+    if (!buckets)
+    {
+        // Keep longer chains
+        trace_msg(TRACE_LEVEL_ERROR, "Online : Enlarge online table error");
+        return;
+    }
+    shard->old_buckets = shard->buckets;
+    shard->old_size = shard->size;
+    shard->rehash_idx = 0;
+    shard->buckets = buckets;
+    shard->size *= 2;
 
     return;
 }
 
-static BSP_ONLINE * _hash_remove(const char *key)
+/* Index operations */
+// Indexed form of value, NULL if not indexable
+static const char * _index_value(BSP_VALUE *val, char *buf, size_t *len)
 {
-    if (!key || !online_hash)
+    BSP_STRING *str;
+    double d;
+    int digits = 15;
+    if (!val)
     {
         return NULL;
     }
 
-    uint32_t h = bsp_hash(key, -1);
-    int idx = (h % ONLINE_HASH_SIZE);
-    bsp_spin_lock(&hash_lock);
-    BSP_ONLINE *try = online_hash[idx];
-    BSP_ONLINE *old = NULL, *ret = NULL;
-    while (try)
+    switch (val->type)
     {
-        if (0 == strcmp(key, try->key))
-        {
-            // Same ID, remove
-            if (!old)
+        case BSP_VAL_INT :
+        case BSP_VAL_INT29 :
+            *len = snprintf(buf, ONLINE_INDEX_VALUE_LENGTH, "%lld", (long long int) value_get_int(val));
+            break;
+        case BSP_VAL_FLOAT :
+        case BSP_VAL_DOUBLE :
+            // Numbers from script are doubles, integral ones indexed as integers.
+            // Floats keep the digits they can hold, 0.1f indexed as 0.1
+            if (BSP_VAL_FLOAT == val->type)
             {
-                // Head
-                online_hash[idx] = try->next;
+                d = (double) value_get_float(val);
+                digits = 6;
             }
             else
             {
-                old->next = try->next;
+                d = value_get_double(val);
             }
 
-            ret = try;
+            if (isfinite(d) && d >= -9223372036854775808.0 && d < 9223372036854775808.0 && d == (double) (long long int) d)
+            {
+                *len = snprintf(buf, ONLINE_INDEX_VALUE_LENGTH, "%lld", (long long int) d);
+            }
+            else
+            {
+                *len = snprintf(buf, ONLINE_INDEX_VALUE_LENGTH, "%.*g", digits, d);
+            }
+            break;
+        case BSP_VAL_BOOLEAN_TRUE :
+            *len = 4;
+            return "true";
+        case BSP_VAL_BOOLEAN_FALSE :
+            *len = 5;
+            return "false";
+        case BSP_VAL_STRING :
+            str = value_get_string(val);
+            if (!str)
+            {
+                return NULL;
+            }
+            *len = STR_LEN(str);
+            return STR_STR(str);
+        default :
+            return NULL;
+    }
+
+    return buf;
+}
+
+static struct bsp_online_posting_t * _index_find(struct bsp_online_index_t *idx, const char *value, size_t len, uint32_t h)
+{
+    struct bsp_online_posting_t *p = idx->buckets[h & (idx->size - 1)];
+    while (p)
+    {
+        if (h == p->hash && len == p->value_len && 0 == memcmp(value, p->value, len))
+        {
             break;
         }
-        old = try;
-        try = try->next;
+        p = p->next;
     }
-    bsp_spin_unlock(&hash_lock);
 
-    return ret;
+    return p;
 }
 
-// Create new online entry
-void new_online(int fd, const char *key)
+// Double buckets of values, the whole table moved at once (values are far less than entries)
+static void _index_grow(struct bsp_online_index_t *idx)
 {
-    if (!key)
+    struct bsp_online_posting_t **buckets, *p, *next;
+    size_t i, size = idx->size * 2;
+    buckets = bsp_calloc(size, sizeof(struct bsp_online_posting_t *));
+    if (!buckets)
     {
         return;
     }
 
-    BSP_ONLINE *entry = _hash_find(key);
-    if (entry)
+    for (i = 0; i < idx->size; i ++)
     {
-        // Used
-        entry->bind = fd;
-        if (entry->data)
+        for (p = idx->buckets[i]; p; p = next)
         {
-            del_object(entry->data);
-            entry->data = NULL;
+            next = p->next;
+            p->next = buckets[p->hash & (size - 1)];
+            buckets[p->hash & (size - 1)] = p;
         }
     }
-    else
-    {
-        entry = bsp_malloc(sizeof(BSP_ONLINE));
-        if (entry)
-        {
-            entry->key = bsp_strdup(key);
-            entry->bind = fd;
-            entry->data = NULL;
+    bsp_free(idx->buckets);
+    idx->buckets = buckets;
+    idx->size = size;
 
-            _hash_insert(entry);
-        }
+    return;
+}
+
+// Entry leaves its posting, empty posting removed. Swapped with the last one
+static void _index_leave(struct bsp_online_index_t *idx, int id, BSP_ONLINE *o)
+{
+    struct bsp_online_posting_t *p = o->indexed[id].posting, **link;
+    BSP_ONLINE *last;
+    if (!p)
+    {
+        return;
     }
-    trace_msg(TRACE_LEVEL_VERBOSE, "Online : New online info <%d>:[%s] registered", fd, key);
 
-    // Bind entry to fd
-    set_fd_online(fd, entry);
+    last = p->entries[-- p->nentries];
+    p->entries[o->indexed[id].pos] = last;
+    last->indexed[id].pos = o->indexed[id].pos;
+    o->indexed[id].posting = NULL;
+    if (0 == p->nentries)
+    {
+        for (link = &idx->buckets[p->hash & (idx->size - 1)]; *link != p; link = &(*link)->next);
+        *link = p->next;
+        idx->npostings --;
+        bsp_free(p->entries);
+        bsp_free(p->value);
+        bsp_free(p);
+    }
 
     return;
 }
 
-// Remove online(set offline) by given fd(bind)
-void del_online_by_bind(int fd)
+static void _index_join(struct bsp_online_index_t *idx, int id, BSP_ONLINE *o, const char *value, size_t len, uint32_t h)
 {
-    if (!fd || !online_hash)
+    struct bsp_online_posting_t *p = _index_find(idx, value, len, h);
+    BSP_ONLINE **entries;
+    if (!p)
     {
-        return;
+        p = bsp_calloc(1, sizeof(struct bsp_online_posting_t));
+        if (!p)
+        {
+            return;
+        }
+        p->value = bsp_malloc(len + 1);
+        p->entries = bsp_malloc(ONLINE_POSTING_INITIAL * sizeof(BSP_ONLINE *));
+        if (!p->value || !p->entries)
+        {
+            bsp_free(p->value);
+            bsp_free(p->entries);
+            bsp_free(p);
+            trace_msg(TRACE_LEVEL_ERROR, "Online : Create index posting error");
+            return;
+        }
+        memcpy(p->value, value, len);
+        p->value[len] = 0x0;
+        p->value_len = len;
+        p->hash = h;
+        p->size = ONLINE_POSTING_INITIAL;
+        p->next = idx->buckets[h & (idx->size - 1)];
+        idx->buckets[h & (idx->size - 1)] = p;
+        if (++ idx->npostings > idx->size)
+        {
+            _index_grow(idx);
+        }
     }
-
-    BSP_ONLINE *entry = get_fd_online(fd);
-    if (entry)
+    else if (p->nentries == p->size)
     {
-        _hash_remove(entry->key);
-        set_fd_online(fd, NULL);
-        if (entry->data)
+        entries = bsp_realloc(p->entries, p->size * 2 * sizeof(BSP_ONLINE *));
+        if (!entries)
         {
-            del_object(entry->data);
+            trace_msg(TRACE_LEVEL_ERROR, "Online : Enlarge index posting error");
+            return;
         }
-        bsp_free(entry->key);
-        bsp_free(entry);
+        p->entries = entries;
+        p->size *= 2;
     }
-    trace_msg(TRACE_LEVEL_VERBOSE, "Online : Online info <%d> removed", fd);
+
+    o->indexed[id].posting = p;
+    o->indexed[id].pos = p->nentries;
+    p->entries[p->nentries ++] = o;
 
     return;
 }
 
-// Remove online by given key
-void del_online_by_key(const char *key)
+// Move entry to postings of its data (none for NULL data) in index [from, nindexes), shard locked by caller
+static void _index_entry(BSP_ONLINE *o, int from)
 {
-    if (!key || !online_hash)
+    struct bsp_online_index_t *idx;
+    struct bsp_online_posting_t *p;
+    char buf[ONLINE_INDEX_VALUE_LENGTH];
+    const char *value;
+    size_t len = 0;
+    uint32_t h = 0;
+    int i, n = __sync_fetch_and_add(&nindexes, 0);
+    for (i = from; i < n; i ++)
     {
-        return;
+        idx = &online_indexes[i];
+        value = (o->data) ? _index_value(object_get_value(o->data, idx->field), buf, &len) : NULL;
+        if (value)
+        {
+            h = bsp_hash(value, len);
+        }
+        bsp_spin_lock(&idx->lock);
+        p = o->indexed[i].posting;
+        if (!p || !value || h != p->hash || len != p->value_len || 0 != memcmp(value, p->value, len))
+        {
+            _index_leave(idx, i, o);
+            if (value)
+            {
+                _index_join(idx, i, o, value, len, h);
+            }
+        }
+        o->indexed[i].bind = o->bind;
+        bsp_spin_unlock(&idx->lock);
     }
 
-    BSP_ONLINE *entry = _hash_remove(key);
-    if (entry)
+    return;
+}
+
+// Entry leaves all indexes, shard locked by caller
+static void _unindex_entry(BSP_ONLINE *o)
+{
+    struct bsp_online_index_t *idx;
+    int i, n = __sync_fetch_and_add(&nindexes, 0);
+    for (i = 0; i < n; i ++)
     {
-        set_fd_online(entry->bind, NULL);
-        if (entry->data)
+        if (o->indexed[i].posting)
         {
-            del_object(entry->data);
+            idx = &online_indexes[i];
+            bsp_spin_lock(&idx->lock);
+            _index_leave(idx, i, o);
+            bsp_spin_unlock(&idx->lock);
         }
-        bsp_free(entry->key);
-        bsp_free(entry);
     }
-    trace_msg(TRACE_LEVEL_VERBOSE, "Online : Online info[%s] removed", key);
 
     return;
 }
 
-// Load online data by handler
-static int _load_online_data(BSP_ONLINE *o)
+int online_add_index(const char *field)
 {
-    if (!o || !online_hash)
+    struct bsp_online_index_t *idx;
+    struct bsp_online_shard_t *shard;
+    BSP_ONLINE *o;
+    size_t j;
+    int i, id, n;
+    if (!field || !online_shards)
     {
         return BSP_RTN_ERROR_GENERAL;
     }
 
-    BSP_THREAD *t = curr_thread();
-    if (!o || !t || !t->script_runner.state)
+    bsp_spin_lock(&indexes_lock);
+    n = __sync_fetch_and_add(&nindexes, 0);
+    for (i = 0; i < n; i ++)
+    {
+        if (0 == strcmp(field, online_indexes[i].field))
+        {
+            bsp_spin_unlock(&indexes_lock);
+            return i;
+        }
+    }
+
+    if (n >= ONLINE_INDEX_MAX)
     {
+        bsp_spin_unlock(&indexes_lock);
+        trace_msg(TRACE_LEVEL_ERROR, "Online : Too many indexes");
         return BSP_RTN_ERROR_GENERAL;
     }
-    int ret = BSP_RTN_ERROR_UNKNOWN;
-    lua_settop(t->script_runner.state, 0);
-    bsp_spin_lock(&t->script_runner.lock);
-    lua_getfield(t->script_runner.state, LUA_REGISTRYINDEX, ONLINE_HANDLER_NAME_LOAD);
-    if (lua_isfunction(t->script_runner.state, -1))
+
+    idx = &online_indexes[n];
+    idx->field = bsp_strdup(field);
+    idx->buckets = bsp_calloc(ONLINE_INDEX_HASH_INITIAL, sizeof(struct bsp_online_posting_t *));
+    if (!idx->field || !idx->buckets)
     {
-        // Call
-        lua_pushstring(t->script_runner.state, o->key);
-        lua_pcall(t->script_runner.state, 1, 1, 0);
-        if (lua_istable(t->script_runner.state, -1))
+        bsp_free(idx->field);
+        bsp_free(idx->buckets);
+        idx->field = NULL;
+        idx->buckets = NULL;
+        bsp_spin_unlock(&indexes_lock);
+        trace_msg(TRACE_LEVEL_ERROR, "Online : Create index error");
+        return BSP_RTN_ERROR_MEMORY;
+    }
+    idx->size = ONLINE_INDEX_HASH_INITIAL;
+    idx->npostings = 0;
+    bsp_spin_init(&idx->lock);
+
+    // Kept by data changes from now on, entries online before are indexed shard by shard
+    id = n;
+    __sync_add_and_fetch(&nindexes, 1);
+    bsp_spin_unlock(&indexes_lock);
+    for (i = 0; i < ONLINE_SHARDS; i ++)
+    {
+        shard = &online_shards[i];
+        bsp_spin_lock(&shard->lock);
+        for (j = shard->rehash_idx; j < shard->old_size; j ++)
         {
-            // Object
-            if (o->data)
+            for (o = shard->old_buckets[j]; o; o = o->next)
             {
-                del_object(o->data);
+                if (ONLINE_OFFLINE != o->bind)
+                {
+                    _index_entry(o, id);
+                }
+            }
+        }
+
+        for (j = 0; j < shard->size; j ++)
+        {
+            for (o = shard->buckets[j]; o; o = o->next)
+            {
+                if (ONLINE_OFFLINE != o->bind)
+                {
+                    _index_entry(o, id);
+                }
             }
-            o->data = lua_stack_to_object(t->script_runner.state);
-            ret = BSP_RTN_SUCCESS;
         }
+        bsp_spin_unlock(&shard->lock);
     }
-    bsp_spin_unlock(&t->script_runner.lock);
-    lua_settop(t->script_runner.state, 0);
+    trace_msg(TRACE_LEVEL_DEBUG, "Online : Index %d on field [%s] created", id, field);
 
-    return ret;
+    return id;
 }
 
-int load_online_data_by_bind(int fd)
+/* Snapshot */
+// Serialized out of lock
+static BSP_STRING * _snapshot_record(BSP_OBJECT *data)
 {
-    BSP_ONLINE *o = get_fd_online(fd);
-    return _load_online_data(o);
+    return (online_snapshot && data) ? object_serialize(data) : NULL;
 }
 
-int load_online_data_by_key(const char *key)
+// Shard locked by caller, record only queued
+static void _snapshot_write(BSP_ONLINE *o, BSP_STRING *record, uint32_t flags)
 {
-    BSP_ONLINE *o = _hash_find(key);
-    return _load_online_data(o);
+    if (online_snapshot)
+    {
+        snapshot_write(online_snapshot, o->key, strlen(o->key), (record) ? STR_STR(record) : NULL, (record) ? STR_LEN(record) : 0, flags);
+    }
+
+    return;
 }
 
-// Save online data by handler
-static int _save_online_data(BSP_ONLINE *o)
+static BSP_OBJECT * _snapshot_object(const char *data, size_t data_len)
+{
+    BSP_STRING *str = new_string_const(data, data_len);
+    BSP_OBJECT *ret = object_unserialize(str);
+    del_string(str);
+
+    return object_freeze(ret);
+}
+
+static void _online_release(BSP_ONLINE *o)
 {
-    if (!o || !online_hash)
+    if (o && 0 == __sync_sub_and_fetch(&o->refcount, 1))
     {
-        return BSP_RTN_ERROR_GENERAL;
+        del_object(o->data);
+        bsp_free(o->key);
+        bsp_free(o);
     }
 
-    BSP_THREAD *t = curr_thread();
-    if (!o || !o->data || !t || !t->script_runner.state)
+    return;
+}
+
+// Entry of key, with a reference released by _online_release()
+static BSP_ONLINE * _online_find(const char *key)
+{
+    if (!key || !online_shards)
     {
-        return BSP_RTN_ERROR_GENERAL;
+        return NULL;
     }
-    int ret = BSP_RTN_ERROR_UNKNOWN;
-    lua_settop(t->script_runner.state, 0);
-    bsp_spin_lock(&t->script_runner.lock);
-    lua_getfield(t->script_runner.state, LUA_REGISTRYINDEX, ONLINE_HANDLER_NAME_SAVE);
-    if (lua_isfunction(t->script_runner.state, -1))
+
+    uint32_t h = bsp_hash(key, -1);
+    struct bsp_online_shard_t *shard = _shard_of(h);
+    BSP_ONLINE **link, *ret = NULL;
+    bsp_spin_lock(&shard->lock);
+    _shard_rehash(shard);
+    link = _shard_lookup(shard, key, h);
+    if (link)
     {
-        // Call
-        lua_pushstring(t->script_runner.state, o->key);
-        object_to_lua_stack(t->script_runner.state, o->data);
-        lua_pcall(t->script_runner.state, 2, 1, 0);
-        if (lua_isboolean(t->script_runner.state, -1))
+        ret = *link;
+        __sync_add_and_fetch(&ret->refcount, 1);
+    }
+    bsp_spin_unlock(&shard->lock);
+
+    return ret;
+}
+
+// Entry of key removed if bound to expect (ONLINE_OFFLINE : any bind), returned with a reference
+// released by _online_release(). Bind before removing set to bind. Dirty entry stays offline in table until saved
+static BSP_ONLINE * _online_remove(const char *key, int expect, int *bind)
+{
+    BSP_ONLINE *unlinked = NULL;
+    *bind = ONLINE_OFFLINE;
+    if (!key || !online_shards)
+    {
+        return NULL;
+    }
+
+    uint32_t h = bsp_hash(key, -1);
+    struct bsp_online_shard_t *shard = _shard_of(h);
+    BSP_ONLINE **link, *ret = NULL;
+    bsp_spin_lock(&shard->lock);
+    _shard_rehash(shard);
+    link = _shard_lookup(shard, key, h);
+    if (link && (ONLINE_OFFLINE == expect || expect == (*link)->bind))
+    {
+        ret = *link;
+        __sync_add_and_fetch(&ret->refcount, 1);
+        *bind = ret->bind;
+        _unindex_entry(ret);
+        if (ret->dirty)
         {
-            // Boolean
-            int b = lua_toboolean(t->script_runner.state, -1);
-            if (b)
-            {
-                ret = BSP_RTN_SUCCESS;
-            }
-            else
-            {
-                ret = BSP_RTN_ERROR_SCRIPT;
-            }
+            ret->bind = ONLINE_OFFLINE;
+        }
+        else
+        {
+            unlinked = ret;
+            *link = ret->next;
+            ret->next = NULL;
+            shard->nitems --;
+            _snapshot_write(ret, NULL, SNAPSHOT_FLAG_REMOVED);
         }
     }
-    bsp_spin_unlock(&t->script_runner.lock);
-    lua_settop(t->script_runner.state, 0);
+    bsp_spin_unlock(&shard->lock);
+
+    // Reference of table, caller still holds one
+    _online_release(unlinked);
 
     return ret;
 }
 
-int save_online_data_by_bind(int fd)
+// Offline entry leaves table once saved
+static int _online_drop(BSP_ONLINE *o)
 {
-    BSP_ONLINE *o = get_fd_online(fd);
-    return _save_online_data(o);
+    struct bsp_online_shard_t *shard = _shard_of(o->hash);
+    BSP_ONLINE **link;
+    int ret = 0;
+    bsp_spin_lock(&shard->lock);
+    if (ONLINE_OFFLINE == o->bind && !o->dirty)
+    {
+        link = _shard_lookup(shard, o->key, o->hash);
+        if (link && o == *link)
+        {
+            *link = o->next;
+            o->next = NULL;
+            shard->nitems --;
+            _snapshot_write(o, NULL, SNAPSHOT_FLAG_REMOVED);
+            ret = 1;
+        }
+    }
+    bsp_spin_unlock(&shard->lock);
+
+    return ret;
 }
 
-int save_online_data_by_key(const char *key)
+/* Binds */
+// Entry bound to fd, with a reference released by _online_release()
+static BSP_ONLINE * _bind_get(int fd)
 {
-    BSP_ONLINE *o = _hash_find(key);
-    return _save_online_data(o);
+    BSP_SPINLOCK *lock = &online_bind_locks[(unsigned int) fd % ONLINE_BIND_LOCKS];
+    BSP_ONLINE *ret = NULL;
+    bsp_spin_lock(lock);
+    ret = get_fd_online(fd);
+    if (ret)
+    {
+        __sync_add_and_fetch(&ret->refcount, 1);
+    }
+    bsp_spin_unlock(lock);
+
+    return ret;
 }
 
-// Get online data
-BSP_OBJECT * get_online_data_by_key(const char *key)
+// Fd refers o (NULL : nothing) when o is NULL or still the bound one, reference of fd list moved along
+static void _bind_set(int fd, BSP_ONLINE *o, BSP_ONLINE *expect)
 {
-    if (!key || !online_hash)
+    BSP_SPINLOCK *lock = &online_bind_locks[(unsigned int) fd % ONLINE_BIND_LOCKS];
+    BSP_ONLINE *old = NULL;
+    bsp_spin_lock(lock);
+    old = get_fd_online(fd);
+    if (expect && expect != old)
     {
-        return NULL;
+        // Bound to another entry already
+        old = NULL;
     }
-
-    BSP_ONLINE *o = _hash_find(key);
-    if (o)
+    else
     {
-        return o->data;
+        set_fd_online(fd, o);
+        if (get_fd_online(fd) != o)
+        {
+            // Fd not registered, nothing changed
+            old = NULL;
+        }
+        else if (o)
+        {
+            __sync_add_and_fetch(&o->refcount, 1);
+        }
     }
+    bsp_spin_unlock(lock);
+    _online_release(old);
 
-    return NULL;
+    return;
 }
 
-BSP_OBJECT * get_online_data_by_bind(int fd)
+// Entry queued once until flushed, shard locked by caller
+static void _mark_dirty(BSP_ONLINE *o)
 {
-    if (!fd || !online_hash)
+    BSP_CORE_SETTING *settings = get_core_setting();
+    if (!settings || settings->online_autosave_interval <= 0)
     {
-        return NULL;
+        // Saved by caller only
+        return;
     }
 
-    BSP_ONLINE *o = get_fd_online(fd);
-    if (o)
+    o->dirty = 1;
+    bsp_spin_lock(&dirty_lock);
+    if (!o->queued)
     {
-        return o->data;
+        o->queued = 1;
+        o->dirty_since = time(NULL);
+        o->dirty_next = NULL;
+        __sync_add_and_fetch(&o->refcount, 1);
+        if (dirty_tail)
+        {
+            dirty_tail->dirty_next = o;
+        }
+        else
+        {
+            dirty_head = o;
+        }
+        dirty_tail = o;
+        ndirty ++;
     }
+    bsp_spin_unlock(&dirty_lock);
 
-    return NULL;
+    return;
 }
 
-// Online list
-BSP_OBJECT * get_online_list(const char *condition)
+// Data replaced under shard lock, readers hold their own references. Replaced one returned.
+// Data from storage never replaces dirty data, it is returned itself. Record (serialized data) goes to snapshot
+static BSP_OBJECT * _swap_online_data(BSP_ONLINE *o, BSP_OBJECT *data, int dirty, BSP_STRING *record)
 {
-    if (!online_hash)
+    struct bsp_online_shard_t *shard = _shard_of(o->hash);
+    BSP_OBJECT *old = data;
+    bsp_spin_lock(&shard->lock);
+    if (dirty || !o->dirty)
     {
-        return NULL;
+        old = o->data;
+        o->data = data;
+        if (ONLINE_OFFLINE != o->bind)
+        {
+            _index_entry(o, 0);
+        }
+
+        if (dirty)
+        {
+            _mark_dirty(o);
+        }
+
+        if (record)
+        {
+            _snapshot_write(o, record, (dirty) ? SNAPSHOT_FLAG_DIRTY : 0);
+        }
     }
+    bsp_spin_unlock(&shard->lock);
 
-    if (!condition)
+    return old;
+}
+
+// Entry clean if data not replaced while saving
+static void _mark_saved(BSP_ONLINE *o, BSP_OBJECT *data)
+{
+    struct bsp_online_shard_t *shard = _shard_of(o->hash);
+    bsp_spin_lock(&shard->lock);
+    if (data == o->data)
     {
-        // All
+        o->dirty = 0;
+        _snapshot_write(o, NULL, SNAPSHOT_FLAG_SAVED);
     }
+    o->last_save = time(NULL);
+    bsp_spin_unlock(&shard->lock);
 
-    BSP_OBJECT *ret = new_object(OBJECT_TYPE_ARRAY);
-    BSP_VALUE *val = NULL;
-    BSP_ONLINE *o = NULL;
-    int i;
-    bsp_spin_lock(&hash_lock);
-    for (i = 0; i < ONLINE_HASH_SIZE; i ++)
-    {
-        o = online_hash[i];
-        while (o)
-        {
-            val = new_value();
-            value_set_int(val, o->bind);
-            object_set_array(ret, -1, val);
-            o = o->next;
-        }
+    return;
+}
+
+static BSP_OBJECT * _ref_online_data(BSP_ONLINE *o)
+{
+    struct bsp_online_shard_t *shard = _shard_of(o->hash);
+    bsp_spin_lock(&shard->lock);
+    BSP_OBJECT *ret = object_ref(o->data);
+    bsp_spin_unlock(&shard->lock);
+
+    return ret;
+}
+
+// Create new online entry
+void new_online(int fd, const char *key)
+{
+    if (!key || !online_shards)
+    {
+        return;
+    }
+
+    uint32_t h = bsp_hash(key, -1);
+    struct bsp_online_shard_t *shard = _shard_of(h);
+    BSP_ONLINE **link, *entry = NULL;
+    BSP_OBJECT *old = NULL;
+    int prev = fd;
+
+    // Prepared out of lock, dropped if key is already online
+    BSP_ONLINE *fresh = bsp_calloc(1, sizeof(BSP_ONLINE));
+    if (fresh)
+    {
+        fresh->key = bsp_strdup(key);
+        fresh->hash = h;
+        fresh->bind = fd;
+        fresh->refcount = 1;
+        if (!fresh->key)
+        {
+            bsp_free(fresh);
+            fresh = NULL;
+        }
+    }
+
+    bsp_spin_lock(&shard->lock);
+    _shard_rehash(shard);
+    link = _shard_lookup(shard, key, h);
+    if (link)
+    {
+        // Used
+        entry = *link;
+        prev = entry->bind;
+        entry->bind = fd;
+        if (entry->dirty)
+        {
+            // Not saved yet, newer than storage
+            _index_entry(entry, 0);
+        }
+        else
+        {
+            old = entry->data;
+            entry->data = NULL;
+            _unindex_entry(entry);
+        }
+    }
+    else if (fresh)
+    {
+        _shard_grow(shard);
+        entry = fresh;
+        fresh = NULL;
+        entry->next = shard->buckets[h & (shard->size - 1)];
+        shard->buckets[h & (shard->size - 1)] = entry;
+        shard->nitems ++;
+    }
+
+    if (entry)
+    {
+        // Held until bound to fd
+        __sync_add_and_fetch(&entry->refcount, 1);
+    }
+    bsp_spin_unlock(&shard->lock);
+
+    del_object(old);
+    if (fresh)
+    {
+        bsp_free(fresh->key);
+        bsp_free(fresh);
+    }
+
+    if (entry)
+    {
+        trace_msg(TRACE_LEVEL_VERBOSE, "Online : New online info <%d>:[%s] registered", fd, key);
+    }
+    else
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Online : Create online entry error");
+    }
+
+    // Bind entry to fd, the fd bound before no longer refers it
+    if (entry && prev != fd && ONLINE_OFFLINE != prev)
+    {
+        _bind_set(prev, NULL, entry);
+    }
+    _bind_set(fd, entry, NULL);
+
+    // Tell other instances on host
+    if (entry && ONLINE_OFFLINE != fd)
+    {
+        presence_set(key, fd);
+    }
+    _online_release(entry);
+
+    return;
+}
+
+// Remove online(set offline) by given fd(bind)
+void del_online_by_bind(int fd)
+{
+    if (!fd || !online_shards)
+    {
+        return;
+    }
+
+    BSP_ONLINE *entry = _bind_get(fd);
+    int bind;
+    if (entry)
+    {
+        _bind_set(fd, NULL, entry);
+        presence_del(entry->key, fd);
+        // Already removed by key if not in table, kept if bound to another fd meanwhile
+        _online_release(_online_remove(entry->key, fd, &bind));
+        _online_release(entry);
+    }
+    trace_msg(TRACE_LEVEL_VERBOSE, "Online : Online info <%d> removed", fd);
+
+    return;
+}
+
+// Remove online by given key
+void del_online_by_key(const char *key)
+{
+    if (!key || !online_shards)
+    {
+        return;
+    }
+
+    int bind;
+    BSP_ONLINE *entry = _online_remove(key, ONLINE_OFFLINE, &bind);
+    if (entry && ONLINE_OFFLINE != bind)
+    {
+        // Fd may be reused by another entry already
+        _bind_set(bind, NULL, entry);
+        presence_del(key, bind);
+    }
+    _online_release(entry);
+    trace_msg(TRACE_LEVEL_VERBOSE, "Online : Online info[%s] removed", key);
+
+    return;
+}
+
+// Data left in snapshot by last run, taken once
+static int _load_snapshot_data(BSP_ONLINE *o)
+{
+    size_t len = 0;
+    uint32_t flags = 0;
+    const char *raw = snapshot_take(online_snapshot, o->key, strlen(o->key), &len, &flags);
+    BSP_OBJECT *data;
+    if (!raw)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    data = _snapshot_object(raw, len);
+    if (!data)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Online : Bad snapshot data of [%s]", o->key);
+        return BSP_RTN_ERROR_GENERAL;
+    }
+    del_object(_swap_online_data(o, data, (flags & SNAPSHOT_FLAG_DIRTY) ? 1 : 0, NULL));
+
+    return BSP_RTN_SUCCESS;
+}
+
+// Load online data by handler
+static int _load_online_data(BSP_ONLINE *o)
+{
+    if (!o || !online_shards)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    // Warm restart, storage not touched
+    if (BSP_RTN_SUCCESS == _load_snapshot_data(o))
+    {
+        return BSP_RTN_SUCCESS;
+    }
+
+    BSP_THREAD *t = curr_thread();
+    if (!o || !t || !t->script_runner.state)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+    int ret = BSP_RTN_ERROR_UNKNOWN;
+    lua_settop(t->script_runner.state, 0);
+    bsp_spin_lock(&t->script_runner.lock);
+    lua_getfield(t->script_runner.state, LUA_REGISTRYINDEX, ONLINE_HANDLER_NAME_LOAD);
+    if (lua_isfunction(t->script_runner.state, -1))
+    {
+        // Call
+        lua_pushstring(t->script_runner.state, o->key);
+        lua_pcall(t->script_runner.state, 1, 1, 0);
+        if (lua_istable(t->script_runner.state, -1))
+        {
+            // Online data lives longer than the event, frozen and shared by readers
+            BSP_OBJECT *data = object_freeze(lua_stack_to_object(t->script_runner.state));
+            BSP_STRING *record = _snapshot_record(data);
+            BSP_OBJECT *old = _swap_online_data(o, data, 0, record);
+            del_object(old);
+            del_string(record);
+            ret = BSP_RTN_SUCCESS;
+        }
+    }
+    bsp_spin_unlock(&t->script_runner.lock);
+    lua_settop(t->script_runner.state, 0);
+
+    return ret;
+}
+
+int load_online_data_by_bind(int fd)
+{
+    BSP_ONLINE *o = (online_shards) ? _bind_get(fd) : NULL;
+    int ret = _load_online_data(o);
+    _online_release(o);
+
+    return ret;
+}
+
+int load_online_data_by_key(const char *key)
+{
+    BSP_ONLINE *o = _online_find(key);
+    int ret = _load_online_data(o);
+    _online_release(o);
+
+    return ret;
+}
+
+// Save data by handler
+static int _call_save_handler(const char *key, BSP_OBJECT *data)
+{
+    BSP_THREAD *t = curr_thread();
+    if (!t || !t->script_runner.state)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+    int ret = BSP_RTN_ERROR_UNKNOWN;
+    lua_settop(t->script_runner.state, 0);
+    bsp_spin_lock(&t->script_runner.lock);
+    lua_getfield(t->script_runner.state, LUA_REGISTRYINDEX, ONLINE_HANDLER_NAME_SAVE);
+    if (lua_isfunction(t->script_runner.state, -1))
+    {
+        // Call
+        lua_pushstring(t->script_runner.state, key);
+        object_to_lua_stack(t->script_runner.state, data);
+        lua_pcall(t->script_runner.state, 2, 1, 0);
+        if (lua_isboolean(t->script_runner.state, -1))
+        {
+            // Boolean
+            int b = lua_toboolean(t->script_runner.state, -1);
+            if (b)
+            {
+                ret = BSP_RTN_SUCCESS;
+            }
+            else
+            {
+                ret = BSP_RTN_ERROR_SCRIPT;
+            }
+        }
+    }
+    bsp_spin_unlock(&t->script_runner.lock);
+    lua_settop(t->script_runner.state, 0);
+
+    return ret;
+}
+
+static int _save_online_data(BSP_ONLINE *o)
+{
+    if (!o || !online_shards)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    BSP_OBJECT *data = _ref_online_data(o);
+    if (!data)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+    int ret = _call_save_handler(o->key, data);
+    if (BSP_RTN_SUCCESS == ret)
+    {
+        _mark_saved(o, data);
+    }
+    del_object(data);
+
+    return ret;
+}
+
+int save_online_data_by_bind(int fd)
+{
+    BSP_ONLINE *o = (online_shards) ? _bind_get(fd) : NULL;
+    int ret = _save_online_data(o);
+    _online_release(o);
+
+    return ret;
+}
+
+int save_online_data_by_key(const char *key)
+{
+    BSP_ONLINE *o = _online_find(key);
+    int ret = _save_online_data(o);
+    _online_release(o);
+
+    return ret;
+}
+
+// Get online data, a reference (frozen) must be released by del_object()
+BSP_OBJECT * get_online_data_by_key(const char *key)
+{
+    if (!key || !online_shards)
+    {
+        return NULL;
+    }
+
+    BSP_ONLINE *o = _online_find(key);
+    BSP_OBJECT *ret = NULL;
+    if (o)
+    {
+        ret = _ref_online_data(o);
+        _online_release(o);
+    }
+
+    return ret;
+}
+
+BSP_OBJECT * get_online_data_by_bind(int fd)
+{
+    if (!fd || !online_shards)
+    {
+        return NULL;
+    }
+
+    BSP_ONLINE *o = _bind_get(fd);
+    BSP_OBJECT *ret = NULL;
+    if (o)
+    {
+        ret = _ref_online_data(o);
+        _online_release(o);
+    }
+
+    return ret;
+}
+
+// Replace data
+static int _set_online_data(BSP_ONLINE *o, BSP_OBJECT *data)
+{
+    if (!o || !data)
+    {
+        del_object(data);
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    data = object_freeze(data);
+    if (!data)
+    {
+        return BSP_RTN_ERROR_MEMORY;
+    }
+    BSP_STRING *record = _snapshot_record(data);
+    del_object(_swap_online_data(o, data, 1, record));
+    del_string(record);
+
+    return BSP_RTN_SUCCESS;
+}
+
+int set_online_data_by_key(const char *key, BSP_OBJECT *data)
+{
+    BSP_ONLINE *o = _online_find(key);
+    int ret = _set_online_data(o, data);
+    _online_release(o);
+
+    return ret;
+}
+
+int set_online_data_by_bind(int fd, BSP_OBJECT *data)
+{
+    BSP_ONLINE *o = (fd && online_shards) ? _bind_get(fd) : NULL;
+    int ret = _set_online_data(o, data);
+    _online_release(o);
+
+    return ret;
+}
+
+// Autosave, snapshot records flushed along (interval 0 : snapshot only)
+void online_autosave(int interval)
+{
+    BSP_CORE_SETTING *settings = get_core_setting();
+    BSP_ONLINE *o;
+    time_t now = time(NULL);
+    size_t n, noverdue = 0, nbatches, i;
+    int nworkers = (settings && settings->static_workers > 0) ? settings->static_workers : 1;
+    if (!online_shards)
+    {
+        return;
+    }
+
+    if (interval <= 0)
+    {
+        // Snapshot records only
+        if (snapshot_pending(online_snapshot) > 0)
+        {
+            trigger_autosave(flush_worker);
+            flush_worker = (flush_worker + 1) % nworkers;
+        }
+
+        return;
+    }
+
+    // Spread across interval, entries dirty for a whole interval (queue head) go now
+    bsp_spin_lock(&dirty_lock);
+    n = (ndirty + interval - 1) / interval;
+    for (o = dirty_head; o && o->dirty_since + interval <= now; o = o->dirty_next)
+    {
+        noverdue ++;
+    }
+    bsp_spin_unlock(&dirty_lock);
+    if (noverdue > n)
+    {
+        n = noverdue;
+    }
+
+    // Quota not used in last round dropped
+    __sync_lock_test_and_set(&flush_quota, (int) n);
+    nbatches = (n + ONLINE_FLUSH_BATCH - 1) / ONLINE_FLUSH_BATCH;
+    if (0 == nbatches && snapshot_pending(online_snapshot) > 0)
+    {
+        // Snapshot records left by removals and saves
+        nbatches = 1;
+    }
+
+    for (i = 0; i < nbatches && i < (size_t) nworkers; i ++)
+    {
+        trigger_autosave(flush_worker);
+        flush_worker = (flush_worker + 1) % nworkers;
+    }
+
+    return;
+}
+
+void online_flush()
+{
+    struct bsp_online_shard_t *shard;
+    BSP_ONLINE *o;
+    BSP_OBJECT *data;
+    int i;
+    for (i = 0; i < ONLINE_FLUSH_BATCH; i ++)
+    {
+        if (__sync_sub_and_fetch(&flush_quota, 1) < 0)
+        {
+            __sync_add_and_fetch(&flush_quota, 1);
+            break;
+        }
+
+        bsp_spin_lock(&dirty_lock);
+        o = dirty_head;
+        if (o)
+        {
+            dirty_head = o->dirty_next;
+            if (!dirty_head)
+            {
+                dirty_tail = NULL;
+            }
+            o->dirty_next = NULL;
+            o->queued = 0;
+            ndirty --;
+        }
+        bsp_spin_unlock(&dirty_lock);
+        if (!o)
+        {
+            break;
+        }
+
+        // Saved already if clean
+        shard = _shard_of(o->hash);
+        bsp_spin_lock(&shard->lock);
+        data = (o->dirty) ? object_ref(o->data) : NULL;
+        bsp_spin_unlock(&shard->lock);
+        if (data)
+        {
+            if (BSP_RTN_SUCCESS == _call_save_handler(o->key, data))
+            {
+                _mark_saved(o, data);
+            }
+            else
+            {
+                // Retried later
+                trace_msg(TRACE_LEVEL_ERROR, "Online : Autosave online data of [%s] failed", o->key);
+                bsp_spin_lock(&shard->lock);
+                _mark_dirty(o);
+                bsp_spin_unlock(&shard->lock);
+            }
+            del_object(data);
+        }
+
+        if (_online_drop(o))
+        {
+            _online_release(o);
+        }
+        _online_release(o);
+    }
+
+    // Records of this batch and before, out of any lock
+    if (online_snapshot)
+    {
+        snapshot_flush(online_snapshot);
+    }
+
+    return;
+}
+
+// Dirty data of last run, offline until saved by autosave
+static void _restore_dirty(const char *key, size_t key_len, const char *data, size_t data_len)
+{
+    char *k = bsp_strndup(key, key_len);
+    BSP_OBJECT *obj = _snapshot_object(data, data_len);
+    BSP_ONLINE *o = NULL;
+    if (k && obj)
+    {
+        new_online(ONLINE_OFFLINE, k);
+        o = _online_find(k);
+        if (o)
+        {
+            del_object(_swap_online_data(o, obj, 1, NULL));
+            obj = NULL;
+        }
+        _online_release(o);
+    }
+    del_object(obj);
+    bsp_free(k);
+
+    return;
+}
+
+int online_snapshot_open(const char *filename)
+{
+    BSP_CORE_SETTING *settings = get_core_setting();
+    if (!filename || !online_shards || online_snapshot)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    online_snapshot = snapshot_open(filename);
+    if (!online_snapshot)
+    {
+        return BSP_RTN_ERROR_IO;
+    }
+
+    if (settings && settings->online_autosave_interval > 0)
+    {
+        snapshot_take_flagged(online_snapshot, SNAPSHOT_FLAG_DIRTY, _restore_dirty);
+    }
+
+    return BSP_RTN_SUCCESS;
+}
+
+// Number of binds in shard copied to binds
+static size_t _shard_binds(struct bsp_online_shard_t *shard, int *binds)
+{
+    BSP_ONLINE *o;
+    size_t i, n = 0;
+    for (i = shard->rehash_idx; i < shard->old_size; i ++)
+    {
+        for (o = shard->old_buckets[i]; o; o = o->next)
+        {
+            if (ONLINE_OFFLINE != o->bind)
+            {
+                binds[n ++] = o->bind;
+            }
+        }
+    }
+
+    for (i = 0; i < shard->size; i ++)
+    {
+        for (o = shard->buckets[i]; o; o = o->next)
+        {
+            if (ONLINE_OFFLINE != o->bind)
+            {
+                binds[n ++] = o->bind;
+            }
+        }
+    }
+
+    return n;
+}
+
+// All binds. Shards copied one by one, others never blocked
+static int * _all_binds(size_t *nbinds)
+{
+    struct bsp_online_shard_t *shard;
+    int *binds = NULL, *tmp;
+    size_t size = 0, need, i;
+    for (i = 0; i < ONLINE_SHARDS; i ++)
+    {
+        shard = &online_shards[i];
+        bsp_spin_lock(&shard->lock);
+        while (*nbinds + shard->nitems > size)
+        {
+            // Enlarge buffer out of lock
+            need = (*nbinds + shard->nitems) * 2;
+            bsp_spin_unlock(&shard->lock);
+            tmp = bsp_realloc(binds, need * sizeof(int));
+            if (!tmp)
+            {
+                trace_msg(TRACE_LEVEL_ERROR, "Online : Alloc online list error");
+                return binds;
+            }
+            binds = tmp;
+            size = need;
+            bsp_spin_lock(&shard->lock);
+        }
+        *nbinds += _shard_binds(shard, binds + *nbinds);
+        bsp_spin_unlock(&shard->lock);
+    }
+
+    return binds;
+}
+
+// Binds of entries in postings of all terms, the shortest posting walked
+static int * _query_binds(const char *condition, size_t *nbinds)
+{
+    struct bsp_online_posting_t *postings[ONLINE_INDEX_MAX], *shortest = NULL;
+    const char *values[ONLINE_INDEX_MAX], *term = condition, *eq, *end;
+    size_t lens[ONLINE_INDEX_MAX], j;
+    uint32_t hashes[ONLINE_INDEX_MAX];
+    BSP_ONLINE *o;
+    int *ret = NULL;
+    int i, n = __sync_fetch_and_add(&nindexes, 0), empty = 0, si = 0;
+    memset(values, 0, sizeof(values));
+    while (*term)
+    {
+        end = strchr(term, '&');
+        if (!end)
+        {
+            end = term + strlen(term);
+        }
+
+        eq = memchr(term, '=', end - term);
+        for (i = 0; eq && i < n; i ++)
+        {
+            if (strlen(online_indexes[i].field) == (size_t) (eq - term) && 0 == strncmp(term, online_indexes[i].field, eq - term))
+            {
+                break;
+            }
+        }
+
+        if (!eq || i == n)
+        {
+            trace_msg(TRACE_LEVEL_ERROR, "Online : Condition [%s] on field not indexed", condition);
+            return NULL;
+        }
+
+        if (values[i] && (lens[i] != (size_t) (end - eq - 1) || 0 != memcmp(values[i], eq + 1, lens[i])))
+        {
+            // One field with two values
+            empty = 1;
+        }
+        values[i] = eq + 1;
+        lens[i] = end - eq - 1;
+        hashes[i] = bsp_hash(values[i], lens[i]);
+        term = (*end) ? end + 1 : end;
+    }
+
+    if (empty)
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < n; i ++)
+    {
+        if (values[i])
+        {
+            bsp_spin_lock(&online_indexes[i].lock);
+            postings[i] = _index_find(&online_indexes[i], values[i], lens[i], hashes[i]);
+            if (!postings[i])
+            {
+                empty = 1;
+            }
+            else if (!shortest || postings[i]->nentries < shortest->nentries)
+            {
+                shortest = postings[i];
+                si = i;
+            }
+        }
+    }
+
+    if (!empty && shortest)
+    {
+        ret = bsp_malloc(shortest->nentries * sizeof(int));
+        for (j = 0; ret && j < shortest->nentries; j ++)
+        {
+            o = shortest->entries[j];
+            for (i = 0; i < n; i ++)
+            {
+                if (values[i] && o->indexed[i].posting != postings[i])
+                {
+                    break;
+                }
+            }
+
+            // Bind written under shard lock, its copy in the walked index taken
+            if (i == n && ONLINE_OFFLINE != o->indexed[si].bind)
+            {
+                ret[(*nbinds) ++] = o->indexed[si].bind;
+            }
+        }
+    }
+
+    for (i = n - 1; i >= 0; i --)
+    {
+        if (values[i])
+        {
+            bsp_spin_unlock(&online_indexes[i].lock);
+        }
+    }
+
+    return ret;
+}
+
+int * get_online_binds(const char *condition, size_t *nbinds)
+{
+    if (!nbinds)
+    {
+        return NULL;
+    }
+
+    *nbinds = 0;
+    if (!online_shards)
+    {
+        return NULL;
+    }
+
+    if (!condition || !condition[0])
+    {
+        // All
+        return _all_binds(nbinds);
+    }
+
+    return _query_binds(condition, nbinds);
+}
+
+// Online list
+BSP_OBJECT * get_online_list(const char *condition)
+{
+    if (!online_shards)
+    {
+        return NULL;
+    }
+
+    BSP_OBJECT *ret = new_object(OBJECT_TYPE_ARRAY);
+    size_t nbinds, i;
+    int *binds;
+    if (!ret)
+    {
+        return NULL;
+    }
+
+    binds = get_online_binds(condition, &nbinds);
+    object_array_reserve(ret, nbinds);
+    for (i = 0; i < nbinds; i ++)
+    {
+        value_set_int(object_array_push(ret), binds[i]);
     }
-    bsp_spin_unlock(&hash_lock);
+    bsp_free(binds);
 
     return ret;
 }
@@ -22,16 +22,19 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 10/23/2012
+ * @update 12/06/2014
  * @changelog 
  *      [06/06/2012] - Creation
  *      [10/23/2012] - Stop signal capture added
+ *      [12/06/2014] - Transparent huge pages for memory blocks
  */
 
 #include "bsp.h"
 
 #include <signal.h>
 
+static size_t large_page_size = 0;
+
 // Capture signals
 // All quit signals will redirect to function exit_handler
 // SIGPIPE will be ignored
@@ -217,8 +220,31 @@ int enable_large_pages()
     }
     
     return ret;
+#elif defined(MADV_HUGEPAGE)
+    // Memory blocks (mempool) aligned and advised
+    large_page_size = LARGE_PAGE_SIZE;
+    trace_msg(TRACE_LEVEL_CORE, "Core   : Transparent huge pages enabled for memory blocks");
+    return 0;
 #else
     trace_msg(TRACE_LEVEL_CORE, "Core   : HugeTLB not supported on this system");
     return 0;
 #endif
 }
+
+// 0 if large page not enabled
+size_t get_large_page_size()
+{
+    return large_page_size;
+}
+
+int advise_large_pages(void *addr, size_t len)
+{
+#ifdef MADV_HUGEPAGE
+    if (large_page_size && addr && len >= large_page_size)
+    {
+        return madvise(addr, len, MADV_HUGEPAGE);
+    }
+#endif
+
+    return BSP_RTN_ERROR_GENERAL;
+}
@@ -0,0 +1,532 @@
+/*
+ * presence.c
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Presence table in shared memory. Instances on one host tell where a key
+ * is online : writers take a lock in segment, readers never lock.
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/15/2014
+ * @changelog
+ *      [12/15/2014] - Creation
+ */
+
+#include "bsp.h"
+
+#include <sched.h>
+#include <signal.h>
+
+static struct bsp_presence_head_t *presence_head = NULL;
+static struct bsp_presence_slot_t *presence_slots = NULL;
+static size_t presence_map_size = 0;
+static int presence_fd = -1;
+static int presence_instance = 0;
+
+// Seed kept in segment, hash is the same in every process
+static inline uint64_t _presence_hash(const char *key, size_t len)
+{
+    uint64_t h = bsp_hash64(key, len, presence_head->seed);
+
+    return (h) ? h : 1;
+}
+
+static inline void _slot_write_begin(struct bsp_presence_slot_t *slot)
+{
+    slot->seq ++;
+    __sync_synchronize();
+
+    return;
+}
+
+static inline void _slot_write_end(struct bsp_presence_slot_t *slot)
+{
+    __sync_synchronize();
+    slot->seq ++;
+
+    return;
+}
+
+// Slots left in writing by a dead writer are dropped
+static void _presence_repair()
+{
+    struct bsp_presence_slot_t *slot;
+    uint32_t i, nused = 0;
+    for (i = 0; i < presence_head->nslots; i ++)
+    {
+        slot = &presence_slots[i];
+        if (slot->seq & 1)
+        {
+            slot->state = PRESENCE_SLOT_DELETED;
+            _slot_write_end(slot);
+        }
+
+        if (PRESENCE_SLOT_USED == slot->state)
+        {
+            nused ++;
+        }
+    }
+    presence_head->nused = nused;
+
+    return;
+}
+
+// Lock of writers of all processes, taken over from a dead owner
+static void _presence_lock()
+{
+    int32_t self = (int32_t) getpid(), owner;
+    size_t tries = 0;
+    while (!__sync_bool_compare_and_swap(&presence_head->lock, 0, self))
+    {
+        if (++ tries < PRESENCE_LOCK_SPIN)
+        {
+            continue;
+        }
+
+        tries = 0;
+        owner = presence_head->lock;
+        if (owner && owner != self && 0 != kill(owner, 0) && ESRCH == errno &&
+            __sync_bool_compare_and_swap(&presence_head->lock, owner, self))
+        {
+            trace_msg(TRACE_LEVEL_ERROR, "Presen : Lock taken over from dead process %d", (int) owner);
+            _presence_repair();
+            return;
+        }
+        sched_yield();
+    }
+
+    return;
+}
+
+static inline void _presence_unlock()
+{
+    __sync_lock_release(&presence_head->lock);
+
+    return;
+}
+
+// Slot of key, or NULL with the first free slot on its probe chain. Lock held
+static struct bsp_presence_slot_t * _slot_find(const char *key, size_t len, uint64_t h, struct bsp_presence_slot_t **avail)
+{
+    struct bsp_presence_slot_t *slot;
+    uint32_t mask = presence_head->nslots - 1, i;
+    *avail = NULL;
+    for (i = 0; i < presence_head->nslots; i ++)
+    {
+        slot = &presence_slots[(h + i) & mask];
+        if (PRESENCE_SLOT_EMPTY == slot->state)
+        {
+            if (!*avail)
+            {
+                *avail = slot;
+            }
+
+            return NULL;
+        }
+
+        if (PRESENCE_SLOT_DELETED == slot->state)
+        {
+            if (!*avail)
+            {
+                *avail = slot;
+            }
+
+            continue;
+        }
+
+        if (h == slot->hash && len == slot->key_len && 0 == memcmp(key, slot->key, len))
+        {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+// A deleted slot before an empty one ends no probe chain, it becomes empty too
+static void _slot_delete(struct bsp_presence_slot_t *slot)
+{
+    uint32_t mask = presence_head->nslots - 1, idx = (uint32_t) (slot - presence_slots);
+    _slot_write_begin(slot);
+    slot->state = (PRESENCE_SLOT_EMPTY == presence_slots[(idx + 1) & mask].state) ? PRESENCE_SLOT_EMPTY : PRESENCE_SLOT_DELETED;
+    _slot_write_end(slot);
+    presence_head->nused --;
+    while (PRESENCE_SLOT_EMPTY == slot->state)
+    {
+        idx = (idx - 1) & mask;
+        slot = &presence_slots[idx];
+        if (PRESENCE_SLOT_DELETED != slot->state)
+        {
+            break;
+        }
+
+        _slot_write_begin(slot);
+        slot->state = PRESENCE_SLOT_EMPTY;
+        _slot_write_end(slot);
+    }
+
+    return;
+}
+
+// Entries of this instance left by last run
+static void _presence_purge()
+{
+    struct bsp_presence_slot_t *slot;
+    uint32_t i, npurged = 0;
+    _presence_lock();
+    for (i = 0; i < presence_head->nslots; i ++)
+    {
+        slot = &presence_slots[i];
+        if (PRESENCE_SLOT_USED == slot->state && presence_instance == slot->instance_id)
+        {
+            _slot_delete(slot);
+            npurged ++;
+        }
+    }
+    _presence_unlock();
+
+    if (npurged > 0)
+    {
+        trace_msg(TRACE_LEVEL_NOTICE, "Presen : %d entries of last run cleared", (int) npurged);
+    }
+
+    return;
+}
+
+// Segment created by another instance, wait until its head written
+static int _presence_attach(int fd)
+{
+    struct bsp_presence_head_t *head = NULL;
+    struct stat st;
+    size_t size = 0;
+    int i;
+    for (i = 0; i < PRESENCE_OPEN_WAIT; i ++)
+    {
+        if (!head && 0 == fstat(fd, &st) && st.st_size >= (off_t) sizeof(struct bsp_presence_head_t))
+        {
+            head = mmap(NULL, sizeof(struct bsp_presence_head_t), PROT_READ, MAP_SHARED, fd, 0);
+            if (MAP_FAILED == head)
+            {
+                return BSP_RTN_ERROR_IO;
+            }
+        }
+
+        if (head && 0 == memcmp(head->magic, PRESENCE_MAGIC, PRESENCE_MAGIC_LENGTH))
+        {
+            __sync_synchronize();
+            size = sizeof(struct bsp_presence_head_t) + (size_t) head->nslots * sizeof(struct bsp_presence_slot_t);
+            if (sizeof(struct bsp_presence_slot_t) != head->slot_size || (off_t) size > st.st_size)
+            {
+                trace_msg(TRACE_LEVEL_ERROR, "Presen : Segment of another layout");
+                size = 0;
+            }
+            break;
+        }
+        usleep(1000);
+    }
+
+    if (head)
+    {
+        munmap(head, sizeof(struct bsp_presence_head_t));
+    }
+
+    if (0 == size)
+    {
+        return BSP_RTN_ERROR_RESOURCE;
+    }
+
+    presence_head = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == presence_head)
+    {
+        presence_head = NULL;
+        return BSP_RTN_ERROR_IO;
+    }
+    presence_map_size = size;
+
+    return BSP_RTN_SUCCESS;
+}
+
+// New segment, magic written last
+static int _presence_create(int fd, size_t nslots)
+{
+    size_t size = sizeof(struct bsp_presence_head_t) + nslots * sizeof(struct bsp_presence_slot_t);
+    uint64_t salt[2] = {(uint64_t) time(NULL), (uint64_t) getpid()};
+    if (0 != ftruncate(fd, size))
+    {
+        return BSP_RTN_ERROR_IO;
+    }
+
+    presence_head = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == presence_head)
+    {
+        presence_head = NULL;
+        return BSP_RTN_ERROR_IO;
+    }
+    presence_map_size = size;
+    presence_head->seed = bsp_hash64((const char *) salt, sizeof(salt), (uint64_t) (uintptr_t) presence_head);
+    presence_head->nslots = (uint32_t) nslots;
+    presence_head->slot_size = sizeof(struct bsp_presence_slot_t);
+    __sync_synchronize();
+    memcpy(presence_head->magic, PRESENCE_MAGIC, PRESENCE_MAGIC_LENGTH);
+
+    return BSP_RTN_SUCCESS;
+}
+
+int presence_open(const char *name, size_t nslots, int instance_id)
+{
+    size_t size = 2;
+    int fd, ret;
+    if (presence_head)
+    {
+        return BSP_RTN_SUCCESS;
+    }
+
+    if (!name)
+    {
+        name = PRESENCE_SHM_NAME;
+    }
+
+    if (0 == nslots)
+    {
+        nslots = DEFAULT_PRESENCE_SLOTS;
+    }
+
+    while (size < nslots)
+    {
+        size <<= 1;
+    }
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+    {
+        ret = _presence_create(fd, size);
+        if (BSP_RTN_SUCCESS != ret)
+        {
+            // Never left without head for others
+            shm_unlink(name);
+        }
+    }
+    else if (EEXIST == errno && (fd = shm_open(name, O_RDWR, 0600)) >= 0)
+    {
+        ret = _presence_attach(fd);
+    }
+    else
+    {
+        ret = BSP_RTN_ERROR_IO;
+    }
+
+    if (BSP_RTN_SUCCESS != ret)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        trace_msg(TRACE_LEVEL_ERROR, "Presen : Open shared segment %s error", name);
+
+        return ret;
+    }
+
+    presence_slots = (struct bsp_presence_slot_t *) (presence_head + 1);
+    presence_instance = instance_id;
+    presence_fd = fd;
+    reg_fd(fd, FD_TYPE_SHM, NULL);
+    _presence_purge();
+    trace_msg(TRACE_LEVEL_CORE, "Presen : Shared segment %s opened with %d slots, %d used", name, (int) presence_head->nslots, (int) presence_head->nused);
+
+    return BSP_RTN_SUCCESS;
+}
+
+// Segment stays for other instances
+void presence_close()
+{
+    if (!presence_head)
+    {
+        return;
+    }
+
+    munmap(presence_head, presence_map_size);
+    presence_head = NULL;
+    presence_slots = NULL;
+    presence_map_size = 0;
+    unreg_fd(presence_fd);
+    presence_fd = -1;
+
+    return;
+}
+
+int presence_set(const char *key, int bind)
+{
+    struct bsp_presence_slot_t *slot, *avail;
+    size_t len;
+    uint64_t h;
+    if (!key || !presence_head)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    len = strlen(key);
+    if (len > PRESENCE_KEY_LENGTH)
+    {
+        trace_msg(TRACE_LEVEL_VERBOSE, "Presen : Key [%s] too long to share", key);
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    h = _presence_hash(key, len);
+    _presence_lock();
+    slot = _slot_find(key, len, h, &avail);
+    if (!slot && (uint64_t) (presence_head->nused + 1) * 100 > (uint64_t) presence_head->nslots * PRESENCE_MAX_LOAD)
+    {
+        // Probe chains kept short
+        avail = NULL;
+    }
+
+    if (!slot && avail)
+    {
+        // Key written before the slot is used
+        slot = avail;
+        _slot_write_begin(slot);
+        memcpy(slot->key, key, len);
+        slot->key_len = (uint32_t) len;
+        slot->hash = h;
+        slot->state = PRESENCE_SLOT_USED;
+        presence_head->nused ++;
+    }
+    else if (slot)
+    {
+        _slot_write_begin(slot);
+    }
+
+    if (slot)
+    {
+        slot->instance_id = presence_instance;
+        slot->bind = bind;
+        slot->since = (int64_t) time(NULL);
+        _slot_write_end(slot);
+    }
+    _presence_unlock();
+
+    if (!slot)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Presen : Shared segment full");
+        return BSP_RTN_ERROR_RESOURCE;
+    }
+
+    return BSP_RTN_SUCCESS;
+}
+
+int presence_del(const char *key, int bind)
+{
+    struct bsp_presence_slot_t *slot, *avail;
+    size_t len;
+    uint64_t h;
+    int ret = BSP_RTN_ERROR_GENERAL;
+    if (!key || !presence_head)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    len = strlen(key);
+    if (len > PRESENCE_KEY_LENGTH)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    h = _presence_hash(key, len);
+    _presence_lock();
+    slot = _slot_find(key, len, h, &avail);
+    if (slot && presence_instance == slot->instance_id && (bind < 0 || bind == slot->bind))
+    {
+        _slot_delete(slot);
+        ret = BSP_RTN_SUCCESS;
+    }
+    _presence_unlock();
+
+    return ret;
+}
+
+int presence_get(const char *key, BSP_PRESENCE *p)
+{
+    struct bsp_presence_slot_t *slot;
+    uint32_t mask, i, seq, state;
+    size_t len, retry;
+    uint64_t h;
+    int match;
+    BSP_PRESENCE copy;
+    if (!key || !presence_head)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    len = strlen(key);
+    if (len > PRESENCE_KEY_LENGTH)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    h = _presence_hash(key, len);
+    mask = presence_head->nslots - 1;
+    for (i = 0; i < presence_head->nslots; i ++)
+    {
+        slot = &presence_slots[(h + i) & mask];
+        for (retry = 0; ; retry ++)
+        {
+            if (retry >= PRESENCE_READ_RETRY)
+            {
+                // Writer died in slot, repaired by next writer
+                return BSP_RTN_ERROR_RESOURCE;
+            }
+
+            seq = slot->seq;
+            if (seq & 1)
+            {
+                sched_yield();
+                continue;
+            }
+
+            __sync_synchronize();
+            state = slot->state;
+            match = (PRESENCE_SLOT_USED == state && h == slot->hash && len == slot->key_len && 0 == memcmp(key, slot->key, len));
+            copy.instance_id = slot->instance_id;
+            copy.bind = slot->bind;
+            copy.since = (time_t) slot->since;
+            __sync_synchronize();
+            if (seq == slot->seq)
+            {
+                break;
+            }
+        }
+
+        if (PRESENCE_SLOT_EMPTY == state)
+        {
+            break;
+        }
+
+        if (match)
+        {
+            if (p)
+            {
+                *p = copy;
+            }
+
+            return BSP_RTN_SUCCESS;
+        }
+    }
+
+    return BSP_RTN_ERROR_GENERAL;
+}
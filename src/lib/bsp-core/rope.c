@@ -0,0 +1,283 @@
+/*
+ * rope.c
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Segmented output builder. Header goes in front of a payload without
+ * moving it, segments go to the send chain of socket as iovecs.
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/09/2014
+ * @changelog
+ *      [12/09/2014] - Creation
+ */
+
+#include "bsp.h"
+
+BSP_ROPE * new_rope()
+{
+    BSP_ROPE *rope = bsp_calloc(1, sizeof(BSP_ROPE));
+    if (!rope)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Rope : Create rope error");
+        return NULL;
+    }
+
+    rope->segs = bsp_calloc(ROPE_SEGMENTS_INITIAL, sizeof(struct bsp_rope_segment_t));
+    if (!rope->segs)
+    {
+        bsp_free(rope);
+        trace_msg(TRACE_LEVEL_ERROR, "Rope : Create rope error");
+        return NULL;
+    }
+    rope->nsegs = ROPE_SEGMENTS_INITIAL;
+    rope->head = rope->tail = ROPE_HEAD_ROOM;
+
+    return rope;
+}
+
+void del_rope(BSP_ROPE *rope)
+{
+    if (rope)
+    {
+        clean_rope(rope);
+        bsp_free(rope->segs);
+        bsp_free(rope);
+    }
+
+    return;
+}
+
+void clean_rope(BSP_ROPE *rope)
+{
+    size_t i;
+    if (!rope)
+    {
+        return;
+    }
+
+    for (i = rope->head; i < rope->tail; i ++)
+    {
+        bsp_free(rope->segs[i].data);
+    }
+    rope->head = rope->tail = ROPE_HEAD_ROOM;
+    rope->len = 0;
+
+    return;
+}
+
+void rope_detach(BSP_ROPE *rope)
+{
+    if (rope)
+    {
+        rope->head = rope->tail = ROPE_HEAD_ROOM;
+        rope->len = 0;
+    }
+
+    return;
+}
+
+// New slot at the end or in the front. Slots (not data) are moved to keep the head room
+static struct bsp_rope_segment_t * _new_segment(BSP_ROPE *rope, int front)
+{
+    size_t nsegs = rope->nsegs, used = ROPE_NSEGS(rope);
+    struct bsp_rope_segment_t *segs = rope->segs;
+    if ((front && 0 == rope->head) || (!front && rope->tail >= rope->nsegs))
+    {
+        if (used + ROPE_HEAD_ROOM * 2 > nsegs)
+        {
+            nsegs *= 2;
+            segs = bsp_realloc(rope->segs, nsegs * sizeof(struct bsp_rope_segment_t));
+            if (!segs)
+            {
+                trace_msg(TRACE_LEVEL_ERROR, "Rope : Enlarge segment list error");
+                return NULL;
+            }
+        }
+        memmove(segs + ROPE_HEAD_ROOM, segs + rope->head, used * sizeof(struct bsp_rope_segment_t));
+        rope->segs = segs;
+        rope->nsegs = nsegs;
+        rope->head = ROPE_HEAD_ROOM;
+        rope->tail = ROPE_HEAD_ROOM + used;
+    }
+
+    return (front) ? &rope->segs[-- rope->head] : &rope->segs[rope->tail ++];
+}
+
+int rope_append(BSP_ROPE *rope, const char *data, size_t len)
+{
+    struct bsp_rope_segment_t *seg = NULL;
+    size_t append;
+    if (!rope || !data)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    if (ROPE_NSEGS(rope) > 0)
+    {
+        // Fill the room of last segment
+        seg = &rope->segs[rope->tail - 1];
+        append = seg->size - seg->len;
+        if (append > len)
+        {
+            append = len;
+        }
+
+        memcpy(seg->data + seg->len, data, append);
+        seg->len += append;
+        rope->len += append;
+        data += append;
+        len -= append;
+    }
+
+    if (len > 0)
+    {
+        seg = _new_segment(rope, 0);
+        if (!seg)
+        {
+            return BSP_RTN_ERROR_MEMORY;
+        }
+
+        seg->size = (len > ROPE_SEGMENT_SIZE) ? len : ROPE_SEGMENT_SIZE;
+        seg->data = bsp_malloc(seg->size);
+        if (!seg->data)
+        {
+            rope->tail --;
+            trace_msg(TRACE_LEVEL_ERROR, "Rope : Alloc segment error");
+            return BSP_RTN_ERROR_MEMORY;
+        }
+
+        memcpy(seg->data, data, len);
+        seg->len = len;
+        rope->len += len;
+    }
+
+    return BSP_RTN_SUCCESS;
+}
+
+int rope_prepend(BSP_ROPE *rope, const char *data, size_t len)
+{
+    char *buffer;
+    if (!rope || !data)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    if (0 == len)
+    {
+        return BSP_RTN_SUCCESS;
+    }
+
+    buffer = bsp_malloc(len);
+    if (!buffer)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Rope : Alloc segment error");
+        return BSP_RTN_ERROR_MEMORY;
+    }
+    memcpy(buffer, data, len);
+
+    struct bsp_rope_segment_t *seg = _new_segment(rope, 1);
+    if (!seg)
+    {
+        bsp_free(buffer);
+        return BSP_RTN_ERROR_MEMORY;
+    }
+
+    // No room to append in a head segment
+    seg->data = buffer;
+    seg->len = seg->size = len;
+    rope->len += len;
+
+    return BSP_RTN_SUCCESS;
+}
+
+int rope_take(BSP_ROPE *rope, char *buffer, size_t len)
+{
+    if (!rope || !buffer)
+    {
+        bsp_free(buffer);
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    if (0 == len)
+    {
+        bsp_free(buffer);
+        return BSP_RTN_SUCCESS;
+    }
+
+    struct bsp_rope_segment_t *seg = _new_segment(rope, 0);
+    if (!seg)
+    {
+        bsp_free(buffer);
+        return BSP_RTN_ERROR_MEMORY;
+    }
+
+    seg->data = buffer;
+    seg->len = seg->size = len;
+    rope->len += len;
+
+    return BSP_RTN_SUCCESS;
+}
+
+int rope_append_string(BSP_ROPE *rope, BSP_STRING *str)
+{
+    char *buffer;
+    size_t len;
+    if (!rope || !str)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    if (STR_IS_READONLY(str) || (COMPRESS_TYPE_NONE == str->compress_type && STR_LEN(str) <= STRING_SSO_SIZE))
+    {
+        // Shared or short data, just copy
+        return rope_append(rope, STR_STR(str), (COMPRESS_TYPE_NONE == str->compress_type) ? STR_LEN(str) : str->compressed_len);
+    }
+
+    buffer = string_detach(str, &len);
+    if (!buffer)
+    {
+        return (len > 0) ? BSP_RTN_ERROR_MEMORY : BSP_RTN_SUCCESS;
+    }
+
+    return rope_take(rope, buffer, len);
+}
+
+BSP_STRING * rope_flatten(BSP_ROPE *rope)
+{
+    BSP_STRING *ret;
+    size_t i;
+    if (!rope)
+    {
+        return NULL;
+    }
+
+    ret = new_string_local(NULL, rope->len);
+    if (!ret)
+    {
+        return NULL;
+    }
+
+    for (i = rope->head; i < rope->tail; i ++)
+    {
+        string_append(ret, rope->segs[i].data, rope->segs[i].len);
+    }
+
+    return ret;
+}
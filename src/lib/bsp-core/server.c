@@ -101,7 +101,7 @@ BSP_SERVER * get_server(const char *name)
 }
 
 // Server output
-static ssize_t _real_output_client(BSP_CLIENT *clt, BSP_STRING *data)
+static ssize_t _queue_output_client(BSP_CLIENT *clt, BSP_STRING *data)
 {
     if (!clt || !data)
     {
@@ -117,108 +117,189 @@ static ssize_t _real_output_client(BSP_CLIENT *clt, BSP_STRING *data)
     else if (clt->client_type == CLIENT_TYPE_WEBSOCKET_DATA)
     {
         // WebSocket data
-        BSP_STRING *ws_data = new_string(NULL, 0);
-        if (ws_data)
+        BSP_STRING *ws_data = NULL;
+        if (clt->ws_deflate)
+        {
+            // Frames share the deflate window, keep them in order
+            bsp_spin_lock(&clt->ws_deflate->lock);
+            ws_data = generate_websocket_data_deflate(data, WS_OPCODE_BINARY, 0, clt->ws_deflate);
+            if (ws_data)
+            {
+                slen = append_data_socket(&SCK(clt), ws_data);
+            }
+            bsp_spin_unlock(&clt->ws_deflate->lock);
+        }
+        else
         {
             ws_data = generate_websocket_data(data, WS_OPCODE_BINARY, 0);
-            slen = append_data_socket(&SCK(clt), ws_data);
-            del_string(ws_data);
+            if (ws_data)
+            {
+                slen = append_data_socket(&SCK(clt), ws_data);
+            }
         }
+        del_string(ws_data);
     }
     else
     {
         // Send nothing
     }
 
-    flush_socket(&SCK(clt));
-
     return slen;
 }
 
-/* Output functions */
-// Raw data, just put a header
-size_t output_client_raw(BSP_CLIENT *clt, const char *data, ssize_t len)
+static ssize_t _real_output_client(BSP_CLIENT *clt, BSP_STRING *data)
 {
-    if (!clt)
+    ssize_t slen = _queue_output_client(clt, data);
+    if (slen >= 0)
     {
-        return 0;
+        flush_socket(&SCK(clt));
     }
 
-    if (len < 0)
-    {
-        len = strlen(data);
-    }
+    return slen;
+}
 
-    char placeholder[1] = {((PACKET_TYPE_RAW & 0b111) << 5) | ((clt->packet_serialize_type & 0b111) << 2) | (clt->packet_compress_type & 0b11)};
-    char num_str[9];
+// Compress payload and put header in front of it. A shared (frozen) payload is compressed on a private copy.
+// Buffer of a writable payload goes to the rope without copy
+static BSP_ROPE * _build_packet(BSP_CLIENT *clt, int p_type, BSP_STRING *stream, BSP_COMPRESS_STREAM *cs)
+{
+    int c_type = clt->packet_compress_type;
     int ret = BSP_RTN_SUCCESS;
-    size_t sent = 0;
-    BSP_STRING *stream = (COMPRESS_TYPE_NONE == clt->packet_compress_type) ? new_string_const(data, len) : new_string(data, len);
-    if (!stream)
+    char num_str[10];
+    size_t payload_len;
+    BSP_STRING *copy = NULL;
+
+    if (stream->is_frozen && COMPRESS_TYPE_NONE != ((cs) ? cs->compress_type : c_type))
     {
-        return 0;
+        copy = string_unshare(stream);
+        if (!copy)
+        {
+            return NULL;
+        }
+        stream = copy;
     }
 
-    // If compress
-    switch (clt->packet_compress_type)
+    if (cs)
     {
-        case COMPRESS_TYPE_DEFLATE : 
-            ret = string_compress_deflate(stream);
-            break;
+        c_type = cs->compress_type;
+        if (COMPRESS_TYPE_NONE != c_type)
+        {
+            ret = string_compress_stream(stream, cs);
+        }
+    }
+    else
+    {
+        switch (c_type)
+        {
+            case COMPRESS_TYPE_DEFLATE : 
+                ret = string_compress_deflate(stream);
+                break;
 #ifdef ENABLE_LZ4
-        case COMPRESS_TYPE_LZ4 : 
-            ret = string_compress_lz4(stream);
-            break;
+            case COMPRESS_TYPE_LZ4 : 
+                ret = string_compress_lz4(stream);
+                break;
 #endif
 #ifdef ENABLE_SNAPPY
-        case COMPRESS_TYPE_SNAPPY : 
-            ret = string_compress_snappy(stream);
-            break;
+            case COMPRESS_TYPE_SNAPPY : 
+                ret = string_compress_snappy(stream);
+                break;
 #endif
-        case COMPRESS_TYPE_NONE : 
-        default : 
-            break;
+            case COMPRESS_TYPE_NONE : 
+            default : 
+                // No compress, do nothing
+                break;
+        }
     }
 
     if (BSP_RTN_SUCCESS != ret)
     {
-        // Compress failed
+        // Compress failed, send plain data
         trace_msg(TRACE_LEVEL_ERROR, "Server : Data compress failed");
+        if (cs)
+        {
+            // Window is out of sync with the peer, never use it again
+            cs->compress_type = COMPRESS_TYPE_NONE;
+        }
     }
 
-    BSP_STRING *str = new_string(placeholder, 1);
-    if (!str)
+    c_type = stream->compress_type;
+    payload_len = (COMPRESS_TYPE_NONE == c_type) ? STR_LEN(stream) : stream->compressed_len;
+    num_str[0] = ((p_type & 0b111) << 5) | ((clt->packet_serialize_type & 0b111) << 2) | (c_type & 0b11);
+    int num_len = set_vint((int64_t) payload_len, num_str + 1);
+    BSP_ROPE *rope = new_rope();
+    if (rope && 
+        (BSP_RTN_SUCCESS != rope_append_string(rope, stream) || 
+         BSP_RTN_SUCCESS != rope_prepend(rope, num_str, 1 + num_len)))
     {
-        del_string(stream);
-        return 0;
+        del_rope(rope);
+        rope = NULL;
     }
+    del_string(copy);
 
-    int num_len = set_vint((int64_t) STR_LEN(stream), num_str);
-    string_append(str, (const char *) num_str, (ssize_t) num_len);
-    string_append(str, STR_STR(stream), STR_LEN(stream));
-    sent = _real_output_client(clt, str);
-    del_string(stream);
-    del_string(str);
+    return rope;
+}
 
-    return sent;
+// Stream of client may be replaced by a new report any time, senders hold a reference
+static BSP_COMPRESS_STREAM * _hold_compress_stream(BSP_CLIENT *clt)
+{
+    BSP_COMPRESS_STREAM *cs = NULL;
+    bsp_spin_lock(&SCK(clt).send_lock);
+    cs = compress_stream_ref(clt->compress_stream);
+    bsp_spin_unlock(&SCK(clt).send_lock);
+
+    return cs;
 }
 
-// Send an object
-size_t output_client_obj(BSP_CLIENT *clt, BSP_OBJECT *obj)
+// Compress payload, put header and send.
+// Packets of a compression stream are queued under the stream lock, the peer must decode them in order
+static size_t _output_packet(BSP_CLIENT *clt, int p_type, BSP_STRING *stream)
 {
-    if (!clt || !obj)
+    BSP_COMPRESS_STREAM *cs = _hold_compress_stream(clt);
+    BSP_ROPE *rope = NULL;
+    BSP_STRING *str = NULL;
+    size_t sent = 0;
+
+    if (cs)
     {
-        return 0;
+        bsp_spin_lock(&cs->lock);
     }
 
-    char placeholder[1] = {((PACKET_TYPE_OBJ & 0b111) << 5) | ((clt->packet_serialize_type & 0b111) << 2) | (clt->packet_compress_type & 0b11)};
-    char num_str[9];
-    int ret = BSP_RTN_SUCCESS;
-    size_t sent = 0;
+    rope = _build_packet(clt, p_type, stream, cs);
+    if (rope)
+    {
+        if (CLIENT_TYPE_DATA == clt->client_type)
+        {
+            // Segments go to socket directly
+            sent = append_rope_socket(&SCK(clt), rope);
+        }
+        else
+        {
+            // WebSocket frame needs the whole packet
+            str = rope_flatten(rope);
+            if (str)
+            {
+                sent = _queue_output_client(clt, str);
+                del_string(str);
+            }
+        }
+        del_rope(rope);
+    }
+
+    if (cs)
+    {
+        bsp_spin_unlock(&cs->lock);
+        del_compress_stream(cs);
+    }
+    flush_socket(&SCK(clt));
+
+    return sent;
+}
+
+// Serialize object by client's serialize type
+static BSP_STRING * _serialize_object(int s_type, BSP_OBJECT *obj)
+{
     BSP_STRING *stream = NULL;
 
-    // Pack data
-    switch (clt->packet_serialize_type)
+    switch (s_type)
     {
         case SERIALIZE_TYPE_NATIVE : 
             stream = object_serialize(obj);
@@ -236,47 +317,77 @@ size_t output_client_obj(BSP_CLIENT *clt, BSP_OBJECT *obj)
             break;
     }
 
-    // If compress
-    switch (clt->packet_compress_type)
+    return stream;
+}
+
+/* Output functions */
+// Raw data, just put a header
+size_t output_client_raw(BSP_CLIENT *clt, const char *data, ssize_t len)
+{
+    if (!clt)
     {
-        case COMPRESS_TYPE_DEFLATE : 
-            ret = string_compress_deflate(stream);
-            break;
-#ifdef ENABLE_LZ4
-        case COMPRESS_TYPE_LZ4 : 
-            ret = string_compress_lz4(stream);
-            break;
-#endif
-#ifdef ENABLE_SNAPPY
-        case COMPRESS_TYPE_SNAPPY : 
-            ret = string_compress_snappy(stream);
-            break;
-#endif
-        case COMPRESS_TYPE_NONE : 
-        default : 
-            // No compress, do nothing
-            break;
+        return 0;
     }
 
-    if (BSP_RTN_SUCCESS != ret)
+    if (len < 0)
     {
-        // Compress failed
-        trace_msg(TRACE_LEVEL_ERROR, "Server : Data compress failed");
+        len = strlen(data);
     }
 
-    BSP_STRING *str = new_string(placeholder, 1);
-    if (!str)
+    size_t sent = 0;
+    BSP_STRING *stream = (COMPRESS_TYPE_NONE == clt->packet_compress_type && !clt->compress_stream) ? new_string_const(data, len) : new_string(data, len);
+    if (!stream)
     {
-        del_string(stream);
         return 0;
     }
 
-    int num_len = set_vint((int64_t) STR_LEN(stream), num_str);
-    string_append(str, (const char *) num_str, (ssize_t) num_len);
-    string_append(str, STR_STR(stream), STR_LEN(stream));
-    sent = _real_output_client(clt, str);
+    sent = _output_packet(clt, PACKET_TYPE_RAW, stream);
+    del_string(stream);
+
+    return sent;
+}
+
+// Send an object
+size_t output_client_obj(BSP_CLIENT *clt, BSP_OBJECT *obj)
+{
+    if (!clt || !obj)
+    {
+        return 0;
+    }
+
+    char placeholder[1] = {((PACKET_TYPE_OBJ & 0b111) << 5) | ((clt->packet_serialize_type & 0b111) << 2) | (clt->packet_compress_type & 0b11)};
+    size_t sent = 0;
+    BSP_STRING *stream = NULL;
+
+    if (SERIALIZE_TYPE_JSON == clt->packet_serialize_type && 
+        COMPRESS_TYPE_NONE == clt->packet_compress_type && 
+        CLIENT_TYPE_DATA == clt->client_type)
+    {
+        // Encode into send buffer, socket takes it directly
+        char head[10];
+        size_t data_len = 0;
+        char *data = json_nd_encode_buffer(obj, &data_len);
+        if (!data)
+        {
+            return 0;
+        }
+        head[0] = placeholder[0];
+        int head_len = 1 + set_vint((int64_t) data_len, head + 1);
+        sent = append_buffer_socket(&SCK(clt), head, head_len, data, data_len);
+        flush_socket(&SCK(clt));
+
+        return sent;
+    }
+
+    // Pack data
+    stream = _serialize_object(clt->packet_serialize_type, obj);
+    if (!stream)
+    {
+        return 0;
+    }
+
+    sent = _output_packet(clt, PACKET_TYPE_OBJ, stream);
     del_string(stream);
-    del_string(str);
 
     return sent;
 }
@@ -289,87 +400,251 @@ size_t output_client_cmd(BSP_CLIENT *clt, int cmd, BSP_OBJECT *obj)
         return 0;
     }
 
-    char placeholder[1] = {((PACKET_TYPE_CMD & 0b111) << 5) | ((clt->packet_serialize_type & 0b111) << 2) | (clt->packet_compress_type & 0b11)};
     char num_str[9];
     set_int32((int32_t) cmd, num_str);
-    int ret = BSP_RTN_SUCCESS;
     size_t sent = 0;
-    BSP_STRING *stream = new_string((const char *) num_str, 4);
+    BSP_STRING *stream = new_string_local((const char *) num_str, 4);
     if (!stream)
     {
         return 0;
     }
 
     // Pack data
-    BSP_STRING *data = NULL;
-    switch (clt->packet_serialize_type)
-    {
-        case SERIALIZE_TYPE_NATIVE : 
-            data = object_serialize(obj);
-            break;
-        case SERIALIZE_TYPE_JSON : 
-            data = json_nd_encode(obj);
-            break;
-        case SERIALIZE_TYPE_MSGPACK : 
-            //data = msgpack_nd_encode(obj);
-            break;
-        case SERIALIZE_TYPE_AMF : 
-            //data = amf_nd_encode(obj);
-            break;
-        default : 
-            break;
-    }
-
+    BSP_STRING *data = _serialize_object(clt->packet_serialize_type, obj);
     if (data)
     {
         string_append(stream, STR_STR(data), STR_LEN(data));
         del_string(data);
     }
-    // If compress
-    switch (clt->packet_compress_type)
+
+    sent = _output_packet(clt, PACKET_TYPE_CMD, stream);
+    del_string(stream);
+
+    return sent;
+}
+
+/* Group output */
+// Payload of a group packet
+static BSP_STRING * _group_payload(int p_type, int s_type, int cmd, BSP_OBJECT *obj, const char *data, size_t len)
+{
+    BSP_STRING *payload = NULL, *body = NULL;
+    char cmd_str[4];
+
+    switch (p_type)
     {
-        case COMPRESS_TYPE_DEFLATE : 
-            ret = string_compress_deflate(stream);
+        case PACKET_TYPE_RAW : 
+            payload = new_string_local(data, len);
             break;
-#ifdef ENABLE_LZ4
-        case COMPRESS_TYPE_LZ4 : 
-            ret = string_compress_lz4(stream);
+        case PACKET_TYPE_OBJ : 
+            payload = _serialize_object(s_type, obj);
             break;
-#endif
-#ifdef ENABLE_SNAPPY
-        case COMPRESS_TYPE_SNAPPY : 
-            ret = string_compress_snappy(stream);
+        case PACKET_TYPE_CMD : 
+            set_int32((int32_t) cmd, cmd_str);
+            payload = new_string_local(cmd_str, 4);
+            body = _serialize_object(s_type, obj);
+            if (payload && body)
+            {
+                string_append(payload, STR_STR(body), STR_LEN(body));
+            }
+            del_string(body);
             break;
-#endif
-        case COMPRESS_TYPE_NONE : 
         default : 
-            // No compress, do nothing
             break;
     }
 
-    if (BSP_RTN_SUCCESS != ret)
+    return payload;
+}
+
+// Frame of a client does not depend on connection state, share it with other clients of the same configuration
+static int _group_frame_key(BSP_CLIENT *clt, BSP_GROUP_FRAME *key)
+{
+    if (clt->compress_stream)
     {
-        // Compress failed
-        trace_msg(TRACE_LEVEL_ERROR, "Server : Data compress failed");
+        return 0;
     }
 
-    BSP_STRING *str = new_string(placeholder, 1);
-    if (!str)
+    key->client_type = clt->client_type;
+    key->serialize_type = clt->packet_serialize_type;
+    key->compress_type = clt->packet_compress_type;
+    key->window_bits = 0;
+    if (CLIENT_TYPE_WEBSOCKET_DATA == clt->client_type && 
+        clt->ws_deflate && 
+        COMPRESS_TYPE_NONE != clt->ws_deflate->compress_type)
     {
-        del_string(stream);
-        return 0;
+        if (!(clt->ws_deflate->flags & COMPRESS_STREAM_DEFLATE_NO_TAKEOVER))
+        {
+            // Context takeover, every connection has its own window
+            return 0;
+        }
+        key->window_bits = clt->ws_deflate->window_bits;
+    }
+
+    return 1;
+}
+
+static BSP_STRING * _group_frame(BSP_CLIENT *clt, int p_type, BSP_STRING *payload)
+{
+    BSP_STRING *stream = clone_string(payload);
+    BSP_STRING *packet = NULL, *frame = NULL;
+    BSP_ROPE *rope = NULL;
+    if (!stream)
+    {
+        return NULL;
     }
 
-    int num_len = set_vint((int64_t) STR_LEN(stream), num_str);
-    string_append(str, (const char *) num_str, (ssize_t) num_len);
-    string_append(str, STR_STR(stream), STR_LEN(stream));
-    sent = _real_output_client(clt, str);
+    rope = _build_packet(clt, p_type, stream, NULL);
     del_string(stream);
-    del_string(str);
+    packet = rope_flatten(rope);
+    del_rope(rope);
+    if (!packet || CLIENT_TYPE_WEBSOCKET_DATA != clt->client_type)
+    {
+        return packet;
+    }
+
+    if (clt->ws_deflate)
+    {
+        bsp_spin_lock(&clt->ws_deflate->lock);
+        frame = generate_websocket_data_deflate(packet, WS_OPCODE_BINARY, 0, clt->ws_deflate);
+        bsp_spin_unlock(&clt->ws_deflate->lock);
+    }
+    else
+    {
+        frame = generate_websocket_data(packet, WS_OPCODE_BINARY, 0);
+    }
+    del_string(packet);
+
+    return frame;
+}
+
+static size_t _output_clients(BSP_CLIENT **clts, size_t nclts, int p_type, int cmd, BSP_OBJECT *obj, const char *data, size_t len)
+{
+    BSP_STRING *payloads[8] = {NULL};
+    BSP_GROUP_FRAME frames[GROUP_FRAME_MAX];
+    BSP_GROUP_FRAME key, *frame;
+    BSP_CLIENT *clt;
+    BSP_STRING *stream;
+    int nframes = 0, s_type, i;
+    size_t n, sent = 0;
+
+    if (!clts)
+    {
+        return 0;
+    }
+
+    for (n = 0; n < nclts; n ++)
+    {
+        clt = clts[n];
+        if (!clt || (CLIENT_TYPE_DATA != clt->client_type && CLIENT_TYPE_WEBSOCKET_DATA != clt->client_type))
+        {
+            continue;
+        }
+
+        // Encode once per serialize type
+        s_type = clt->packet_serialize_type & 0b111;
+        if (!payloads[s_type])
+        {
+            // Shared by all clients below, clone_string() takes a reference only
+            payloads[s_type] = string_freeze(_group_payload(p_type, s_type, cmd, obj, data, len));
+            if (!payloads[s_type])
+            {
+                continue;
+            }
+        }
+
+        // Compress and frame once per configuration
+        frame = NULL;
+        if (_group_frame_key(clt, &key))
+        {
+            for (i = 0; i < nframes; i ++)
+            {
+                if (frames[i].client_type == key.client_type && 
+                    frames[i].serialize_type == key.serialize_type && 
+                    frames[i].compress_type == key.compress_type && 
+                    frames[i].window_bits == key.window_bits)
+                {
+                    frame = &frames[i];
+                    break;
+                }
+            }
+
+            if (!frame && nframes < GROUP_FRAME_MAX)
+            {
+                key.frame = _group_frame(clt, p_type, payloads[s_type]);
+                if (key.frame)
+                {
+                    frames[nframes] = key;
+                    frame = &frames[nframes ++];
+                }
+            }
+        }
+
+        if (frame)
+        {
+            append_data_socket(&SCK(clt), frame->frame);
+            flush_socket(&SCK(clt));
+        }
+        else
+        {
+            // Window of connection involved
+            stream = clone_string(payloads[s_type]);
+            if (!stream)
+            {
+                continue;
+            }
+            _output_packet(clt, p_type, stream);
+            del_string(stream);
+        }
+        sent ++;
+    }
+
+    for (i = 0; i < 8; i ++)
+    {
+        del_string(payloads[i]);
+    }
+
+    for (i = 0; i < nframes; i ++)
+    {
+        del_string(frames[i].frame);
+    }
 
     return sent;
 }
 
+size_t output_clients_raw(BSP_CLIENT **clts, size_t nclts, const char *data, ssize_t len)
+{
+    if (!data)
+    {
+        return 0;
+    }
+
+    if (len < 0)
+    {
+        len = strlen(data);
+    }
+
+    return _output_clients(clts, nclts, PACKET_TYPE_RAW, 0, NULL, data, (size_t) len);
+}
+
+size_t output_clients_obj(BSP_CLIENT **clts, size_t nclts, BSP_OBJECT *obj)
+{
+    if (!obj)
+    {
+        return 0;
+    }
+
+    return _output_clients(clts, nclts, PACKET_TYPE_OBJ, 0, obj, NULL, 0);
+}
+
+size_t output_clients_cmd(BSP_CLIENT **clts, size_t nclts, int cmd, BSP_OBJECT *obj)
+{
+    if (!obj)
+    {
+        return 0;
+    }
+
+    return _output_clients(clts, nclts, PACKET_TYPE_CMD, cmd, obj, NULL, 0);
+}
+
 /* Main data driver */
 // Binary stream
 static size_t _proc_stream(BSP_CLIENT *clt, const char *data, size_t len)
@@ -383,6 +658,8 @@ static size_t _proc_stream(BSP_CLIENT *clt, const char *data, size_t len)
         return len;
     }
 
+    // Everything built for the events of this round goes with the arena
+    BSP_ARENA *prev_arena = arena_enter();
     size_t ret = 0;
     size_t remaining = len;
     const char *stream;
@@ -391,9 +668,12 @@ static size_t _proc_stream(BSP_CLIENT *clt, const char *data, size_t len)
     BSP_OBJECT *obj = NULL;
     char hdr;
     int p_type, s_type, c_type;
+    BSP_VIEW view;
+    BSP_COMPRESS_STREAM *cs = NULL, *old_cs = NULL;
     BSP_CALLBACK cb;
     cb.server = srv;
     cb.client = clt;
+    cb.view = NULL;
 
     switch (clt->data_type)
     {
@@ -457,26 +737,42 @@ static size_t _proc_stream(BSP_CLIENT *clt, const char *data, size_t len)
                         break;
                     }
                     str->compress_type = c_type;
+                    str->compressed_len = plen;
 
-                    switch (c_type)
+                    if (COMPRESS_TYPE_NONE != c_type && clt->compress_stream)
                     {
-                        case COMPRESS_TYPE_DEFLATE : 
-                            string_decompress_deflate(str);
+                        if (BSP_RTN_SUCCESS != string_decompress_stream(str, clt->compress_stream))
+                        {
+                            // Window broken, nothing after this can be decoded
+                            trace_msg(TRACE_LEVEL_ERROR, "Server : Client %d compression stream broken", SFD(clt));
+                            del_string(str);
+                            free_client(clt);
+                            ret = len;
                             break;
+                        }
+                    }
+                    else
+                    {
+                        switch (c_type)
+                        {
+                            case COMPRESS_TYPE_DEFLATE : 
+                                string_decompress_deflate(str);
+                                break;
 #ifdef ENABLE_LZ4
-                        case COMPRESS_TYPE_LZ4 : 
-                            string_decompress_lz4(str);
-                            break;
+                            case COMPRESS_TYPE_LZ4 : 
+                                string_decompress_lz4(str);
+                                break;
 #endif
 #ifdef ENABLE_SNAPPY
-                        case COMPRESS_TYPE_SNAPPY : 
-                            string_decompress_snappy(str);
-                            break;
+                            case COMPRESS_TYPE_SNAPPY : 
+                                string_decompress_snappy(str);
+                                break;
 #endif
-                        case COMPRESS_TYPE_NONE : 
-                        default : 
-                            // Do nothing
-                            break;
+                            case COMPRESS_TYPE_NONE : 
+                            default : 
+                                // Do nothing
+                                break;
+                        }
                     }
                     remaining -= plen;
 
@@ -493,11 +789,12 @@ static size_t _proc_stream(BSP_CLIENT *clt, const char *data, size_t len)
                     else if (PACKET_TYPE_OBJ == p_type)
                     {
                         // Single object
+                        obj = NULL;
                         switch (s_type)
                         {
                             case SERIALIZE_TYPE_NATIVE : 
-                                // BSP.Packet
-                                obj = object_unserialize(str);
+                                // BSP.Packet, just view it, no object created
+                                cb.view = (BSP_RTN_SUCCESS == view_init(&view, STR_STR(str), STR_LEN(str))) ? &view : NULL;
                                 break;
                             case SERIALIZE_TYPE_JSON : 
                                 // JSON
@@ -522,6 +819,7 @@ static size_t _proc_stream(BSP_CLIENT *clt, const char *data, size_t len)
                             cb.obj = obj;
                             settings->on_srv_events(&cb);
                         }
+                        cb.view = NULL;
 
                         del_string(str);
                         //del_object(obj);
@@ -532,15 +830,22 @@ static size_t _proc_stream(BSP_CLIENT *clt, const char *data, size_t len)
                         if (STR_LEN(str) >= 4)
                         {
                             int cmd = (int) get_int32(STR_STR(str));
-                            BSP_STRING *body = new_string_const(STR_STR(str) + 4, STR_LEN(str) - 4);
+                            BSP_STRING *body = NULL;
+                            obj = NULL;
+                            if (SERIALIZE_TYPE_NATIVE == s_type)
+                            {
+                                // BSP.Packet, view on packet data directly
+                                cb.view = (BSP_RTN_SUCCESS == view_init(&view, STR_STR(str) + 4, STR_LEN(str) - 4)) ? &view : NULL;
+                            }
+                            else
+                            {
+                                body = new_string_const(STR_STR(str) + 4, STR_LEN(str) - 4);
+                            }
+
                             if (body)
                             {
                                 switch (s_type)
                                 {
-                                    case SERIALIZE_TYPE_NATIVE : 
-                                        // BSP.Packet
-                                        obj = object_unserialize(body);
-                                        break;
                                     case SERIALIZE_TYPE_JSON : 
                                         // JSON
                                         obj = json_nd_decode(body);
@@ -567,6 +872,7 @@ static size_t _proc_stream(BSP_CLIENT *clt, const char *data, size_t len)
                                 cb.obj = obj;
                                 settings->on_srv_events(&cb);
                             }
+                            cb.view = NULL;
 
                             del_string(str);
                             //del_object(obj);
@@ -582,11 +888,24 @@ static size_t _proc_stream(BSP_CLIENT *clt, const char *data, size_t len)
                 else
                 {
                     // Special
-                    if (PACKET_TYPE_REP == p_type)
+                    if (PACKET_TYPE_REP == p_type || PACKET_TYPE_REP_STREAM == p_type)
                     {
                         // Report serialize and compression
                         clt->packet_serialize_type = s_type;
                         clt->packet_compress_type = c_type;
+                        cs = NULL;
+                        if (PACKET_TYPE_REP_STREAM == p_type && COMPRESS_TYPE_NONE != c_type)
+                        {
+                            // New client : keep compression window for the whole connection
+                            cs = new_compress_stream(c_type);
+                        }
+
+                        // Senders still holding the old stream free it
+                        bsp_spin_lock(&SCK(clt).send_lock);
+                        old_cs = clt->compress_stream;
+                        clt->compress_stream = cs;
+                        bsp_spin_unlock(&SCK(clt).send_lock);
+                        del_compress_stream(old_cs);
                         trace_msg(TRACE_LEVEL_VERBOSE, "Server : Client %d report as serialize type : %d, compress type : %d", SFD(clt), s_type, c_type);
                         // Trigger online event
                         if (settings->on_srv_events)
@@ -631,11 +950,185 @@ static size_t _proc_stream(BSP_CLIENT *clt, const char *data, size_t len)
             // Unknown type, ignore all data
             ret = len;
     }
+    arena_leave(prev_arena);
 
     return ret;
 }
 
 // Default callback for general server
+// A whole WebSocket message, data points into the receive buffer
+static void _proc_websocket_message(BSP_CLIENT *clt, const char *data, size_t len, int opcode)
+{
+    BSP_STRING *str = NULL;
+
+    if (opcode & WS_FLAG_RSV1)
+    {
+        // Compressed message
+        str = new_string(data, len);
+        if (!str || BSP_RTN_SUCCESS != websocket_inflate_data(str, clt->ws_deflate))
+        {
+            trace_msg(TRACE_LEVEL_ERROR, "Server : Websocket client %d sent a bad compressed message", SFD(clt));
+            del_string(str);
+            free_client(clt);
+
+            return;
+        }
+
+        _proc_stream(clt, STR_STR(str), STR_LEN(str));
+        del_string(str);
+    }
+    else
+    {
+        _proc_stream(clt, data, len);
+    }
+
+    return;
+}
+
+static void _proc_websocket_control(BSP_CLIENT *clt, const char *data, size_t len, int opcode)
+{
+    BSP_STRING *str = new_string_const(data, len);
+    BSP_STRING *resp_str = NULL;
+
+    switch (opcode)
+    {
+        case WS_OPCODE_PING : 
+            // Send a PONG back
+            resp_str = generate_websocket_data(str, WS_OPCODE_PONG, 0);
+            append_data_socket(&SCK(clt), resp_str);
+            del_string(resp_str);
+            flush_socket(&SCK(clt));
+            // Refresh heartbeat
+            trace_msg(TRACE_LEVEL_VERBOSE, "Server : Websocket client send ping");
+            clt->last_hb_time = time(NULL);
+            break;
+        case WS_OPCODE_PONG : 
+            // WTF ~~~ Why you send me a PONG ?
+            break;
+        case WS_OPCODE_CLOSE : 
+            // Send a CLOSE back
+            resp_str = generate_websocket_data(str, WS_OPCODE_CLOSE, 0);
+            append_data_socket(&SCK(clt), resp_str);
+            del_string(resp_str);
+            flush_socket(&SCK(clt));
+            // Close connection
+            trace_msg(TRACE_LEVEL_VERBOSE, "Server : Websocket client send close request");
+            free_client(clt);
+            break;
+        default : 
+            break;
+    }
+
+    del_string(str);
+
+    return;
+}
+
+// Unwrap frames in the receive buffer.
+// Fragments of a message are unmasked and joined to the front of the message, nothing is consumed
+// until the final fragment arrives, so ws_frag_* stay valid as offsets from the message start
+static size_t _proc_websocket(BSP_CLIENT *clt, char *data, size_t len)
+{
+    BSP_SERVER *srv = get_client_connected_server(clt);
+    BSP_WEBSOCKET_FRAME frame;
+    ssize_t frame_len;
+    size_t used = 0, pos;
+    char *payload;
+    int opcode;
+
+    while (!(SCK(clt).state & STATE_PRECLOSE))
+    {
+        pos = used + clt->ws_frag_parsed;
+        if (pos >= len)
+        {
+            break;
+        }
+
+        frame_len = parse_websocket_frame(data + pos, len - pos, &frame);
+        if (0 == frame_len)
+        {
+            // Half frame
+            break;
+        }
+
+        opcode = frame.opcode & 0xF;
+        if (frame_len < 0 || 
+            (WS_OPCODE_CONTINUATION == opcode && (!clt->ws_frag_parsed || (frame.opcode & WS_FLAG_RSV1))) || 
+            ((WS_OPCODE_TEXT == opcode || WS_OPCODE_BINARY == opcode) && clt->ws_frag_parsed) || 
+            ((frame.opcode & WS_FLAG_RSV1) && !clt->ws_deflate))
+        {
+            trace_msg(TRACE_LEVEL_ERROR, "Server : Websocket client %d sent a bad frame", SFD(clt));
+            free_client(clt);
+
+            return len;
+        }
+
+        payload = data + pos + frame.header_len;
+        if (frame.masked)
+        {
+            websocket_unmask(payload, payload, frame.payload_len, frame.mask);
+        }
+
+        if (opcode & 0x8)
+        {
+            // Control frame, may be inserted between fragments
+            _proc_websocket_control(clt, payload, frame.payload_len, opcode);
+            if (clt->ws_frag_parsed)
+            {
+                clt->ws_frag_parsed += frame_len;
+            }
+            else
+            {
+                used += frame_len;
+            }
+
+            continue;
+        }
+
+        if (frame.fin && !clt->ws_frag_parsed)
+        {
+            // Single frame message
+            used += frame_len;
+            _proc_websocket_message(clt, payload, frame.payload_len, frame.opcode);
+
+            continue;
+        }
+
+        // Join fragment, payload always moves forward over headers
+        if (WS_OPCODE_CONTINUATION != opcode)
+        {
+            clt->ws_frag_opcode = frame.opcode;
+        }
+        memmove(data + used + clt->ws_frag_len, payload, frame.payload_len);
+        clt->ws_frag_len += frame.payload_len;
+        clt->ws_frag_parsed += frame_len;
+        if (srv && srv->max_packet_length > 0 && clt->ws_frag_len > srv->max_packet_length)
+        {
+            trace_msg(TRACE_LEVEL_ERROR, "Server : Websocket client %d sent a message too big", SFD(clt));
+            free_client(clt);
+
+            return len;
+        }
+
+        if (frame.fin)
+        {
+            _proc_websocket_message(clt, data + used, clt->ws_frag_len, clt->ws_frag_opcode);
+            used += clt->ws_frag_parsed;
+            clt->ws_frag_parsed = 0;
+            clt->ws_frag_len = 0;
+            clt->ws_frag_opcode = 0;
+        }
+    }
+
+    if (SCK(clt).state & STATE_PRECLOSE)
+    {
+        // Closing, drop all
+        return len;
+    }
+
+    return used;
+}
+
 size_t proc_data(BSP_CLIENT *clt, const char *data, ssize_t len)
 {
     if (!clt || !data)
@@ -643,12 +1136,13 @@ size_t proc_data(BSP_CLIENT *clt, const char *data, ssize_t len)
         return 0;
     }
 
+    BSP_SERVER *srv = NULL;
+    BSP_WEBSOCKET_DEFLATE ws_deflate;
     BSP_HTTP_REQUEST *req = NULL;
     BSP_HTTP_RESPONSE *resp = NULL;
     BSP_STRING *resp_str = NULL;
-    BSP_STRING *data_str = NULL;
-    size_t header_len = 0, data_len = 0;
-    int ret, opcode = 0;
+    size_t header_len = 0;
+    int ret;
 
     switch (clt->client_type)
     {
@@ -671,6 +1165,17 @@ size_t proc_data(BSP_CLIENT *clt, const char *data, ssize_t len)
                 ret = websocket_handshake(req, resp);
                 if (BSP_RTN_SUCCESS == ret)
                 {
+                    srv = get_client_connected_server(clt);
+                    if (srv && srv->websocket_deflate)
+                    {
+                        ws_deflate = srv->websocket_deflate_param;
+                        if (BSP_RTN_SUCCESS == websocket_deflate_negotiate(req, resp, &ws_deflate))
+                        {
+                            clt->ws_deflate = new_websocket_deflate_stream(&ws_deflate);
+                            trace_msg(TRACE_LEVEL_VERBOSE, "Server : Websocket client %d uses permessage-deflate", SFD(clt));
+                        }
+                    }
+
                     trace_msg(TRACE_LEVEL_NOTICE, "Server : A websocket client %d handshaked", SFD(clt));
                     // Send handshake back
                     resp_str = generate_http_response(resp);
@@ -701,50 +1206,13 @@ size_t proc_data(BSP_CLIENT *clt, const char *data, ssize_t len)
             return header_len;
             break;
         case CLIENT_TYPE_WEBSOCKET_DATA : 
-            // Peel off the websocket shell
-            data_str = new_string(NULL, 0);
-            data_len = parse_websocket_data(data, len, &opcode, data_str);
-
-            if (data_len > 0)
+            // Peel off the websocket shell. Receive buffer belongs to the socket, frames are unmasked in place
+            if (len < 0)
             {
-                switch (opcode)
-                {
-                    case WS_OPCODE_TEXT : 
-                    case WS_OPCODE_BINARY : 
-                        // General data
-                        _proc_stream(clt, (const char *) STR_STR(data_str), STR_LEN(data_str));
-                        break;
-                    case WS_OPCODE_PING : 
-                        // Send a PONG back
-                        resp_str = generate_websocket_data(data_str, WS_OPCODE_PONG, 0);
-                        append_data_socket(&SCK(clt), resp_str);
-                        del_string(resp_str);
-                        flush_socket(&SCK(clt));
-                        // Refresh heartbeat
-                        trace_msg(TRACE_LEVEL_VERBOSE, "Server : Websocket client send ping");
-                        clt->last_hb_time = time(NULL);
-                        break;
-                    case WS_OPCODE_PONG : 
-                        // WTF ~~~ Why you send me a PONG ?
-                        break;
-                    case WS_OPCODE_CLOSE : 
-                        // Send a CLOSE back
-                        resp_str = generate_websocket_data(data_str, WS_OPCODE_CLOSE, 0);
-                        append_data_socket(&SCK(clt), resp_str);
-                        del_string(resp_str);
-                        flush_socket(&SCK(clt));
-                        // Close connection
-                        trace_msg(TRACE_LEVEL_VERBOSE, "Server : Websocket client send close request");
-                        free_client(clt);
-                        break;
-                    default : 
-                        break;
-                }
+                len = strlen(data);
             }
 
-            del_string(data_str);
-
-            return data_len;
+            return _proc_websocket(clt, (char *) data, (size_t) len);
             break;
         default : 
             // Unknown client type
@@ -0,0 +1,610 @@
+/*
+ * snapshot.c
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Keyed snapshot file. Records are queued and appended while running, the
+ * file is compacted when grown too much. The file left by last run is
+ * compacted and mapped on opening, its records are taken lazily by key.
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/14/2014
+ * @changelog
+ *      [12/14/2014] - Creation
+ */
+
+#include "bsp.h"
+
+static uint32_t _record_check(const char *key, size_t key_len, const char *data, size_t data_len, uint32_t flags)
+{
+    BSP_HASH_STREAM hs;
+    uint64_t h;
+    hash_stream_init(&hs, SNAPSHOT_CHECK_SEED);
+    hash_stream_update(&hs, (const char *) &flags, sizeof(uint32_t));
+    hash_stream_update(&hs, key, key_len);
+    if (data)
+    {
+        hash_stream_update(&hs, data, data_len);
+    }
+    h = hash_stream_final(&hs);
+
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+static void _record_head(struct bsp_snapshot_record_head_t *head, const char *key, size_t key_len, const char *data, size_t data_len, uint32_t flags)
+{
+    if (!data)
+    {
+        data_len = 0;
+    }
+
+    head->key_len = (uint32_t) key_len;
+    head->data_len = (uint32_t) data_len;
+    head->flags = flags;
+    head->check = _record_check(key, key_len, data, data_len, flags);
+
+    return;
+}
+
+// One record by one writev()
+static int _write_record(int fd, const char *key, size_t key_len, const char *data, size_t data_len, uint32_t flags)
+{
+    struct bsp_snapshot_record_head_t head;
+    struct iovec iov[3];
+    ssize_t n;
+    _record_head(&head, key, key_len, data, data_len, flags);
+    data_len = head.data_len;
+    iov[0].iov_base = (void *) &head;
+    iov[0].iov_len = sizeof(head);
+    iov[1].iov_base = (void *) key;
+    iov[1].iov_len = key_len;
+    iov[2].iov_base = (void *) data;
+    iov[2].iov_len = data_len;
+    n = writev(fd, iov, (data_len > 0) ? 3 : 2);
+    if (n != (ssize_t) (sizeof(head) + key_len + data_len))
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Write record error");
+        return BSP_RTN_ERROR_IO;
+    }
+
+    return BSP_RTN_SUCCESS;
+}
+
+/* Index of last records */
+static struct bsp_snapshot_record_t * _index_find(BSP_SNAPSHOT *snap, const char *key, size_t key_len, uint32_t h)
+{
+    struct bsp_snapshot_record_t *r;
+    size_t i;
+    if (!snap->nbuckets)
+    {
+        return NULL;
+    }
+
+    for (i = snap->buckets[h & (snap->nbuckets - 1)]; i; i = r->next)
+    {
+        r = &snap->records[i - 1];
+        if (h == r->hash && key_len == r->key_len && 0 == memcmp(key, r->key, key_len))
+        {
+            return r;
+        }
+    }
+
+    return NULL;
+}
+
+// Records has room of nbuckets, both doubled when full
+static int _index_grow(BSP_SNAPSHOT *snap)
+{
+    size_t nbuckets = (snap->nbuckets) ? snap->nbuckets * 2 : SNAPSHOT_INDEX_INITIAL, i, idx;
+    struct bsp_snapshot_record_t *records = bsp_realloc(snap->records, nbuckets * sizeof(struct bsp_snapshot_record_t));
+    size_t *buckets = bsp_calloc(nbuckets, sizeof(size_t));
+    if (!records || !buckets)
+    {
+        if (records)
+        {
+            snap->records = records;
+        }
+        bsp_free(buckets);
+        trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Enlarge index error");
+        return BSP_RTN_ERROR_MEMORY;
+    }
+
+    for (i = 0; i < snap->nrecords; i ++)
+    {
+        idx = records[i].hash & (nbuckets - 1);
+        records[i].next = buckets[idx];
+        buckets[idx] = i + 1;
+    }
+    bsp_free(snap->buckets);
+    snap->records = records;
+    snap->buckets = buckets;
+    snap->nbuckets = nbuckets;
+
+    return BSP_RTN_SUCCESS;
+}
+
+static int _index_apply(BSP_SNAPSHOT *snap, const char *key, size_t key_len, const char *data, size_t data_len, uint32_t flags)
+{
+    uint32_t h = bsp_hash(key, key_len);
+    struct bsp_snapshot_record_t *r = _index_find(snap, key, key_len, h);
+    size_t idx;
+    if (flags & SNAPSHOT_FLAG_SAVED)
+    {
+        if (r)
+        {
+            r->flags &= ~SNAPSHOT_FLAG_DIRTY;
+        }
+
+        return BSP_RTN_SUCCESS;
+    }
+
+    if (!r)
+    {
+        if (flags & SNAPSHOT_FLAG_REMOVED)
+        {
+            return BSP_RTN_SUCCESS;
+        }
+
+        if (snap->nrecords == snap->nbuckets && BSP_RTN_SUCCESS != _index_grow(snap))
+        {
+            return BSP_RTN_ERROR_MEMORY;
+        }
+
+        r = &snap->records[snap->nrecords ++];
+        r->key = key;
+        r->key_len = (uint32_t) key_len;
+        r->hash = h;
+        r->taken = 0;
+        idx = h & (snap->nbuckets - 1);
+        r->next = snap->buckets[idx];
+        snap->buckets[idx] = snap->nrecords;
+    }
+    r->data = data;
+    r->data_len = (uint32_t) data_len;
+    r->flags = flags;
+
+    return BSP_RTN_SUCCESS;
+}
+
+// Index records of mapped file, length of valid records returned
+static size_t _parse(BSP_SNAPSHOT *snap, const char *map, size_t size)
+{
+    struct bsp_snapshot_record_head_t head;
+    const char *key, *data;
+    size_t off = SNAPSHOT_MAGIC_LENGTH, left;
+    if (size < SNAPSHOT_MAGIC_LENGTH || 0 != memcmp(map, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH))
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Not a snapshot file");
+        return 0;
+    }
+
+    while (off + sizeof(head) <= size)
+    {
+        memcpy(&head, map + off, sizeof(head));
+        left = size - off - sizeof(head);
+        if (head.key_len > left || head.data_len > left - head.key_len)
+        {
+            // Torn record
+            break;
+        }
+
+        key = map + off + sizeof(head);
+        data = key + head.key_len;
+        if (head.check != _record_check(key, head.key_len, data, head.data_len, head.flags))
+        {
+            break;
+        }
+
+        if (BSP_RTN_SUCCESS != _index_apply(snap, key, head.key_len, data, head.data_len, head.flags))
+        {
+            break;
+        }
+        off += sizeof(head) + head.key_len + head.data_len;
+    }
+
+    if (off < size)
+    {
+        trace_msg(TRACE_LEVEL_NOTICE, "Snapsh : %d bytes at end of snapshot dropped", (int) (size - off));
+    }
+
+    return off;
+}
+
+static void _clean_index(BSP_SNAPSHOT *snap)
+{
+    bsp_free(snap->records);
+    bsp_free(snap->buckets);
+    snap->records = NULL;
+    snap->buckets = NULL;
+    snap->nrecords = 0;
+    snap->nbuckets = 0;
+
+    return;
+}
+
+// Rewrite file of last run with last records of keys
+static int _compact(const char *filename)
+{
+    BSP_SNAPSHOT old;
+    struct bsp_snapshot_record_t *r;
+    struct stat st;
+    char tmp[_POSIX_PATH_MAX];
+    char *map;
+    size_t i;
+    int fd, ret = BSP_RTN_SUCCESS;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return (ENOENT == errno) ? BSP_RTN_SUCCESS : BSP_RTN_ERROR_IO;
+    }
+
+    if (0 != fstat(fd, &st) || 0 == st.st_size)
+    {
+        close(fd);
+        return BSP_RTN_SUCCESS;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Map snapshot file error");
+        return BSP_RTN_ERROR_IO;
+    }
+
+    memset(&old, 0, sizeof(BSP_SNAPSHOT));
+    _parse(&old, map, st.st_size);
+    snprintf(tmp, _POSIX_PATH_MAX - 1, "%s.tmp", filename);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || SNAPSHOT_MAGIC_LENGTH != write(fd, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH))
+    {
+        ret = BSP_RTN_ERROR_IO;
+    }
+
+    for (i = 0; BSP_RTN_SUCCESS == ret && i < old.nrecords; i ++)
+    {
+        r = &old.records[i];
+        if (!(r->flags & SNAPSHOT_FLAG_REMOVED))
+        {
+            ret = _write_record(fd, r->key, r->key_len, r->data, r->data_len, r->flags);
+        }
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    if (BSP_RTN_SUCCESS == ret && 0 == rename(tmp, filename))
+    {
+        trace_msg(TRACE_LEVEL_CORE, "Snapsh : Snapshot %s compacted from %d bytes", filename, (int) st.st_size);
+    }
+    else
+    {
+        // Old file used as is
+        trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Compact snapshot %s error", filename);
+        unlink(tmp);
+        ret = BSP_RTN_ERROR_IO;
+    }
+    _clean_index(&old);
+    munmap(map, st.st_size);
+
+    return ret;
+}
+
+BSP_SNAPSHOT * snapshot_open(const char *filename)
+{
+    BSP_SNAPSHOT *snap;
+    struct stat st;
+    size_t valid;
+    if (!filename)
+    {
+        return NULL;
+    }
+
+    _compact(filename);
+    snap = bsp_calloc(1, sizeof(BSP_SNAPSHOT));
+    if (!snap)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Create snapshot error");
+        return NULL;
+    }
+
+    snap->fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (snap->fd < 0 || 0 != fstat(snap->fd, &st))
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Open snapshot %s error", filename);
+        snapshot_close(snap);
+        return NULL;
+    }
+
+    if (st.st_size > 0)
+    {
+        snap->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, snap->fd, 0);
+        if (MAP_FAILED == snap->map)
+        {
+            snap->map = NULL;
+            trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Map snapshot %s error", filename);
+            snapshot_close(snap);
+            return NULL;
+        }
+        snap->map_size = st.st_size;
+        valid = _parse(snap, snap->map, snap->map_size);
+        if (valid < snap->map_size)
+        {
+            // Records appended after a torn one could never be read, nothing beyond is touched in map
+            if (0 != ftruncate(snap->fd, valid))
+            {
+                trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Truncate snapshot %s error", filename);
+                snapshot_close(snap);
+                return NULL;
+            }
+            st.st_size = valid;
+        }
+    }
+
+    if (0 == st.st_size && SNAPSHOT_MAGIC_LENGTH != write(snap->fd, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH))
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Write snapshot %s error", filename);
+        snapshot_close(snap);
+        return NULL;
+    }
+    snap->filename = bsp_strdup(filename);
+    if (!snap->filename)
+    {
+        trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Create snapshot error");
+        snapshot_close(snap);
+        return NULL;
+    }
+    snap->file_size = (st.st_size > 0) ? (size_t) st.st_size : SNAPSHOT_MAGIC_LENGTH;
+    snap->compacted_size = snap->file_size;
+    bsp_spin_init(&snap->lock);
+    trace_msg(TRACE_LEVEL_CORE, "Snapsh : Snapshot %s opened with %d records", filename, (int) snap->nrecords);
+
+    return snap;
+}
+
+void snapshot_close(BSP_SNAPSHOT *snap)
+{
+    if (!snap)
+    {
+        return;
+    }
+
+    if (snap->filename)
+    {
+        // Fully opened, queued records kept
+        snapshot_flush(snap);
+    }
+
+    if (snap->map)
+    {
+        munmap(snap->map, snap->map_size);
+    }
+
+    if (snap->fd >= 0)
+    {
+        close(snap->fd);
+    }
+    _clean_index(snap);
+    bsp_free(snap->pending);
+    bsp_free(snap->filename);
+    bsp_free(snap);
+
+    return;
+}
+
+// Record encoded into queue, file untouched
+int snapshot_write(BSP_SNAPSHOT *snap, const char *key, size_t key_len, const char *data, size_t data_len, uint32_t flags)
+{
+    struct bsp_snapshot_record_head_t head;
+    size_t need, size;
+    char *pending;
+    if (!snap || !key)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    _record_head(&head, key, key_len, data, data_len, flags);
+    need = sizeof(head) + head.key_len + head.data_len;
+    bsp_spin_lock(&snap->lock);
+    if (snap->pending_len + need > snap->pending_size)
+    {
+        size = (snap->pending_size) ? snap->pending_size : SNAPSHOT_PENDING_INITIAL;
+        while (size < snap->pending_len + need)
+        {
+            size *= 2;
+        }
+
+        pending = bsp_realloc(snap->pending, size);
+        if (!pending)
+        {
+            bsp_spin_unlock(&snap->lock);
+            trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Enlarge pending records error");
+            return BSP_RTN_ERROR_MEMORY;
+        }
+        snap->pending = pending;
+        snap->pending_size = size;
+    }
+
+    memcpy(snap->pending + snap->pending_len, &head, sizeof(head));
+    memcpy(snap->pending + snap->pending_len + sizeof(head), key, head.key_len);
+    if (head.data_len > 0)
+    {
+        memcpy(snap->pending + snap->pending_len + sizeof(head) + head.key_len, data, head.data_len);
+    }
+    snap->pending_len += need;
+    bsp_spin_unlock(&snap->lock);
+
+    return BSP_RTN_SUCCESS;
+}
+
+// Rewrite file with last records of keys, fd reopened on the new one. Map of file opened stays valid
+static void _compact_running(BSP_SNAPSHOT *snap)
+{
+    struct stat st;
+    int fd;
+    if (BSP_RTN_SUCCESS == _compact(snap->filename))
+    {
+        fd = open(snap->filename, O_RDWR | O_APPEND, 0644);
+        if (fd >= 0 && 0 == fstat(fd, &st))
+        {
+            close(snap->fd);
+            snap->fd = fd;
+            snap->file_size = st.st_size;
+        }
+        else
+        {
+            // Records after are appended to the unlinked old file, lost on restart
+            trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Reopen snapshot %s error", snap->filename);
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+    }
+
+    // Not retried before grown again
+    snap->compacted_size = snap->file_size;
+
+    return;
+}
+
+int snapshot_flush(BSP_SNAPSHOT *snap)
+{
+    char *pending;
+    size_t len, off = 0;
+    ssize_t n;
+    int ret = BSP_RTN_SUCCESS;
+    if (!snap)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    if (__sync_lock_test_and_set(&snap->flushing, 1))
+    {
+        // Queue taken by another flusher, order of records kept by one writer
+        return BSP_RTN_SUCCESS;
+    }
+
+    bsp_spin_lock(&snap->lock);
+    pending = snap->pending;
+    len = snap->pending_len;
+    snap->pending = NULL;
+    snap->pending_len = 0;
+    snap->pending_size = 0;
+    bsp_spin_unlock(&snap->lock);
+
+    while (off < len)
+    {
+        n = write(snap->fd, pending + off, len - off);
+        if (n < 0 && EINTR == errno)
+        {
+            continue;
+        }
+
+        if (n <= 0)
+        {
+            // Partial records cut off, a torn record would hide all after it
+            trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Write records error");
+            if (0 != ftruncate(snap->fd, snap->file_size))
+            {
+                trace_msg(TRACE_LEVEL_ERROR, "Snapsh : Truncate snapshot %s error", snap->filename);
+            }
+            ret = BSP_RTN_ERROR_IO;
+            break;
+        }
+        off += n;
+    }
+    bsp_free(pending);
+
+    if (BSP_RTN_SUCCESS == ret)
+    {
+        snap->file_size += len;
+        if (snap->file_size >= SNAPSHOT_COMPACT_MIN && snap->file_size >= snap->compacted_size * SNAPSHOT_COMPACT_RATIO)
+        {
+            _compact_running(snap);
+        }
+    }
+    __sync_lock_release(&snap->flushing);
+
+    return ret;
+}
+
+size_t snapshot_pending(BSP_SNAPSHOT *snap)
+{
+    size_t ret = 0;
+    if (snap)
+    {
+        bsp_spin_lock(&snap->lock);
+        ret = snap->pending_len;
+        bsp_spin_unlock(&snap->lock);
+    }
+
+    return ret;
+}
+
+const char * snapshot_take(BSP_SNAPSHOT *snap, const char *key, size_t key_len, size_t *data_len, uint32_t *flags)
+{
+    struct bsp_snapshot_record_t *r;
+    const char *ret = NULL;
+    if (!snap || !key || !snap->nrecords)
+    {
+        return NULL;
+    }
+
+    bsp_spin_lock(&snap->lock);
+    r = _index_find(snap, key, key_len, bsp_hash(key, key_len));
+    if (r && !r->taken && !(r->flags & SNAPSHOT_FLAG_REMOVED))
+    {
+        r->taken = 1;
+        ret = r->data;
+        *data_len = r->data_len;
+        *flags = r->flags;
+    }
+    bsp_spin_unlock(&snap->lock);
+
+    return ret;
+}
+
+void snapshot_take_flagged(BSP_SNAPSHOT *snap, uint32_t flags, void (* callback) (const char *key, size_t key_len, const char *data, size_t data_len))
+{
+    struct bsp_snapshot_record_t *r;
+    size_t i;
+    int take;
+    if (!snap || !callback)
+    {
+        return;
+    }
+
+    for (i = 0; i < snap->nrecords; i ++)
+    {
+        r = &snap->records[i];
+        bsp_spin_lock(&snap->lock);
+        take = (!r->taken && (r->flags & flags) && !(r->flags & SNAPSHOT_FLAG_REMOVED)) ? 1 : 0;
+        r->taken |= take;
+        bsp_spin_unlock(&snap->lock);
+        if (take)
+        {
+            callback(r->key, r->key_len, r->data, r->data_len);
+        }
+    }
+
+    return;
+}
@@ -496,7 +496,24 @@ int drive_socket(struct bsp_socket_t *sck)
         // Close socket immedialy
         trace_msg(TRACE_LEVEL_DEBUG, "Socket : Closing socket %d", sck->fd);
         _close_socket(sck);
-        bsp_free(ptr);
+        if (clt && clt->compress_stream)
+        {
+            del_compress_stream(clt->compress_stream);
+        }
+
+        if (clt && clt->ws_deflate)
+        {
+            del_compress_stream(clt->ws_deflate);
+        }
+
+        if (clt)
+        {
+            freelist_free(&freelist_client, clt);
+        }
+        else
+        {
+            freelist_free(&freelist_connector, cnt);
+        }
 
         return 0;
     }
@@ -693,6 +710,160 @@ size_t append_data_socket(struct bsp_socket_t *sck, BSP_STRING *data)
     return STR_LEN(data);
 }
 
+// Append a head and a prepared send buffer to socket without copy of buffer.
+// Buffer must be allocated by bsp_malloc(), socket takes it and frees it after sent
+size_t append_buffer_socket(struct bsp_socket_t *sck, const char *head, size_t head_len, char *buffer, size_t len)
+{
+    if (!sck || !buffer)
+    {
+        return 0;
+    }
+
+    BSP_STRING *str = NULL;
+    void *buf = NULL;
+    struct iovec *iov = NULL;
+    if (IS_UDP(sck))
+    {
+        // UDP must be exploded into MTU, just copy
+        str = new_string(head, (head) ? head_len : 0);
+        if (str)
+        {
+            string_append(str, buffer, len);
+            len = append_data_socket(sck, str);
+            del_string(str);
+        }
+        bsp_free(buffer);
+
+        return len;
+    }
+
+    BSP_CORE_SETTING *settings = get_core_setting();
+    if (settings->debug_hex_output && !settings->is_daemonize)
+    {
+        debug_printf("Appendding buffer to socket %d ...", sck->fd);
+        if (head && head_len)
+        {
+            debug_hex(head, head_len);
+        }
+        debug_hex(buffer, len);
+    }
+
+    if (head && head_len)
+    {
+        buf = bsp_malloc(head_len);
+        if (!buf)
+        {
+            bsp_free(buffer);
+            trace_msg(TRACE_LEVEL_ERROR, "Socket : Alloc send buffer error");
+            return 0;
+        }
+        memcpy(buf, head, head_len);
+    }
+
+    // Head and buffer must be neighbours in IOV list
+    bsp_spin_lock(&sck->send_lock);
+    if (buf)
+    {
+        iov = _new_iovec(sck);
+        if (!iov)
+        {
+            bsp_spin_unlock(&sck->send_lock);
+            bsp_free(buf);
+            bsp_free(buffer);
+            trace_msg(TRACE_LEVEL_ERROR, "Socket : Create new IOV error");
+            return 0;
+        }
+        iov->iov_base = buf;
+        iov->iov_len = head_len;
+    }
+
+    if (0 == len)
+    {
+        // Nothing in buffer
+        bsp_free(buffer);
+    }
+    else
+    {
+        iov = _new_iovec(sck);
+        if (!iov)
+        {
+            if (buf)
+            {
+                // Rollback head
+                sck->iov_list_curr --;
+                bsp_free(buf);
+            }
+            bsp_spin_unlock(&sck->send_lock);
+            bsp_free(buffer);
+            trace_msg(TRACE_LEVEL_ERROR, "Socket : Create new IOV error");
+            return 0;
+        }
+        iov->iov_base = buffer;
+        iov->iov_len = len;
+    }
+    bsp_spin_unlock(&sck->send_lock);
+    trace_msg(TRACE_LEVEL_DEBUG, "Socket : Append %d byte buffer to socket %d's send buffer", (int) (head_len + len), sck->fd);
+
+    return ((head) ? head_len : 0) + len;
+}
+
+// Every segment of rope becomes an IOV, in order
+size_t append_rope_socket(struct bsp_socket_t *sck, BSP_ROPE *rope)
+{
+    if (!sck || !rope)
+    {
+        return 0;
+    }
+
+    size_t len = ROPE_LEN(rope), nsegs = ROPE_NSEGS(rope), i;
+    struct iovec *iov = NULL;
+    BSP_STRING *str = NULL;
+    if (IS_UDP(sck))
+    {
+        // UDP must be exploded into MTU, just copy
+        str = rope_flatten(rope);
+        len = (str) ? append_data_socket(sck, str) : 0;
+        del_string(str);
+        clean_rope(rope);
+
+        return len;
+    }
+
+    BSP_CORE_SETTING *settings = get_core_setting();
+    if (settings->debug_hex_output && !settings->is_daemonize)
+    {
+        debug_printf("Appendding rope to socket %d ...", sck->fd);
+        for (i = 0; i < nsegs; i ++)
+        {
+            debug_hex(ROPE_SEG(rope, i)->data, ROPE_SEG(rope, i)->len);
+        }
+    }
+
+    // Segments must be neighbours in IOV list
+    bsp_spin_lock(&sck->send_lock);
+    for (i = 0; i < nsegs; i ++)
+    {
+        iov = _new_iovec(sck);
+        if (!iov)
+        {
+            // Rollback, segments still in rope
+            sck->iov_list_curr -= i;
+            bsp_spin_unlock(&sck->send_lock);
+            trace_msg(TRACE_LEVEL_ERROR, "Socket : Create new IOV error");
+            return 0;
+        }
+        iov->iov_base = ROPE_SEG(rope, i)->data;
+        iov->iov_len = ROPE_SEG(rope, i)->len;
+    }
+    bsp_spin_unlock(&sck->send_lock);
+
+    // Socket frees them after sent
+    rope_detach(rope);
+    trace_msg(TRACE_LEVEL_DEBUG, "Socket : Append %d byte rope to socket %d's send buffer", (int) len, sck->fd);
+
+    return len;
+}
+
 // If any data in send buffer(IOV), try send all
 int flush_socket(struct bsp_socket_t *sck)
 {
@@ -1004,7 +1175,7 @@ BSP_CLIENT * new_client(BSP_SERVER *srv, struct sockaddr_storage *clt_addr)
     char ipaddr[64];
     socklen_t addrlen;
 
-    clt = bsp_calloc(1, sizeof(BSP_CLIENT));
+    clt = freelist_alloc(&freelist_client);
     if (!clt)
     {
         return NULL;
@@ -1023,7 +1194,7 @@ BSP_CLIENT * new_client(BSP_SERVER *srv, struct sockaddr_storage *clt_addr)
         if (fd < 0)
         {
             trace_msg(TRACE_LEVEL_ERROR, "Socket : UDP fake fd failed");
-            bsp_free(clt);
+            freelist_free(&freelist_client, clt);
             return NULL;
         }
         else
@@ -1036,7 +1207,7 @@ BSP_CLIENT * new_client(BSP_SERVER *srv, struct sockaddr_storage *clt_addr)
                 {
                     close(fd);
                     trace_msg(TRACE_LEVEL_ERROR, "Socket : UDP IPv6 virtual port bind error");
-                    bsp_free(clt);
+                    freelist_free(&freelist_client, clt);
                     return NULL;
                 }
                 
@@ -1051,7 +1222,7 @@ BSP_CLIENT * new_client(BSP_SERVER *srv, struct sockaddr_storage *clt_addr)
                 {
                     close(fd);
                     trace_msg(TRACE_LEVEL_ERROR, "Socket : UDP IPv4 virtual port bind error");
-                    bsp_free(clt);
+                    freelist_free(&freelist_client, clt);
                     return NULL;
                 }
                 
@@ -1065,7 +1236,7 @@ BSP_CLIENT * new_client(BSP_SERVER *srv, struct sockaddr_storage *clt_addr)
             {
                 close(fd);
                 trace_msg(TRACE_LEVEL_ERROR, "Socket : UDP virtual port connect error");
-                bsp_free(clt);
+                freelist_free(&freelist_client, clt);
                 return NULL;
             }
 
@@ -1096,7 +1267,7 @@ BSP_CLIENT * new_client(BSP_SERVER *srv, struct sockaddr_storage *clt_addr)
         {
             // Accept error
             trace_msg(TRACE_LEVEL_ERROR, "Socket : TCP Accept failed");
-            bsp_free(clt);
+            freelist_free(&freelist_client, clt);
             return NULL;
         }
         else
@@ -1203,7 +1374,7 @@ static BSP_CONNECTOR * _new_unix_connector(const char *path)
         return NULL;
     }
 
-    cnt = bsp_calloc(1, sizeof(BSP_CONNECTOR));
+    cnt = freelist_alloc(&freelist_connector);
     if (!cnt)
     {
         trace_msg(TRACE_LEVEL_FATAL, "Socket : Connector alloc failed");
@@ -1343,7 +1514,7 @@ BSP_CONNECTOR * new_connector(const char *addr, int port, int inet_type, int soc
             return NULL;
         }
 
-        cnt = bsp_calloc(1, sizeof(BSP_CONNECTOR));
+        cnt = freelist_alloc(&freelist_connector);
         if (!cnt)
         {
             trace_msg(TRACE_LEVEL_FATAL, "Socket : Connector alloc failed");
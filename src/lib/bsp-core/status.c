@@ -22,9 +22,11 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 07/18/2013
+ * @update 12/06/2014
  * @chagelog
  *      [07/18/2013] - Creation
+ *      [12/04/2014] - Atomic mempool counters
+ *      [12/06/2014] - Mempool block free
  */
 #include "bsp.h"
 
@@ -68,27 +70,24 @@ void status_op_core(int op, size_t value)
 void status_op_mempool(int slab_id, int op, size_t value)
 {
 #ifdef ENABLE_MEMPOOL
+    // Called by all threads without lock. Alloc / Free counted by batch (value)
     // Huge memory block
     if (STATUS_OP_MEMPOOL_HUGE_ALLOC == op)
     {
-        //bsp_spin_lock(&slock);
-        s.mempool.huge_item_alloc_times ++;
-        s.mempool.huge_item_alloced += value;
-        s.mempool.alloc_times ++;
-        s.mempool.dissociative_space += value;
-        //bsp_spin_unlock(&slock);
+        __sync_add_and_fetch(&s.mempool.huge_item_alloc_times, 1);
+        __sync_add_and_fetch(&s.mempool.huge_item_alloced, value);
+        __sync_add_and_fetch(&s.mempool.alloc_times, 1);
+        __sync_add_and_fetch(&s.mempool.dissociative_space, value);
 
         return;
     }
 
     if (STATUS_OP_MEMPOOL_HUGE_FREE == op)
     {
-        //bsp_spin_lock(&slock);
-        s.mempool.huge_item_free_times ++;
-        s.mempool.huge_item_freed += value;
-        s.mempool.free_times ++;
-        s.mempool.dissociative_space -= value;
-        //bsp_spin_unlock(&slock);
+        __sync_add_and_fetch(&s.mempool.huge_item_free_times, 1);
+        __sync_add_and_fetch(&s.mempool.huge_item_freed, value);
+        __sync_add_and_fetch(&s.mempool.free_times, 1);
+        __sync_sub_and_fetch(&s.mempool.dissociative_space, value);
 
         return;
     }
@@ -98,34 +97,39 @@ void status_op_mempool(int slab_id, int op, size_t value)
         return;
     }
     struct bsp_status_mempool_slab_t *ms = &s.mempool.slab[slab_id];
-    //bsp_spin_lock(&slock);
     switch (op)
     {
         case STATUS_OP_MEMPOOL_ALLOC : 
-            ms->alloc_times ++;
-            ms->items_inuse ++;
-            s.mempool.alloc_times ++;
-            s.mempool.items_inuse ++;
+            __sync_add_and_fetch(&ms->alloc_times, value);
+            __sync_add_and_fetch(&ms->items_inuse, value);
+            __sync_add_and_fetch(&s.mempool.alloc_times, value);
+            __sync_add_and_fetch(&s.mempool.items_inuse, value);
             break;
         case STATUS_OP_MEMPOOL_FREE : 
-            ms->free_times ++;
-            ms->items_inuse --;
-            s.mempool.free_times ++;
-            s.mempool.items_inuse --;
+            __sync_add_and_fetch(&ms->free_times, value);
+            __sync_sub_and_fetch(&ms->items_inuse, value);
+            __sync_add_and_fetch(&s.mempool.free_times, value);
+            __sync_sub_and_fetch(&s.mempool.items_inuse, value);
             break;
         case STATUS_OP_MEMPOOL_BLOCK : 
-            ms->block_alloced ++;
-            s.mempool.blocks_total ++;
-            s.mempool.blocks_space += value;
+            __sync_add_and_fetch(&ms->block_alloced, 1);
+            __sync_add_and_fetch(&s.mempool.blocks_total, 1);
+            __sync_add_and_fetch(&s.mempool.blocks_space, value);
             break;
         case STATUS_OP_MEMPOOL_ITEM : 
-            ms->items_total += value;
-            s.mempool.items_total += value;
+            __sync_add_and_fetch(&ms->items_total, value);
+            __sync_add_and_fetch(&s.mempool.items_total, value);
+            break;
+        case STATUS_OP_MEMPOOL_BLOCK_FREE : 
+            __sync_sub_and_fetch(&ms->block_alloced, 1);
+            __sync_sub_and_fetch(&ms->items_total, slab_nitems[slab_id]);
+            __sync_sub_and_fetch(&s.mempool.blocks_total, 1);
+            __sync_sub_and_fetch(&s.mempool.blocks_space, value);
+            __sync_sub_and_fetch(&s.mempool.items_total, slab_nitems[slab_id]);
             break;
         default : 
             break;
     }
-    //bsp_spin_unlock(&slock);
 #endif
     return;
 }
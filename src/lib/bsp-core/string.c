@@ -22,13 +22,20 @@
  * 
  * @package bsp::libbsp-core
  * @author Dr.NP <np@bsgroup.org>
- * @update 05/09/2013
+ * @update 12/09/2014
  * @changelog 
  *      [06/14/2012] - Creation
  *      [04/10/2013] - string_fill() added
  *      [04/16/2013] - Remove free list
  *      [05/09/2013] - Patch for zlib < 1.2.7
  *      [05/21/2014] - lz4 instead of mini-lzo
+ *      [11/26/2014] - Persistent compression streams
+ *      [11/29/2014] - Arena strings
+ *      [12/02/2014] - Atom strings
+ *      [12/03/2014] - Frozen (refcounted) strings
+ *      [12/07/2014] - Strings from freelist
+ *      [12/08/2014] - Buffer capacity, inline short strings, local strings
+ *      [12/09/2014] - Buffer detached for rope
  */
 
 #define _GNU_SOURCE
@@ -50,10 +57,109 @@
 #   define z_const
 #endif
 
+/* Buffer */
+// Free heap buffer owned by the string
+static inline void _string_release(BSP_STRING *str)
+{
+    if (0 == str->is_const && STR_STR(str) && !STR_IS_INLINE(str))
+    {
+        bsp_free(STR_STR(str));
+    }
+    STR_STR(str) = NULL;
+    str->capacity = 0;
+
+    return;
+}
+
+// Buffer (allocated by bsp_malloc(), at least capacity bytes) owned by the string after that
+static inline void _string_take(BSP_STRING *str, char *data, size_t capacity)
+{
+    _string_release(str);
+    STR_STR(str) = data;
+    str->capacity = (data) ? capacity : 0;
+
+    return;
+}
+
+// Take data out as a heap buffer (inline data copied), string left without buffer.
+// Nothing changed if alloc failed
+static char * _string_detach(BSP_STRING *str)
+{
+    char *data = STR_STR(str);
+    if (data && STR_IS_INLINE(str))
+    {
+        data = bsp_malloc(STRING_SSO_SIZE);
+        if (!data)
+        {
+            return NULL;
+        }
+        memcpy(data, str->sso, STRING_SSO_SIZE);
+    }
+    STR_STR(str) = NULL;
+    str->capacity = 0;
+
+    return data;
+}
+
+// Short data stays inline, heap buffer grows by doubling
+static int _string_reserve(BSP_STRING *str, size_t size)
+{
+    size_t capacity;
+    char *new_str;
+    if (size <= str->capacity)
+    {
+        return BSP_RTN_SUCCESS;
+    }
+
+    if (!STR_STR(str) && size <= STRING_SSO_SIZE)
+    {
+        STR_STR(str) = str->sso;
+        str->capacity = STRING_SSO_SIZE;
+
+        return BSP_RTN_SUCCESS;
+    }
+
+    capacity = (str->capacity > STRING_INITIAL) ? str->capacity : STRING_INITIAL;
+    while (capacity < size)
+    {
+        capacity *= 2;
+    }
+
+    if (STR_IS_INLINE(str))
+    {
+        new_str = bsp_malloc(capacity);
+        if (new_str)
+        {
+            memcpy(new_str, str->sso, STRING_SSO_SIZE);
+        }
+    }
+    else
+    {
+        new_str = bsp_realloc(STR_STR(str), capacity);
+    }
+
+    if (!new_str)
+    {
+        return BSP_RTN_ERROR_MEMORY;
+    }
+    STR_STR(str) = new_str;
+    str->capacity = capacity;
+
+    return BSP_RTN_SUCCESS;
+}
+
+// Heap buffer of an arena string goes with the arena
+static void _string_arena_cleanup(void *data)
+{
+    _string_release((BSP_STRING *) data);
+
+    return;
+}
+
 // New string
-BSP_STRING * new_string(const char *data, ssize_t len)
+BSP_STRING * new_string_arena(BSP_ARENA *arena, const char *data, ssize_t len)
 {
-    BSP_STRING *ret = bsp_calloc(1, sizeof(BSP_STRING));
+    BSP_STRING *ret = (arena) ? arena_calloc(arena, 1, sizeof(BSP_STRING)) : freelist_alloc(&freelist_string);
     if (!ret)
     {
         trace_msg(TRACE_LEVEL_ERROR, "String : Create string error");
@@ -62,27 +168,38 @@ BSP_STRING * new_string(const char *data, ssize_t len)
 
     ret->compress_type = COMPRESS_TYPE_NONE;
     bsp_spin_init(&ret->lock);
+    if (arena)
+    {
+        ret->arena = arena;
+        ret->is_local = 1;
+        arena_on_reset(arena, _string_arena_cleanup, ret);
+    }
 
-    if (data)
+    if (data && len < 0)
     {
-        if (len < 0)
-        {
-            len = strlen(data);
-        }
+        len = strlen(data);
+    }
 
-        ret->str = (char *) bsp_malloc(len);
-        if (ret->str)
-        {
-            memcpy(ret->str, data, len);
-            ret->original_len = len;
-        }
+    if (len > 0 && BSP_RTN_SUCCESS == _string_reserve(ret, len) && data)
+    {
+        memcpy(STR_STR(ret), data, len);
+        ret->original_len = len;
     }
-    else
+
+    return ret;
+}
+
+BSP_STRING * new_string(const char *data, ssize_t len)
+{
+    return new_string_arena(curr_arena(), data, len);
+}
+
+BSP_STRING * new_string_local(const char *data, ssize_t len)
+{
+    BSP_STRING *ret = new_string_arena(curr_arena(), data, len);
+    if (ret)
     {
-        if (len > 0)
-        {
-            ret->str = (char *) bsp_malloc(len);
-        }
+        ret->is_local = 1;
     }
 
     return ret;
@@ -91,7 +208,8 @@ BSP_STRING * new_string(const char *data, ssize_t len)
 // New const(Read-Only) string
 BSP_STRING * new_string_const(const char *data, ssize_t len)
 {
-    BSP_STRING *ret = bsp_malloc(sizeof(BSP_STRING));
+    BSP_ARENA *arena = curr_arena();
+    BSP_STRING *ret = (arena) ? arena_calloc(arena, 1, sizeof(BSP_STRING)) : freelist_alloc(&freelist_string);
     if (!ret)
     {
         trace_msg(TRACE_LEVEL_ERROR, "String : Create string error");
@@ -101,6 +219,8 @@ BSP_STRING * new_string_const(const char *data, ssize_t len)
     ret->compress_type = COMPRESS_TYPE_NONE;
     bsp_spin_init(&ret->lock);
     ret->is_const = 1;
+    ret->is_local = (arena) ? 1 : 0;
+    ret->arena = arena;
 
     if (data)
     {
@@ -151,17 +271,23 @@ BSP_STRING * new_string_from_file(const char *path)
 // Return string to free list
 void del_string(BSP_STRING *str)
 {
-    if (!str)
+    if (!str || str->is_atom)
     {
         return;
     }
-    bsp_spin_lock(&str->lock);
-    if (0 == str->is_const && STR_STR(str))
+
+    if (str->is_frozen && __sync_sub_and_fetch(&str->refcount, 1) > 0)
     {
-        bsp_free(STR_STR(str));
+        // Still referred by others
+        return;
+    }
+    STR_LOCK(str);
+    _string_release(str);
+    STR_UNLOCK(str);
+    if (!str->arena)
+    {
+        freelist_free(&freelist_string, str);
     }
-    bsp_spin_unlock(&str->lock);
-    bsp_free(str);
 
     return;
 }
@@ -169,33 +295,29 @@ void del_string(BSP_STRING *str)
 // All data gone?
 void clean_string(BSP_STRING *str)
 {
-    if (str && 0 == str->is_const)
+    if (str && !STR_IS_READONLY(str))
     {
-        bsp_spin_lock(&str->lock);
+        STR_LOCK(str);
         STR_LEN(str) = 0;
         str->compressed_len = 0;
         str->compress_type = COMPRESS_TYPE_NONE;
-
-        if (STR_STR(str))
-        {
-            bsp_free(STR_STR(str));
-            STR_STR(str) = NULL;
-        }
-        bsp_spin_unlock(&str->lock);
+        _string_release(str);
+        STR_UNLOCK(str);
     }
 
     return;
 }
 
-// Duplicate
-BSP_STRING * clone_string(BSP_STRING *str)
+// Duplicate. A compressed string keeps compressed data
+static BSP_STRING * _clone_string(BSP_ARENA *arena, BSP_STRING *str)
 {
     if (!str)
     {
         return NULL;
     }
 
-    BSP_STRING *new = new_string(STR_STR(str), STR_LEN(str));
+    size_t len = (COMPRESS_TYPE_NONE == str->compress_type) ? STR_LEN(str) : str->compressed_len;
+    BSP_STRING *new = new_string_arena(arena, STR_STR(str), len);
     if (new)
     {
         new->original_len = STR_LEN(str);
@@ -206,11 +328,158 @@ BSP_STRING * clone_string(BSP_STRING *str)
     return new;
 }
 
+BSP_STRING * clone_string(BSP_STRING *str)
+{
+    if (str && (str->is_atom || str->is_frozen))
+    {
+        // Immutable, just share it
+        return string_ref(str);
+    }
+
+    return _clone_string(curr_arena(), str);
+}
+
+// Arena string to heap, nothing changed on the original one. Data is copied, const data of an
+// arena string may live in a buffer of the event (receive buffer for example).
+// Heap strings returned as is, a heap const string refers data its creator keeps alive
+BSP_STRING * string_promote(BSP_STRING *str)
+{
+    if (!str || !str->arena)
+    {
+        return str;
+    }
+
+    return _clone_string(NULL, str);
+}
+
+BSP_STRING * string_copy_arena(BSP_ARENA *arena, BSP_STRING *str)
+{
+    return _clone_string(arena, str);
+}
+
+/* Refcount */
+BSP_STRING * string_freeze(BSP_STRING *str)
+{
+    if (!str || str->is_atom || str->is_frozen)
+    {
+        return str;
+    }
+
+    BSP_STRING *ret = str;
+    if (str->arena || str->is_const)
+    {
+        // Shared data must be owned by the string itself
+        ret = _clone_string(NULL, str);
+        if (!ret)
+        {
+            return NULL;
+        }
+
+        if (!str->arena)
+        {
+            del_string(str);
+        }
+    }
+
+    ret->is_frozen = 1;
+    ret->refcount = 1;
+
+    return ret;
+}
+
+BSP_STRING * string_ref(BSP_STRING *str)
+{
+    if (!str || str->is_atom)
+    {
+        return str;
+    }
+
+    if (str->is_frozen)
+    {
+        __sync_add_and_fetch(&str->refcount, 1);
+
+        return str;
+    }
+
+    return _clone_string(NULL, str);
+}
+
+BSP_STRING * string_unshare(BSP_STRING *str)
+{
+    if (str && str->is_frozen)
+    {
+        return _clone_string(NULL, str);
+    }
+
+    return str;
+}
+
 /* Operators */
+int string_reserve(BSP_STRING *str, size_t size)
+{
+    int ret;
+    if (!str || COMPRESS_TYPE_NONE != str->compress_type || STR_IS_READONLY(str))
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    STR_LOCK(str);
+    ret = _string_reserve(str, size);
+    STR_UNLOCK(str);
+
+    return ret;
+}
+
+void string_take(BSP_STRING *str, char *data, size_t len)
+{
+    if (!str || STR_IS_READONLY(str))
+    {
+        bsp_free(data);
+        return;
+    }
+
+    STR_LOCK(str);
+    _string_take(str, data, len);
+    STR_LEN(str) = (data) ? len : 0;
+    str->compressed_len = 0;
+    str->compress_type = COMPRESS_TYPE_NONE;
+    STR_UNLOCK(str);
+
+    return;
+}
+
+char * string_detach(BSP_STRING *str, size_t *len)
+{
+    char *data;
+    size_t size;
+    if (!str || STR_IS_READONLY(str))
+    {
+        return NULL;
+    }
+
+    STR_LOCK(str);
+    size = (COMPRESS_TYPE_NONE == str->compress_type) ? STR_LEN(str) : str->compressed_len;
+    data = (size > 0) ? _string_detach(str) : NULL;
+    if (data || 0 == size)
+    {
+        _string_release(str);
+        STR_LEN(str) = 0;
+        str->compressed_len = 0;
+        str->compress_type = COMPRESS_TYPE_NONE;
+    }
+    STR_UNLOCK(str);
+    if (len)
+    {
+        *len = size;
+    }
+
+    return data;
+}
+
 // Append data to string
 ssize_t string_append(BSP_STRING *str, const char *data, ssize_t len)
 {
-    if (!str || !data || !len || COMPRESS_TYPE_NONE != str->compress_type || 0 != str->is_const)
+    if (!str || !data || !len || COMPRESS_TYPE_NONE != str->compress_type || STR_IS_READONLY(str))
     {
         return 0;
     }
@@ -220,20 +489,17 @@ ssize_t string_append(BSP_STRING *str, const char *data, ssize_t len)
         len = strlen(data);
     }
 
-    bsp_spin_lock(&str->lock);
-    // Try to realloc
-    char *new_str = (char *) bsp_realloc(STR_STR(str), STR_LEN(str) + len);
-    if (!new_str)
+    STR_LOCK(str);
+    if (BSP_RTN_SUCCESS != _string_reserve(str, STR_LEN(str) + len))
     {
         // Alloc error
-        bsp_spin_unlock(&str->lock);
+        STR_UNLOCK(str);
         return -1;
     }
 
-    memcpy(new_str + STR_LEN(str), data, len);
-    STR_STR(str) = new_str;
+    memcpy(STR_STR(str) + STR_LEN(str), data, len);
     STR_LEN(str) += len;
-    bsp_spin_unlock(&str->lock);
+    STR_UNLOCK(str);
 
     return len;
 }
@@ -241,26 +507,23 @@ ssize_t string_append(BSP_STRING *str, const char *data, ssize_t len)
 // Fill (enlarge) string
 ssize_t string_fill(BSP_STRING *str, int code, size_t len)
 {
-    if (!str || !len || COMPRESS_TYPE_NONE != str->compress_type || 0 != str->is_const)
+    if (!str || !len || COMPRESS_TYPE_NONE != str->compress_type || STR_IS_READONLY(str))
     {
         // Nothing to do
         return 0;
     }
 
-    bsp_spin_lock(&str->lock);
-    // Try to realloc
-    char *new_str = (char *) bsp_realloc(STR_STR(str), STR_LEN(str) + len);
-    if (!new_str)
+    STR_LOCK(str);
+    if (BSP_RTN_SUCCESS != _string_reserve(str, STR_LEN(str) + len))
     {
         // Alloc error
-        bsp_spin_unlock(&str->lock);
+        STR_UNLOCK(str);
         return -1;
     }
 
-    memset(new_str + STR_LEN(str), (char) code, len);
-    STR_STR(str) = new_str;
+    memset(STR_STR(str) + STR_LEN(str), (char) code, len);
     STR_LEN(str) += len;
-    bsp_spin_unlock(&str->lock);
+    STR_UNLOCK(str);
 
     return len;
 }
@@ -268,30 +531,41 @@ ssize_t string_fill(BSP_STRING *str, int code, size_t len)
 // Formatted append
 ssize_t string_printf(BSP_STRING *str, const char *fmt, ...)
 {
-    if (!str || !fmt || COMPRESS_TYPE_NONE != str->compress_type || 0 != str->is_const)
+    if (!str || !fmt || COMPRESS_TYPE_NONE != str->compress_type || STR_IS_READONLY(str))
     {
         return 0;
     }
 
-    char *tmp = NULL;
     va_list ap;
     va_start(ap, fmt);
-    int len = vasprintf(&tmp, fmt, ap);
+    int len = vsnprintf(NULL, 0, fmt, ap);
     va_end(ap);
+    if (len <= 0)
+    {
+        return len;
+    }
 
-    if (tmp && len > 0)
+    // Print into the buffer directly, with room for the tailing \0
+    STR_LOCK(str);
+    if (BSP_RTN_SUCCESS != _string_reserve(str, STR_LEN(str) + len + 1))
     {
-        len = string_append(str, tmp, len);
-        free(tmp);
+        STR_UNLOCK(str);
+        return -1;
     }
-    
+
+    va_start(ap, fmt);
+    vsnprintf(STR_STR(str) + STR_LEN(str), len + 1, fmt, ap);
+    va_end(ap);
+    STR_LEN(str) += len;
+    STR_UNLOCK(str);
+
     return len;
 }
 
 // Replace needle
 void string_replace(BSP_STRING *str, const char *search, ssize_t search_len, const char *replace, ssize_t replace_len)
 {
-    if (!str || !STR_STR(str) || COMPRESS_TYPE_NONE != str->compress_type || 0 != str->is_const)
+    if (!str || !STR_STR(str) || COMPRESS_TYPE_NONE != str->compress_type || STR_IS_READONLY(str))
     {
         return;
     }
@@ -305,16 +579,24 @@ void string_replace(BSP_STRING *str, const char *search, ssize_t search_len, con
         replace_len = strlen(replace);
     }
 
+    if (!search_len)
+    {
+        return;
+    }
+
     // Make a copy first
-    char *dup = STR_STR(str);
     size_t dup_len = STR_LEN(str);
+    char *dup = _string_detach(str);
+    if (!dup)
+    {
+        return;
+    }
     STR_LEN(str) = 0;
-    STR_STR(str) = NULL;
 
     size_t i, s = 0;
-    for (i = 0; i < dup_len - search_len; i ++)
+    for (i = 0; i + search_len <= dup_len; i ++)
     {
-        if (0 == memcmp(str->str + i, search, search_len))
+        if (0 == memcmp(dup + i, search, search_len))
         {
             // Found
             if (i > s)
@@ -330,6 +612,7 @@ void string_replace(BSP_STRING *str, const char *search, ssize_t search_len, con
     {
         string_append(str, dup + s, dup_len - s);
     }
+    bsp_free(dup);
 
     return;
 }
@@ -348,24 +631,39 @@ ssize_t string_strlen(BSP_STRING *str)
     }
 
     size_t i;
-    bsp_spin_lock(&str->lock);
+    STR_LOCK(str);
     for (i = 0; i < STR_LEN(str); i ++)
     {
         if (0 == str->str[i])
         {
-            bsp_spin_unlock(&str->lock);
+            STR_UNLOCK(str);
             return i;
         }
     }
-    bsp_spin_unlock(&str->lock);
+    STR_UNLOCK(str);
 
     return STR_LEN(str);
 }
 
+#ifdef ENABLE_MEMPOOL
+// Allocators of zlib signature
+static voidpf _zalloc(voidpf opaque, uInt items, uInt size)
+{
+    return (voidpf) mempool_alloc((size_t) items * size);
+}
+
+static void _zfree(voidpf opaque, voidpf addr)
+{
+    mempool_free((void *) addr);
+
+    return;
+}
+#endif
+
 // Compress / Decompress with zlib deflate (stream without header)
 int string_compress_deflate(BSP_STRING *str)
 {
-    if (!str || !STR_STR(str) || COMPRESS_TYPE_NONE != str->compress_type || 0 != str->is_const)
+    if (!str || !STR_STR(str) || COMPRESS_TYPE_NONE != str->compress_type || STR_IS_READONLY(str))
     {
         // You should not compress a string twice or a const string
         return BSP_RTN_FATAL;
@@ -377,18 +675,21 @@ int string_compress_deflate(BSP_STRING *str)
     int ret;
 
 #ifdef ENABLE_MEMPOOL
-    strm.zalloc = mempool_alloc;
-    strm.zfree = mempool_free;
+    strm.zalloc = _zalloc;
+    strm.zfree = _zfree;
 #else
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
 #endif
     strm.opaque = Z_NULL;
 
-    char *dup = STR_STR(str);
     size_t dup_len = STR_LEN(str);
+    char *dup = _string_detach(str);
+    if (!dup)
+    {
+        return BSP_RTN_ERROR_MEMORY;
+    }
     STR_LEN(str) = 0;
-    STR_STR(str) = NULL;
 
     if (Z_OK == deflateInit(&strm, Z_DEFAULT_COMPRESSION))
     {
@@ -406,7 +707,7 @@ int string_compress_deflate(BSP_STRING *str)
             {
                 // Stream error
                 (void) deflateEnd(&strm);
-                STR_STR(str) = dup;
+                _string_take(str, dup, dup_len);
                 STR_LEN(str) = dup_len;
                 return BSP_RTN_ERROR_GENERAL;
             }
@@ -423,13 +724,15 @@ int string_compress_deflate(BSP_STRING *str)
 
         return BSP_RTN_SUCCESS;
     }
+    _string_take(str, dup, dup_len);
+    STR_LEN(str) = dup_len;
 
     return BSP_RTN_ERROR_GENERAL;
 }
 
 int string_decompress_deflate(BSP_STRING *str)
 {
-    if (!str || !STR_STR(str) || COMPRESS_TYPE_DEFLATE != str->compress_type || 0 != str->is_const)
+    if (!str || !STR_STR(str) || COMPRESS_TYPE_DEFLATE != str->compress_type || STR_IS_READONLY(str))
     {
         return BSP_RTN_FATAL;
     }
@@ -439,19 +742,23 @@ int string_decompress_deflate(BSP_STRING *str)
     ssize_t chunk_data_size = 0;
     int ret;
 #ifdef ENABLE_MEMPOOL
-    strm.zalloc = mempool_alloc;
-    strm.zfree = mempool_free;
+    strm.zalloc = _zalloc;
+    strm.zfree = _zfree;
 #else
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
 #endif
     strm.opaque = Z_NULL;
 
-    char *dup = STR_STR(str);
     size_t dup_len = str->compressed_len;
     size_t old_ori = STR_LEN(str);
+    char *dup = _string_detach(str);
+    if (!dup)
+    {
+        return BSP_RTN_ERROR_MEMORY;
+    }
     STR_LEN(str) = 0;
-    STR_STR(str) = NULL;
+    str->compress_type = COMPRESS_TYPE_NONE;
 
     if (Z_OK == inflateInit(&strm))
     {
@@ -474,7 +781,8 @@ int string_decompress_deflate(BSP_STRING *str)
                     break;
                 case Z_MEM_ERROR : 
                     (void) inflateEnd(&strm);
-                    STR_STR(str) = dup;
+                    _string_take(str, dup, dup_len);
+                    str->compress_type = COMPRESS_TYPE_DEFLATE;
                     str->compressed_len = dup_len;
                     STR_LEN(str) = old_ori;
                     return BSP_RTN_ERROR_MEMORY;
@@ -486,7 +794,8 @@ int string_decompress_deflate(BSP_STRING *str)
                 default : 
                     // Data error
                     (void) inflateEnd(&strm);
-                    STR_STR(str) = dup;
+                    _string_take(str, dup, dup_len);
+                    str->compress_type = COMPRESS_TYPE_DEFLATE;
                     str->compressed_len = dup_len;
                     STR_LEN(str) = old_ori;
                     return BSP_RTN_ERROR_GENERAL;
@@ -494,12 +803,14 @@ int string_decompress_deflate(BSP_STRING *str)
         } while (strm.avail_out == 0);
 
         bsp_free(dup);
-        str->compress_type = COMPRESS_TYPE_NONE;
         str->compressed_len = 0;
         (void) inflateEnd(&strm);
 
         return BSP_RTN_SUCCESS;
     }
+    _string_take(str, dup, dup_len);
+    str->compress_type = COMPRESS_TYPE_DEFLATE;
+    STR_LEN(str) = old_ori;
 
     return BSP_RTN_ERROR_GENERAL;
 }
@@ -508,7 +819,7 @@ int string_decompress_deflate(BSP_STRING *str)
 // Compress / Decompress with Google snappy
 int string_compress_snappy(BSP_STRING *str)
 {
-    if (!str || !STR_STR(str) || COMPRESS_TYPE_NONE != str->compress_type || 0 != str->is_const)
+    if (!str || !STR_STR(str) || COMPRESS_TYPE_NONE != str->compress_type || STR_IS_READONLY(str))
     {
         // You should not compress a string twice or a const string
         return BSP_RTN_FATAL;
@@ -520,12 +831,11 @@ int string_compress_snappy(BSP_STRING *str)
     {
         if (SNAPPY_OK == snappy_compress(STR_STR(str), STR_LEN(str), new_str, &compressed_size))
         {
-            bsp_spin_lock(&str->lock);
-            bsp_free(STR_STR(str));
-            STR_STR(str) = new_str;
+            STR_LOCK(str);
+            _string_take(str, new_str, compressed_size);
             str->compress_type = COMPRESS_TYPE_SNAPPY;
             str->compressed_len = compressed_size;
-            bsp_spin_unlock(&str->lock);
+            STR_UNLOCK(str);
 
             return BSP_RTN_SUCCESS;
         }
@@ -541,7 +851,7 @@ int string_compress_snappy(BSP_STRING *str)
 
 int string_decompress_snappy(BSP_STRING *str)
 {
-    if (!str || !STR_STR(str) || COMPRESS_TYPE_SNAPPY != str->compress_type || 0 != str->is_const)
+    if (!str || !STR_STR(str) || COMPRESS_TYPE_SNAPPY != str->compress_type || STR_IS_READONLY(str))
     {
         return BSP_RTN_FATAL;
     }
@@ -554,13 +864,12 @@ int string_decompress_snappy(BSP_STRING *str)
         {
             if (SNAPPY_OK == snappy_uncompress(STR_STR(str), str->compressed_len, new_str, &uncompressed_size))
             {
-                bsp_spin_lock(&str->lock);
-                bsp_free(STR_STR(str));
-                STR_STR(str) = new_str;
+                STR_LOCK(str);
+                _string_take(str, new_str, uncompressed_size);
                 str->compress_type = COMPRESS_TYPE_NONE;
                 str->compressed_len = 0;
                 STR_LEN(str) = uncompressed_size;
-                bsp_spin_unlock(&str->lock);
+                STR_UNLOCK(str);
 
                 return BSP_RTN_SUCCESS;
             }
@@ -585,7 +894,7 @@ int string_decompress_snappy(BSP_STRING *str)
 // Compress / Decompress with LZ4
 int string_compress_lz4(BSP_STRING *str)
 {
-    if (!str || !STR_STR(str) || COMPRESS_TYPE_NONE != str->compress_type || 0 != str->is_const)
+    if (!str || !STR_STR(str) || COMPRESS_TYPE_NONE != str->compress_type || STR_IS_READONLY(str))
     {
         // You should not compress a string twice or a const string
         return BSP_RTN_FATAL;
@@ -600,13 +909,12 @@ int string_compress_lz4(BSP_STRING *str)
     {
         if ((compressed_size = LZ4_compress_withState((void *) state, STR_STR(str), new_str, STR_LEN(str))) > 0)
         {
-            bsp_spin_lock(&str->lock);
-            bsp_free(STR_STR(str));
-            STR_STR(str) = new_str;
+            STR_LOCK(str);
+            _string_take(str, new_str, LZ4_compressBound(STR_LEN(str)));
             str->compress_type = COMPRESS_TYPE_LZ4;
             str->compressed_len = compressed_size;
             bsp_free(state);
-            bsp_spin_unlock(&str->lock);
+            STR_UNLOCK(str);
 
             return BSP_RTN_SUCCESS;
         }
@@ -633,7 +941,7 @@ int string_compress_lz4(BSP_STRING *str)
 
 int string_decompress_lz4(BSP_STRING *str)
 {
-    if (!str || !STR_STR(str) || COMPRESS_TYPE_LZ4 != str->compress_type || 0 != str->is_const)
+    if (!str || !STR_STR(str) || COMPRESS_TYPE_LZ4 != str->compress_type || STR_IS_READONLY(str))
     {
         return BSP_RTN_FATAL;
     }
@@ -644,12 +952,11 @@ int string_decompress_lz4(BSP_STRING *str)
         if (LZ4_decompress_fast(STR_STR(str), new_str, STR_LEN(str)) == str->compressed_len)
         {
             // Decompress successfully
-            bsp_spin_lock(&str->lock);
-            bsp_free(STR_STR(str));
-            STR_STR(str) = new_str;
+            STR_LOCK(str);
+            _string_take(str, new_str, STR_LEN(str));
             str->compress_type = COMPRESS_TYPE_NONE;
             str->compressed_len = 0;
-            bsp_spin_unlock(&str->lock);
+            STR_UNLOCK(str);
 
             return BSP_RTN_SUCCESS;
         }
@@ -666,6 +973,439 @@ int string_decompress_lz4(BSP_STRING *str)
 }
 #endif
 
+/* Persistent compression streams */
+// Packets of one connection share the compression window, every packet is
+// flushed so it can be decoded as soon as it arrives
+BSP_COMPRESS_STREAM * new_compress_stream(char compress_type)
+{
+    BSP_COMPRESS_STREAM *cs = bsp_calloc(1, sizeof(BSP_COMPRESS_STREAM));
+    if (!cs)
+    {
+        return NULL;
+    }
+
+    cs->compress_type = compress_type;
+    cs->window_bits = COMPRESS_STREAM_WINDOW_BITS;
+    cs->flags = 0;
+    cs->refcount = 1;
+    bsp_spin_init(&cs->lock);
+
+    return cs;
+}
+
+BSP_COMPRESS_STREAM * new_deflate_stream(int window_bits, int flags)
+{
+    BSP_COMPRESS_STREAM *cs = new_compress_stream(COMPRESS_TYPE_DEFLATE);
+    if (cs)
+    {
+        cs->window_bits = window_bits;
+        cs->flags = flags;
+    }
+
+    return cs;
+}
+
+BSP_COMPRESS_STREAM * compress_stream_ref(BSP_COMPRESS_STREAM *cs)
+{
+    if (cs)
+    {
+        __sync_add_and_fetch(&cs->refcount, 1);
+    }
+
+    return cs;
+}
+
+void del_compress_stream(BSP_COMPRESS_STREAM *cs)
+{
+    if (!cs || __sync_sub_and_fetch(&cs->refcount, 1) > 0)
+    {
+        return;
+    }
+
+    if (cs->deflate_strm)
+    {
+        (void) deflateEnd((z_stream *) cs->deflate_strm);
+        bsp_free(cs->deflate_strm);
+    }
+
+    if (cs->inflate_strm)
+    {
+        (void) inflateEnd((z_stream *) cs->inflate_strm);
+        bsp_free(cs->inflate_strm);
+    }
+
+#ifdef ENABLE_LZ4
+    if (cs->lz4_strm)
+    {
+        LZ4_freeStream((LZ4_stream_t *) cs->lz4_strm);
+    }
+#endif
+
+    if (cs->lz4_enc_dict)
+    {
+        bsp_free(cs->lz4_enc_dict);
+    }
+
+    if (cs->lz4_dec_dict)
+    {
+        bsp_free(cs->lz4_dec_dict);
+    }
+
+    bsp_spin_destroy(&cs->lock);
+    bsp_free(cs);
+
+    return;
+}
+
+static z_stream * _new_z_stream(int window_bits, int is_inflate)
+{
+    z_stream *strm = bsp_calloc(1, sizeof(z_stream));
+    if (!strm)
+    {
+        return NULL;
+    }
+
+#ifdef ENABLE_MEMPOOL
+    strm->zalloc = _zalloc;
+    strm->zfree = _zfree;
+#else
+    strm->zalloc = Z_NULL;
+    strm->zfree = Z_NULL;
+#endif
+    strm->opaque = Z_NULL;
+
+    // Inflater always takes the largest window, any smaller one of peer fits in
+    if (Z_OK != (is_inflate ? 
+                 inflateInit2(strm, (window_bits < 0) ? -MAX_WBITS : MAX_WBITS) : 
+                 deflateInit2(strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY)))
+    {
+        bsp_free(strm);
+        return NULL;
+    }
+
+    return strm;
+}
+
+// Replace content of string with (de)compressed buffer
+static void _string_adopt(BSP_STRING *str, char *data, size_t original_len, size_t compressed_len, char compress_type)
+{
+    STR_LOCK(str);
+    _string_take(str, data, (COMPRESS_TYPE_NONE == compress_type) ? original_len : compressed_len);
+    STR_LEN(str) = original_len;
+    str->compressed_len = compressed_len;
+    str->compress_type = compress_type;
+    STR_UNLOCK(str);
+
+    return;
+}
+
+static int _deflate_stream(BSP_STRING *str, BSP_COMPRESS_STREAM *cs)
+{
+    z_stream *strm = (z_stream *) cs->deflate_strm;
+    if (!strm)
+    {
+        strm = _new_z_stream(cs->window_bits, 0);
+        if (!strm)
+        {
+            return BSP_RTN_ERROR_MEMORY;
+        }
+        cs->deflate_strm = (void *) strm;
+    }
+
+    // Sync flush marker takes a few bytes more than the bound
+    size_t out_size = deflateBound(strm, STR_LEN(str)) + 16;
+    size_t out_len = 0;
+    char *out = bsp_malloc(out_size);
+    char *tmp = NULL;
+    if (!out)
+    {
+        return BSP_RTN_ERROR_MEMORY;
+    }
+
+    strm->next_in = (z_const Bytef *) STR_STR(str);
+    strm->avail_in = STR_LEN(str);
+    while (1)
+    {
+        strm->next_out = (Bytef *) out + out_len;
+        strm->avail_out = out_size - out_len;
+        if (Z_STREAM_ERROR == deflate(strm, Z_SYNC_FLUSH))
+        {
+            bsp_free(out);
+            return BSP_RTN_ERROR_GENERAL;
+        }
+
+        out_len = out_size - strm->avail_out;
+        if (strm->avail_out > 0)
+        {
+            // Flushed completely
+            break;
+        }
+
+        tmp = bsp_realloc(out, out_size * 2);
+        if (!tmp)
+        {
+            bsp_free(out);
+            return BSP_RTN_ERROR_MEMORY;
+        }
+        out = tmp;
+        out_size *= 2;
+    }
+
+    if (cs->flags & COMPRESS_STREAM_DEFLATE_NO_TAKEOVER)
+    {
+        (void) deflateReset(strm);
+    }
+
+    _string_adopt(str, out, STR_LEN(str), out_len, COMPRESS_TYPE_DEFLATE);
+
+    return BSP_RTN_SUCCESS;
+}
+
+static int _inflate_stream(BSP_STRING *str, BSP_COMPRESS_STREAM *cs)
+{
+    z_stream *strm = (z_stream *) cs->inflate_strm;
+    if (!strm)
+    {
+        strm = _new_z_stream(cs->window_bits, 1);
+        if (!strm)
+        {
+            return BSP_RTN_ERROR_MEMORY;
+        }
+        cs->inflate_strm = (void *) strm;
+    }
+
+    size_t out_size = str->compressed_len * 4 + 256;
+    size_t out_len = 0;
+    char *out = bsp_malloc(out_size);
+    char *tmp = NULL;
+    int ret;
+    if (!out)
+    {
+        return BSP_RTN_ERROR_MEMORY;
+    }
+
+    strm->next_in = (z_const Bytef *) STR_STR(str);
+    strm->avail_in = str->compressed_len;
+    while (1)
+    {
+        strm->next_out = (Bytef *) out + out_len;
+        strm->avail_out = out_size - out_len;
+        ret = inflate(strm, Z_SYNC_FLUSH);
+        if (Z_OK != ret && Z_BUF_ERROR != ret && Z_STREAM_END != ret)
+        {
+            // Window broken, following packets can not be decoded either
+            bsp_free(out);
+            return BSP_RTN_ERROR_GENERAL;
+        }
+
+        out_len = out_size - strm->avail_out;
+        if (strm->avail_out > 0)
+        {
+            // All input consumed (or no progress possible)
+            break;
+        }
+
+        if (out_size >= COMPRESS_STREAM_MAX_LENGTH)
+        {
+            bsp_free(out);
+            return BSP_RTN_ERROR_GENERAL;
+        }
+
+        tmp = bsp_realloc(out, out_size * 2);
+        if (!tmp)
+        {
+            bsp_free(out);
+            return BSP_RTN_ERROR_MEMORY;
+        }
+        out = tmp;
+        out_size *= 2;
+    }
+
+    if (strm->avail_in > 0)
+    {
+        bsp_free(out);
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    if (cs->flags & COMPRESS_STREAM_INFLATE_NO_TAKEOVER)
+    {
+        (void) inflateReset(strm);
+    }
+
+    _string_adopt(str, out, out_len, 0, COMPRESS_TYPE_NONE);
+
+    return BSP_RTN_SUCCESS;
+}
+
+#ifdef ENABLE_LZ4
+// LZ4 stream packet : vint(original length) + block compressed with the previous 64K as dictionary.
+// Encoder buffer holds the last 64K of history followed by the packet, so LZ4 sees them as one
+// prefix and the window rolls over packets the same way as decoder's dictionary
+static int _lz4_compress_stream(BSP_STRING *str, BSP_COMPRESS_STREAM *cs)
+{
+    if (!cs->lz4_strm)
+    {
+        cs->lz4_strm = (void *) LZ4_createStream();
+        if (!cs->lz4_strm)
+        {
+            return BSP_RTN_ERROR_MEMORY;
+        }
+    }
+
+    size_t need = COMPRESS_LZ4_DICT_SIZE + STR_LEN(str);
+    size_t size = (need > COMPRESS_LZ4_DICT_SIZE * 2) ? need : COMPRESS_LZ4_DICT_SIZE * 2;
+    char *buf = cs->lz4_enc_dict;
+    int dict_len;
+    if (!buf || cs->lz4_enc_dict_size < need || cs->lz4_enc_dict_size > size * 2)
+    {
+        // Grow for a large packet, or give a large buffer back
+        buf = bsp_malloc(size);
+        if (!buf)
+        {
+            return BSP_RTN_ERROR_MEMORY;
+        }
+    }
+
+    // History moved to the front of buffer (copied from the old one if replaced)
+    dict_len = LZ4_saveDict((LZ4_stream_t *) cs->lz4_strm, buf, COMPRESS_LZ4_DICT_SIZE);
+    if (buf != cs->lz4_enc_dict)
+    {
+        bsp_free(cs->lz4_enc_dict);
+        cs->lz4_enc_dict = buf;
+        cs->lz4_enc_dict_size = size;
+    }
+
+    int bound = LZ4_compressBound(STR_LEN(str));
+    char *out = bsp_malloc(bound + 9);
+    if (!out)
+    {
+        return BSP_RTN_ERROR_MEMORY;
+    }
+
+    memcpy(buf + dict_len, STR_STR(str), STR_LEN(str));
+    int head_len = set_vint((int64_t) STR_LEN(str), out);
+    int compressed_size = LZ4_compress_fast_continue((LZ4_stream_t *) cs->lz4_strm, buf + dict_len, out + head_len, STR_LEN(str), bound, 1);
+    if (compressed_size <= 0)
+    {
+        bsp_free(out);
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    _string_adopt(str, out, STR_LEN(str), (size_t) (head_len + compressed_size), COMPRESS_TYPE_LZ4);
+
+    return BSP_RTN_SUCCESS;
+}
+
+static int _lz4_decompress_stream(BSP_STRING *str, BSP_COMPRESS_STREAM *cs)
+{
+    if (!cs->lz4_dec_dict)
+    {
+        cs->lz4_dec_dict = bsp_malloc(COMPRESS_LZ4_DICT_SIZE);
+        cs->lz4_dec_dict_len = 0;
+        if (!cs->lz4_dec_dict)
+        {
+            return BSP_RTN_ERROR_MEMORY;
+        }
+    }
+
+    int head_len = (int) str->compressed_len;
+    int64_t original_len = get_vint(STR_STR(str), &head_len);
+    if (head_len < 0 || original_len < 0 || original_len > COMPRESS_STREAM_MAX_LENGTH)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    char *out = bsp_malloc((size_t) original_len + 1);
+    if (!out)
+    {
+        return BSP_RTN_ERROR_MEMORY;
+    }
+
+    if (original_len != LZ4_decompress_safe_usingDict(STR_STR(str) + head_len, out, (int) str->compressed_len - head_len, (int) original_len, cs->lz4_dec_dict, (int) cs->lz4_dec_dict_len))
+    {
+        bsp_free(out);
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    // Roll the window forward, keep the same history as encoder
+    size_t keep;
+    if ((size_t) original_len >= COMPRESS_LZ4_DICT_SIZE)
+    {
+        memcpy(cs->lz4_dec_dict, out + original_len - COMPRESS_LZ4_DICT_SIZE, COMPRESS_LZ4_DICT_SIZE);
+        cs->lz4_dec_dict_len = COMPRESS_LZ4_DICT_SIZE;
+    }
+    else
+    {
+        keep = COMPRESS_LZ4_DICT_SIZE - (size_t) original_len;
+        if (keep > cs->lz4_dec_dict_len)
+        {
+            keep = cs->lz4_dec_dict_len;
+        }
+        memmove(cs->lz4_dec_dict, cs->lz4_dec_dict + cs->lz4_dec_dict_len - keep, keep);
+        memcpy(cs->lz4_dec_dict + keep, out, (size_t) original_len);
+        cs->lz4_dec_dict_len = keep + (size_t) original_len;
+    }
+
+    _string_adopt(str, out, (size_t) original_len, 0, COMPRESS_TYPE_NONE);
+
+    return BSP_RTN_SUCCESS;
+}
+#endif
+
+int string_compress_stream(BSP_STRING *str, BSP_COMPRESS_STREAM *cs)
+{
+    if (!str || !cs || !STR_STR(str) || COMPRESS_TYPE_NONE != str->compress_type || STR_IS_READONLY(str))
+    {
+        return BSP_RTN_FATAL;
+    }
+
+    switch (cs->compress_type)
+    {
+        case COMPRESS_TYPE_DEFLATE : 
+            return _deflate_stream(str, cs);
+#ifdef ENABLE_LZ4
+        case COMPRESS_TYPE_LZ4 : 
+            return _lz4_compress_stream(str, cs);
+#endif
+#ifdef ENABLE_SNAPPY
+        case COMPRESS_TYPE_SNAPPY : 
+            // Snappy has no streaming mode
+            return string_compress_snappy(str);
+#endif
+        case COMPRESS_TYPE_NONE : 
+        default : 
+            break;
+    }
+
+    return BSP_RTN_ERROR_GENERAL;
+}
+
+int string_decompress_stream(BSP_STRING *str, BSP_COMPRESS_STREAM *cs)
+{
+    if (!str || !cs || !STR_STR(str) || COMPRESS_TYPE_NONE == str->compress_type || STR_IS_READONLY(str))
+    {
+        return BSP_RTN_FATAL;
+    }
+
+    switch (str->compress_type)
+    {
+        case COMPRESS_TYPE_DEFLATE : 
+            return _inflate_stream(str, cs);
+#ifdef ENABLE_LZ4
+        case COMPRESS_TYPE_LZ4 : 
+            return _lz4_decompress_stream(str, cs);
+#endif
+#ifdef ENABLE_SNAPPY
+        case COMPRESS_TYPE_SNAPPY : 
+            return string_decompress_snappy(str);
+#endif
+        default : 
+            break;
+    }
+
+    return BSP_RTN_ERROR_GENERAL;
+}
+
 // Base64
 char *base64_enc_idx = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 int base64_dec_idx[128] = {
@@ -695,7 +1435,7 @@ BSP_STRING * string_base64_encode(const char *data, ssize_t len)
     ssize_t remaining = len;
     int c1, c2, c3;
     char tmp[4];
-    BSP_STRING *ret = new_string(NULL, 0);
+    BSP_STRING *ret = new_string_local(NULL, 0);
 
     while (remaining > 0)
     {
@@ -732,7 +1472,7 @@ BSP_STRING * string_base64_decode(const char *data, ssize_t len)
     ssize_t remaining = len;
     int c1, c2, c3, c4;
     char tmp[3] = {0, 0, 0};
-    BSP_STRING *ret = new_string(NULL, 0);
+    BSP_STRING *ret = new_string_local(NULL, 0);
 
     while (remaining > 0)
     {
@@ -781,7 +1521,7 @@ BSP_STRING * string_md5(const char *data, ssize_t len, int raw)
     }
 
     unsigned char hash_val[MD5_DIGEST_LENGTH];
-    BSP_STRING *ret = new_string(NULL, 0);
+    BSP_STRING *ret = new_string_local(NULL, 0);
     MD5((const unsigned char *) data, (unsigned long) len, hash_val);
     if (raw)
     {
@@ -813,7 +1553,7 @@ BSP_STRING * string_sha1(const char *data, ssize_t len, int raw)
     }
 
     unsigned char hash_val[SHA_DIGEST_LENGTH];
-    BSP_STRING *ret = new_string(NULL, 0);
+    BSP_STRING *ret = new_string_local(NULL, 0);
     SHA1((const unsigned char *) data, (unsigned long) len, hash_val);
     if (raw)
     {
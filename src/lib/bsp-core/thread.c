@@ -229,6 +229,16 @@ void * thread_process(void *arg)
                         trace_msg(TRACE_LEVEL_NOTICE, "Thread : Thread %d script GC triggered", me->id);
                         lua_gc(me->script_runner.state, LUA_GCCOLLECT, 0);
                     }
+                    if (notify_buff[6])
+                    {
+                        // Autosave event
+                        online_flush();
+                    }
+                    if (notify_buff[5])
+                    {
+                        // Channel messages queued
+                        channel_flush();
+                    }
                     break;
                 case FD_TYPE_EXIT : 
                     read(me->exit_fd, notify_buff, 8);
@@ -666,6 +676,40 @@ int trigger_gc(int tid)
     return BSP_RTN_SUCCESS;
 }
 
+// Trigger online autosave, counted in its own byte of eventfd
+int trigger_autosave(int tid)
+{
+    static char buff[8] = {0, 0, 0, 0, 0, 0, 1, 0};
+    BSP_THREAD *t = get_thread(tid);
+    if (t)
+    {
+        write(t->notify_fd, buff, 8);
+    }
+    else
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    return BSP_RTN_SUCCESS;
+}
+
+// Trigger channel messages, counted in its own byte of eventfd
+int trigger_channel(int tid)
+{
+    static char buff[8] = {0, 0, 0, 0, 0, 1, 0, 0};
+    BSP_THREAD *t = get_thread(tid);
+    if (t)
+    {
+        write(t->notify_fd, buff, 8);
+    }
+    else
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    return BSP_RTN_SUCCESS;
+}
+
 // Stop all threads
 void stop_workers()
 {
@@ -0,0 +1,723 @@
+/*
+ * view.c
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Read-only view over native serialized (BSP.Packet) data
+ * Fields can be read from the raw packet without building an object,
+ * the object (or LUA table) is only created when somebody asks for it.
+ *
+ * @package bsp::libbsp-core
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/02/2014
+ * @changelog
+ *      [11/24/2014] - Creation
+ *      [12/02/2014] - Hash keys decoded as atoms
+ */
+
+#include "bsp.h"
+
+static ssize_t _object_len(const char *data, size_t left, int depth);
+
+// Length of a vint at data, -1 if imperfect
+static inline ssize_t _vint_len(const char *data, size_t left)
+{
+    if (!data || 0 == left)
+    {
+        return -1;
+    }
+
+    int vlen = (left > 9) ? 9 : (int) left;
+    get_vint(data, &vlen);
+
+    return (ssize_t) vlen;
+}
+
+// Length of a lengthed string (vint + bytes), -1 if imperfect
+static inline ssize_t _lstring_len(const char *data, size_t left, size_t *str_len)
+{
+    int vlen = (left > 9) ? 9 : (int) left;
+    if (!data || 0 == left)
+    {
+        return -1;
+    }
+
+    int64_t len = get_vint(data, &vlen);
+    if (vlen < 0 || len < 0 || (size_t) len > left - vlen)
+    {
+        return -1;
+    }
+
+    if (str_len)
+    {
+        *str_len = (size_t) len;
+    }
+
+    return vlen + (ssize_t) len;
+}
+
+// Length of value payload (after the type byte), -1 if imperfect
+static ssize_t _value_len(const char *data, size_t left, char type, int depth)
+{
+    ssize_t ret = -1;
+    switch (type)
+    {
+        case BSP_VAL_INT :
+            ret = _vint_len(data, left);
+            break;
+        case BSP_VAL_FLOAT :
+            ret = (left >= sizeof(float)) ? (ssize_t) sizeof(float) : -1;
+            break;
+        case BSP_VAL_DOUBLE :
+            ret = (left >= sizeof(double)) ? (ssize_t) sizeof(double) : -1;
+            break;
+        case BSP_VAL_STRING :
+            ret = _lstring_len(data, left, NULL);
+            break;
+        case BSP_VAL_POINTER :
+            ret = (left >= sizeof(void *)) ? (ssize_t) sizeof(void *) : -1;
+            break;
+        case BSP_VAL_OBJECT :
+            if (left > 0 &&
+                (BSP_VAL_OBJECT_SINGLE == data[0] || BSP_VAL_OBJECT_ARRAY == data[0] || BSP_VAL_OBJECT_HASH == data[0]))
+            {
+                ret = _object_len(data, left, depth + 1);
+            }
+            else
+            {
+                // Empty object, serialized with no body
+                ret = 0;
+            }
+            break;
+        case BSP_VAL_BOOLEAN_TRUE :
+        case BSP_VAL_BOOLEAN_FALSE :
+        case BSP_VAL_NULL :
+        case BSP_VAL_UNKNOWN :
+            ret = 0;
+            break;
+        default :
+            // Unsupported type
+            ret = -1;
+            break;
+    }
+
+    return ret;
+}
+
+// Read one value (type byte + payload) at data
+static inline ssize_t _read_value(const char *data, size_t left, BSP_VIEW_VALUE *val, int depth)
+{
+    if (0 == left)
+    {
+        return -1;
+    }
+
+    char type = data[0];
+    ssize_t vlen = _value_len(data + 1, left - 1, type, depth);
+    if (vlen < 0)
+    {
+        return -1;
+    }
+
+    if (val)
+    {
+        val->type = type;
+        val->data = data + 1;
+        val->len = (size_t) vlen;
+        if (BSP_VAL_STRING == type)
+        {
+            // Point to string body
+            ssize_t hlen = _vint_len(data + 1, left - 1);
+            val->data += hlen;
+            val->len -= hlen;
+        }
+    }
+
+    return vlen + 1;
+}
+
+// Read one hash key at data
+static inline ssize_t _read_key(const char *data, size_t left, BSP_VIEW_VALUE *key)
+{
+    size_t str_len = 0;
+    ssize_t klen = _lstring_len(data, left, &str_len);
+    if (klen < 0)
+    {
+        return -1;
+    }
+
+    if (key)
+    {
+        key->type = BSP_VAL_STRING;
+        key->data = data + (klen - str_len);
+        key->len = str_len;
+    }
+
+    return klen;
+}
+
+// Total length of an object, from beginning marker to endding marker
+static ssize_t _object_len(const char *data, size_t left, int depth)
+{
+    if (!data || 0 == left || depth > VIEW_MAX_DEPTH)
+    {
+        return -1;
+    }
+
+    size_t off = 1;
+    ssize_t len;
+    switch (data[0])
+    {
+        case BSP_VAL_OBJECT_SINGLE :
+            if (off < left && BSP_VAL_OBJECT_SINGLE_END != data[off])
+            {
+                len = _read_value(data + off, left - off, NULL, depth);
+                if (len < 0)
+                {
+                    return -1;
+                }
+                off += len;
+            }
+            if (off >= left || BSP_VAL_OBJECT_SINGLE_END != data[off])
+            {
+                return -1;
+            }
+            break;
+        case BSP_VAL_OBJECT_ARRAY :
+            while (off < left && BSP_VAL_OBJECT_ARRAY_END != data[off])
+            {
+                len = _read_value(data + off, left - off, NULL, depth);
+                if (len < 0)
+                {
+                    return -1;
+                }
+                off += len;
+            }
+            if (off >= left)
+            {
+                return -1;
+            }
+            break;
+        case BSP_VAL_OBJECT_HASH :
+            while (off < left && BSP_VAL_OBJECT_HASH_END != data[off])
+            {
+                len = _read_key(data + off, left - off, NULL);
+                if (len < 0)
+                {
+                    return -1;
+                }
+                off += len;
+                len = _read_value(data + off, left - off, NULL, depth);
+                if (len < 0)
+                {
+                    return -1;
+                }
+                off += len;
+            }
+            if (off >= left)
+            {
+                return -1;
+            }
+            break;
+        default :
+            // Not an object
+            return -1;
+    }
+
+    return (ssize_t) off + 1;
+}
+
+int view_init(BSP_VIEW *view, const char *data, size_t len)
+{
+    if (!view || !data)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    ssize_t olen = _object_len(data, len, 0);
+    if (olen < 0)
+    {
+        trace_msg(TRACE_LEVEL_DEBUG, "View : Imperfect native data");
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    view->data = data;
+    view->len = (size_t) olen;
+    switch (data[0])
+    {
+        case BSP_VAL_OBJECT_SINGLE :
+            view->type = OBJECT_TYPE_SINGLE;
+            break;
+        case BSP_VAL_OBJECT_ARRAY :
+            view->type = OBJECT_TYPE_ARRAY;
+            break;
+        case BSP_VAL_OBJECT_HASH :
+        default :
+            view->type = OBJECT_TYPE_HASH;
+            break;
+    }
+
+    return BSP_RTN_SUCCESS;
+}
+
+// Walk items of view. Set *offset to 0 before the first call
+int view_next_item(BSP_VIEW *view, size_t *offset, BSP_VIEW_VALUE *key, BSP_VIEW_VALUE *val)
+{
+    if (!view || !view->data || !offset)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    size_t off = (*offset > 0) ? *offset : 1;
+    // Last byte is the endding marker
+    size_t left = (view->len > off + 1) ? view->len - off - 1 : 0;
+    const char *data = view->data + off;
+    ssize_t len;
+    if (0 == left)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    if (OBJECT_TYPE_HASH == view->type)
+    {
+        len = _read_key(data, left, key);
+        if (len < 0)
+        {
+            return BSP_RTN_ERROR_GENERAL;
+        }
+        data += len;
+        left -= len;
+        off += len;
+    }
+    else if (key)
+    {
+        key->type = BSP_VAL_UNKNOWN;
+        key->data = NULL;
+        key->len = 0;
+    }
+
+    len = _read_value(data, left, val, 0);
+    if (len < 0)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+    *offset = off + len;
+
+    return BSP_RTN_SUCCESS;
+}
+
+size_t view_size(BSP_VIEW *view)
+{
+    size_t ret = 0, offset = 0;
+    while (BSP_RTN_SUCCESS == view_next_item(view, &offset, NULL, NULL))
+    {
+        ret ++;
+    }
+
+    return ret;
+}
+
+int view_get_single(BSP_VIEW *view, BSP_VIEW_VALUE *val)
+{
+    if (!view || OBJECT_TYPE_SINGLE != view->type)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    size_t offset = 0;
+
+    return view_next_item(view, &offset, NULL, val);
+}
+
+int view_get_array(BSP_VIEW *view, size_t idx, BSP_VIEW_VALUE *val)
+{
+    if (!view || OBJECT_TYPE_ARRAY != view->type)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    size_t offset = 0, i = 0;
+    BSP_VIEW_VALUE curr;
+    while (BSP_RTN_SUCCESS == view_next_item(view, &offset, NULL, &curr))
+    {
+        if (i == idx)
+        {
+            if (val)
+            {
+                *val = curr;
+            }
+
+            return BSP_RTN_SUCCESS;
+        }
+        i ++;
+    }
+
+    return BSP_RTN_ERROR_GENERAL;
+}
+
+int view_get_hash(BSP_VIEW *view, const char *key, ssize_t key_len, BSP_VIEW_VALUE *val)
+{
+    if (!view || !key || OBJECT_TYPE_HASH != view->type)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    if (key_len < 0)
+    {
+        key_len = strlen(key);
+    }
+
+    size_t offset = 0;
+    BSP_VIEW_VALUE curr_key, curr;
+    while (BSP_RTN_SUCCESS == view_next_item(view, &offset, &curr_key, &curr))
+    {
+        if (curr_key.len == (size_t) key_len && 0 == memcmp(curr_key.data, key, key_len))
+        {
+            if (val)
+            {
+                *val = curr;
+            }
+
+            return BSP_RTN_SUCCESS;
+        }
+    }
+
+    return BSP_RTN_ERROR_GENERAL;
+}
+
+/* Magic path, same as object_get_value() */
+int view_get_value(BSP_VIEW *view, const char *path, BSP_VIEW_VALUE *val)
+{
+    if (!view || !val)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    if (OBJECT_TYPE_SINGLE == view->type)
+    {
+        return view_get_single(view, val);
+    }
+
+    if (!path || 0 == strlen(path))
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    BSP_VIEW curr = *view;
+    const char *seg = path;
+    const char *end = NULL;
+    char *endptr = NULL;
+    size_t seg_len, idx;
+    int ret;
+    while (1)
+    {
+        end = strchr(seg, '.');
+        seg_len = (end) ? (size_t) (end - seg) : strlen(seg);
+        if (0 == seg_len)
+        {
+            return BSP_RTN_ERROR_GENERAL;
+        }
+
+        if (OBJECT_TYPE_HASH == curr.type)
+        {
+            ret = view_get_hash(&curr, seg, seg_len, val);
+        }
+        else if (OBJECT_TYPE_ARRAY == curr.type)
+        {
+            idx = (size_t) strtoull(seg, &endptr, 0);
+            if (endptr != seg + seg_len)
+            {
+                // No digital
+                return BSP_RTN_ERROR_GENERAL;
+            }
+            ret = view_get_array(&curr, idx, val);
+        }
+        else
+        {
+            return view_get_single(&curr, val);
+        }
+
+        if (BSP_RTN_SUCCESS != ret || !end)
+        {
+            return ret;
+        }
+
+        if (BSP_RTN_SUCCESS != view_value_to_view(val, &curr))
+        {
+            return BSP_RTN_ERROR_GENERAL;
+        }
+        seg = end + 1;
+    }
+
+    return BSP_RTN_ERROR_GENERAL;
+}
+
+/* Value readers */
+int view_value_to_view(BSP_VIEW_VALUE *val, BSP_VIEW *view)
+{
+    if (!val || !view || BSP_VAL_OBJECT != val->type || 0 == val->len)
+    {
+        return BSP_RTN_ERROR_GENERAL;
+    }
+
+    return view_init(view, val->data, val->len);
+}
+
+int64_t view_value_get_int(BSP_VIEW_VALUE *val)
+{
+    int64_t ret = 0;
+    if (val && BSP_VAL_INT == val->type)
+    {
+        int vlen = (int) val->len;
+        ret = get_vint(val->data, &vlen);
+    }
+
+    return ret;
+}
+
+int view_value_get_boolean(BSP_VIEW_VALUE *val)
+{
+    int ret = BSP_BOOLEAN_FALSE;
+    if (val && BSP_VAL_BOOLEAN_TRUE == val->type)
+    {
+        ret = BSP_BOOLEAN_TRUE;
+    }
+
+    return ret;
+}
+
+double view_value_get_double(BSP_VIEW_VALUE *val)
+{
+    double ret = 0.0;
+    if (val)
+    {
+        if (BSP_VAL_DOUBLE == val->type)
+        {
+            ret = get_double(val->data);
+        }
+        else if (BSP_VAL_FLOAT == val->type)
+        {
+            ret = (double) get_float(val->data);
+        }
+    }
+
+    return ret;
+}
+
+const char * view_value_get_string(BSP_VIEW_VALUE *val, size_t *len)
+{
+    const char *ret = NULL;
+    if (val && BSP_VAL_STRING == val->type)
+    {
+        ret = val->data;
+        if (len)
+        {
+            *len = val->len;
+        }
+    }
+
+    return ret;
+}
+
+/* Materialize */
+BSP_VALUE * view_value_to_value(BSP_VIEW_VALUE *val)
+{
+    if (!val)
+    {
+        return NULL;
+    }
+
+    BSP_VALUE *ret = new_value();
+    BSP_VIEW sub;
+    if (!ret)
+    {
+        return NULL;
+    }
+
+    switch (val->type)
+    {
+        case BSP_VAL_INT :
+        case BSP_VAL_FLOAT :
+        case BSP_VAL_DOUBLE :
+            // Payload is just what we store in lval
+            memcpy(ret->lval, val->data, (val->len > sizeof(ret->lval)) ? sizeof(ret->lval) : val->len);
+            ret->type = val->type;
+            break;
+        case BSP_VAL_BOOLEAN_TRUE :
+            value_set_boolean_true(ret);
+            break;
+        case BSP_VAL_BOOLEAN_FALSE :
+            value_set_boolean_false(ret);
+            break;
+        case BSP_VAL_STRING :
+            value_set_string(ret, new_string(val->data, val->len));
+            break;
+        case BSP_VAL_POINTER :
+            value_set_pointer(ret, get_pointer(val->data));
+            break;
+        case BSP_VAL_OBJECT :
+            if (BSP_RTN_SUCCESS == view_value_to_view(val, &sub))
+            {
+                value_set_object(ret, view_to_object(&sub));
+            }
+            else
+            {
+                value_set_null(ret);
+            }
+            break;
+        case BSP_VAL_NULL :
+        case BSP_VAL_UNKNOWN :
+        default :
+            value_set_null(ret);
+            break;
+    }
+
+    return ret;
+}
+
+BSP_OBJECT * view_to_object(BSP_VIEW *view)
+{
+    if (!view || !view->data)
+    {
+        return NULL;
+    }
+
+    BSP_OBJECT *obj = new_object(view->type);
+    BSP_VIEW_VALUE key, val;
+    size_t offset = 0;
+    if (!obj)
+    {
+        return NULL;
+    }
+
+    while (BSP_RTN_SUCCESS == view_next_item(view, &offset, &key, &val))
+    {
+        switch (view->type)
+        {
+            case OBJECT_TYPE_SINGLE :
+                object_set_single(obj, view_value_to_value(&val));
+                break;
+            case OBJECT_TYPE_ARRAY :
+                object_set_array(obj, -1, view_value_to_value(&val));
+                break;
+            case OBJECT_TYPE_HASH :
+                object_set_hash(obj, atom_key(key.data, key.len), view_value_to_value(&val));
+                break;
+            default :
+                break;
+        }
+    }
+
+    return obj;
+}
+
+/* View -> LUA stack */
+static void _push_view_value_to_lua(lua_State *s, BSP_VIEW_VALUE *val)
+{
+    BSP_VIEW sub;
+    switch (val->type)
+    {
+        case BSP_VAL_INT :
+            lua_pushinteger(s, (lua_Integer) view_value_get_int(val));
+            break;
+        case BSP_VAL_FLOAT :
+        case BSP_VAL_DOUBLE :
+            lua_pushnumber(s, (lua_Number) view_value_get_double(val));
+            break;
+        case BSP_VAL_BOOLEAN_TRUE :
+            lua_pushboolean(s, BSP_BOOLEAN_TRUE);
+            break;
+        case BSP_VAL_BOOLEAN_FALSE :
+            lua_pushboolean(s, BSP_BOOLEAN_FALSE);
+            break;
+        case BSP_VAL_STRING :
+            lua_pushlstring(s, val->data, val->len);
+            break;
+        case BSP_VAL_POINTER :
+            lua_pushlightuserdata(s, get_pointer(val->data));
+            break;
+        case BSP_VAL_OBJECT :
+            if (BSP_RTN_SUCCESS == view_value_to_view(val, &sub))
+            {
+                view_to_lua_stack(s, &sub);
+            }
+            else
+            {
+                lua_pushnil(s);
+            }
+            break;
+        case BSP_VAL_NULL :
+        case BSP_VAL_UNKNOWN :
+        default :
+            lua_pushnil(s);
+            break;
+    }
+
+    return;
+}
+
+void view_to_lua_stack(lua_State *s, BSP_VIEW *view)
+{
+    if (!s)
+    {
+        return;
+    }
+
+    lua_checkstack(s, 1);
+    if (!view || !view->data)
+    {
+        lua_pushnil(s);
+        return;
+    }
+
+    BSP_VIEW_VALUE key, val;
+    size_t offset = 0;
+    lua_Integer idx = 0;
+    if (OBJECT_TYPE_SINGLE == view->type)
+    {
+        if (BSP_RTN_SUCCESS == view_next_item(view, &offset, NULL, &val))
+        {
+            _push_view_value_to_lua(s, &val);
+        }
+        else
+        {
+            lua_pushnil(s);
+        }
+
+        return;
+    }
+
+    lua_newtable(s);
+    while (BSP_RTN_SUCCESS == view_next_item(view, &offset, &key, &val))
+    {
+        lua_checkstack(s, 2);
+        if (OBJECT_TYPE_ARRAY == view->type)
+        {
+            _push_view_value_to_lua(s, &val);
+            lua_rawseti(s, -2, ++ idx);
+        }
+        else
+        {
+            lua_pushlstring(s, key.data, key.len);
+            _push_view_value_to_lua(s, &val);
+            lua_settable(s, -3);
+        }
+    }
+
+    return;
+}
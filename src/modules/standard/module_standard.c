@@ -128,6 +128,14 @@ static int standard_net_send(lua_State *s)
     else
     {
         // Send to group
+        size_t nclts = 0, size = lua_rawlen(s, 1);
+        BSP_CLIENT **clts = bsp_malloc(sizeof(BSP_CLIENT *) * (size + 1));
+        if (!clts)
+        {
+            lua_pushinteger(s, 0);
+            return 1;
+        }
+
         lua_checkstack(s, 3);
         lua_pushnil(s);
         while (0 != lua_next(s, 1))
@@ -135,27 +143,44 @@ static int standard_net_send(lua_State *s)
             if (lua_isnumber(s, -1))
             {
                 client_fd = lua_tonumber(s, -1);
+                fd_type = FD_TYPE_SOCKET_CLIENT;
                 clt = (BSP_CLIENT *) get_fd(client_fd, &fd_type);
                 if (clt)
                 {
-                    switch (data_type)
+                    if (nclts > size)
                     {
-                        case PACKET_TYPE_RAW : 
-                            output_client_raw(clt, raw, len);
-                            break;
-                        case PACKET_TYPE_OBJ : 
-                            output_client_obj(clt, obj);
-                            break;
-                        case PACKET_TYPE_CMD : 
-                            output_client_cmd(clt, cmd, obj);
-                        default : 
+                        // Hash part of table
+                        BSP_CLIENT **tmp = bsp_realloc(clts, sizeof(BSP_CLIENT *) * (size * 2 + 2));
+                        if (!tmp)
+                        {
+                            lua_pop(s, 1);
                             break;
+                        }
+                        clts = tmp;
+                        size = size * 2 + 1;
                     }
-                    ret ++;
+                    clts[nclts ++] = clt;
                 }
             }
             lua_pop(s, 1);
         }
+
+        // Encode once for all clients
+        switch (data_type)
+        {
+            case PACKET_TYPE_RAW : 
+                ret = output_clients_raw(clts, nclts, raw, len);
+                break;
+            case PACKET_TYPE_OBJ : 
+                ret = output_clients_obj(clts, nclts, obj);
+                break;
+            case PACKET_TYPE_CMD : 
+                ret = output_clients_cmd(clts, nclts, cmd, obj);
+                break;
+            default : 
+                break;
+        }
+        bsp_free(clts);
     }
 
     lua_pushinteger(s, ret);
@@ -489,7 +514,14 @@ static int standard_json_encode(lua_State *s)
 
     BSP_OBJECT *obj = lua_stack_to_object(s);
     BSP_STRING *json = json_nd_encode(obj);
-    lua_pushlstring(s, STR_STR(json), STR_LEN(json));
+    if (json)
+    {
+        lua_pushlstring(s, STR_STR(json), STR_LEN(json));
+    }
+    else
+    {
+        lua_pushnil(s);
+    }
     del_object(obj);
     del_string(json);
 
@@ -605,7 +637,9 @@ static int standard_hash(lua_State *s)
 
     size_t len;
     const char *input = lua_tolstring(s, -1, &len);
-    uint32_t hash_value = bsp_hash(input, len);
+    // Scripts may compare it between processes, not the seeded one
+    uint64_t h = bsp_hash64(input, len, 0);
+    uint32_t hash_value = (uint32_t) (h ^ (h >> 32));
     lua_pushinteger(s, (lua_Integer) hash_value);
 
     return 1;
@@ -700,13 +734,100 @@ static int standard_log(lua_State *s)
 }
 
 /** Memdb **/
+// Scalars go to cache as they are, tables frozen once and shared by every reader
 static int standard_set_cache(lua_State *s)
 {
-    return 0;
+    if (!s || lua_gettop(s) < 2 || !lua_isstring(s, 1))
+    {
+        return 0;
+    }
+
+    const char *key = lua_tostring(s, 1);
+    int ttl = (lua_gettop(s) > 2) ? lua_tointeger(s, 3) : 0;
+    lua_settop(s, 2);
+    int ret = memdb_set(key, lua_stack_to_value(s), ttl);
+    lua_checkstack(s, 1);
+    lua_pushboolean(s, (BSP_RTN_SUCCESS == ret) ? 1 : 0);
+
+    return 1;
 }
 
+// Value and version (for bsp_cas_cache), nil if missing
 static int standard_get_cache(lua_State *s)
 {
+    if (!s || !lua_isstring(s, 1))
+    {
+        return 0;
+    }
+
+    uint64_t version = 0;
+    BSP_VALUE *val = memdb_get(lua_tostring(s, 1), &version);
+    if (!val)
+    {
+        lua_checkstack(s, 1);
+        lua_pushnil(s);
+
+        return 1;
+    }
+
+    lua_checkstack(s, 2);
+    value_to_lua_stack(s, val);
+    lua_pushnumber(s, (lua_Number) version);
+    del_value(val);
+
+    return 2;
+}
+
+static int standard_del_cache(lua_State *s)
+{
+    if (!s || !lua_isstring(s, 1))
+    {
+        return 0;
+    }
+
+    memdb_del(lua_tostring(s, 1));
+
+    return 0;
+}
+
+static int standard_incr_cache(lua_State *s)
+{
+    if (!s || !lua_isstring(s, 1))
+    {
+        return 0;
+    }
+
+    int64_t delta = (lua_isnumber(s, 2)) ? (int64_t) lua_tonumber(s, 2) : 1;
+    int64_t result = 0;
+    lua_checkstack(s, 1);
+    if (BSP_RTN_SUCCESS == memdb_incr(lua_tostring(s, 1), delta, &result))
+    {
+        lua_pushnumber(s, (lua_Number) result);
+    }
+    else
+    {
+        lua_pushnil(s);
+    }
+
+    return 1;
+}
+
+// Version 0 : only if key does not exist
+static int standard_cas_cache(lua_State *s)
+{
+    if (!s || lua_gettop(s) < 3 || !lua_isstring(s, 1) || !lua_isnumber(s, 2))
+    {
+        return 0;
+    }
+
+    const char *key = lua_tostring(s, 1);
+    uint64_t version = (uint64_t) lua_tonumber(s, 2);
+    int ttl = (lua_gettop(s) > 3) ? lua_tointeger(s, 4) : 0;
+    lua_settop(s, 3);
+    int ret = memdb_cas(key, version, lua_stack_to_value(s), ttl);
+    lua_checkstack(s, 1);
+    lua_pushboolean(s, (BSP_RTN_SUCCESS == ret) ? 1 : 0);
+
     return 1;
 }
 
@@ -733,16 +854,25 @@ static int standard_set_offline(lua_State *s)
         return 0;
     }
 
+    // Dirty data saved by autosave later, logout never waits for storage
+    BSP_CORE_SETTING *settings = get_core_setting();
+    int write_behind = (settings && settings->online_autosave_interval > 0) ? 1 : 0;
     if (lua_isnumber(s, -1))
     {
         int fd = lua_tointeger(s, -1);
-        save_online_data_by_bind(fd);
+        if (!write_behind)
+        {
+            save_online_data_by_bind(fd);
+        }
         del_online_by_bind(fd);
     }
     else
     {
         const char *key = lua_tostring(s, -1);
-        save_online_data_by_key(key);
+        if (!write_behind)
+        {
+            save_online_data_by_key(key);
+        }
         del_online_by_key(key);
     }
 
@@ -770,10 +900,50 @@ static int standard_online_data(lua_State *s)
 
     lua_checkstack(s, 1);
     object_to_lua_stack(s, data);
+    del_object(data);
+
+    return 1;
+}
+
+static int standard_set_online_data(lua_State *s)
+{
+    if (!s || !lua_istable(s, -1))
+    {
+        return 0;
+    }
+
+    int ret;
+    BSP_OBJECT *data = lua_stack_to_object(s);
+    if (lua_isnumber(s, -2))
+    {
+        ret = set_online_data_by_bind(lua_tointeger(s, -2), data);
+    }
+    else
+    {
+        ret = set_online_data_by_key(lua_tostring(s, -2), data);
+    }
+    lua_checkstack(s, 1);
+    lua_pushboolean(s, (BSP_RTN_SUCCESS == ret) ? 1 : 0);
 
     return 1;
 }
 
+static int standard_online_index(lua_State *s)
+{
+    if (!s || !lua_isstring(s, -1))
+    {
+        return 0;
+    }
+
+    const char *field = lua_tostring(s, -1);
+    int id = online_add_index(field);
+    lua_checkstack(s, 1);
+    lua_pushboolean(s, (id >= 0) ? 1 : 0);
+
+    return 1;
+}
+
+// Fds matching condition (all without), pushed as a sequence
 static int standard_online_list(lua_State *s)
 {
     if (!s)
@@ -781,10 +951,126 @@ static int standard_online_list(lua_State *s)
         return 0;
     }
 
-    BSP_OBJECT *list = get_online_list(NULL);
+    const char *condition = (lua_isstring(s, 1)) ? lua_tostring(s, 1) : NULL;
+    size_t nbinds, i;
+    int *binds = get_online_binds(condition, &nbinds);
+    lua_checkstack(s, 3);
+    lua_createtable(s, (int) nbinds, 0);
+    for (i = 0; i < nbinds; i ++)
+    {
+        lua_pushinteger(s, binds[i]);
+        lua_rawseti(s, -2, (int) i + 1);
+    }
+    bsp_free(binds);
+
+    return 1;
+}
+
+// Where key is online on this host : instance id, fd and online time, nil if not
+static int standard_presence(lua_State *s)
+{
+    if (!s || !lua_isstring(s, -1))
+    {
+        return 0;
+    }
+
+    BSP_PRESENCE p;
+    if (BSP_RTN_SUCCESS != presence_get(lua_tostring(s, -1), &p))
+    {
+        lua_checkstack(s, 1);
+        lua_pushnil(s);
+
+        return 1;
+    }
+
+    lua_checkstack(s, 3);
+    lua_pushinteger(s, p.instance_id);
+    lua_pushinteger(s, p.bind);
+    lua_pushinteger(s, (lua_Integer) p.since);
+
+    return 3;
+}
+
+/** Channel **/
+static int standard_channel_join(lua_State *s)
+{
+    if (!s || !lua_isstring(s, 1) || !lua_isnumber(s, 2))
+    {
+        return 0;
+    }
+
+    int ret = channel_join(lua_tostring(s, 1), lua_tointeger(s, 2));
+    lua_checkstack(s, 1);
+    lua_pushboolean(s, (BSP_RTN_SUCCESS == ret) ? 1 : 0);
+
+    return 1;
+}
+
+static int standard_channel_leave(lua_State *s)
+{
+    if (!s || !lua_isstring(s, 1) || !lua_isnumber(s, 2))
+    {
+        return 0;
+    }
+
+    int ret = channel_leave(lua_tostring(s, 1), lua_tointeger(s, 2));
+    lua_checkstack(s, 1);
+    lua_pushboolean(s, (BSP_RTN_SUCCESS == ret) ? 1 : 0);
+
+    return 1;
+}
+
+// Fds of channel, pushed as a sequence
+static int standard_channel_members(lua_State *s)
+{
+    if (!s || !lua_isstring(s, 1))
+    {
+        return 0;
+    }
+
+    size_t nmembers, i;
+    int *members = get_channel_members(lua_tostring(s, 1), &nmembers);
+    lua_checkstack(s, 3);
+    lua_createtable(s, (int) nmembers, 0);
+    for (i = 0; i < nmembers; i ++)
+    {
+        lua_pushinteger(s, members[i]);
+        lua_rawseti(s, -2, (int) i + 1);
+    }
+    bsp_free(members);
+
+    return 1;
+}
+
+// Same arguments as bsp_net_send() with a channel name instead of fds, sent by workers of members
+static int standard_channel_send(lua_State *s)
+{
+    if (!s || lua_gettop(s) < 2 || !lua_isstring(s, 1))
+    {
+        return 0;
+    }
+
+    const char *name = lua_tostring(s, 1);
+    const char *raw = NULL;
+    size_t len = 0, ret = 0;
+    if (lua_istable(s, 2) && 2 == lua_gettop(s))
+    {
+        // OBJ
+        ret = channel_send_obj(name, lua_stack_to_object(s));
+    }
+    else if (lua_isnumber(s, 2) && lua_istable(s, 3) && 3 == lua_gettop(s))
+    {
+        // CMD
+        ret = channel_send_cmd(name, lua_tointeger(s, 2), lua_stack_to_object(s));
+    }
+    else if (lua_isstring(s, 2) && 2 == lua_gettop(s))
+    {
+        // RAW
+        raw = lua_tolstring(s, 2, &len);
+        ret = channel_send_raw(name, raw, len);
+    }
     lua_checkstack(s, 1);
-    object_to_lua_stack(s, list);
-    del_object(list);
+    lua_pushinteger(s, ret);
 
     return 1;
 }
@@ -857,6 +1143,15 @@ int bsp_module_standard(lua_State *s)
     lua_pushcfunction(s, standard_get_cache);
     lua_setglobal(s, "bsp_get_cache");
 
+    lua_pushcfunction(s, standard_del_cache);
+    lua_setglobal(s, "bsp_del_cache");
+
+    lua_pushcfunction(s, standard_incr_cache);
+    lua_setglobal(s, "bsp_incr_cache");
+
+    lua_pushcfunction(s, standard_cas_cache);
+    lua_setglobal(s, "bsp_cas_cache");
+
     lua_pushcfunction(s, standard_set_online);
     lua_setglobal(s, "bsp_set_online");
 
@@ -866,9 +1161,30 @@ int bsp_module_standard(lua_State *s)
     lua_pushcfunction(s, standard_online_data);
     lua_setglobal(s, "bsp_online_data");
 
+    lua_pushcfunction(s, standard_set_online_data);
+    lua_setglobal(s, "bsp_set_online_data");
+
+    lua_pushcfunction(s, standard_online_index);
+    lua_setglobal(s, "bsp_online_index");
+
     lua_pushcfunction(s, standard_online_list);
     lua_setglobal(s, "bsp_online_list");
 
+    lua_pushcfunction(s, standard_presence);
+    lua_setglobal(s, "bsp_presence");
+
+    lua_pushcfunction(s, standard_channel_join);
+    lua_setglobal(s, "bsp_channel_join");
+
+    lua_pushcfunction(s, standard_channel_leave);
+    lua_setglobal(s, "bsp_channel_leave");
+
+    lua_pushcfunction(s, standard_channel_members);
+    lua_setglobal(s, "bsp_channel_members");
+
+    lua_pushcfunction(s, standard_channel_send);
+    lua_setglobal(s, "bsp_channel_send");
+
     lua_settop(s, 0);
 
     return 0;
@@ -0,0 +1,47 @@
+/*
+ * bsp_test.h
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Regression test helpers
+ *
+ * @package bsp::test
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/18/2014
+ * @changelog
+ *      [12/18/2014] - Creation
+ */
+
+#ifndef _TEST_BSP_TEST_H
+
+#define _TEST_BSP_TEST_H
+/* Headers */
+#include "bsp.h"
+
+/* Definations */
+
+/* Macros */
+// Failed checks are counted, main() returns the count (0 : passed)
+#define TEST_CHECK(cond)                        do { if (!(cond)) { fprintf(stderr, "%s:%d : check failed : %s\n", __FILE__, __LINE__, #cond); test_failed ++; } } while (0)
+
+/* Structs */
+
+/* Functions */
+static int test_failed = 0;
+
+#endif  /* _TEST_BSP_TEST_H */
@@ -0,0 +1,164 @@
+/*
+ * test_hash.c
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Object hash regression test : growth, holes and rebuild of the open addressing table,
+ * string hash of empty keys
+ *
+ * @package bsp::test
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/18/2014
+ * @changelog
+ *      [12/18/2014] - Creation
+ */
+
+#include "bsp_test.h"
+
+#define TEST_HASH_ITEMS                         5000
+#define TEST_HASH_ROUNDS                        20
+
+static void _set(BSP_OBJECT *obj, int k, int64_t v)
+{
+    char key[32];
+    BSP_VALUE *val = new_value();
+    sprintf(key, "key-%d", k);
+    value_set_int(val, v);
+    object_set_hash_str(obj, key, val);
+
+    return;
+}
+
+static void _del(BSP_OBJECT *obj, int k)
+{
+    char key[32];
+    sprintf(key, "key-%d", k);
+    object_set_hash_str(obj, key, NULL);
+
+    return;
+}
+
+static int64_t _get(BSP_OBJECT *obj, int k)
+{
+    char key[32];
+    BSP_VALUE *val = NULL;
+    sprintf(key, "key-%d", k);
+    val = object_get_hash_str(obj, key);
+
+    return (val) ? value_get_int(val) : -1;
+}
+
+// Every live key found with its value, iteration gives them in order of last insertion
+static void _verify(BSP_OBJECT *obj, const int64_t *expect, const int *order, const size_t *pos, size_t norder)
+{
+    size_t i, n = 0, live = 0;
+    BSP_STRING *key = NULL;
+    char buf[32];
+    for (i = 0; i < TEST_HASH_ITEMS; i ++)
+    {
+        TEST_CHECK(expect[i] == _get(obj, (int) i));
+        live += (expect[i] >= 0);
+    }
+    TEST_CHECK(live == object_size(obj));
+
+    reset_object(obj);
+    while ((key = curr_hash_key(obj)))
+    {
+        while (n < norder && (expect[order[n]] < 0 || pos[order[n]] != n))
+        {
+            n ++;
+        }
+        sprintf(buf, "key-%d", (n < norder) ? order[n] : -1);
+        TEST_CHECK(STR_LEN(key) == strlen(buf) && 0 == memcmp(STR_STR(key), buf, STR_LEN(key)));
+        n ++;
+        next_item(obj);
+    }
+
+    return;
+}
+
+// Length 0 is the empty key, nothing read from data
+static void test_empty_key()
+{
+    const char data[3] = {'a', 'b', 'c'};
+    TEST_CHECK(bsp_hash(data, 0) == bsp_hash("", -1));
+    TEST_CHECK(bsp_hash(data, 0) != bsp_hash("abc", -1));
+    TEST_CHECK(bsp_hash(data, 3) == bsp_hash("abc", -1));
+
+    return;
+}
+
+int main(int argc, char **argv)
+{
+    static int64_t expect[TEST_HASH_ITEMS];
+    static int order[TEST_HASH_ITEMS * (TEST_HASH_ROUNDS + 1)];
+    static size_t pos[TEST_HASH_ITEMS];
+    size_t norder = 0;
+    int i, r, k;
+    BSP_OBJECT *obj = NULL;
+    hash_init();
+    freelist_init();
+    srand(1);
+    test_empty_key();
+
+    obj = new_object(OBJECT_TYPE_HASH);
+    for (i = 0; i < TEST_HASH_ITEMS; i ++)
+    {
+        _set(obj, i, i);
+        expect[i] = i;
+        pos[i] = norder;
+        order[norder ++] = i;
+    }
+    _verify(obj, expect, order, pos, norder);
+
+    // Remove and add back at random, holes compacted by rebuilds
+    for (r = 0; r < TEST_HASH_ROUNDS; r ++)
+    {
+        for (i = 0; i < TEST_HASH_ITEMS / 2; i ++)
+        {
+            k = rand() % TEST_HASH_ITEMS;
+            if (expect[k] >= 0)
+            {
+                _del(obj, k);
+                expect[k] = -1;
+            }
+        }
+        for (i = 0; i < TEST_HASH_ITEMS / 2; i ++)
+        {
+            k = rand() % TEST_HASH_ITEMS;
+            if (expect[k] < 0)
+            {
+                // Moved to the end of insertion order
+                _set(obj, k, r * TEST_HASH_ITEMS + k);
+                expect[k] = r * TEST_HASH_ITEMS + k;
+                pos[k] = norder;
+                order[norder ++] = k;
+            }
+            else
+            {
+                // Overwritten in place
+                _set(obj, k, expect[k] + 1);
+                expect[k] ++;
+            }
+        }
+        _verify(obj, expect, order, pos, norder);
+    }
+    del_object(obj);
+
+    return test_failed;
+}
@@ -0,0 +1,196 @@
+/*
+ * test_memdb.c
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * MemDB regression test : TTL, CAS, incr, CLOCK eviction
+ *
+ * @package bsp::test
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/18/2014
+ * @changelog
+ *      [12/18/2014] - Creation
+ */
+
+#include "bsp_test.h"
+
+static int64_t _get_int(const char *key, uint64_t *version)
+{
+    BSP_VALUE *val = memdb_get(key, version);
+    int64_t ret = (val) ? value_get_int(val) : -1;
+    del_value(val);
+
+    return ret;
+}
+
+static int _set_int(const char *key, int64_t v, int ttl)
+{
+    BSP_VALUE *val = new_value();
+    value_set_int(val, v);
+
+    return memdb_set(key, val, ttl);
+}
+
+static int _cas_int(const char *key, uint64_t version, int64_t v)
+{
+    BSP_VALUE *val = new_value();
+    value_set_int(val, v);
+
+    return memdb_cas(key, version, val, 0);
+}
+
+// Another key in the same shard and bucket of key, chained behind it
+static void _same_bucket(const char *key, char *other)
+{
+    uint32_t hash = bsp_hash(key, strlen(key));
+    uint32_t mask = ((MEMDB_SHARDS - 1) << (32 - MEMDB_SHARD_BITS)) | (MEMDB_SHARD_INITIAL - 1);
+    uint32_t h;
+    int i = 0;
+    do
+    {
+        sprintf(other, "other-%d", i ++);
+        h = bsp_hash(other, strlen(other));
+    } while ((h & mask) != (hash & mask));
+
+    return;
+}
+
+static void test_ttl()
+{
+    int64_t result = 0;
+    char other[32];
+    TEST_CHECK(BSP_RTN_SUCCESS == _set_int("ttl", 5, 1));
+    TEST_CHECK(BSP_RTN_SUCCESS == _set_int("forever", 6, 0));
+    TEST_CHECK(5 == _get_int("ttl", NULL));
+
+    // Expired entry in front of another key of the same chain
+    _same_bucket("chained", other);
+    TEST_CHECK(BSP_RTN_SUCCESS == _set_int("chained", 1, 1));
+    TEST_CHECK(BSP_RTN_SUCCESS == _set_int(other, 2, 0));
+    TEST_CHECK(BSP_RTN_SUCCESS == _set_int("incr-expired", 100, 1));
+    sleep(2);
+    TEST_CHECK(-1 == _get_int("ttl", NULL));
+    TEST_CHECK(6 == _get_int("forever", NULL));
+
+    // Expired key is missing for set, cas and incr, neighbour untouched
+    TEST_CHECK(BSP_RTN_SUCCESS == _set_int("chained", 3, 0));
+    TEST_CHECK(2 == _get_int(other, NULL));
+    TEST_CHECK(3 == _get_int("chained", NULL));
+    TEST_CHECK(BSP_RTN_SUCCESS == memdb_incr("incr-expired", 7, &result));
+    TEST_CHECK(7 == result);
+
+    TEST_CHECK(BSP_RTN_SUCCESS == _set_int("expire-scan", 1, 1));
+    sleep(2);
+    memdb_expire();
+    TEST_CHECK(-1 == _get_int("expire-scan", NULL));
+
+    return;
+}
+
+static void test_cas()
+{
+    uint64_t version = 0, stale = 0;
+    char other[32];
+    TEST_CHECK(BSP_RTN_SUCCESS == _cas_int("cas", 0, 1));
+    TEST_CHECK(BSP_RTN_SUCCESS != _cas_int("cas", 0, 2));
+    TEST_CHECK(1 == _get_int("cas", &version));
+    stale = version;
+    TEST_CHECK(BSP_RTN_SUCCESS == _cas_int("cas", version, 2));
+    TEST_CHECK(BSP_RTN_SUCCESS != _cas_int("cas", stale, 3));
+    TEST_CHECK(2 == _get_int("cas", &version));
+    TEST_CHECK(version != stale);
+
+    // Version 0 matches an expired key, not the key chained behind it
+    _same_bucket("cas-expired", other);
+    TEST_CHECK(BSP_RTN_SUCCESS == _set_int("cas-expired", 1, 1));
+    TEST_CHECK(BSP_RTN_SUCCESS == _set_int(other, 2, 0));
+    sleep(2);
+    TEST_CHECK(BSP_RTN_SUCCESS == _cas_int("cas-expired", 0, 3));
+    TEST_CHECK(3 == _get_int("cas-expired", NULL));
+    TEST_CHECK(2 == _get_int(other, NULL));
+
+    return;
+}
+
+static void test_incr()
+{
+    int64_t result = 0;
+    BSP_VALUE *val = NULL;
+    TEST_CHECK(BSP_RTN_SUCCESS == memdb_incr("incr", 3, &result));
+    TEST_CHECK(3 == result);
+    TEST_CHECK(BSP_RTN_SUCCESS == memdb_incr("incr", -5, &result));
+    TEST_CHECK(-2 == result);
+    TEST_CHECK(-2 == _get_int("incr", NULL));
+
+    val = new_value();
+    value_set_string(val, new_string("text", -1));
+    TEST_CHECK(BSP_RTN_SUCCESS == memdb_set("incr-string", val, 0));
+    TEST_CHECK(BSP_RTN_SUCCESS != memdb_incr("incr-string", 1, &result));
+
+    return;
+}
+
+// 1MB in all, far more entries stored than fit
+static void test_evict()
+{
+    char key[32];
+    int i, kept = 0;
+    BSP_VALUE *val = NULL;
+    for (i = 0; i < 50000; i ++)
+    {
+        sprintf(key, "evict-%d", i);
+        val = new_value();
+        value_set_string(val, new_string("0123456789012345678901234567890123456789", -1));
+        TEST_CHECK(BSP_RTN_SUCCESS == memdb_set(key, val, 0));
+    }
+
+    for (i = 0; i < 50000; i ++)
+    {
+        sprintf(key, "evict-%d", i);
+        val = memdb_get(key, NULL);
+        if (val)
+        {
+            kept ++;
+            del_value(val);
+        }
+    }
+    TEST_CHECK(kept > 0 && kept < 50000);
+    TEST_CHECK((size_t) kept * sizeof(BSP_MEMDB_ENTRY) <= 1024 * 1024);
+
+    // Newest one always stays
+    val = memdb_get("evict-49999", NULL);
+    TEST_CHECK(val != NULL);
+    del_value(val);
+
+    return;
+}
+
+int main(int argc, char **argv)
+{
+    hash_init();
+    freelist_init();
+    get_core_setting()->memdb_memory = 1;
+    memdb_init();
+
+    test_incr();
+    test_cas();
+    test_ttl();
+    test_evict();
+
+    return test_failed;
+}
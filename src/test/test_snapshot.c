@@ -0,0 +1,128 @@
+/*
+ * test_snapshot.c
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Snapshot regression test : records queued until flushed, file compacted when grown
+ *
+ * @package bsp::test
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/18/2014
+ * @changelog
+ *      [12/18/2014] - Creation
+ */
+
+#include "bsp_test.h"
+
+#define TEST_SNAPSHOT_FILE                      "test_snapshot.snap"
+#define TEST_SNAPSHOT_DATA                      1048576
+
+static size_t _file_size()
+{
+    struct stat st;
+
+    return (0 == stat(TEST_SNAPSHOT_FILE, &st)) ? (size_t) st.st_size : 0;
+}
+
+static void test_queue()
+{
+    BSP_SNAPSHOT *snap = snapshot_open(TEST_SNAPSHOT_FILE);
+    size_t size;
+    TEST_CHECK(snap != NULL);
+    size = _file_size();
+    TEST_CHECK(SNAPSHOT_MAGIC_LENGTH == size);
+
+    // Nothing written before flush
+    TEST_CHECK(BSP_RTN_SUCCESS == snapshot_write(snap, "a", 1, "1", 1, SNAPSHOT_FLAG_DIRTY));
+    TEST_CHECK(BSP_RTN_SUCCESS == snapshot_write(snap, "b", 1, "2", 1, 0));
+    TEST_CHECK(BSP_RTN_SUCCESS == snapshot_write(snap, "b", 1, NULL, 0, SNAPSHOT_FLAG_REMOVED));
+    TEST_CHECK(snapshot_pending(snap) > 0);
+    TEST_CHECK(size == _file_size());
+
+    TEST_CHECK(BSP_RTN_SUCCESS == snapshot_flush(snap));
+    TEST_CHECK(0 == snapshot_pending(snap));
+    TEST_CHECK(size < _file_size() && snap->file_size == _file_size());
+
+    // Flushed by close
+    TEST_CHECK(BSP_RTN_SUCCESS == snapshot_write(snap, "c", 1, "3", 1, 0));
+    snapshot_close(snap);
+
+    return;
+}
+
+// Same key rewritten, file never grows far beyond threshold
+static void test_compact()
+{
+    BSP_SNAPSHOT *snap = snapshot_open(TEST_SNAPSHOT_FILE);
+    char *data = bsp_calloc(1, TEST_SNAPSHOT_DATA);
+    int i;
+    TEST_CHECK(snap && data);
+    for (i = 0; i < 3 * SNAPSHOT_COMPACT_MIN * SNAPSHOT_COMPACT_RATIO / TEST_SNAPSHOT_DATA; i ++)
+    {
+        data[0] = (char) i;
+        TEST_CHECK(BSP_RTN_SUCCESS == snapshot_write(snap, "big", 3, data, TEST_SNAPSHOT_DATA, 0));
+        TEST_CHECK(BSP_RTN_SUCCESS == snapshot_flush(snap));
+        TEST_CHECK(_file_size() <= SNAPSHOT_COMPACT_MIN * SNAPSHOT_COMPACT_RATIO + TEST_SNAPSHOT_DATA);
+    }
+    TEST_CHECK(snap->file_size == _file_size());
+    TEST_CHECK(BSP_RTN_SUCCESS == snapshot_write(snap, "d", 1, "4", 1, 0));
+    snapshot_close(snap);
+    bsp_free(data);
+
+    return;
+}
+
+// Last records of keys survive, removed ones are gone
+static void test_reopen()
+{
+    BSP_SNAPSHOT *snap = snapshot_open(TEST_SNAPSHOT_FILE);
+    const char *data;
+    size_t len = 0;
+    uint32_t flags = 0;
+    TEST_CHECK(snap != NULL);
+    TEST_CHECK(_file_size() < TEST_SNAPSHOT_DATA * 2);
+
+    data = snapshot_take(snap, "a", 1, &len, &flags);
+    TEST_CHECK(data && 1 == len && '1' == data[0] && SNAPSHOT_FLAG_DIRTY == flags);
+    TEST_CHECK(NULL == snapshot_take(snap, "b", 1, &len, &flags));
+    data = snapshot_take(snap, "c", 1, &len, &flags);
+    TEST_CHECK(data && 1 == len && '3' == data[0]);
+    data = snapshot_take(snap, "d", 1, &len, &flags);
+    TEST_CHECK(data && 1 == len && '4' == data[0]);
+    data = snapshot_take(snap, "big", 3, &len, &flags);
+    TEST_CHECK(data && TEST_SNAPSHOT_DATA == len);
+    TEST_CHECK(data && (char) (3 * SNAPSHOT_COMPACT_MIN * SNAPSHOT_COMPACT_RATIO / TEST_SNAPSHOT_DATA - 1) == data[0]);
+    snapshot_close(snap);
+
+    return;
+}
+
+int main(int argc, char **argv)
+{
+    hash_init();
+    freelist_init();
+    unlink(TEST_SNAPSHOT_FILE);
+
+    test_queue();
+    test_compact();
+    test_reopen();
+    unlink(TEST_SNAPSHOT_FILE);
+
+    return test_failed;
+}
@@ -0,0 +1,238 @@
+/*
+ * test_view.c
+ *
+ * Copyright (C) 2014 - Dr.NP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * View regression test : lookups and bounds checks of truncated / corrupted native data
+ * Buffers are allocated with their exact size, run under a memory checker to catch overreads
+ *
+ * @package bsp::test
+ * @author Dr.NP <np@bsgroup.org>
+ * @update 12/18/2014
+ * @changelog
+ *      [12/18/2014] - Creation
+ */
+
+#include "bsp_test.h"
+
+static BSP_STRING * _sample()
+{
+    BSP_OBJECT *obj = new_object(OBJECT_TYPE_HASH);
+    BSP_OBJECT *arr = new_object(OBJECT_TYPE_ARRAY);
+    BSP_OBJECT *sub = new_object(OBJECT_TYPE_HASH);
+    BSP_VALUE *val = NULL;
+    BSP_STRING *ret = NULL;
+
+    val = new_value();
+    value_set_boolean_true(val);
+    object_set_hash_str(sub, "k", val);
+
+    val = new_value();
+    value_set_int(val, 1);
+    object_set_array(arr, -1, val);
+    val = new_value();
+    value_set_string(val, new_string("x", -1));
+    object_set_array(arr, -1, val);
+    val = new_value();
+    value_set_object(val, sub);
+    object_set_array(arr, -1, val);
+
+    val = new_value();
+    value_set_int(val, 12345678901LL);
+    object_set_hash_str(obj, "int", val);
+    val = new_value();
+    value_set_string(val, new_string("hello", -1));
+    object_set_hash_str(obj, "str", val);
+    val = new_value();
+    value_set_double(val, 1.5);
+    object_set_hash_str(obj, "dbl", val);
+    val = new_value();
+    value_set_object(val, arr);
+    object_set_hash_str(obj, "arr", val);
+
+    ret = object_serialize(obj);
+    del_object(obj);
+
+    return ret;
+}
+
+// Touch everything reachable, nothing may be read outside the buffer
+static void _walk(BSP_VIEW *view)
+{
+    size_t offset = 0, len = 0;
+    BSP_VIEW_VALUE key, val;
+    BSP_VIEW sub;
+    while (BSP_RTN_SUCCESS == view_next_item(view, &offset, &key, &val))
+    {
+        TEST_CHECK(offset <= view->len);
+        switch (val.type)
+        {
+            case BSP_VAL_OBJECT :
+                if (BSP_RTN_SUCCESS == view_value_to_view(&val, &sub))
+                {
+                    TEST_CHECK(sub.data >= view->data && sub.data + sub.len <= view->data + view->len);
+                    _walk(&sub);
+                }
+                break;
+            case BSP_VAL_STRING :
+                view_value_get_string(&val, &len);
+                break;
+            case BSP_VAL_INT :
+                view_value_get_int(&val);
+                break;
+            case BSP_VAL_DOUBLE :
+            case BSP_VAL_FLOAT :
+                view_value_get_double(&val);
+                break;
+            default :
+                break;
+        }
+    }
+
+    return;
+}
+
+static void test_lookup(BSP_STRING *native)
+{
+    char *buf = bsp_malloc(STR_LEN(native));
+    size_t len = 0;
+    const char *str = NULL;
+    BSP_VIEW view, arr, sub;
+    BSP_VIEW_VALUE val;
+    BSP_OBJECT *obj = NULL;
+    memcpy(buf, STR_STR(native), STR_LEN(native));
+    TEST_CHECK(BSP_RTN_SUCCESS == view_init(&view, buf, STR_LEN(native)));
+    TEST_CHECK(STR_LEN(native) == view.len);
+    TEST_CHECK(OBJECT_TYPE_HASH == view.type);
+    TEST_CHECK(4 == view_size(&view));
+
+    TEST_CHECK(BSP_RTN_SUCCESS == view_get_hash(&view, "int", -1, &val));
+    TEST_CHECK(12345678901LL == view_value_get_int(&val));
+    TEST_CHECK(BSP_RTN_SUCCESS == view_get_hash(&view, "str", -1, &val));
+    str = view_value_get_string(&val, &len);
+    TEST_CHECK(str && 5 == len && 0 == memcmp(str, "hello", 5));
+    TEST_CHECK(BSP_RTN_SUCCESS == view_get_hash(&view, "dbl", -1, &val));
+    TEST_CHECK(1.5 == view_value_get_double(&val));
+    TEST_CHECK(BSP_RTN_SUCCESS != view_get_hash(&view, "none", -1, &val));
+
+    TEST_CHECK(BSP_RTN_SUCCESS == view_get_hash(&view, "arr", -1, &val));
+    TEST_CHECK(BSP_RTN_SUCCESS == view_value_to_view(&val, &arr));
+    TEST_CHECK(3 == view_size(&arr));
+    TEST_CHECK(BSP_RTN_SUCCESS != view_get_array(&arr, 3, &val));
+    TEST_CHECK(BSP_RTN_SUCCESS == view_get_array(&arr, 2, &val));
+    TEST_CHECK(BSP_RTN_SUCCESS == view_value_to_view(&val, &sub));
+    TEST_CHECK(BSP_RTN_SUCCESS == view_get_hash(&sub, "k", 1, &val));
+    TEST_CHECK(view_value_get_boolean(&val));
+
+    obj = view_to_object(&view);
+    TEST_CHECK(obj && 4 == object_size(obj));
+    del_object(obj);
+    bsp_free(buf);
+
+    return;
+}
+
+// No prefix of an object is a complete object
+static void test_truncated(BSP_STRING *native)
+{
+    size_t len;
+    char *buf = NULL;
+    BSP_VIEW view;
+    for (len = 0; len < STR_LEN(native); len ++)
+    {
+        buf = bsp_malloc(len + 1);
+        memcpy(buf, STR_STR(native), len);
+        TEST_CHECK(BSP_RTN_SUCCESS != view_init(&view, buf, len));
+        bsp_free(buf);
+    }
+
+    return;
+}
+
+// Any byte replaced by type markers or length bytes : refused, or accepted inside the buffer
+static void test_corrupted(BSP_STRING *native)
+{
+    static const char bytes[] = {
+        0x0, 0x1, 0x7, 0x7F, (char) 0x80, (char) 0xFF, BSP_VAL_STRING, BSP_VAL_OBJECT,
+        BSP_VAL_OBJECT_ARRAY, BSP_VAL_OBJECT_ARRAY_END, BSP_VAL_OBJECT_HASH, BSP_VAL_OBJECT_HASH_END
+    };
+    size_t len = STR_LEN(native), i, j;
+    char *buf = bsp_malloc(len);
+    BSP_VIEW view;
+    BSP_OBJECT *obj = NULL;
+    for (i = 0; i < len; i ++)
+    {
+        for (j = 0; j < sizeof(bytes); j ++)
+        {
+            memcpy(buf, STR_STR(native), len);
+            buf[i] = bytes[j];
+            if (BSP_RTN_SUCCESS == view_init(&view, buf, len))
+            {
+                TEST_CHECK(view.len <= len);
+                _walk(&view);
+                obj = view_to_object(&view);
+                del_object(obj);
+            }
+        }
+    }
+    bsp_free(buf);
+
+    return;
+}
+
+// Nesting deeper than VIEW_MAX_DEPTH refused
+static void test_depth()
+{
+    size_t depth = VIEW_MAX_DEPTH + 8, len = 0, i;
+    char *buf = bsp_malloc(depth * 3);
+    BSP_VIEW view;
+    for (i = 0; i < depth; i ++)
+    {
+        buf[len ++] = BSP_VAL_OBJECT_ARRAY;
+        buf[len ++] = BSP_VAL_OBJECT;
+    }
+    len -= 1;
+    for (i = 0; i < depth; i ++)
+    {
+        buf[len ++] = BSP_VAL_OBJECT_ARRAY_END;
+    }
+    TEST_CHECK(BSP_RTN_SUCCESS != view_init(&view, buf, len));
+
+    // Shallow one is fine
+    TEST_CHECK(BSP_RTN_SUCCESS == view_init(&view, buf + (depth - 4) * 2, len - (depth - 4) * 3));
+    bsp_free(buf);
+
+    return;
+}
+
+int main(int argc, char **argv)
+{
+    BSP_STRING *native = NULL;
+    hash_init();
+    freelist_init();
+
+    native = _sample();
+    TEST_CHECK(native && STR_LEN(native) > 0);
+    test_lookup(native);
+    test_truncated(native);
+    test_corrupted(native);
+    test_depth();
+    del_string(native);
+
+    return test_failed;
+}